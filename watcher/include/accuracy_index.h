@@ -0,0 +1,39 @@
+#ifndef _TURINGWATCHER_ACCURACY_INDEX_H
+#define _TURINGWATCHER_ACCURACY_INDEX_H
+#include "common.h"
+#include "db_common.h"
+
+#include <unordered_map>
+
+/*
+  Decides in process which measurements are worth inserting, as the
+  measurement_quality_ensurance trigger did per row in SQL. A measurement of
+  a step is dropped if its tot_time is 0, if the step has measurements of a
+  watcher of higher accuracy, or if one of the same accuracy and target node
+  already holds the same tot_time.
+
+  Per step, the index keeps the best accuracy seen and the latest tot_time of
+  every target node at that accuracy. tot_time only grows, so comparing with
+  the latest is comparing with all of them. Steps are loaded from the
+  database on first sight and forgotten after ACCURACY_INDEX_IDLE_SECS.
+
+  Admissions are serialized by the write lock of the database: they only
+  happen within write transactions, which see everything committed. Steps
+  admitted to in a transaction that is rolled back are forgotten, so they
+  are loaded again from what was committed.
+*/
+
+#define ACCURACY_INDEX_IDLE_SECS (24 * 60 * 60)
+
+// Thread-safe. Whether a measurement of jobid.stepid with tot_time taken by
+// watcherid is to be inserted, recording it as inserted if so
+bool accuracy_index_admit(int watcherid, uint32_t jobid, uint32_t stepid,
+                          int64_t tot_time);
+// Once the admitted measurement could not be inserted after all
+void accuracy_index_forget(uint32_t jobid, uint32_t stepid);
+// Once the transaction of the calling thread ended
+void accuracy_index_commit();
+void accuracy_index_rollback();
+// Drops steps that were idle for ACCURACY_INDEX_IDLE_SECS
+void accuracy_index_evict();
+#endif
@@ -0,0 +1,16 @@
+#ifndef _TURINGWATCHER_ANALYSIS_FUNCTIONS_H
+#define _TURINGWATCHER_ANALYSIS_FUNCTIONS_H
+#include "common.h"
+#include "db_common.h"
+
+/*
+  Aggregates the analysis SQL uses where a window over the rows of a group
+  would otherwise be needed, each computed in one pass over the group.
+
+  max_by(value, key) is value of the row with the greatest numeric key, the
+  first of them on ties. Rows with a NULL key are skipped, NULL if all are.
+*/
+
+// Registers them on SQL_CONN_NAME, before analysis statements are prepared
+bool analysis_functions_register();
+#endif
@@ -61,21 +61,16 @@ typedef struct analyze_result_field_t {
   const enum analyze_field_flag_t flags;
 };
 
-typedef struct sqlite3_stmt;
-
+// Statements are prepared by each analysis worker on its own connection
 typedef struct analysis_info_t {
   const char *name;
   const struct analyze_result_field_t *fields;
   const char *analysis_description;
   const char *headers_description;
   const struct analyze_problem_t *problems;
-  #define PAIR(NAME) \
-    const char *NAME##_sql; \
-    struct sqlite3_stmt *NAME##_stmt;
-  PAIR(latest_analysis);
-  PAIR(latest_problem);
-  PAIR(history_analysis);
-  #undef PAIR
+  const char *latest_analysis_sql;
+  const char *latest_problem_sql;
+  const char *history_analysis_sql;
 };
 
 extern const char *row_group_top_style;
@@ -4,11 +4,19 @@
 
 #include "db_common.h"
 #include "analyze_info.h"
+#include "analysis_functions.h"
+#include "gpucpu_usage.h"
+#include "html_render.h"
+#include "report_sections.h"
+#include "result_archive.h"
 #include "worker.h"
 
 #include <cmath>
-#include <sstream>
-#include <iomanip>
+#include <optional>
+
+// Users are analyzed concurrently on up to this many cores, each worker with
+// a reader and its own in-memory tables
+#define ANALYZE_MAX_WORKER_CNT 32
 
 void analyzer_finalize();
 void do_analyze();
@@ -0,0 +1,43 @@
+#ifndef _TURINGWATCHER_CGROUP_SCRAPE_H
+#define _TURINGWATCHER_CGROUP_SCRAPE_H
+#include "common.h"
+#include "messaging.h"
+#include "proc_scrape.h"
+
+// Set to 1 to enumerate slurm job and step cgroups instead of every pid in
+// /proc, or to the directory holding job_<jobid> cgroups if it is not at the
+// default location of cgroup v2 slurm plugin
+#define SCRAPE_CGROUP_ENV WATCHER_ENV("SCRAPE_CGROUP")
+#define CGROUP_V2_SLURM_ROOT "/system.slice/slurmstepd.scope"
+#define CGROUP_V1_SLURM_ROOT "/slurm"
+
+enum cgroup_version_t {
+  CGROUP_NONE,
+  CGROUP_V1,
+  CGROUP_V2,
+};
+
+struct cgroup_step_result_t {
+  // step is set, pid is 0 and counters are totals of the step cgroup. Unlike
+  // scraping /proc, res is anonymous memory of the whole step rather than the
+  // largest rss of its processes, and rchar / wchar count block device IO
+  // only, reads and writes served by page cache are not included
+  scrape_result_t stat;
+  std::vector<pid_t> pids;
+  std::set<std::string> apps;
+};
+
+typedef std::vector<cgroup_step_result_t> cgroup_step_results_t;
+// Same as jobstep_val_map_t of worker
+typedef std::map<std::pair<uint32_t /*jobid*/, uint32_t /*stepid*/>,
+                 int /*ncpu*/> cgroup_cpu_available_map_t;
+
+extern cgroup_version_t cgroup_scrape_version;
+
+// Leaves cgroup_scrape_version as CGROUP_NONE unless requested by environment
+bool init_cgroup_scrape();
+void scrape_cgroups(cgroup_step_results_t &results,
+                    cgroup_cpu_available_map_t &cpu_available);
+// Number of cpus in a cpuset list file like 0-3,8,10-11, -1 if unreadable
+int read_cpuset_cpu_cnt(const char *path);
+#endif
@@ -130,8 +130,8 @@ struct worker_info_t {
   slurm_step_id_t jobstep_info;
 };
 
-// Connections
-extern sqlite3 *SQL_CONN_NAME;
+// Connections, the ingest thread of the watcher opens one of its own
+extern thread_local sqlite3 *SQL_CONN_NAME;
 extern void *slurm_conn;
 extern int sock;
 extern bool is_server;
@@ -146,10 +146,10 @@ extern bool update_jobinfo_only;
 extern char *db_path;
 extern std::string slurm_conf_path;
 
-// Watcher Parameters
-extern int watcher_id;
-extern time_t time_range_start;
-extern time_t time_range_end;
+// Watcher Parameters, set by renew_watcher of the calling thread
+extern thread_local int watcher_id;
+extern thread_local time_t time_range_start;
+extern thread_local time_t time_range_end;
 
 extern time_t program_start;
 #endif
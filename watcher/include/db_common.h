@@ -2,19 +2,169 @@
 #define _TURINGWATCHER_DB_COMMON_H
 #include "common.h"
 
-bool renew_watcher(const char *query, worker_info_t *worker = &worker);
+#include <deque>
+
+// How long a statement waits for the lock held by another connection
+#define SQLITE_BUSY_TIMEOUT_MS 10000
+// WAL size in pages a commit checkpoints passively at, past which readers
+// start paying for scanning the WAL
+#define SQLITE_WAL_CHECKPOINT_PAGES 10000
+// Read-only connections shared by exporters, analysis workers open their own
+#define SQLITE_READER_POOL_SIZE 4
+
+// Opens SQL_CONN_NAME of the calling thread on db_path in WAL mode
+bool open_sqlite_conn();
+// Read-only, outside of the pool, its partitions are not attached yet
+sqlite3 *open_sqlite_reader();
+// Blocks while all SQLITE_READER_POOL_SIZE readers are taken, NULL on failure
+sqlite3 *acquire_sqlite_reader();
+void release_sqlite_reader(sqlite3 *conn);
+// Of the readers that are not taken
+void close_sqlite_readers();
+
+// Points SQL_CONN_NAME of the calling thread to conn within the scope
+struct sqlite_conn_scope_t {
+  sqlite3 *saved;
+  explicit sqlite_conn_scope_t(sqlite3 *conn) : saved(SQL_CONN_NAME) {
+    SQL_CONN_NAME = conn;
+  }
+  ~sqlite_conn_scope_t() {
+    SQL_CONN_NAME = saved;
+  }
+};
+// Renews the time range of worker, and fetches watcher_id too if with_id
+bool renew_watcher(bool with_id = true, worker_info_t *worker = &worker);
 
 // Setting it to NULL breaks finializations midway at unprepared statements
 #define FINALIZE_END_ADDR (sqlite3_stmt *)0xbadbeef
 void finalize_stmt_array(sqlite3_stmt *stmt_to_finalize[]);
 void db_common_finalize();
-bool step_renew(sqlite3_stmt *stmt, const char *op, int &start, int &end);
 bool step_and_verify(sqlite3_stmt *stmt, bool expect_rows, const char *op);
 bool verify_sqlite_ret(int ret, const char *op);
 void sqlite3_begin_transaction();
+// Takes the write lock right away, false if it stayed busy
+bool sqlite3_begin_immediate_transaction();
 bool sqlite3_end_transaction();
 bool sqlite3_exec_wrap(const char *sql, const char *op);
 bool setup_stmt(sqlite3_stmt *&stmt, const char *sql, const char *op);
 bool reset_stmt(sqlite3_stmt *stmt, const char *op);
 void cleanup_all_stmts();
+
+// A value of bulk_columns_t, type is SQLITE_INTEGER, SQLITE_TEXT or SQLITE_NULL
+struct bulk_cell_t {
+  union {
+    int64_t num;
+    const char *text;
+  };
+  int type;
+};
+
+// Rows stored by column, filled one row at a time from the first column on.
+// Texts are referenced, own keeps a copy alive as long as the columns
+struct bulk_columns_t {
+  explicit bulk_columns_t(int ncol) : cols(ncol) {}
+  size_t rows() const {
+    return cols[0].size();
+  }
+  void add(int64_t num) {
+    cols[next++ % cols.size()].push_back({{num}, SQLITE_INTEGER});
+  }
+  void add(const char *text) {
+    bulk_cell_t cell;
+    cell.text = text;
+    cell.type = text ? SQLITE_TEXT : SQLITE_NULL;
+    cols[next++ % cols.size()].push_back(cell);
+  }
+  void add_null() {
+    add((const char *)NULL);
+  }
+  const char *own(std::string str) {
+    owned.push_back(std::move(str));
+    return owned.back().c_str();
+  }
+  void clear();
+  bool bind_row(sqlite3_stmt *stmt, int param, size_t row) const;
+
+  std::vector<std::vector<bulk_cell_t>> cols;
+  size_t next = 0;
+  std::deque<std::string> owned;
+};
+
+// Multi-row statements of 1, 2, 4 ... BULK_INSERT_MAX_ROWS rows
+#define BULK_INSERT_LEVELS 7
+#define BULK_INSERT_MAX_ROWS (1 << (BULK_INSERT_LEVELS - 1))
+
+// Inserts rows with as few steps as possible, each one binding up to
+// BULK_INSERT_MAX_ROWS rows by position instead of by name. head is an
+// INSERT up to VALUES, which the rows follow, and the column count is taken
+// from its column list. Prepared on the connection of the first insert
+struct bulk_insert_t {
+  explicit bulk_insert_t(const char *head, const char *tail = "");
+  // bind_row(stmt, param, row) binds all columns of row from parameter index
+  // param on, returning false on failure. Rows of a failing step are retried
+  // one by one, failed(row) is called for the ones failing alone
+  template<typename B, typename F>
+  void insert(size_t cnt, B &&bind_row, F &&failed, const char *op);
+  // Of all rows of columns, which must match the column list
+  template<typename F>
+  void insert(const bulk_columns_t &columns, F &&failed, const char *op) {
+    insert(columns.rows(),
+           [&](sqlite3_stmt *stmt, int param, size_t row) {
+             return columns.bind_row(stmt, param, row);
+           },
+           failed, op);
+  }
+  void finalize();
+
+  const char *head;
+  const char *tail;
+  int ncol;
+  sqlite3_stmt *stmts[BULK_INSERT_LEVELS] = {};
+
+ private:
+  sqlite3_stmt *prepare(int level, const char *op);
+  template<typename B, typename F>
+  void step_rows(int level, size_t first, B &bind_row, F &failed,
+                 const char *op);
+};
+
+template<typename B, typename F>
+void bulk_insert_t::step_rows(int level, size_t first, B &bind_row, F &failed,
+                              const char *op) {
+  sqlite3_stmt *stmt = prepare(level, op);
+  if (!stmt) {
+    return;
+  }
+  const size_t rows = (size_t)1 << level;
+  bool bound = true;
+  for (size_t row = 0; row < rows && bound; row++) {
+    bound = bind_row(stmt, row * ncol + 1, first + row);
+  }
+  const int ret = bound ? sqlite3_step(stmt) : SQLITE_MISUSE;
+  sqlite3_reset(stmt);
+  if (ret == SQLITE_DONE) {
+    return;
+  } else if (level) {
+    for (size_t row = 0; row < rows; row++) {
+      step_rows(0, first + row, bind_row, failed, op);
+    }
+  } else {
+    fprintf(stderr, "sqlite3_step%s: %s\n", op,
+            bound ? sqlite3_errstr(ret) : "bind failed");
+    failed(first);
+  }
+}
+
+template<typename B, typename F>
+void bulk_insert_t::insert(size_t cnt, B &&bind_row, F &&failed,
+                           const char *op) {
+  for (size_t done = 0; done < cnt;) {
+    int level = BULK_INSERT_LEVELS - 1;
+    while (((size_t)1 << level) > cnt - done) {
+      level--;
+    }
+    step_rows(level, done, bind_row, failed, op);
+    done += (size_t)1 << level;
+  }
+}
 #endif
@@ -54,7 +54,8 @@ struct gpu_measurement_t {
 
   slurm_step_id_t step;
 
-  const uint32_t source = gpu_measurement_source;
+  // Overwritten by the server with what the scraper sent
+  uint32_t source = gpu_measurement_source;
 };
 
 typedef std::vector<gpu_measurement_t> measure_gpu_result_t;
@@ -0,0 +1,35 @@
+#ifndef _TURINGWATCHER_GPUCPU_USAGE_H
+#define _TURINGWATCHER_GPUCPU_USAGE_H
+#include "common.h"
+#include "db_common.h"
+
+#include <optional>
+
+/*
+  Fills inmem.gpucpu_usage of the steps new in the period from the cache of
+  samples by number of GPUs and CPUs in use, in one pass over them in the
+  order of their keys instead of a window sorting them by node. Rows of GPUs
+  come before those of CPUs, each by step and node. node_tot is the number
+  of samples of the node, of CPUs only those with 1 to ncpu + 1 of them in
+  use, which are the only ones ncpu_in_use is given for.
+
+  Runs on SQL_CONN_NAME within the analysis transaction, after the base
+  tables and before ANALYZE_CREATE_USAGE_TABLES. Statements are prepared on
+  the connection of the first fill and kept until finalize.
+*/
+
+struct gpucpu_usage_t {
+  gpucpu_usage_t();
+  // False if the steps could not be read or their rows inserted
+  bool fill();
+  void finalize();
+
+ private:
+  sqlite3_stmt *read_steps_stmt = NULL;
+  sqlite3_stmt *read_stmt = NULL;
+  bulk_insert_t insert;
+  // Of the latest fill, kept for their capacity
+  bulk_columns_t gpu_rows;
+  bulk_columns_t cpu_rows;
+};
+#endif
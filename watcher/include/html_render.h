@@ -0,0 +1,220 @@
+#ifndef _TURINGWATCHER_HTML_RENDER_H
+#define _TURINGWATCHER_HTML_RENDER_H
+#include "common.h"
+
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <string_view>
+
+/*
+  Letters are built from literals of the HTML macros of analyzer.cpp with
+  "%s" wherever a value goes. HTML_TEMPLATE splits such a literal at them at
+  compile time, and html_render writes its pieces with the values in between
+  straight into the buffer of a letter file, or onto a string, without
+  parsing a format at run time. Values are strings and integers as they are,
+  numbers wrapped in html_grouped or html_fixed formatted as "%'lld" and
+  "%'.*lf" would be, with the decimal point and grouping of the locale, and
+  html_hex as "%0*llx". Numbers are converted by std::to_chars instead of
+  the printf family, which takes most of the time of a row otherwise.
+*/
+
+constexpr size_t html_count_slots(std::string_view str) {
+  size_t cnt = 0;
+  for (size_t pos = 0; (pos = str.find("%s", pos)) != str.npos; pos += 2) {
+    cnt++;
+  }
+  return cnt;
+}
+
+template <size_t SLOTS>
+struct html_template_t {
+  constexpr html_template_t(std::string_view str) {
+    size_t begin = 0;
+    for (size_t i = 0; i < SLOTS; i++) {
+      const size_t end = str.find("%s", begin);
+      pieces[i] = str.substr(begin, end - begin);
+      begin = end + 2;
+    }
+    pieces[SLOTS] = str.substr(begin);
+  }
+  // Around the values
+  std::string_view pieces[SLOTS + 1];
+};
+
+#define HTML_TEMPLATE(LITERAL) \
+  html_template_t<html_count_slots(LITERAL)>( \
+    std::string_view(LITERAL, sizeof(LITERAL) - 1))
+// Of a template split once, kept in a static of its own
+#define HTML_RENDER(OUT, LITERAL, ...) \
+  do { \
+    static constexpr auto html_template = HTML_TEMPLATE(LITERAL); \
+    html_render(OUT, html_template, ##__VA_ARGS__); \
+  } while (0)
+
+struct html_grouped {
+  long long val;
+};
+
+struct html_fixed {
+  double val;
+  int precision;
+  bool grouped;
+};
+
+// Zero padded to width, as "%0*llx"
+struct html_hex {
+  unsigned long long val;
+  int width;
+};
+
+// Letter files are written by a single thread each
+static inline void html_put(FILE *fp, std::string_view str) {
+  fwrite_unlocked(str.data(), 1, str.size(), fp);
+}
+
+static inline void html_put(std::string &out, std::string_view str) {
+  out.append(str);
+}
+
+template <typename SINK>
+static inline void html_value(SINK &out, const char *str) {
+  // As printf prints it
+  html_put(out, str ? str : "(null)");
+}
+
+template <typename SINK>
+static inline void html_value(SINK &out, const std::string &str) {
+  html_put(out, str);
+}
+
+// Of LC_NUMERIC as set once the first number is rendered
+struct html_numeric_t {
+  std::string decimal_point;
+  std::string thousands_sep;
+  std::string grouping;
+};
+
+static inline const html_numeric_t &html_numeric() {
+  static const html_numeric_t numeric = []() {
+    const lconv *conv = localeconv();
+    return html_numeric_t{conv->decimal_point, conv->thousands_sep,
+                          conv->grouping};
+  }();
+  return numeric;
+}
+
+// The digits of an integral part, grouped from the right as the "'" flag of
+// printf does by the locale
+template <typename SINK>
+static inline void html_put_grouped(SINK &out, std::string_view digits) {
+  const auto &numeric = html_numeric();
+  if (numeric.thousands_sep.empty() || numeric.grouping.empty()) {
+    html_put(out, digits);
+    return;
+  }
+  // Where groups start, from the right
+  size_t starts[std::numeric_limits<double>::max_exponent10 + 1];
+  size_t cnt = 0;
+  size_t left = digits.size();
+  size_t size = 0;
+  for (const char *group = numeric.grouping.c_str();;) {
+    // The last size repeats
+    if (*group) {
+      if (*group == CHAR_MAX || *group < 0) {
+        break;
+      }
+      size = *group++;
+    }
+    if (!size || left <= size) {
+      break;
+    }
+    left -= size;
+    starts[cnt++] = left;
+  }
+  size_t begin = 0;
+  while (cnt--) {
+    html_put(out, digits.substr(begin, starts[cnt] - begin));
+    html_put(out, numeric.thousands_sep);
+    begin = starts[cnt];
+  }
+  html_put(out, digits.substr(begin));
+}
+
+template <typename SINK, typename INT,
+          std::enable_if_t<std::is_integral_v<INT>, bool> = true>
+static inline void html_value(SINK &out, INT val) {
+  char buf[24];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), val);
+  html_put(out, std::string_view(buf, res.ptr - buf));
+}
+
+template <typename SINK>
+static inline void html_value(SINK &out, html_grouped num) {
+  char buf[24];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), num.val);
+  std::string_view str(buf, res.ptr - buf);
+  if (num.val < 0) {
+    html_put(out, "-");
+    str.remove_prefix(1);
+  }
+  html_put_grouped(out, str);
+}
+
+template <typename SINK>
+static inline void html_value(SINK &out, html_fixed num) {
+  // The integral part of the largest double and the sign, point and decimals
+  char buf[std::numeric_limits<double>::max_exponent10 + 32];
+  const auto res = std::to_chars(buf, buf + sizeof(buf), num.val,
+                                 std::chars_format::fixed, num.precision);
+  if (res.ec != std::errc()) {
+    char *str;
+    if (asprintf(&str, num.grouped ? "%'.*lf" : "%.*lf", num.precision,
+                 num.val) != -1) {
+      html_put(out, str);
+      free(str);
+    }
+    return;
+  }
+  std::string_view str(buf, res.ptr - buf);
+  if (!std::isfinite(num.val)) {
+    html_put(out, str);
+    return;
+  }
+  if (str[0] == '-') {
+    html_put(out, "-");
+    str.remove_prefix(1);
+  }
+  const size_t point = str.find('.');
+  if (num.grouped) {
+    html_put_grouped(out, str.substr(0, point));
+  } else {
+    html_put(out, str.substr(0, point));
+  }
+  if (point != str.npos) {
+    html_put(out, html_numeric().decimal_point);
+    html_put(out, str.substr(point + 1));
+  }
+}
+
+template <typename SINK>
+static inline void html_value(SINK &out, html_hex num) {
+  char buf[32];
+  const auto res = std::to_chars(buf + 16, buf + sizeof(buf), num.val, 16);
+  char *begin = buf + 16;
+  while (begin > buf && res.ptr - begin < num.width) {
+    *--begin = '0';
+  }
+  html_put(out, std::string_view(begin, res.ptr - begin));
+}
+
+template <typename SINK, size_t SLOTS, typename... ARGS>
+static inline void html_render(SINK &out, const html_template_t<SLOTS> &tmpl,
+                               const ARGS &...args) {
+  static_assert(sizeof...(ARGS) == SLOTS, "a value for every %s");
+  const std::string_view *piece = tmpl.pieces;
+  html_put(out, *piece);
+  ((html_value(out, args), html_put(out, *++piece)), ...);
+}
+#endif
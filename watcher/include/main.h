@@ -4,6 +4,9 @@
 
 #include "worker_interface.h"
 #include "gpu/interface.h"
+#include "proc_scrape.h"
+#include "cgroup_scrape.h"
+#include "proc_events.h"
 #include "db_common.h"
 #include "messaging.h"
 #include "analyzer.h"
@@ -3,15 +3,22 @@
 #include "common.h"
 #include "sql.h"
 #include "gpu/interface.h"
+#include "string_table.h"
+#include "spool.h"
 
 #include <atomic>
+#include <deque>
+#include <memory>
 
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 
-constexpr protocol_version_t protocol_version = 2;
+constexpr protocol_version_t protocol_version = 3;
+// Oldest version still accepted from scrapers
+constexpr protocol_version_t min_protocol_version = 2;
 
 /*
   APPEND ONLY. DO NOT MODIFY/REMOVE OLD PROTOCOL DESCRIPTION ONCE IN PRODUCTION.
@@ -43,13 +50,72 @@ constexpr protocol_version_t protocol_version = 2;
   (2) length includes terminating \0, guaranteed to be less than INIT_BUF_SIZE
 
   ======================== PROTOCOL VERSION 1/2  END   =========================
+
+  ======================== PROTOCOL VERSION 3    BEGIN =========================
+
+  [header_t] | [uint32_t payload_len][payload]
+
+  Negotiation: in the first batch of a connection the client waits after
+  header_t until the server sends back the protocol_version_t it accepts.
+  A server older than version 3 closes the connection instead, and the
+  client then reconnects speaking version 2. Later batches of the connection
+  do not wait.
+
+  hostname_len in header_t is 0, counts in header_t are those of the records
+  in payload. payload is a sequence of records ended by V3_RECORD_END. Each
+  record is a varint record type followed by varint fields:
+
+  V3_RECORD_STRING         [len][bytes]      next id of the string table
+  V3_RECORD_HOSTNAME       [string id]       before any other record
+  V3_RECORD_RESULT         [jobid][stepid][gpu_measurement_cnt]
+                           [res][minor_pagefault][utime][stime][rchar][wchar]
+                           [peak_mem_usage] (schema 7 and later)
+                           ... then gpu_measurement_cnt times ...
+                           [gpu_id][pid][age][temp][sm_clock][util]
+                           [power_usage][clock_limit_reason_mask]
+                           [jobid][stepid][source]
+  V3_RECORD_USAGE          [jobid][stepid][string id]
+  V3_RECORD_CPU_AVAILABLE  [jobid][stepid][cpu_available]
+
+  Varints are unsigned LEB128. Counters of V3_RECORD_RESULT are zigzag
+  encoded deltas against the previous result of the same step on the same
+  connection, against 0 for the first. The string table and the previous
+  results persist across streamed batches of a connection.
+
+  ======================== PROTOCOL VERSION 3    END   =========================
 */
 
+enum v3_record_t {
+  V3_RECORD_END,
+  V3_RECORD_STRING,
+  V3_RECORD_HOSTNAME,
+  V3_RECORD_RESULT,
+  V3_RECORD_USAGE,
+  V3_RECORD_CPU_AVAILABLE,
+};
+
 #define TASK_COMM_LEN 32
 
 #define INIT_BUF_SIZE 4096
 #define DEFAULT_PORT 3755
-#define SOCK_MAX_CONN 32
+// Backlog of the listening socket, connections themselves are not limited
+#define SOCK_MAX_CONN 1024
+// A streaming scraper that stays silent this long is considered gone
+#define SOCK_IDLE_TIMEOUT 600 /* secs */
+// Batches a scraper holds on to while the server is unreachable, the oldest
+// are dropped beyond it
+#define MAX_UNSENT_SIZE (16 << 20)
+// Upper bound of a version 3 batch payload accepted by the server
+#define MAX_PAYLOAD_SIZE (64 << 20)
+// Upper bound of any batch including its framing, a connection whose pending
+// batch would exceed it is dropped
+#define MAX_BATCH_SIZE (MAX_PAYLOAD_SIZE + (1 << 16))
+// Number of epoll loops the server spreads connections over
+#define INGEST_THREAD_CNT 2
+#define INGEST_MAX_EVENTS 64
+#define INGEST_READ_SIZE (64 << 10)
+// How often connections are checked against SOCK_IDLE_TIMEOUT
+#define INGEST_SWEEP_INTERVAL 60 /* secs */
 
 #define SOCK_FAMILY PF_INET
 #define SOCK_TYPE SOCK_STREAM
@@ -61,7 +127,8 @@ const turing_watch_comm_magic_t server_magic = 0xEAC1CAFE;
 const turing_watch_comm_magic_t confirmation_magic = 0x9A115ED9; // 9 ALLSET 9
 
 struct header_t {
-  const protocol_version_t protocol_ver = protocol_version;
+  // Lowered by clients talking to an older server
+  protocol_version_t protocol_ver = protocol_version;
   const protocol_version_t schema_ver = schema_version;
   uint32_t result_cnt;
   uint32_t usage_cnt;
@@ -76,6 +143,8 @@ struct cpu_available_info_t {
   uint32_t cpu_available;
 };
 
+#define PRIVILEGED_STAT_NULL ((size_t)-1)
+
 struct scrape_result_t {
   slurm_step_id_t step;
   char comm[TASK_COMM_LEN + 1];
@@ -90,9 +159,11 @@ struct scrape_result_t {
   time_t stime;
   time_t cstime;
 
-  /* Privileged info, -1 == NULL */
+  /* Privileged info, PRIVILEGED_STAT_NULL == NULL */
   size_t rchar;
   size_t wchar;
+  // Cgroup scraping only, 0 otherwise
+  size_t peak_mem_usage;
 
   // Would not exceed number of pids
   pid_t gpu_measurement_cnt;
@@ -113,28 +184,70 @@ struct scrape_result_t {
 
 struct application_usage_t {
   slurm_step_id_t step;
-  const char *app;
+  // Application name interned in the string table of its batch. Aligned to
+  // keep the place of the pointer version 2 sends and ignores
+  alignas(8) string_id_t app;
+};
+static_assert(sizeof(application_usage_t) == 24,
+              "version 2 wire layout of application_usage_t changed");
+
+// Counters of the ingestion server since startup
+struct ingest_stats_t {
+  uint64_t accepted;
+  uint64_t active;
+  // Closed on error, mid-batch or for being idle
+  uint64_t failed;
+  uint64_t bytes;
+  uint64_t batches;
+  // Time spent parsing and staging complete batches
+  uint64_t parse_ns;
+  // Since last call of get_ingest_stats
+  uint64_t parse_max_ns;
 };
 
-struct result_group_t {
-  worker_info_t worker;
-  char **buf;
-  std::queue<scrape_result_t> scrape_results;
-  std::queue<application_usage_t> usages;
-  std::queue<gpu_measurement_t> gpu_results;
-  std::queue<cpu_available_info_t> cpu_available_info;
+// Everything one scraper sent or stages in a round. Owns its records and the
+// strings they refer to, so it is handed over as a whole and never copied
+struct batch_t {
+  header_t header;
+  string_table_t strings;
+  // Interned in strings, STRING_ID_NONE if the scraper sent none
+  string_id_t hostname = STRING_ID_NONE;
+  std::vector<scrape_result_t> results;
+  // In the order of the results they belong to
+  std::vector<gpu_measurement_t> gpu_results;
+  std::vector<application_usage_t> usages;
+  std::vector<cpu_available_info_t> cpu_available_infos;
+  // Server side, set when the batch is handed off. hostname of the worker in
+  // header is then resolved too
+  time_t received_at = 0;
+  spool_ref_t spool_ref;
+  batch_t *next = NULL;
 };
 
 void build_socket();
-void stage_message(gpu_measurement_t result, int queue_id = -1);
-void stage_message(scrape_result_t result, int queue_id = -1);
-void stage_message(application_usage_t usage, int queue_id = -1);
-void stage_message(cpu_available_info_t info, int queue_id = -1);
-void freeze_queue();
-bool recombine_queue(result_group_t &result);
-void sendout();
+void stage_message(gpu_measurement_t result);
+void stage_message(scrape_result_t result);
+// Stages that step ran app
+void stage_message(slurm_step_id_t step, const char *app);
+void stage_message(cpu_available_info_t info);
+// Hands out received batches oldest first, NULL once none is left. Batches
+// are pushed by the connection threads as soon as they are complete. Single
+// consumer only
+std::unique_ptr<batch_t> take_batch();
+// Sends staged messages as one batch along with those a failed call left
+// behind, which are kept up to MAX_UNSENT_SIZE and retried after reconnecting.
+// The connection is kept open for further batches if keep_open is set and
+// the server speaks version 3
+bool sendout(bool keep_open = false);
+// Bytes that sendout would currently send, without framing
+size_t staged_message_size();
 void *conn_mgr(void *arg);
-// In case of sendout fail / crash with unprocessed queue element
+ingest_stats_t get_ingest_stats();
+// Syncs and closes the spool of received batches, those not committed yet are
+// replayed by collect_dumped_messages on the next start
 void dump_message();
+// Opens the spool next to the database and hands off the batches it still
+// holds before anything new is received. Received batches are only kept in
+// memory if it fails
 void collect_dumped_messages();
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef _TURINGWATCHER_PARTITION_H
+#define _TURINGWATCHER_PARTITION_H
+#include "common.h"
+#include "db_common.h"
+
+/*
+  Measurements and GPU measurements are stored by period, in a database file
+  of their own per period of partition length (db_path followed by
+  PARTITION_SUFFIX and the period number), attached to every connection.
+  The one of the current period is attached as PARTITION_CUR, which the
+  inserts name, the earlier ones as PARTITION_PREFIX followed by their
+  period. TEMP views measurements and gpu_measurements join all of them
+  and the tables of the main database, which hold what was measured before
+  partitioning, so queries keep naming the tables alone. measurements_latest
+  holds the latest recordid. Partitions are created with the schema of the
+  time, migrations of the measurement tables have to cover them as well.
+
+  Whole partitions are dropped once they are PARTITION_RETAINED periods
+  old, which is the only way measurements are ever deleted. recordid goes
+  on across partitions: a partition continues the latest recordid once it
+  takes its first write, under the write lock.
+
+  Writers move on to the partition of the current period whenever a write
+  transaction begins, readers whenever they are acquired or synced.
+  Attachments are not changed within a transaction, so a writer that gets
+  the lock after the period ended rolls back and begins again.
+*/
+
+// Partitions are named after these in the SQL of sql/, keep them in sync
+#define PARTITION_CUR "partition_cur"
+#define PARTITION_PREFIX "partition_"
+#define PARTITION_SUFFIX ".partition."
+// SQLite attaches at most 10 databases unless built otherwise, the analyzer
+// attaches two of its own
+#define PARTITION_RETAINED 8
+
+// Attaches the partitions of the current period of length seconds to
+// SQL_CONN_NAME, creating the current one if the connection is writable.
+// Once per process, before other threads sync their connections
+bool partitions_attach(time_t length, int retained = PARTITION_RETAINED);
+// Moves SQL_CONN_NAME to the partitions of the current period, if it is not
+// there yet. Does nothing before partitions_attach, must not be called
+// within a transaction
+bool partitions_sync();
+// Whether SQL_CONN_NAME is on the partitions of the current period
+bool partitions_synced();
+// Seeds recordid of a fresh PARTITION_CUR, within the write transaction
+bool partitions_seed();
+std::string partition_path(long period);
+#endif
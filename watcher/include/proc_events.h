@@ -0,0 +1,41 @@
+#ifndef _TURINGWATCHER_PROC_EVENTS_H
+#define _TURINGWATCHER_PROC_EVENTS_H
+#include "common.h"
+#include "messaging.h"
+
+// Set to 1 to follow fork/exec/exit through the kernel proc connector instead
+// of rediscovering the process tree from /proc on every scrape. Needs
+// CAP_NET_ADMIN, falls back to plain scraping when the kernel refuses
+#define SCRAPE_PROC_EVENTS_ENV WATCHER_ENV("SCRAPE_PROC_EVENTS")
+
+enum proc_event_type_t {
+  PROC_EVENT_TYPE_FORK,
+  PROC_EVENT_TYPE_EXEC,
+  PROC_EVENT_TYPE_EXIT,
+};
+
+// Only processes are reported, events of non-leader threads are dropped
+struct proc_event_t {
+  proc_event_type_t type;
+  pid_t pid;
+  // Fork only
+  pid_t ppid;
+  // Exit only. With taskstats the counters are final values of the process,
+  // otherwise only comm is set, and only if the zombie was still readable
+  bool has_stats;
+  scrape_result_t stat;
+};
+
+typedef std::vector<proc_event_t> proc_event_list_t;
+
+extern bool proc_events_enabled;
+
+// Leaves proc_events_enabled false unless requested by environment and the
+// connector accepted the subscription
+bool init_proc_events();
+void finalize_proc_events();
+// Moves events received since last call into events in arrival order.
+// Returns false if events were dropped on the way, the caller then has to
+// rediscover the process tree from scratch
+bool drain_proc_events(proc_event_list_t &events);
+#endif
@@ -0,0 +1,54 @@
+#ifndef _TURINGWATCHER_PROC_SCRAPE_H
+#define _TURINGWATCHER_PROC_SCRAPE_H
+#include "common.h"
+
+#include <functional>
+
+// Submit reads of a whole batch with one io_uring_enter. Falls back to plain
+// reads when disabled here or when the running kernel refuses to set up a ring
+#define PROC_SCRAPE_USE_IO_URING 1
+#define PROC_SCRAPE_ROOT "/proc"
+#define PROC_STAT_BUF_SIZE 4096
+
+// Number of processes whose files are opened and read together
+constexpr int PROC_SCRAPE_BATCH = 64;
+
+// Files read for every process on every scrape. Anything only needed once in
+// the lifetime of a process (cmdline, cpuset) is left to read_proc_file
+enum proc_file_t {
+  PROC_FILE_STAT,
+  PROC_FILE_IO,
+  PROC_FILE_CNT
+};
+
+struct proc_reading_t {
+  pid_t pid;
+  // NUL-terminated for convenience; len < 0 if the file is unreadable
+  const char *buf[PROC_FILE_CNT];
+  ssize_t len[PROC_FILE_CNT];
+};
+
+typedef std::function<void(const proc_reading_t &)> proc_reading_callback_t;
+
+// root is overridable to run against a synthetic proc tree
+bool init_proc_scrape(const char *root = PROC_SCRAPE_ROOT);
+void finalize_proc_scrape();
+// Callbacks are issued in directory order, same as readdir on root
+void scrape_proc(const proc_reading_callback_t &callback);
+// Same as above for known pids only, in the given order. Gone ones are skipped
+void scrape_proc_pids(
+  const std::vector<pid_t> &pids, const proc_reading_callback_t &callback);
+// Whether batches are read through io_uring, false once it fell back to read
+bool proc_scrape_uses_ring();
+#if PROC_SCRAPE_USE_IO_URING
+// For tests, submits reads with opcode op from now on, and probes for it in
+// init_proc_scrape, so that the kernel refuses them as one without it does
+void proc_scrape_set_ring_op(uint8_t op);
+#endif
+// Only true when the pid is known to be gone, not on other errors
+bool proc_pid_exited(pid_t pid);
+// Reads at most size - 1 bytes of dir_fd/name and NUL-terminates the buffer
+ssize_t read_proc_file(int dir_fd, const char *name, char *buf, size_t size);
+// Same as above for /proc/<pid>/name
+ssize_t read_proc_pid_file(pid_t pid, const char *name, char *buf, size_t size);
+#endif
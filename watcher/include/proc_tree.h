@@ -0,0 +1,64 @@
+#ifndef _TURINGWATCHER_PROC_TREE_H
+#define _TURINGWATCHER_PROC_TREE_H
+#include "common.h"
+#include "messaging.h"
+#include "proc_scrape.h"
+#include "cgroup_scrape.h"
+#include "proc_events.h"
+
+#define SLURMSTEPD_COMM "slurmstepd"
+#define READ_BUF_SIZE 4096
+
+typedef std::map<pid_t, std::vector<pid_t> > process_tree_t;
+typedef std::map<pid_t, scrape_result_t> scraper_result_map_t;
+typedef std::map<pid_t, slurm_step_id_t> stepd_step_id_map_t;
+typedef std::set<std::string> step_application_set_t;
+typedef std::map<std::pair<uint32_t /*jobid*/, uint32_t /*stepid*/>,
+                 step_application_set_t> jobstep_application_map_t;
+
+// A pid is the same process as long as its starttime (field 22 of stat) is
+// unchanged, so whatever was derived from cmdline and cpuset is kept until
+// the pid disappears or is reused
+struct cached_process_t {
+  // 0 if only known from a fork event
+  size_t starttime;
+  pid_t ppid;
+  // Last scrape the process was seen in
+  uint32_t generation;
+  // Forked or exec'ed since cmdline was last looked at
+  bool stale_cmdline;
+};
+
+// Kept across scrapes of a scraper run. Every live process gets its counters
+// overwritten by each scrape, processes not seen are dropped at its end
+struct process_cache_t {
+  uint32_t generation;
+  std::map<pid_t, cached_process_t> processes;
+  process_tree_t child;
+  scraper_result_map_t result;
+  stepd_step_id_map_t stepd_pids;
+  // From proc events: counters of children exited since last scrape, merged
+  // into the parent once it is scraped, and applications that ran and exited
+  // in between, by step so they are kept when the stepd exits as well
+  scraper_result_map_t exited_children;
+  jobstep_application_map_t exited_apps;
+};
+
+#define STAT_MERGE_DST my_stat
+#define STAT_MERGE_SRC child_stat
+#define ACCUMULATE_SCRAPER_STAT(NAME) \
+  STAT_MERGE_DST.NAME += STAT_MERGE_SRC.NAME
+#define AGGERGATE_SCRAPER_STAT_MAX(NAME) \
+  STAT_MERGE_DST.NAME = std::max(STAT_MERGE_SRC.NAME, STAT_MERGE_DST.NAME);
+// NULL only while no process contributed a readable value
+#define ACCUMULATE_PRIVILEGED_SCRAPER_STAT(NAME) \
+  if (STAT_MERGE_SRC.NAME != PRIVILEGED_STAT_NULL) { \
+    STAT_MERGE_DST.NAME = STAT_MERGE_DST.NAME == PRIVILEGED_STAT_NULL \
+      ? STAT_MERGE_SRC.NAME : STAT_MERGE_DST.NAME + STAT_MERGE_SRC.NAME; \
+  }
+
+// Scrapes every process into cache.result and links them into cache.child,
+// slurmstepd processes are put into cache.stepd_pids with their step
+void fetch_proc_stats(process_cache_t &cache,
+                      cgroup_cpu_available_map_t &jobstep_cpu_available);
+#endif
@@ -0,0 +1,25 @@
+#ifndef _TURINGWATCHER_PROTOCOL_V3_H
+#define _TURINGWATCHER_PROTOCOL_V3_H
+#include "messaging.h"
+
+typedef std::pair<uint32_t /*jobid*/, uint32_t /*stepid*/> v3_step_key_t;
+
+// Lives as long as a connection, on both ends
+struct v3_state_t {
+  // Client side string table
+  std::map<std::string, uint32_t> string_ids;
+  // Server side string table
+  std::vector<std::string> strings;
+  std::string hostname;
+  std::map<v3_step_key_t, scrape_result_t> last_results;
+  bool negotiated;
+};
+
+// Appends the records of batch to payload, the hostname is taken from the
+// worker of its header
+void v3_encode_batch(
+  v3_state_t &state, const batch_t &batch, std::string &payload);
+// Only fills the record vectors of batch. Returns false on malformed payload
+bool v3_decode_batch(
+  v3_state_t &state, const std::string &payload, batch_t &batch);
+#endif
@@ -0,0 +1,96 @@
+#ifndef _TURINGWATCHER_REPORT_SECTIONS_H
+#define _TURINGWATCHER_REPORT_SECTIONS_H
+#include "common.h"
+#include "result_archive.h"
+
+#include <deque>
+#include <optional>
+
+/*
+  The report of webserver/main.go shows letters split into sections, each
+  starting at a heading, some of them the same for every user. Instead of
+  parsing the letters back, the analyzer marks the sections where it writes
+  them and puts them into the result tarball ahead of the letters:
+
+    index.json        started, updated, the display names of sections by
+                      machine name, and of every user with a letter its
+                      sections in order as [machine name, id], the id empty
+                      for sections of the user alone
+    sections/<id>.html  shared sections, stored once by their content
+    users/<user>.json {"data": {<user>: raw data}, "sections": {machine
+                      name: HTML}} of the sections of the user alone
+
+  so that the webserver loads a period without parsing any HTML.
+*/
+
+// A section of a letter as the report shows it
+struct report_section_t {
+  std::string machine_name;
+  std::string name;
+  // Stored once by content if shared, else in the shard of the user
+  bool shared;
+  std::string html;
+};
+
+// Files of a letter written in memory, with sections marked where they start
+// in them. A section ends where the next one in the same file starts, or
+// where the file is marked to end
+struct report_letter_t {
+  struct file_t {
+    std::string name;
+    char *buf = NULL;
+    size_t len = 0;
+    // NULL once closed
+    FILE *fp = NULL;
+  };
+
+  ~report_letter_t();
+  // NULL if it could not be opened
+  FILE *open(const std::string &name);
+  void close(FILE *fp);
+  // Starts a section at the current end of fp, ending the one before there
+  void mark(FILE *fp, const std::string &machine_name, const std::string &name,
+            bool shared);
+  // Ends the section at the current end of fp without starting another
+  void end(FILE *fp);
+  // Of the letter once all files are closed, in the order of files and where
+  // they start, every from in them replaced by to
+  std::vector<report_section_t> sections(const std::string &from,
+                                         const std::string &to) const;
+
+  // In the order opened
+  std::deque<file_t> files;
+
+ private:
+  struct mark_t {
+    size_t file;
+    size_t offset;
+    // Without a section for end
+    std::optional<report_section_t> section;
+  };
+  std::vector<mark_t> marks;
+};
+
+// As a JSON string, quotes included
+std::string report_json_quote(const std::string &str);
+// Content address of a shared section, 16 hexadecimal digits
+std::string report_section_id(const std::string &html);
+// users/<user>.json, json being "<user>": {...} as dumped by the analysis
+void report_add_shard(archive_part_t &part, const std::string &user,
+                      const std::optional<std::string> &json,
+                      const std::vector<report_section_t> &sections);
+
+// index.json and sections/ of the users added
+struct report_index_t {
+  void add_user(const std::string &user,
+                const std::vector<report_section_t> &sections);
+  // Adds index.json followed by the shared sections to part
+  void add_files(archive_part_t &part, time_t started, time_t updated) const;
+
+ private:
+  std::map<std::string, std::string> names;
+  // Ids to shared sections of users added, which must outlive the index
+  std::map<std::string, const std::string *> store;
+  std::string users_json;
+};
+#endif
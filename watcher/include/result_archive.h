@@ -0,0 +1,34 @@
+#ifndef _TURINGWATCHER_RESULT_ARCHIVE_H
+#define _TURINGWATCHER_RESULT_ARCHIVE_H
+#include "common.h"
+
+/*
+  Analysis results are a gzip compressed tar, which the webserver reads in
+  loadResultTar of webserver/main.go: raw.json first, then the files of
+  every user. The archive is built in memory out of parts, each a run of
+  tar entries compressed by whoever built it into gzip members of its own,
+  so that the analysis workers compress their users concurrently. Members
+  written one after another are read as one stream by gzip readers, Go's
+  included.
+*/
+
+// Of tar a part is compressed into members of up to this many bytes each,
+// which can be compressed concurrently
+#define ARCHIVE_BLOCK_SIZE (1 << 20)
+
+struct archive_part_t {
+  // A regular file, names longer than ustar holds get a PAX header
+  void add_file(const std::string &name, const std::string &data);
+  // Of all files added, on up to threads threads. False if compression
+  // failed, tar is dropped either way
+  bool compress(size_t threads = 1);
+
+  std::string tar;
+  std::string gz;
+};
+
+// Writes the compressed parts in order, followed by the end of the tar, to
+// path with ".tmp" appended, and renames it to path once on disk
+bool archive_write(const std::string &path,
+                   const std::vector<const archive_part_t *> &parts);
+#endif
@@ -0,0 +1,57 @@
+#ifndef _TURINGWATCHER_ROLLUP_H
+#define _TURINGWATCHER_ROLLUP_H
+#include "common.h"
+#include "db_common.h"
+
+#include <optional>
+
+/*
+  Keeps what the analyzer reads of measurements as they are inserted, so that
+  analysis goes by the number of steps rather than the number of samples. Per
+  step and watcher, step_rollup counts the samples and holds the latest
+  cumulative times along with the sys ratio buckets of the time between
+  samples, step_usage_rollup the samples by number of CPUs and GPUs in use,
+  and step_gpu_rollup the utilization buckets of every GPU.
+
+  Samples are added after they were inserted, within the write transaction,
+  and written by rollup_flush in the same transaction. The rollups of a step
+  are loaded from the database at the first sample of a flush, which sees
+  all samples before since writes are serialized, so nothing is kept across
+  transactions.
+
+  Times between samples are taken within what one watcher measured of a
+  step. A GPU reading is repeated by the driver if it is older than the one
+  before with the same values, and is not counted again.
+*/
+
+// Samples are flushed at least this often while backfilling
+#define ROLLUP_BACKFILL_FLUSH_SAMPLES 65536
+
+struct rollup_sample_t {
+  int watcherid;
+  uint32_t jobid;
+  uint32_t stepid;
+  // The latest one inserted along with the sample will do, analysis periods
+  // never begin within a transaction
+  int64_t recordid;
+  // Cumulative, in usec
+  int64_t user_time;
+  int64_t sys_time;
+  std::optional<int64_t> res_size;
+  std::optional<int64_t> gpu_measurement_batch;
+  // In seconds, what the sample was scraped with
+  int scrape_interval;
+};
+
+// Of a sample inserted in the open transaction of the calling thread, in the
+// order of insertion. False if its rollups could not be loaded
+bool rollup_add(const rollup_sample_t &sample);
+// Writes the rollups of what was added since the last flush
+bool rollup_flush();
+// Rebuilds all rollups from the measurements in a write transaction of its
+// own, if the migration that brought them asked for it. After the partitions
+// are attached
+bool rollup_backfill();
+// Of the statements of the calling thread
+void rollup_finalize();
+#endif
@@ -0,0 +1,68 @@
+#ifndef _TURINGWATCHER_SPOOL_H
+#define _TURINGWATCHER_SPOOL_H
+#include "common.h"
+
+#include <functional>
+
+#include <sys/mman.h>
+
+/*
+  Append-only spool of received batches, kept until they are committed to the
+  database so that a restart does not lose them.
+
+  The spool is made of SPOOL_SEGMENT_CNT memory-mapped segment files. Records
+  are appended to the active one, which is switched once it grew past
+  SPOOL_SEGMENT_SIZE and the other one is empty. A segment is truncated as
+  soon as all of its records are committed and it is no longer appended to.
+
+  [spool_record_t][payload][padding to 8 bytes] ... continues ...
+
+  A background thread syncs whatever was appended or committed since its last
+  round every SPOOL_SYNC_INTERVAL_MS, so at most that much is lost on a crash.
+  Records are checksummed, a segment is read up to its first torn or stale
+  record, that is one failing the checksum or not newer than its predecessor.
+*/
+
+#define SPOOL_SEGMENT_CNT 2
+#define SPOOL_SEGMENT_SIZE (64 << 20)
+// Address space reserved per segment, appends fail beyond it
+#define SPOOL_MAP_SIZE (1ul << 30)
+// Segment files grow by this much
+#define SPOOL_GROW_SIZE (4 << 20)
+#define SPOOL_SYNC_INTERVAL_MS 200
+#define SPOOL_RECORD_MAGIC 0x5900100Du
+
+struct spool_record_t {
+  uint32_t magic;
+  // Of the payload, without the padding
+  uint32_t len;
+  // Of seq and the payload
+  uint32_t crc;
+  // Set in place once the payload is in the database
+  uint32_t committed;
+  // Increasing across all segments
+  uint64_t seq;
+};
+
+// Where a record went, segment is -1 for a batch that was not spooled
+struct spool_ref_t {
+  int segment = -1;
+  size_t offset;
+};
+
+// Opens or creates the segments at prefix.0, prefix.1 ... and starts syncing
+bool spool_open(const char *prefix);
+bool spool_is_open();
+// Calls fn on every uncommitted record, oldest first. Only valid right after
+// spool_open, before anything is appended
+void spool_replay(
+  const std::function<void(const char *, size_t, spool_ref_t)> &fn);
+// Thread-safe. Returns false if payload could not be spooled
+bool spool_append(const std::string &payload, spool_ref_t &ref);
+// Thread-safe, refs of batches that were not spooled are ignored
+void spool_commit(const spool_ref_t &ref);
+// Stops syncing after a last round and unmaps the segments
+void spool_close();
+
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len);
+#endif
@@ -0,0 +1,182 @@
+#ifndef _TURINGWATCHER_STMT_REGISTRY_H
+#define _TURINGWATCHER_STMT_REGISTRY_H
+#include "common.h"
+#include "db_common.h"
+
+#include <array>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+
+/*
+  Statements declared once with the types and names of their parameters and
+  result columns, see sql/stmts.h. Every thread prepares a statement on its
+  connection at first use and keeps it until db_common_finalize, resolving
+  the parameter names to indices then. Binding and fetching go by those
+  indices and by column position, checked against the declared types at
+  compile time. stmt_registry_check compares the declared names with what
+  SQLite reports for every statement once at startup.
+*/
+
+struct prepared_stmt_t {
+  sqlite3_stmt *stmt = NULL;
+  // Index of every declared parameter
+  std::vector<int> params;
+};
+
+struct registered_stmt_t {
+  registered_stmt_t(const char *const &sql,
+                    const char *const *params, size_t nparam,
+                    const char *const *columns, size_t ncol,
+                    const char *op);
+  // Prepared on SQL_CONN_NAME of the calling thread, NULL on failure
+  prepared_stmt_t *get();
+  // Prints every mismatch of the declaration on SQL_CONN_NAME
+  bool check();
+
+  const char *const &sql;
+  std::vector<const char *> param_names;
+  std::vector<const char *> column_names;
+  const char *op;
+  size_t id;
+};
+
+// All declared statements, in the order of their registration
+std::vector<registered_stmt_t *> &stmt_registry();
+bool stmt_registry_check();
+// Of the statements of the calling thread
+void stmt_registry_finalize();
+
+template<typename T>
+struct is_optional_t : std::false_type {};
+template<typename T>
+struct is_optional_t<std::optional<T>> : std::true_type {};
+
+// std::optional binds NULL if empty, so does a NULL text
+template<typename T>
+inline int stmt_bind_value(sqlite3_stmt *stmt, int idx, const T &val) {
+  if constexpr (is_optional_t<T>::value) {
+    return val ? stmt_bind_value(stmt, idx, *val)
+               : sqlite3_bind_null(stmt, idx);
+  } else if constexpr (std::is_same_v<T, const char *>
+                       || std::is_same_v<T, char *>) {
+    return val ? sqlite3_bind_text(stmt, idx, val, -1, SQLITE_STATIC)
+               : sqlite3_bind_null(stmt, idx);
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    return sqlite3_bind_text(stmt, idx, val.c_str(), val.size(),
+                             SQLITE_STATIC);
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return sqlite3_bind_double(stmt, idx, val);
+  } else {
+    static_assert(std::is_integral_v<T> || std::is_enum_v<T>,
+                  "no binding for the parameter type");
+    return sqlite3_bind_int64(stmt, idx, (sqlite3_int64)val);
+  }
+}
+
+// Texts are valid until the statement steps again or is reset
+template<typename T>
+inline T stmt_fetch_value(sqlite3_stmt *stmt, int col) {
+  if constexpr (is_optional_t<T>::value) {
+    if (sqlite3_column_type(stmt, col) == SQLITE_NULL) {
+      return std::nullopt;
+    }
+    return stmt_fetch_value<typename T::value_type>(stmt, col);
+  } else if constexpr (std::is_same_v<T, const char *>) {
+    return (const char *)sqlite3_column_text(stmt, col);
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    const auto text = (const char *)sqlite3_column_text(stmt, col);
+    return text ? std::string(text, sqlite3_column_bytes(stmt, col)) : "";
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return sqlite3_column_double(stmt, col);
+  } else {
+    static_assert(std::is_integral_v<T> || std::is_enum_v<T>,
+                  "no fetching for the column type");
+    return (T)sqlite3_column_int64(stmt, col);
+  }
+}
+
+template<typename... T> struct params_t {};
+template<typename... T> struct columns_t {};
+
+template<typename P, typename C> struct stmt_t;
+
+template<typename... P, typename... C>
+struct stmt_t<params_t<P...>, columns_t<C...>> : registered_stmt_t {
+  typedef std::tuple<C...> row_t;
+
+  stmt_t(const char *const &sql,
+         const std::array<const char *, sizeof...(P)> &params,
+         const std::array<const char *, sizeof...(C)> &columns,
+         const char *op)
+    : registered_stmt_t(sql, params.data(), params.size(),
+                        columns.data(), columns.size(), op) {}
+
+  // Resets the statement and binds all parameters, NULL on failure
+  sqlite3_stmt *bind(const P &...vals) {
+    prepared_stmt_t *prepared = get();
+    if (!prepared) {
+      return NULL;
+    }
+    sqlite3_reset(prepared->stmt);
+    size_t param = 0;
+    const bool bound = (IS_SQLITE_OK(stmt_bind_value(
+      prepared->stmt, prepared->params[param++], vals)) && ...);
+    if (!bound) {
+      fprintf(stderr, "sqlite3_bind%s: %s\n", op,
+              sqlite3_errmsg(SQL_CONN_NAME));
+      return NULL;
+    }
+    return prepared->stmt;
+  }
+
+  static row_t row(sqlite3_stmt *stmt) {
+    return fetch_row(stmt, std::index_sequence_for<C...>());
+  }
+
+  // Runs the statement to its end, false on failure
+  bool exec(const P &...vals) {
+    sqlite3_stmt *stmt = bind(vals...);
+    int ret = SQLITE_MISUSE;
+    if (stmt) {
+      while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        ;
+      sqlite3_reset(stmt);
+    }
+    return stmt && verify_sqlite_ret(ret, op);
+  }
+
+  // The first row, false on failure or if there was none. The statement is
+  // reset right away, so texts are to be fetched as std::string
+  bool fetch_one(row_t &out, const P &...vals) {
+    sqlite3_stmt *stmt = bind(vals...);
+    if (!stmt || !step_and_verify(stmt, true, op)) {
+      return false;
+    }
+    out = row(stmt);
+    sqlite3_reset(stmt);
+    return true;
+  }
+
+  // Calls each_row(row_t) for every row, false on failure
+  template<typename F>
+  bool for_each(F &&each_row, const P &...vals) {
+    sqlite3_stmt *stmt = bind(vals...);
+    if (!stmt) {
+      return false;
+    }
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+      each_row(row(stmt));
+    }
+    sqlite3_reset(stmt);
+    return verify_sqlite_ret(ret, op);
+  }
+
+ private:
+  template<size_t... I>
+  static row_t fetch_row(sqlite3_stmt *stmt, std::index_sequence<I...>) {
+    return row_t(stmt_fetch_value<C>(stmt, I)...);
+  }
+};
+#endif
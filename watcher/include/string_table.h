@@ -0,0 +1,50 @@
+#ifndef _TURINGWATCHER_STRING_TABLE_H
+#define _TURINGWATCHER_STRING_TABLE_H
+#include "common.h"
+
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+
+// Arena chunks double from the first size up to the last, strings larger than
+// that get a chunk of their own
+#define STRING_ARENA_FIRST_CHUNK_SIZE 512
+#define STRING_ARENA_CHUNK_SIZE (64 << 10)
+
+typedef uint32_t string_id_t;
+#define STRING_ID_NONE ((string_id_t)-1)
+
+// Interns the strings of one batch: every distinct string is copied once into
+// an arena and named by a dense id, which stays valid until clear. clear
+// releases all strings at once and keeps the arena for reuse
+struct string_table_t {
+  string_id_t intern(const char *str, size_t len);
+  string_id_t intern(const char *str) {
+    return intern(str, strlen(str));
+  }
+  const char *str(string_id_t id) const {
+    return strs[id];
+  }
+  size_t size() const {
+    return strs.size();
+  }
+  // Arena bytes taken by the interned strings
+  size_t bytes() const {
+    return used_bytes;
+  }
+  void clear();
+
+private:
+  char *allocate(size_t len);
+
+  std::unordered_map<std::string_view, string_id_t> ids;
+  std::vector<const char *> strs;
+  std::vector<std::unique_ptr<char[]>> chunks;
+  std::vector<size_t> chunk_sizes;
+  // Chunk being filled and how much of it is taken
+  size_t chunk_idx = 0;
+  size_t chunk_used = 0;
+  std::vector<std::unique_ptr<char[]>> large;
+  size_t used_bytes = 0;
+};
+#endif
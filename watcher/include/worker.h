@@ -4,19 +4,22 @@
 #include "sqlite_helper.h"
 #include "db_common.h"
 #include "messaging.h"
+#include "accuracy_index.h"
+#include "rollup.h"
+#include "partition.h"
+#include "stmts.h"
 #include "gpu/interface.h"
+#include "proc_scrape.h"
+#include "cgroup_scrape.h"
+#include "proc_events.h"
+#include "proc_tree.h"
 
 #include <thread>
 
-// ========================== FOR DEBUG AND TEST ONLY ==========================
-// THIS OPTION BRINGS KNOWN PROBLEM OF POSSIBLY MISSING MATCHING JOBINFO!!!
-// Set this value to be the length of sleep that waits for last-minute messages
-// Recommended to be 10 secs with manual scraper and 600 secs with distributor
-// 0 = Disable
-#define PROCESS_ALL_MSG_BEFORE_NEXT_ROUND 0 /* secs */
-// ============================================================================
-
-#define GUARANTEED_FREEZE_WAIT 3 /* secs */
+// How often received batches are committed to the database
+#define INGEST_INTERVAL 2 /* secs */
+// At most this many batches share a transaction
+#define INGEST_GROUP_COMMIT_BATCHES 256
 
 #define TRES_ID(X) tres_t::from_str(X)
 #define DISK_TRES TRES_ID("fs/disk")
@@ -55,12 +58,18 @@ constexpr int TOTAL_SCRAPE_TIME_PER_NODE = FREQ(
 #endif
 );
 constexpr int SCRAPE_CNT = TOTAL_SCRAPE_TIME_PER_NODE / SCRAPE_INTERVAL;
+// Scrapers stream results over one connection every SCRAPE_FLUSH_CNT scrapes
+// or once SCRAPE_FLUSH_SIZE bytes are staged. Set to SCRAPE_CNT to send only
+// once at the end
+constexpr int SCRAPE_FLUSH_CNT = 3;
+constexpr size_t SCRAPE_FLUSH_SIZE = 1 << 20;
+// Unsent batches are retried with the next flush, or this often at the end
+constexpr int SCRAPE_SEND_RETRY_CNT = 3;
+constexpr int SCRAPE_SEND_RETRY_INTERVAL = 10; /* secs */
 // NOTE: The implementation could use up to double of this concurrency value
 constexpr int SCRAPE_CONCURRENT_NODES = 4;
 constexpr int ALLOCATION_TIMEOUT = 120;
 
-#define READ_BUF_SIZE 4096
-
 // No check for existence of mandatory arguments
 struct measurement_rec_t {
   const int *recordid; /* Optional */
@@ -69,6 +78,7 @@ struct measurement_rec_t {
   const size_t *dev_out;
   const size_t *res_size;
   const size_t *minor_pagefault; /* Optional */
+  const size_t *peak_mem_usage; /* Optional */
   const pid_t *gpu_measurement_batch; /* Optional */
 
   const uint64_t *sys_cpu_sec;
@@ -77,11 +87,7 @@ struct measurement_rec_t {
   const uint32_t *user_cpu_usec;
 };
 
-typedef std::map<pid_t, std::vector<pid_t> > process_tree_t;
-typedef std::map<pid_t, scrape_result_t> scraper_result_map_t;
-typedef std::map<pid_t, slurm_step_id_t> stepd_step_id_map_t;
 typedef uint32_t node_val_t;
-typedef std::set<std::string> step_application_set_t;
 typedef std::set<std::string> node_set_t;
 typedef std::vector<std::string> node_string_list_t;
 
@@ -102,13 +108,6 @@ val_assignment_t;
 typedef std::map<pid_t, std::vector<gpu_measurement_t *> >
   pid_gpu_measurement_map_t;
 
-#define STAT_MERGE_DST my_stat
-#define STAT_MERGE_SRC child_stat
-#define ACCUMULATE_SCRAPER_STAT(NAME) \
-  STAT_MERGE_DST.NAME += STAT_MERGE_SRC.NAME
-#define AGGERGATE_SCRAPER_STAT_MAX(NAME) \
-  STAT_MERGE_DST.NAME = std::max(STAT_MERGE_SRC.NAME, STAT_MERGE_DST.NAME);
-
 typedef std::map<std::pair<uint32_t /*jobid*/, uint32_t /*stepid*/>,
                  int /*recordid*/> jobstep_val_map_t;
 typedef jobstep_val_map_t jobstep_recordid_map_t;
@@ -119,7 +118,7 @@ void measurement_record_insert(
 bool build_slurmdb_conn();
 bool close_slurmdb_conn();
 
-bool log_scraper_freq(const char *sql, const char *op);
+bool log_scraper_freq(scrape_freq_stmt_t &stmt);
 
 void do_analyze();
 
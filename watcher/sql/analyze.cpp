@@ -1,17 +1,105 @@
 #include "sql_helper.h"
 
 const char *ANALYZE_LIST_ACTIVE_USERS = SQLITE_CODEBLOCK(
-  SELECT DISTINCT user FROM measurements, jobinfo
-  WHERE measurements.recordid > :offset_start
-        AND measurements.recordid <= :offset_end
-        AND measurements.jobid == jobinfo.jobid
+  SELECT DISTINCT user FROM step_rollup, jobinfo
+  WHERE step_rollup.latest_recordid > :offset_start
+        AND step_rollup.latest_recordid <= :offset_end
+        AND step_rollup.jobid == jobinfo.jobid
         AND user IS NOT NULL;
   EXCEPT SELECT user FROM analyze_user_info WHERE skip IS 1;
 );
 
+/* Results of steps, kept on the reader of a worker across periods so
+   that a user is analyzed again by the jobs that changed since. A job is
+   analyzed again once any of its steps is measured, and as long as it runs
+   since its steps and their accounting may still come in. Sums are kept
+   rather than averages, as the rollups they come from */
+const char *ANALYZE_ATTACH_CACHE_SQL = SQLITE_CODEBLOCK(
+  ATTACH DATABASE 'file:analysis_cache?mode=memory' AS analysis_cache;
+
+  /* Rollups with latest_recordid up to cached_until are in the cache */
+  CREATE TABLE analysis_cache.cached_user(
+    user TEXT PRIMARY KEY,
+    cached_until INTEGER NOT NULL
+  ) WITHOUT ROWID;
+
+  CREATE TABLE analysis_cache.cached_job(
+    jobid INTEGER PRIMARY KEY,
+    user TEXT NOT NULL,
+    ended INTEGER NOT NULL
+  );
+  CREATE INDEX analysis_cache.cached_job_index ON cached_job(user, ended);
+
+  CREATE TABLE analysis_cache.step_usage(
+    jobid INTEGER NOT NULL,
+    stepid INTEGER NOT NULL,
+    user TEXT NOT NULL,
+    sample_cnt INTEGER,
+    latest_recordid INTEGER,
+    sampled_peak_res_size INTEGER,
+    sys_ratio_cnt INTEGER,
+    sys_ratio_1_10 INTEGER,
+    sys_ratio_1_3 INTEGER,
+    sys_ratio_2_3 INTEGER,
+    sys_ratio_gt_1 REAL,
+    mem_limit INTEGER,
+    name TEXT,
+    submit_line TEXT,
+    ngpu INTEGER,
+    nnodes INTEGER,
+    step_start_offset INTEGER,
+    step_end_offset INTEGER,
+    job_length INTEGER,
+    timelimit INTEGER,
+    peak_res_size INTEGER,
+    PRIMARY KEY (jobid, stepid)
+  ) WITHOUT ROWID;
+  CREATE INDEX analysis_cache.step_usage_index ON step_usage(user);
+
+  CREATE TABLE analysis_cache.step_gpu_usage(
+    jobid INTEGER NOT NULL,
+    stepid INTEGER NOT NULL,
+    target_node TEXT NOT NULL,
+    gpuid INTEGER NOT NULL,
+    sample_cnt INTEGER NOT NULL,
+    util_sum INTEGER NOT NULL,
+    zero_util_cnt INTEGER NOT NULL,
+    low_util_cnt INTEGER NOT NULL,
+    longest_zero_util_run INTEGER NOT NULL,
+    sm_clock_sum INTEGER NOT NULL,
+    power_usage_sum INTEGER NOT NULL,
+    temperature_sum INTEGER NOT NULL,
+    PRIMARY KEY (jobid, stepid, target_node, gpuid)
+  ) WITHOUT ROWID;
+
+  CREATE TABLE analysis_cache.step_gpucpu_usage(
+    jobid INTEGER NOT NULL,
+    stepid INTEGER NOT NULL,
+    target_node TEXT NOT NULL,
+    is_gpu INTEGER NOT NULL,
+    in_use INTEGER NOT NULL,
+    ncpu INTEGER,
+    cnt INTEGER NOT NULL,
+    PRIMARY KEY (jobid, stepid, target_node, is_gpu, in_use)
+  ) WITHOUT ROWID;
+);
+
+/* Before the reader is given back */
+const char *ANALYZE_DETACH_CACHE_SQL = SQLITE_CODEBLOCK(
+  DETACH DATABASE analysis_cache;
+);
+
+/* Attached databases take the flags of the connection, the in-memory one is
+   only writable on a read-only reader when opened through a URI. The tables
+   of a round are built at once for the users added to analyzed_user */
 const char *PRE_ANALYZE_SQL = SQLITE_CODEBLOCK(
-  ATTACH DATABASE ':memory:' AS inmem;
+  ATTACH DATABASE 'file:inmem?mode=memory' AS inmem;
   BEGIN TRANSACTION;
+  CREATE TABLE inmem.analyzed_user(user TEXT PRIMARY KEY) WITHOUT ROWID;
+);
+
+const char *ANALYZE_ADD_USER_SQL = SQLITE_CODEBLOCK(
+  INSERT OR IGNORE INTO inmem.analyzed_user(user) VALUES (:user);
 );
 
 #define SLURM_STYLE_TIME(VAR) \
@@ -28,18 +116,37 @@ Analysis ideas:
     (could maintain own memory pool to hold these chunks and accelearate allocation / free)
 */
 
+/* Statements bind :offset_start and :offset_end where they have them, and
+   run once for all users in analyzed_user. [0] to [7] bring the cache of the
+   users up to date, the tables after are built from it with the user first
+   and indexed by it, for the letters to select theirs by :user */
 const char *ANALYZE_CREATE_BASE_TABLES[] = {
   /*[0]*/SQLITE_CODEBLOCK(
-  CREATE TABLE inmem.measurements AS
-    SELECT measurements.*,
-           max(recordid) OVER win AS latest_recordid
-    FROM measurements, watcher, jobinfo
-    WHERE jobinfo.user IS :user
-          AND watcher.target_node IS NOT NULL
-          AND measurements.watcherid == watcher.id
-          AND measurements.jobid == jobinfo.jobid
-    WINDOW win AS (PARTITION BY measurements.jobid, measurements.stepid);
+  CREATE TABLE inmem.changed_job AS
+    WITH since AS MATERIALIZED (
+      SELECT user, ifnull(cached_until, 0) AS cached_until
+      FROM inmem.analyzed_user
+           LEFT JOIN analysis_cache.cached_user USING (user)
+    )
+    SELECT since.user, step_rollup.jobid FROM step_rollup, jobinfo, since
+    WHERE step_rollup.latest_recordid > (SELECT min(cached_until) FROM since)
+          AND jobinfo.jobid == step_rollup.jobid AND jobinfo.stepid IS NULL
+          AND jobinfo.user == since.user
+          AND step_rollup.latest_recordid > since.cached_until
+    UNION SELECT user, jobid FROM analysis_cache.cached_job
+    WHERE user IN (SELECT user FROM inmem.analyzed_user) AND NOT ended;
   ), /*[1]*/SQLITE_CODEBLOCK(
+  CREATE TABLE inmem.rollup AS
+    SELECT step_rollup.*, watcher.target_node, cpu.ncpu
+    FROM inmem.changed_job, step_rollup, watcher,
+         job_step_cpu_available AS cpu
+    WHERE watcher.target_node IS NOT NULL
+          AND step_rollup.jobid == changed_job.jobid
+          AND step_rollup.watcherid == watcher.id
+          AND cpu.watcherid == step_rollup.watcherid
+          AND cpu.jobid == step_rollup.jobid
+          AND cpu.stepid == step_rollup.stepid;
+  ), /*[2]*/SQLITE_CODEBLOCK(
 
     CREATE TABLE inmem.recombined_jobinfo AS SELECT * FROM (
       SELECT jobid, stepid,
@@ -56,217 +163,156 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
       ifnull(timelimit, first_value(timelimit) OVER win) AS timelimit,
       peak_res_size
     FROM jobinfo
-    WHERE user IS NULL OR user IS :user
+    WHERE jobid IN (SELECT jobid FROM inmem.changed_job)
     WINDOW win AS (PARTITION BY jobid ORDER BY stepid NULLS FIRST)
-    ) WHERE user IS :user
-  ), /*[2]*/SQLITE_CODEBLOCK(
-
-  CREATE TABLE inmem.timeseries AS
-    WITH grouped_measurements AS MATERIALIZED (
-      WITH batch_ranges AS MATERIALIZED (
-        SELECT recordid, sum(flag) OVER win AS measurement_batch
-        FROM (
-          SELECT
-            recordid, (
-              lag(watcherid) OVER win IS NOT watcherid
-            ) AS flag, (
-              max(latest_recordid) OVER win2 > :offset_start
-              AND max(latest_recordid) OVER win2 <= :offset_end
-            ) AS kept
-          FROM inmem.measurements
-               JOIN inmem.recombined_jobinfo USING (jobid, stepid)
-          WINDOW win AS (ORDER BY recordid),
-                 win2 AS (PARTITION BY name, submit_line)
-        ) WHERE kept
-        WINDOW win AS (ORDER BY recordid
-          ROWS BETWEEN UNBOUNDED PRECEDING AND CURRENT ROW)
-      )
-      SELECT *, measurement_batch
-        FROM inmem.measurements JOIN batch_ranges USING (recordid)
-    )
-    SELECT
-      *,
-      latest_recordid > :offset_start AND latest_recordid <= :offset_end
-        AS is_new_in_period,
-      user_sec * 1e6 + user_usec
-        - lag(user_sec * 1e6 + user_usec, 1, user_sec * 1e6 + user_usec)
-      OVER win AS delta_user_time,
-      sys_sec * 1e6 + sys_usec
-        - lag(sys_sec * 1e6 + sys_usec, 1, sys_sec * 1e6 + sys_usec)
-      OVER win AS delta_sys_time,
-      res_size - lag(res_size, 1, res_size) OVER win AS delta_res_size,
-      res_size - first_value(res_size) OVER win AS delta_res_size_from_start,
-      lag(res_size) OVER win IS NOT NULL AND
-      res_size - (max(res_size) OVER win + min(res_size) OVER win) / 2 >= 0
-      IS NOT
-      lag(res_size) OVER win
-        - (max(res_size) OVER win + min(res_size) OVER win) / 2
-      >= 0
-      AS delta_res_size_from_midline,
-      minor_pagefault - lag(minor_pagefault, 1, minor_pagefault)
-        OVER win AS delta_minor_pagefault
-    FROM grouped_measurements
-           JOIN inmem.recombined_jobinfo USING (jobid, stepid)
-           /*LEFT*/ JOIN job_step_cpu_available USING (jobid, stepid, watcherid)
-           JOIN (SELECT *, lead(start, 1, 2e9) OVER win AS endval
-                   FROM scrape_freq_log_internal WINDOW win AS (ORDER BY start))
-                      ON (recordid >= start AND recordid < endval)
-    WHERE
-      inmem.recombined_jobinfo.jobid == grouped_measurements.jobid
-      AND inmem.recombined_jobinfo.stepid == grouped_measurements.stepid
-    WINDOW win AS (
-      PARTITION BY
-        grouped_measurements.jobid,
-        grouped_measurements.stepid,
-        measurement_batch
-    );
+    ) WHERE user IN (SELECT user FROM inmem.analyzed_user)
   ), /*[3]*/SQLITE_CODEBLOCK(
 
-  DELETE FROM inmem.measurements;
+  INSERT OR REPLACE INTO analysis_cache.cached_job(jobid, user, ended)
+    SELECT jobid, user, ifnull(ended_at, 0) > 0 FROM jobinfo
+    WHERE jobid IN (SELECT jobid FROM inmem.changed_job) AND stepid IS NULL;
   ), /*[4]*/SQLITE_CODEBLOCK(
 
-  CREATE TABLE inmem.sys_ratio AS
-    WITH systime_ratio_base AS MATERIALIZED (
-    WITH systime_ratio_base AS MATERIALIZED (
-    WITH systime_ratio_base AS MATERIALIZED (
-      SELECT jobid, stepid, is_new_in_period,
-             measurement_batch, name, submit_line, 
-             delta_sys_time / delta_user_time AS sys_ratio
-      FROM inmem.timeseries
-      WHERE delta_sys_time >= 1e6 AND delta_user_time > 0
-    )
-    SELECT *,
-      CASE WHEN sys_ratio IS NULL THEN NULL
-          WHEN sys_ratio <= 0.1 THEN 0
-          WHEN sys_ratio <= 1.0 / 3 THEN 333
-          WHEN sys_ratio <= 2.0 / 3 THEN 667
-          WHEN sys_ratio <= 1 THEN 1000
-          ELSE sys_ratio * 1000
-      END AS sys_ratio_category FROM systime_ratio_base
-    ) SELECT *, count(*) AS tot_in_batch,
-      count(sys_ratio_category) FILTER (WHERE sys_ratio_category == 333)
-        AS sys_ratio_1_10,
-      count(sys_ratio_category) FILTER (WHERE sys_ratio_category == 667)
-        AS sys_ratio_1_3,
-      count(sys_ratio_category) FILTER (WHERE sys_ratio_category == 1000)
-        AS sys_ratio_2_3,
-      total(sys_ratio_category / 1000) FILTER (WHERE sys_ratio_category > 1000)
-        AS sys_ratio_gt_1
-      FROM systime_ratio_base
+  INSERT OR REPLACE INTO analysis_cache.step_usage
+    SELECT jobid, stepid, user, sample_cnt, latest_recordid,
+      sampled_peak_res_size, sys_ratio_cnt, sys_ratio_1_10, sys_ratio_1_3,
+      sys_ratio_2_3, sys_ratio_gt_1, mem_limit, name, submit_line, ngpu,
+      nnodes, step_start_offset, step_end_offset, job_length, timelimit,
+      peak_res_size
+    FROM (
+      SELECT jobid, stepid,
+        sum(sample_cnt) AS sample_cnt,
+        max(latest_recordid) AS latest_recordid,
+        max(peak_res_size) AS sampled_peak_res_size,
+        sum(sys_ratio_cnt) AS sys_ratio_cnt,
+        sum(sys_ratio_1_10) AS sys_ratio_1_10,
+        sum(sys_ratio_1_3) AS sys_ratio_1_3,
+        sum(sys_ratio_2_3) AS sys_ratio_2_3,
+        sum(sys_ratio_gt_1_milli) / 1000.0 AS sys_ratio_gt_1
+      FROM inmem.rollup
       GROUP BY jobid, stepid
+    ) JOIN inmem.recombined_jobinfo USING (jobid, stepid);
+  ), /*[5]*/SQLITE_CODEBLOCK(
+
+  INSERT OR REPLACE INTO analysis_cache.step_gpu_usage
+    SELECT jobid, stepid, target_node, gpu.gpuid,
+      sum(gpu.sample_cnt), sum(util_sum), sum(zero_util_cnt),
+      sum(low_util_cnt), max(longest_zero_util_run), sum(sm_clock_sum),
+      sum(power_usage_sum), sum(temperature_sum)
+    FROM inmem.rollup
+         JOIN step_gpu_rollup AS gpu USING (jobid, stepid, watcherid)
+    GROUP BY jobid, stepid, target_node, gpu.gpuid;
+  ), /*[6]*/SQLITE_CODEBLOCK(
+
+  INSERT OR REPLACE INTO analysis_cache.step_gpucpu_usage
+    SELECT jobid, stepid, target_node, is_gpu, in_use, max(ncpu), sum(cnt)
+    FROM inmem.rollup
+         JOIN step_usage_rollup AS usage USING (jobid, stepid, watcherid)
+    GROUP BY jobid, stepid, target_node, is_gpu, in_use;
+  ), /*[7]*/SQLITE_CODEBLOCK(
+
+  /* Of what was measured up to the start of the analysis at least */
+  INSERT OR REPLACE INTO analysis_cache.cached_user(user, cached_until)
+    SELECT user, :offset_end FROM inmem.analyzed_user;
+  ), /*[8]*/SQLITE_CODEBLOCK(
+
+  /* Steps of the submissions, by name and submit line, that were measured
+     in the period */
+  CREATE TABLE inmem.step_usage AS
+    SELECT * FROM (
+      SELECT *,
+        latest_recordid > :offset_start AND latest_recordid <= :offset_end
+          AS is_new_in_period,
+        max(latest_recordid) OVER (PARTITION BY user, name, submit_line)
+          AS submission_latest_recordid
+      FROM analysis_cache.step_usage
+      WHERE user IN (SELECT user FROM inmem.analyzed_user)
     )
-    SELECT *,
+    WHERE submission_latest_recordid > :offset_start
+          AND submission_latest_recordid <= :offset_end;
+  ), /*[9]*/SQLITE_CODEBLOCK(
+  CREATE INDEX inmem.step_usage_user_index ON step_usage(user);
+  ), /*[10]*/SQLITE_CODEBLOCK(
+
+  CREATE TABLE inmem.sys_ratio AS
+    SELECT user, jobid, stepid, is_new_in_period, latest_recordid,
+      name, submit_line, sys_ratio_cnt AS tot_in_batch,
+      sys_ratio_1_10, sys_ratio_1_3, sys_ratio_2_3, sys_ratio_gt_1,
       sys_ratio_1_3 + sys_ratio_2_3 * 2 + sys_ratio_gt_1 * 3
         AS major_ratio_unified_tot
-      FROM systime_ratio_base;
-  ), /*[5]*/SQLITE_CODEBLOCK(
-  
+    FROM inmem.step_usage
+    WHERE sys_ratio_cnt > 0;
+  ), /*[11]*/SQLITE_CODEBLOCK(
+  CREATE INDEX inmem.sys_ratio_user_index ON sys_ratio(user);
+  ), /*[12]*/SQLITE_CODEBLOCK(
+
   CREATE TABLE inmem.gpu_usage_base AS
-    WITH gpu_usage_base AS MATERIALIZED (
-    WITH gpu_measurements_flagged AS MATERIALIZED (
-    WITH gpu_measurements_flagged AS MATERIALIZED (
-    WITH gpu_measurements_flagged AS MATERIALIZED (
-      SELECT
-        gpu_measurements.jobid, gpu_measurements.stepid, batch,
-        is_new_in_period, age, gpuid, power_usage, temperature, sm_clock, util,
-        age IS NOT 0 AND age > lag(age) OVER win IS 1 AS discard,
-        util == 0 AS zero_flags
-      FROM gpu_measurements, inmem.timeseries
-      WHERE gpu_measurement_batch == batch
-      WINDOW win AS
-      (PARTITION BY measurement_batch,
-                    gpu_measurements.jobid, gpu_measurements.stepid, gpuid,
-                    power_usage, temperature, sm_clock, util
-      ORDER BY batch)
-    )
-      SELECT *,
-            CASE WHEN zero_flags IS 0 OR lead(zero_flags) OVER win IS NULL
-              THEN ifnull(-sum(zero_flags) OVER (
-                            win ROWS UNBOUNDED PRECEDING EXCLUDE CURRENT ROW),
-                          0)
-              ELSE 0
-            END AS segment_breaker
-      FROM gpu_measurements_flagged
-      WHERE discard IS 0
-      WINDOW win AS (PARTITION BY jobid, stepid, gpuid ORDER BY batch)
-    )
-      SELECT *,
-            CASE WHEN segment_breaker IS NOT 0
-              THEN -(segment_breaker
-                      - ifnull(
-                          min(segment_breaker) OVER (
-                            win ROWS UNBOUNDED PRECEDING EXCLUDE CURRENT ROW),
-                          0)
-                      ) + iif(util IS 0, 1, 0)
-              ELSE 0
-              END AS zero_segment_length
-      FROM gpu_measurements_flagged
-      WINDOW win AS (PARTITION BY jobid, stepid, gpuid ORDER BY batch)
-    )
-    SELECT ts.watcherid, ts.jobid, ts.stepid, ts.is_new_in_period, ts.nnodes,
-           ts.measurement_batch, name, submit_line,
-           batch AS gpu_measurement_batch, gpuid,
-           power_usage, temperature, sm_clock, util, zero_segment_length
-    FROM inmem.timeseries AS ts, gpu_measurements_flagged
-    WHERE ts.gpu_measurement_batch IS NOT NULL
-          AND gpu_measurements_flagged.batch == ts.gpu_measurement_batch
-          AND gpu_measurements_flagged.jobid == ts.jobid
-          AND gpu_measurements_flagged.stepid == ts.stepid
-    ) SELECT gpu_usage_base.jobid, gpu_usage_base.stepid,
-       is_new_in_period, name, target_node, gpuid AS gpuid_raw,
-       iif(nnodes > 1, target_node || '/', '') || gpuid AS gpuid,
-       submit_line, count(util) AS measurement_cnt,
-       avg(util) AS avg_util, sum(zero_segment_length) AS zero_util_cnt,
-       count(util) FILTER (WHERE util > 0 AND util < 13) AS low_util_cnt,
-       max(zero_segment_length) AS longest_continuous_zero_util,
-       avg(sm_clock) AS avg_clock, avg(power_usage) / 100 AS avg_power_usage,
-       avg(temperature) AS avg_temperature
-      FROM gpu_usage_base, watcher
-      WHERE watcher.id == watcherid
-      GROUP BY gpu_usage_base.jobid, gpu_usage_base.stepid, target_node, gpuid;
-), /*[6]*/SQLITE_CODEBLOCK(
-  CREATE TABLE inmem.gpucpu_usage AS
-  SELECT DISTINCT ts.jobid, ts.stepid, target_node AS node,
-        ngpu_in_use, count(*) OVER win AS cnt_gpu, ts.ngpu,
-        NULL AS ncpu_in_use, NULL AS cnt_cpu, NULL AS ncpu,
-        count(*) OVER win_super AS node_tot, nnodes AS alloc_nnodes
-  FROM inmem.timeseries AS ts, watcher,
-      (SELECT batch, count(gpuid) AS ngpu_in_use
-        FROM gpu_measurements GROUP BY batch, gpuid
-        UNION SELECT NULL, 0)
-  WHERE batch IS gpu_measurement_batch AND watcher.id == watcherid
-        AND ts.is_new_in_period
-  WINDOW win AS
-          (PARTITION BY ts.jobid, ts.stepid, target_node, ngpu_in_use),
-        win_super AS
-          (PARTITION BY ts.jobid, ts.stepid, target_node)
-  UNION
-  SELECT DISTINCT ts.jobid, ts.stepid, target_node AS node,
-        NULL AS ngpu_in_use, NULL AS cnt_gpu, NULL AS ngpu,
-        iif(the_ncpu_in_use BETWEEN 1 AND the_ncpu + 1, the_ncpu_in_use, NULL)
-          AS ncpu_in_use,
-        count(*) OVER win AS cnt_cpu,
-        the_ncpu AS ncpu,
-        count(*) FILTER (WHERE the_ncpu_in_use BETWEEN 1 AND the_ncpu + 1)
-          OVER win_super AS node_tot,
-        nnodes AS alloc_nnodes
-  FROM inmem.timeseries AS ts, watcher, (
-          SELECT recordid AS the_recordid, ncpu AS the_ncpu,
-                ceil(1.0 *
-                  (delta_user_time + delta_sys_time)
-                    / (scrape_interval * 1e6)) AS the_ncpu_in_use
-          FROM inmem.timeseries
-        )
-  WHERE watcher.id == watcherid AND the_recordid == recordid
-        AND ts.is_new_in_period
-  WINDOW win AS
-          (PARTITION BY ts.jobid, ts.stepid, target_node, the_ncpu_in_use),
-        win_super AS
-          (PARTITION BY ts.jobid, ts.stepid, target_node)
-), /*[7]*/ SQLITE_CODEBLOCK(
+    SELECT user, jobid, stepid, is_new_in_period, name, target_node,
+       gpu.gpuid AS gpuid_raw,
+       iif(nnodes > 1, target_node || '/', '') || gpu.gpuid AS gpuid,
+       submit_line, gpu.sample_cnt AS measurement_cnt,
+       1.0 * util_sum / gpu.sample_cnt AS avg_util,
+       zero_util_cnt, low_util_cnt,
+       longest_zero_util_run AS longest_continuous_zero_util,
+       1.0 * sm_clock_sum / gpu.sample_cnt AS avg_clock,
+       1.0 * power_usage_sum / gpu.sample_cnt / 100 AS avg_power_usage,
+       1.0 * temperature_sum / gpu.sample_cnt AS avg_temperature
+    FROM inmem.step_usage
+         JOIN analysis_cache.step_gpu_usage AS gpu USING (jobid, stepid)
+    WHERE gpu.sample_cnt > 0;
+  ), /*[13]*/SQLITE_CODEBLOCK(
+  CREATE INDEX inmem.gpu_usage_base_user_index ON gpu_usage_base(user);
+), /*[14]*/SQLITE_CODEBLOCK(
+  CREATE INDEX inmem.step_usage_step_index ON step_usage(jobid, stepid);
+), /*[15]*/SQLITE_CODEBLOCK(
+
+  /* Filled by gpucpu_usage_t, see gpucpu_usage.h */
+  CREATE TABLE inmem.gpucpu_usage(
+    user TEXT,
+    jobid INT,
+    stepid INT,
+    node TEXT,
+    ngpu_in_use INT,
+    cnt_gpu INT,
+    ngpu INT,
+    ncpu_in_use INT,
+    cnt_cpu INT,
+    ncpu INT,
+    node_tot INT,
+    alloc_nnodes INT
+  );
+), 0};
+
+/* The steps new in the period, and of each the samples by number of GPUs or
+   CPUs in use on each node, in the order gpucpu_usage is filled in */
+const char *ANALYZE_READ_GPUCPU_USAGE_STEPS_SQL = SQLITE_CODEBLOCK(
+  SELECT user, jobid, stepid, ngpu, nnodes
+  FROM inmem.step_usage
+  WHERE is_new_in_period
+  ORDER BY jobid, stepid;
+);
+
+const char *ANALYZE_READ_GPUCPU_USAGE_SQL = SQLITE_CODEBLOCK(
+  SELECT target_node, is_gpu, in_use, ncpu, cnt
+  FROM analysis_cache.step_gpucpu_usage
+  WHERE jobid == :jobid AND stepid == :stepid
+  ORDER BY target_node, is_gpu, in_use;
+);
+
+const char *ANALYZE_INSERT_GPUCPU_USAGE_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO inmem.gpucpu_usage(user, jobid, stepid, node,
+    ngpu_in_use, cnt_gpu, ngpu, ncpu_in_use, cnt_cpu, ncpu,
+    node_tot, alloc_nnodes) VALUES
+);
+
+/* Run like ANALYZE_CREATE_BASE_TABLES, once gpucpu_usage is filled */
+const char *ANALYZE_CREATE_USAGE_TABLES[] = {
+  /*[0]*/SQLITE_CODEBLOCK(
+  CREATE INDEX inmem.gpucpu_usage_user_index ON gpucpu_usage(user);
+), /*[1]*/SQLITE_CODEBLOCK(
 
   CREATE TABLE inmem.resource_usage AS
-  SELECT ts.jobid, ts.stepid, name,
+  SELECT ts.user, ts.jobid, ts.stepid, name,
         format('[%.2lf%%, %.2lf%%]',
                 (1.0 * step_start_offset) / job_length * 100,
                 (1.0 * step_end_offset) / job_length * 100) AS timespan,
@@ -282,13 +328,11 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
               || iif(cpu_flagged, 'cpu_underusage | ', '')
               , '| ') AS problem
   FROM (SELECT
-    jobid, stepid, name, submit_line, job_length, ngpu,
-    step_start_offset, step_end_offset, nnodes, mem_limit,
-    count(recordid) AS sample_cnt,
-    max(peak_res_size, max(res_size)) AS peak_res_size,
+    user, jobid, stepid, name, submit_line, job_length, ngpu,
+    step_start_offset, step_end_offset, nnodes, mem_limit, sample_cnt,
+    max(peak_res_size, sampled_peak_res_size) AS peak_res_size,
     peak_res_size AS peak_res_size_slurm
-    FROM inmem.timeseries
-    GROUP BY jobid, stepid
+    FROM inmem.step_usage
     ) AS ts, (
         SELECT jobid, stepid,
          iif(sel_ngpu == 0, '',
@@ -312,7 +356,9 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
   FROM (
     SELECT
       jobid, stepid, node,
-      max(ncpu) AS sel_ncpu, max(ngpu) AS sel_ngpu, node_tot, 
+      max(ncpu) AS sel_ncpu, max(ngpu) AS sel_ngpu,
+      /* Samples of the GPUs of the node if it has any, of its CPUs if not */
+      ifnull(max_by(node_tot, ngpu_in_use), max(node_tot)) AS node_tot,
       ' ncpu' || x'0a' || 'inuse percentage' || x'0a' ||  
       group_concat(iif(ncpu_in_use IS NULL, NULL, format('%5d %6.2lf%%',
                           ncpu_in_use, (1.0 * cnt_cpu) / node_tot * 100)),
@@ -323,20 +369,18 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
                           ngpu_in_use, (1.0 * cnt_gpu) / node_tot * 100)),
                   x'0a')
         AS gpu_usage,
-      ngpu > 0 AND
-      (first_value(ngpu_in_use) OVER win == 0
-        OR first_value(cnt_gpu) OVER win != max(cnt_gpu)
-        OR (alloc_nnodes == 1 AND first_value(ngpu_in_use) OVER win != ngpu))
+      max(ngpu) > 0 AND
+      (max(ngpu_in_use) == 0
+        OR max_by(cnt_gpu, ngpu_in_use) != max(cnt_gpu)
+        OR (alloc_nnodes == 1 AND max(ngpu_in_use) != max(ngpu)))
       AS gpu_flagged,
       max(ncpu) > 1 AND max(ncpu_in_use) <= 1 AND max(ngpu_in_use) IS 0
         AS low_concurrency,
-      1.0 * total(ncpu_in_use * cnt_cpu) / node_tot < 0.5 * max(ncpu)
-        AS cpu_flagged
+      1.0 * total(ncpu_in_use * cnt_cpu)
+        / ifnull(max_by(node_tot, ngpu_in_use), max(node_tot))
+        < 0.5 * max(ncpu) AS cpu_flagged
     FROM inmem.gpucpu_usage
     GROUP BY jobid, stepid, node
-    WINDOW win AS
-      (PARTITION BY jobid, stepid, node
-      ORDER BY ngpu_in_use DESC NULLS LAST, ncpu_in_use DESC NULLS LAST)
     )
     GROUP BY jobid, stepid
     ORDER BY gpu_flagged DESC, cpu_flagged DESC
@@ -348,11 +392,11 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
   ) AS jupyterinfo
   WHERE gpucpuinfo.jobid == ts.jobid AND gpucpuinfo.stepid == ts.stepid
         AND jupyterinfo.jobid == ts.jobid AND jupyterinfo.stepid == ts.stepid;
-), /*[8]*/
+), /*[2]*/
     "INSERT INTO inmem.resource_usage("
-    "jobid, stepid, name, peak_res_size, mem_limit, timespan, nnode,"
+    "user, jobid, stepid, name, peak_res_size, mem_limit, timespan, nnode,"
     "ncpu, cpu_usage, problem)"
-    "SELECT jobid, NULL AS stepid, name, 0, 0,"
+    "SELECT user, jobid, NULL AS stepid, name, 0, 0,"
     "iif(elapsed > 0, "
     "format('%.2lf%% of timelimit used', 1.0 * elapsed / timelimit * 100)"
     " || x'0a' || 'actual: ' || " SLURM_STYLE_TIME(elapsed) ", 'running')"
@@ -375,16 +419,18 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
                 , '| ') AS problem
     FROM (
     WITH jobids AS MATERIALIZED
-      (SELECT DISTINCT jobid FROM inmem.resource_usage)
-    SELECT jobids.jobid, name, nnodes AS nnode, timelimit * 60 AS timelimit,
+      (SELECT DISTINCT user, jobid FROM inmem.resource_usage)
+    SELECT jobids.user, jobids.jobid, name, nnodes AS nnode,
+          timelimit * 60 AS timelimit,
           ncpu, tot_time / 1e6 AS actual_cpu,
           ended_at - started_at AS elapsed,
           (ended_at - started_at) * ncpu AS cpu_possible
     FROM jobinfo, jobids,
         (SELECT t.jobid, max(tot_time) AS tot_time FROM (
             SELECT t.jobid, sum(t.tot_time) AS tot_time FROM (
-              SELECT jobid, max(tot_time) AS tot_time
-              FROM measurements
+              SELECT jobid, max(user_time + sys_time) AS tot_time
+              FROM step_rollup
+              WHERE jobid IN (SELECT jobid FROM jobids)
               GROUP BY jobid, stepid
             ) AS t GROUP BY t.jobid
             UNION SELECT DISTINCT jobid, 0 FROM jobids
@@ -394,18 +440,21 @@ const char *ANALYZE_CREATE_BASE_TABLES[] = {
           AND jobinfo.jobid == jobids.jobid
           AND jobinfo.jobid == tot_time_info.jobid
     )
-), /*[9]*/SQLITE_CODEBLOCK(
+), /*[3]*/SQLITE_CODEBLOCK(
+  CREATE INDEX inmem.resource_usage_user_index ON resource_usage(user);
+), /*[4]*/SQLITE_CODEBLOCK(
   CREATE TABLE inmem.problem_listing(
+    user TEXT,
     jobid INT,
     stepid INT,
     problem TEXT,
-    PRIMARY KEY (jobid, stepid, problem)
+    PRIMARY KEY (user, jobid, stepid, problem)
   )
 ), 0};
 
 const char *ANALYZE_INSERT_PROBLEM_LISTING_SQL = SQLITE_CODEBLOCK(
-  INSERT OR IGNORE INTO inmem.problem_listing(jobid, stepid, problem)
-    VALUES(:jobid, :stepid, :problem);
+  INSERT OR IGNORE INTO inmem.problem_listing(user, jobid, stepid, problem)
+    VALUES(:user, :jobid, :stepid, :problem);
 );
 
 const char *ANALYZE_DUMP_DATA_TO_JSON_SQL = SQLITE_CODEBLOCK(
@@ -424,25 +473,22 @@ const char *ANALYZE_DUMP_DATA_TO_JSON_SQL = SQLITE_CODEBLOCK(
       'Job', ts.jobid, 'Name', jobinfo.name, 'NodeCnt', ts.nnodes,
       'JobLength', ts.job_length, 'TimeLimit', ts.timelimit
     )) AS jobinfo_data
-    FROM (SELECT * FROM inmem.timeseries
-            GROUP BY jobid, stepid
-            HAVING is_new_in_period
-          ) AS ts
+    FROM (SELECT * FROM inmem.step_usage
+          WHERE user IS :user AND is_new_in_period) AS ts
           LEFT JOIN jobinfo
             ON (jobinfo.jobid == ts.jobid AND jobinfo.stepid IS NULL)
   ) AS jobinfo_data, (
     SELECT json_group_array(json_object(
       'Job', jobid, 'Step', stepid,
       'PeakRssSize', peak_res_size, 'MemLimit', mem_limit
-    )) AS memusage_data FROM inmem.resource_usage
+    )) AS memusage_data FROM inmem.resource_usage WHERE user IS :user
   ) AS memusage_data, (
     SELECT json_group_array(json_object(
       'Job', jobid, 'Step', stepid, 'App', application
     )) FROM application_usage
         JOIN (
-          SELECT jobid, stepid FROM inmem.timeseries
-          GROUP BY jobid, stepid
-          HAVING is_new_in_period
+          SELECT jobid, stepid FROM inmem.step_usage
+          WHERE user IS :user AND is_new_in_period
         ) USING (jobid, stepid)
   ) AS application_usage_data, (
     SELECT json_group_array(json(data)) AS problems_data FROM (
@@ -451,6 +497,7 @@ const char *ANALYZE_DUMP_DATA_TO_JSON_SQL = SQLITE_CODEBLOCK(
       json_group_object(problem, 1))
     AS data
     FROM inmem.problem_listing
+    WHERE user IS :user
     GROUP BY jobid, stepid)
   ) AS problems_data, (
     SELECT json_group_array(json_object(
@@ -462,7 +509,8 @@ const char *ANALYZE_DUMP_DATA_TO_JSON_SQL = SQLITE_CODEBLOCK(
       'CPUInUse', ncpu_in_use, 'GPUInUse', ngpu_in_use
     )) AS resources_data
       FROM inmem.gpucpu_usage
-      WHERE ngpu IS NOT 0 AND ifnull(ncpu_in_use, ngpu_in_use) IS NOT NULL
+      WHERE user IS :user AND ngpu IS NOT 0
+            AND ifnull(ncpu_in_use, ngpu_in_use) IS NOT NULL
   ) AS resources_data, (
     SELECT json_group_array(json_object(
       'Job', jobid, 'Step', stepid, 'Node', target_node, 'GPUID', gpuid_raw,
@@ -473,18 +521,18 @@ const char *ANALYZE_DUMP_DATA_TO_JSON_SQL = SQLITE_CODEBLOCK(
       'AvgGPUClockMHz', avg_clock, 'AvgGPUPowerUsageWatt', avg_power_usage,
       'AvgGPUTempC', avg_temperature
     )) AS gpu_usage_data FROM inmem.gpu_usage_base
-    WHERE is_new_in_period
+    WHERE user IS :user AND is_new_in_period
   ) AS gpu_usage_data, (
     SELECT json_group_array(json_object(
       'Job', jobid, 'Step', stepid, 'TotSysTimeRatioSamples', tot_in_batch,
       '10%~33%', sys_ratio_1_10, '33%~66%', sys_ratio_1_3,
       '66%~100%', sys_ratio_2_3, '>100%', sys_ratio_gt_1
     )) AS sys_time_ratio_data FROM inmem.sys_ratio
-    WHERE is_new_in_period
+    WHERE user IS :user AND is_new_in_period
   ) AS sys_time_ratio_data);
 );
 
-#define _FILTER_LATEST_RECORD_SQL "is_new_in_period"
+#define _FILTER_LATEST_RECORD_SQL "user IS :user AND is_new_in_period"
 
 #define _SUMMARIZE_GPU_PROBLEM_SQL SQLITE_CODEBLOCK(                           \
   iif(zero_util_cnt == measurement_cnt, 'completely_no_util',                  \
@@ -518,6 +566,7 @@ const char *ANALYZE_GPU_USAGE_HISTORY_SQL
       sum(avg_power_usage * measurement_cnt) / sum(measurement_cnt)
         AS avg_power_usage
     FROM inmem.gpu_usage_base
+    WHERE user IS :user
     GROUP BY name, submit_line
     ) SELECT *,
   )
@@ -533,7 +582,7 @@ const char *ANALYZE_GPU_USAGE_HISTORY_SQL
 #define _ANALYZE_SYS_TIME_RATIO_SQL(EXTRA_CONDITION) \
   "SELECT * FROM inmem.sys_ratio" \
   "  WHERE " _FILTER_LATEST_RECORD_SQL " " EXTRA_CONDITION \
-  "  ORDER BY name, jobid, stepid, measurement_batch"
+  "  ORDER BY name, jobid, stepid, latest_recordid"
 
 const char *ANALYSIS_LIST_PROBLEMATIC_LATEST_SYS_RATIO_SQL
   = "SELECT *, 'sys_ratio' AS problem_tag FROM (" _ANALYZE_SYS_TIME_RATIO_SQL(
@@ -558,9 +607,10 @@ const char *ANALYZE_SYS_RATIO_HISTORY_SQL
       sum(sys_ratio_gt_1) AS sys_ratio_gt_1,
       sum(major_ratio_unified_tot) AS major_ratio_unified_tot
       FROM inmem.sys_ratio
+      WHERE user IS :user
       GROUP BY name, submit_line
       HAVING max(is_new_in_period)
-      ORDER BY name, submit_line, measurement_batch
+      ORDER BY name, submit_line, latest_recordid
     ) SELECT *,
   ) "iif(" _PROBLEMATIC_SYS_RATIO_CONDITION ", 'sys_ratio', '') AS problem_tag"
   "  FROM grouped_sys_ratio"
@@ -607,12 +657,14 @@ const char *ANALYZE_RESOURCE_USAGE_SQL = SQLITE_CODEBLOCK(
           stepid IS NULL AND ncpu <= 8 AND max(ngpu) OVER win IS 0
             AS low_compute_power
     FROM inmem.resource_usage AS usage
+    WHERE user IS :user
     WINDOW win AS (PARTITION BY usage.jobid)
     ORDER BY usage.jobid, stepid NULLS FIRST
   );
 );
 
+/* Committed for the cache, the tables of the round go with inmem */
 const char *POST_ANALYZE_SQL = SQLITE_CODEBLOCK(
-  ROLLBACK;
+  COMMIT;
   DETACH DATABASE inmem;
 );
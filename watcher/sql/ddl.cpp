@@ -1,6 +1,86 @@
 #include "sql_helper.h"
 #include "sql.h"
 
+/* Also of every partition, see partition.h. References to the tables of the
+   main database are declared only, foreign keys are not enforced */
+#define _MEASUREMENT_TABLES_SQL SQLITE_CODEBLOCK( \
+CREATE TABLE IF NOT EXISTS gpu_measurements( \
+  watcherid INTEGER NOT NULL REFERENCES watcher(id), \
+  batch INTEGER NOT NULL CHECK(batch > 0), \
+  jobid INTEGER NOT NULL REFERENCES jobinfo(jobid) ON DELETE RESTRICT, \
+  stepid INTEGER, \
+  pid INTEGER NOT NULL, \
+  gpuid INTEGER NOT NULL, \
+  age INTEGER, \
+\
+  power_usage INTEGER, \
+  temperature INTEGER, \
+  sm_clock INTEGER CHECK (sm_clock > 0), \
+  util INTEGER CHECK (util >= 0), \
+  clock_limit_reason TEXT, \
+  source TEXT NOT NULL, \
+  PRIMARY KEY(batch, pid, gpuid) \
+); \
+\
+CREATE TRIGGER IF NOT EXISTS gpu_measurements_del \
+BEFORE DELETE ON gpu_measurements \
+BEGIN \
+  SELECT RAISE(ABORT, 'Deletion of GPU measurement record not supported'); \
+END; \
+\
+CREATE TRIGGER IF NOT EXISTS gpu_measurements_upd \
+BEFORE UPDATE ON gpu_measurements \
+BEGIN \
+  SELECT RAISE(ABORT, 'Update of GPU measurement record not supported'); \
+END; \
+\
+CREATE TABLE IF NOT EXISTS measurements( \
+  recordid INTEGER PRIMARY KEY AUTOINCREMENT, \
+  watcherid INTEGER NOT NULL REFERENCES watcher(id) ON DELETE RESTRICT, \
+  jobid INTEGER NOT NULL, \
+  stepid INTEGER, \
+  /* timestamp INTEGER DEFAULT(unixepoch('now')) NOT NULL, */ \
+  /* should ORDER BY tot_time */ \
+\
+  /* measurements */ \
+  /* rchar / wchar when scraped from /proc, block device IO from cgroup */ \
+  dev_in INTEGER, dev_out INTEGER, \
+  user_sec INTEGER NOT NULL, user_usec INTEGER NOT NULL, \
+  sys_sec INTEGER NOT NULL, sys_usec INTEGER NOT NULL, \
+  tot_time INTEGER \
+    GENERATED ALWAYS \
+    AS (user_sec * 1e6 + user_usec + sys_sec * 1e6 + sys_usec) STORED \
+    CHECK (tot_time > 0), \
+  res_size INTEGER, /* resident set size */ \
+  minor_pagefault INTEGER, \
+  /* High-water mark of the step cgroup including page cache, if scraped */ \
+  peak_mem_usage INTEGER, \
+\
+  /* GPU utilization data could be directly updated given the entry exists */ \
+  gpu_measurement_batch INTEGER, \
+  FOREIGN KEY (gpu_measurement_batch, jobid, stepid) \
+    REFERENCES gpu_measurements(batch, jobid, stepid) ON DELETE RESTRICT, \
+  FOREIGN KEY (jobid, stepid) \
+    REFERENCES jobinfo(jobid, stepid) ON DELETE RESTRICT \
+); \
+\
+CREATE INDEX IF NOT EXISTS measurements_index ON measurements(tot_time); \
+\
+/* For loading steps into the accuracy index, deciding what is inserted */ \
+CREATE INDEX IF NOT EXISTS measurements_jobstep_index \
+  ON measurements(jobid, stepid); \
+\
+CREATE TRIGGER IF NOT EXISTS measurements_del BEFORE DELETE ON measurements \
+BEGIN \
+  SELECT RAISE(ABORT, 'Deletion of measurement record not supported'); \
+END; \
+\
+CREATE TRIGGER IF NOT EXISTS measurements_upd BEFORE UPDATE ON measurements \
+BEGIN \
+  SELECT RAISE(ABORT, 'Update of measurement record not supported'); \
+END; \
+)
+
 const char *INIT_DB_SQL = SQLITE_CODEBLOCK(
 CREATE TABLE IF NOT EXISTS watcher(
   id INTEGER PRIMARY KEY AUTOINCREMENT,
@@ -72,98 +152,26 @@ CREATE TABLE IF NOT EXISTS jobinfo(
 CREATE UNIQUE INDEX IF NOT EXISTS jobinfo_unique_null
   ON jobinfo (jobid) WHERE stepid IS NULL;
 
-CREATE TABLE IF NOT EXISTS gpu_measurements(
-  watcherid INTEGER NOT NULL REFERENCES watcher(id),
-  batch INTEGER NOT NULL CHECK(batch > 0),
-  jobid INTEGER NOT NULL REFERENCES jobinfo(jobid) ON DELETE RESTRICT,
-  stepid INTEGER,
-  pid INTEGER NOT NULL,
-  gpuid INTEGER NOT NULL,
-  age INTEGER,
-
-  power_usage INTEGER,
-  temperature INTEGER,
-  sm_clock INTEGER CHECK (sm_clock > 0),
-  util INTEGER CHECK (util >= 0),
-  clock_limit_reason TEXT,
-  source TEXT NOT NULL,
-  PRIMARY KEY(batch, pid, gpuid)
-);
-
-CREATE TRIGGER IF NOT EXISTS gpu_measurements_del
-BEFORE DELETE ON gpu_measurements
-BEGIN
-  SELECT RAISE(ABORT, 'Deletion of GPU measurement record not supported');
-END;
-
-CREATE TRIGGER IF NOT EXISTS gpu_measurements_upd
-BEFORE UPDATE ON gpu_measurements
-BEGIN
-  SELECT RAISE(ABORT, 'Update of GPU measurement record not supported');
-END;
+) _MEASUREMENT_TABLES_SQL SQLITE_CODEBLOCK(
 
-CREATE TABLE IF NOT EXISTS measurements(
-  recordid INTEGER PRIMARY KEY AUTOINCREMENT,
+/* Scraped measurements whose job is not imported from accounting yet, moved
+   into measurements by the import that brings the job */
+CREATE TABLE IF NOT EXISTS pending_measurements(
   watcherid INTEGER NOT NULL REFERENCES watcher(id) ON DELETE RESTRICT,
   jobid INTEGER NOT NULL,
   stepid INTEGER,
-  /* timestamp INTEGER DEFAULT(unixepoch('now')) NOT NULL, */
-  /* should ORDER BY tot_time */
-
-  /* measurements */
   dev_in INTEGER, dev_out INTEGER,
   user_sec INTEGER NOT NULL, user_usec INTEGER NOT NULL,
   sys_sec INTEGER NOT NULL, sys_usec INTEGER NOT NULL,
-  tot_time INTEGER
-    GENERATED ALWAYS
-    AS (user_sec * 1e6 + user_usec + sys_sec * 1e6 + sys_usec) STORED
-    CHECK (tot_time > 0),
-  res_size INTEGER, /* resident set size */
+  res_size INTEGER,
   minor_pagefault INTEGER,
-
-  /* GPU utilization data could be directly updated given the entry exists */
+  peak_mem_usage INTEGER,
   gpu_measurement_batch INTEGER,
-  FOREIGN KEY (gpu_measurement_batch, jobid, stepid)
-    REFERENCES gpu_measurements(batch, jobid, stepid) ON DELETE RESTRICT,
-  FOREIGN KEY (jobid, stepid)
-    REFERENCES jobinfo(jobid, stepid) ON DELETE RESTRICT
+  pending_since INTEGER NOT NULL DEFAULT(unixepoch('now'))
 );
 
-CREATE INDEX IF NOT EXISTS measurements_index ON measurements(tot_time);
-
-CREATE TRIGGER IF NOT EXISTS measurement_quality_ensurance
-  BEFORE INSERT ON measurements
-  FOR EACH ROW
-  WHEN NEW.tot_time == 0
-    OR EXISTS (
-      WITH newentry_watcher AS MATERIALIZED (
-        SELECT accuracy, target_node FROM watcher
-          WHERE NEW.watcherid == watcher.id
-      )
-      SELECT measurements.jobid FROM measurements, watcher, newentry_watcher
-        WHERE measurements.jobid == NEW.jobid
-              AND measurements.stepid IS NEW.stepid
-              AND measurements.watcherid == watcher.id
-                   /* More accurate measurements available */
-              AND (watcher.accuracy > newentry_watcher.accuracy
-                 OR (watcher.accuracy == newentry_watcher.accuracy
-                     /* Nothing new, theoretically */
-                     AND tot_time == NEW.tot_time
-                     AND watcher.target_node IS newentry_watcher.target_node
-                 )
-              )
-    )
-BEGIN SELECT RAISE (IGNORE); END;
-
-CREATE TRIGGER IF NOT EXISTS measurements_del BEFORE DELETE ON measurements
-BEGIN
-  SELECT RAISE(ABORT, 'Deletion of measurement record not supported');
-END;
-
-CREATE TRIGGER IF NOT EXISTS measurements_upd BEFORE UPDATE ON measurements
-BEGIN
-  SELECT RAISE(ABORT, 'Update of measurement record not supported');
-END;
+CREATE INDEX IF NOT EXISTS pending_measurements_index
+  ON pending_measurements(jobid);
 
 CREATE TABLE IF NOT EXISTS application_usage(
   jobid INTEGER NOT NULL REFERENCES jobinfo(jobid) ON DELETE RESTRICT,
@@ -180,7 +188,10 @@ CREATE TABLE IF NOT EXISTS worker_task_info(
 
   prev_schema_version INTEGER DEFAULT NULL,
   prev_analysis_offset INTEGER DEFAULT 0,
-  prev_gpu_measurement_batch_cnt INTEGER DEFAULT 0
+  prev_gpu_measurement_batch_cnt INTEGER DEFAULT 0,
+
+  /* Set by the migration that brought the rollups, see rollup.h */
+  rollup_backfill INTEGER DEFAULT 0
 ) WITHOUT ROWID;
 
 /* Fetch and update range in one statement */
@@ -223,4 +234,99 @@ CREATE TABLE IF NOT EXISTS job_step_cpu_available(
   FOREIGN KEY (jobid, stepid)
     REFERENCES jobinfo(jobid, stepid) ON DELETE RESTRICT
 );
+
+/* Rollups of the measurements of a step by one watcher, kept up to date as
+   measurements are inserted, see rollup.h. They are not partitioned and
+   outlive the measurements they were made of. Times are in usec */
+CREATE TABLE IF NOT EXISTS step_rollup(
+  jobid INTEGER NOT NULL,
+  stepid INTEGER NOT NULL,
+  watcherid INTEGER NOT NULL REFERENCES watcher(id) ON DELETE RESTRICT,
+  sample_cnt INTEGER NOT NULL,
+  latest_recordid INTEGER NOT NULL,
+  /* Of the latest measurement, cumulative */
+  user_time INTEGER NOT NULL,
+  sys_time INTEGER NOT NULL,
+  res_size INTEGER,
+  peak_res_size INTEGER,
+  /* Samples whose sys time grew by a second or more along with user time,
+     by the ratio of the two. Ratios above 1 are summed up in thousandths */
+  sys_ratio_cnt INTEGER NOT NULL,
+  sys_ratio_1_10 INTEGER NOT NULL,
+  sys_ratio_1_3 INTEGER NOT NULL,
+  sys_ratio_2_3 INTEGER NOT NULL,
+  sys_ratio_gt_1_milli INTEGER NOT NULL,
+  PRIMARY KEY (jobid, stepid, watcherid)
+) WITHOUT ROWID;
+
+/* For the steps measured since an analysis */
+CREATE INDEX IF NOT EXISTS step_rollup_latest_index
+  ON step_rollup(latest_recordid);
+
+/* Samples by the number of CPUs in use, the CPU time since the sample before
+   over the scrape interval rounded up, or by the number of GPUs in use */
+CREATE TABLE IF NOT EXISTS step_usage_rollup(
+  jobid INTEGER NOT NULL,
+  stepid INTEGER NOT NULL,
+  watcherid INTEGER NOT NULL REFERENCES watcher(id) ON DELETE RESTRICT,
+  is_gpu INTEGER NOT NULL CHECK (is_gpu IN (0, 1)),
+  in_use INTEGER NOT NULL,
+  cnt INTEGER NOT NULL,
+  PRIMARY KEY (jobid, stepid, watcherid, is_gpu, in_use)
+) WITHOUT ROWID;
+
+/* Of the readings of a GPU that the driver did not repeat. The latest one is
+   kept to tell repeated readings, zero_util_run counts the readings of zero
+   utilization up to it */
+CREATE TABLE IF NOT EXISTS step_gpu_rollup(
+  jobid INTEGER NOT NULL,
+  stepid INTEGER NOT NULL,
+  watcherid INTEGER NOT NULL REFERENCES watcher(id) ON DELETE RESTRICT,
+  gpuid INTEGER NOT NULL,
+  sample_cnt INTEGER NOT NULL,
+  util_sum INTEGER NOT NULL,
+  zero_util_cnt INTEGER NOT NULL,
+  low_util_cnt INTEGER NOT NULL,
+  zero_util_run INTEGER NOT NULL,
+  longest_zero_util_run INTEGER NOT NULL,
+  sm_clock_sum INTEGER NOT NULL,
+  power_usage_sum INTEGER NOT NULL,
+  temperature_sum INTEGER NOT NULL,
+  age INTEGER,
+  power_usage INTEGER,
+  temperature INTEGER,
+  sm_clock INTEGER,
+  util INTEGER,
+  PRIMARY KEY (jobid, stepid, watcherid, gpuid)
+) WITHOUT ROWID;
+);
+
+/* The journal mode sticks to the database file, the size limit applies to the
+   connection truncating the WAL after a checkpoint reset it */
+const char *CONFIGURE_WRITER_CONN_SQL = SQLITE_CODEBLOCK(
+  PRAGMA journal_mode = WAL;
+  PRAGMA journal_size_limit = 67108864;
+);
+
+/* Measurement partitions are journaled like the main database */
+const char *PARTITION_INIT_SQL = SQLITE_CODEBLOCK(
+  PRAGMA journal_mode = WAL;
+  BEGIN IMMEDIATE TRANSACTION;
+) _MEASUREMENT_TABLES_SQL SQLITE_CODEBLOCK(
+  COMMIT;
+);
+
+/* Of the views over the main database and all partitions */
+const char *MEASUREMENT_COLUMNS_SQL = SQLITE_CODEBLOCK(
+  recordid, watcherid, jobid, stepid,
+  dev_in, dev_out,
+  user_sec, user_usec,
+  sys_sec, sys_usec, tot_time,
+  res_size, minor_pagefault, peak_mem_usage,
+  gpu_measurement_batch
+);
+
+const char *GPU_MEASUREMENT_COLUMNS_SQL = SQLITE_CODEBLOCK(
+  watcherid, batch, jobid, stepid, pid, gpuid, age,
+  power_usage, temperature, sm_clock, util, clock_limit_reason, source
 );
@@ -12,15 +12,15 @@ static const char *GET_LATEST_GLOBAL_MEASUREMENT_FOR_JOBSTEPS_SQL
   );
 static sqlite3_stmt *get_latest_global_measurement_for_jobsteps_stmt;
 
-// All these shall be recovered in the next run of CREATE TRIGGER IF NOT EXISTS
+// All these shall be recovered in the next run of CREATE TRIGGER IF NOT EXISTS,
+// but measurement_quality_ensurance, left to the accuracy index since version 8
 static const char *PREPARE_MIGRATE_SQL
   = SQLITE_CODEBLOCK(
-    DROP TRIGGER measurement_quality_ensurance;
+    DROP TRIGGER IF EXISTS measurement_quality_ensurance;
     DROP TRIGGER measurements_upd;
   );
 
 void migrate_db(int cur_version) {
-  int start, end;
   if (cur_version < 3) {
     const char *MIGRATE_COMPATABILITY_SQL
       = "ALTER TABLE worker_task_info ADD COLUMN prev_schema_version INTEGER;";
@@ -30,15 +30,11 @@ void migrate_db(int cur_version) {
     }
   }
   sqlite3_begin_transaction();
-  #define OP "(renew_schema_version)"
-  sqlite3_stmt *renew_db_schema_version_stmt = NULL;
-  if (!setup_stmt(renew_db_schema_version_stmt,
-                  RENEW_DB_SCHEMA_VERSION_SQL,
-                  OP)) {
+  decltype(RENEW_DB_SCHEMA_VERSION_STMT)::row_t version;
+  if (!RENEW_DB_SCHEMA_VERSION_STMT.fetch_one(version)) {
     exit(1);
   }
-  step_renew(renew_db_schema_version_stmt, OP, start, end);
-  reset_stmt(renew_db_schema_version_stmt, OP);
+  const auto [start, end] = version;
   if (start == DB_SCHEMA_VERSION) {
     sqlite3_end_transaction();
     return;
@@ -88,9 +84,7 @@ void migrate_db(int cur_version) {
         ALTER TABLE jobinfo DROP COLUMN node;
         ALTER TABLE jobinfo ADD COLUMN nnodes INTEGER CHECK(nnodes > 0);
       ))
-      if (!log_scraper_freq(SQLITE_CODEBLOCK(
-          INSERT INTO scrape_freq_log(start, scrape_interval)
-            VALUES(1, :scrape_interval)), "(init_scraper_freq_log)")) {
+      if (!log_scraper_freq(INIT_SCRAPE_FREQ_LOG_STMT)) {
         success = 0;
         break;
       }
@@ -99,8 +93,12 @@ void migrate_db(int cur_version) {
     EXEC_SQL_AND_CHECK("migrate_alter_table_6", SQLITE_CODEBLOCK(
       ALTER TABLE jobinfo ADD COLUMN peak_res_size INTEGER;
     ))
+    case 6:
+    EXEC_SQL_AND_CHECK("migrate_alter_table_7", SQLITE_CODEBLOCK(
+      ALTER TABLE measurements ADD COLUMN peak_mem_usage INTEGER;
+    ))
     // Import from SLURM after all required schema changes are performed
-    {
+    if (start <= 5) {
       const char *op = "(get_latest_global_measurement_for_jobsteps)";
       std::vector<slurm_selected_step_t> jobids;
       slurm_selected_step_t selected_step_template;
@@ -165,6 +163,17 @@ void migrate_db(int cur_version) {
       FROM (SELECT id FROM watcher WHERE target_node IS NULL LIMIT 1) AS target
       WHERE watcherid IS 0;
     ));
+    case 7:
+    // Nothing but the trigger dropped above, measurements_jobstep_index
+    // is created along with the schema
+    case 8:
+    // Rollup tables are created along with the schema, and filled from the
+    // measurements on the next start, once partitions are attached
+    EXEC_SQL_AND_CHECK("migrate_alter_table_9", SQLITE_CODEBLOCK(
+      ALTER TABLE worker_task_info ADD COLUMN rollup_backfill INTEGER
+        DEFAULT 0;
+      UPDATE worker_task_info SET rollup_backfill = 1;
+    ))
     #undef EXEC_SQL_AND_CHECK
   }
   cleanup_all_stmts();
@@ -176,5 +185,4 @@ void migrate_db(int cur_version) {
     sqlite3_exec_wrap("ROLLBACK;", "rollback");
   }
   exit(2);
-  #undef OP
 }
@@ -22,24 +22,56 @@ const char *REGISTER_WATCHER_SQL_RETURNING_TIMESTAMPS_AND_WATCHERID
 const char *UPSERT_WATCHER_SQL_RETURNING_TIMESTAMP_RANGE
   = _RENEW_WATCHER_RETURNING_TIMESTAMP_RANGE_SQL;
 
+/* Heads of bulk_insert_t, the rows follow VALUES */
 const char *MEASUREMENTS_INSERT_SQL = SQLITE_CODEBLOCK(
-  INSERT OR REPLACE INTO measurements(
+  INSERT OR REPLACE INTO partition_cur.measurements(
     recordid,
     watcherid, jobid, stepid,
     dev_in, dev_out,
     user_sec, user_usec,
     sys_sec, sys_usec,
-    res_size, minor_pagefault,
+    res_size, minor_pagefault, peak_mem_usage,
     gpu_measurement_batch
-  ) VALUES (
-    :recordid,
-    :watcherid, :jobid, :stepid,
-    :dev_in, :dev_out,
-    :user_sec, :user_usec,
-    :sys_sec, :sys_usec,
-    :res_size, :minor_pagefault,
-    :gpu_measurement_batch
+  ) VALUES
+);
+
+const char *PENDING_MEASUREMENTS_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO pending_measurements(
+    watcherid, jobid, stepid,
+    dev_in, dev_out,
+    user_sec, user_usec,
+    sys_sec, sys_usec,
+    res_size, minor_pagefault, peak_mem_usage,
+    gpu_measurement_batch
+  ) VALUES
+);
+
+// Inserted one by one, through the accuracy index
+const char *LIST_RESOLVED_PENDING_MEASUREMENTS_SQL = SQLITE_CODEBLOCK(
+  SELECT
+    watcherid, jobid, stepid,
+    dev_in, dev_out,
+    user_sec, user_usec,
+    sys_sec, sys_usec,
+    res_size, minor_pagefault, peak_mem_usage,
+    gpu_measurement_batch
+  FROM pending_measurements
+  WHERE EXISTS (
+    SELECT 1 FROM jobinfo WHERE jobinfo.jobid == pending_measurements.jobid
   )
+  ORDER BY rowid
+);
+
+// Measurements of jobs that never show up in accounting are given up on
+const char *DELETE_RESOLVED_PENDING_MEASUREMENTS_SQL = SQLITE_CODEBLOCK(
+  DELETE FROM pending_measurements
+  WHERE EXISTS (
+    SELECT 1 FROM jobinfo WHERE jobinfo.jobid == pending_measurements.jobid
+  ) OR pending_since < unixepoch('now', '-7 days');
+);
+
+const char *JOBINFO_EXISTS_SQL = SQLITE_CODEBLOCK(
+  SELECT 1 AS found FROM jobinfo WHERE jobid == :jobid LIMIT 1
 );
 
 const char *JOBINFO_INSERT_SQL = SQLITE_CODEBLOCK(
@@ -55,29 +87,34 @@ const char *JOBINFO_INSERT_SQL = SQLITE_CODEBLOCK(
 );
 
 const char *APPLICATION_USAGE_INSERT_SQL = SQLITE_CODEBLOCK(
-  INSERT INTO application_usage(jobid, stepid, application)
-    VALUES(:jobid, :stepid, :application) ON CONFLICT DO NOTHING
+  INSERT INTO application_usage(jobid, stepid, application) VALUES
+);
+
+const char *APPLICATION_USAGE_INSERT_TAIL_SQL = SQLITE_CODEBLOCK(
+  ON CONFLICT DO NOTHING
 );
 
 const char *GPU_MEASUREMENT_INSERT_SQL = SQLITE_CODEBLOCK(
-  INSERT INTO gpu_measurements(
+  INSERT INTO partition_cur.gpu_measurements(
     watcherid, batch, pid, jobid, stepid, gpuid, age,
     power_usage, temperature, sm_clock, util, clock_limit_reason, source
-  ) VALUES (
-    :watcherid, :batch, :pid, :jobid, :stepid, :gpuid, :age,
-    :power_usage, :temperature, :sm_clock, :util, :clock_limit_reason, :source
-  )
+  ) VALUES
 );
 
 const char *UPDATE_SCRAPE_FREQ_LOG_SQL = SQLITE_CODEBLOCK(
   INSERT INTO scrape_freq_log(start, scrape_interval)
-    SELECT (SELECT ifnull(max(recordid), 1) FROM measurements) AS start,
+    SELECT (SELECT ifnull(max(recordid), 1) FROM measurements_latest) AS start,
            :scrape_interval AS scrape_interval
 );
 
+const char *INIT_SCRAPE_FREQ_LOG_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO scrape_freq_log(start, scrape_interval)
+    VALUES(1, :scrape_interval)
+);
+
 const char *JOBSTEP_AVAILABLE_CPU_INSERT_SQL = SQLITE_CODEBLOCK(
   INSERT OR IGNORE INTO job_step_cpu_available(watcherid, jobid, stepid, ncpu)
-    VALUES(:watcherid, :jobid, :stepid, :ncpu);
+    VALUES
 );
 
 const char *GET_SCHEMA_VERSION_SQL =
@@ -85,16 +122,125 @@ const char *GET_SCHEMA_VERSION_SQL =
   "  ifnull(schema_version, " STRINGIFY(DB_SCHEMA_VERSION) ")"
   "  RETURNING schema_version";
 
-const char *UPDATE_GPU_BATCH_SQL
+// Takes :cnt batch numbers, start + 1 to end
+const char *UPDATE_GPU_BATCHES_SQL
   = _RENEW_SQL("worker_task_info", "gpu_measurement_batch_cnt",
-               "gpu_measurement_batch_cnt + 1");
+               "gpu_measurement_batch_cnt + :cnt");
 
 const char *RENEW_ANALYSIS_OFFSET_SQL
   = SQLITE_CODEBLOCK(
     INSERT INTO worker_task_info(analysis_offset)
-      SELECT MAX(recordid) AS analysis_offset FROM measurements WHERE TRUE
+      SELECT MAX(recordid) AS analysis_offset FROM measurements_latest
+        WHERE TRUE
   ) _RENEW_SQL_UPSERT("analysis_offset");
 
 const char *RENEW_DB_SCHEMA_VERSION_SQL
   = _RENEW_SQL("worker_task_info", "schema_version",
               "MAX(schema_version, " MIGRATE_TARGET_DB_SCHEMA_VERSION_STR ")");
+
+const char *WATCHER_RANK_SQL = SQLITE_CODEBLOCK(
+  SELECT accuracy, target_node FROM watcher WHERE id == :id
+);
+
+// Once per partition, before its first measurement takes a recordid
+const char *PARTITION_SEED_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO partition_cur.sqlite_sequence(name, seq)
+    SELECT 'measurements',
+           (SELECT ifnull(max(recordid), 0) FROM measurements_latest)
+    WHERE NOT EXISTS (
+      SELECT 1 FROM partition_cur.sqlite_sequence
+      WHERE name == 'measurements'
+    )
+);
+
+// Latest tot_time per kind of watcher that measured the step
+const char *ACCURACY_INDEX_LOAD_SQL = SQLITE_CODEBLOCK(
+  SELECT watcher.accuracy, watcher.target_node, max(tot_time) AS tot_time
+  FROM measurements JOIN watcher ON watcher.id == measurements.watcherid
+  WHERE measurements.jobid == :jobid AND measurements.stepid IS :stepid
+  GROUP BY watcher.accuracy, watcher.target_node
+);
+
+// Of a step measured by a watcher, see rollup.h
+const char *STEP_ROLLUP_LOAD_SQL = SQLITE_CODEBLOCK(
+  SELECT sample_cnt, latest_recordid, user_time, sys_time,
+         res_size, peak_res_size, sys_ratio_cnt,
+         sys_ratio_1_10, sys_ratio_1_3, sys_ratio_2_3, sys_ratio_gt_1_milli
+  FROM step_rollup
+  WHERE jobid == :jobid AND stepid == :stepid AND watcherid == :watcherid
+);
+
+const char *STEP_GPU_ROLLUP_LOAD_SQL = SQLITE_CODEBLOCK(
+  SELECT gpuid, sample_cnt, util_sum, zero_util_cnt, low_util_cnt,
+         zero_util_run, longest_zero_util_run,
+         sm_clock_sum, power_usage_sum, temperature_sum,
+         age, power_usage, temperature, sm_clock, util
+  FROM step_gpu_rollup
+  WHERE jobid == :jobid AND stepid == :stepid AND watcherid == :watcherid
+);
+
+// One reading per GPU, the processes sharing one got the same
+const char *GPU_BATCH_READINGS_SQL = SQLITE_CODEBLOCK(
+  SELECT DISTINCT gpuid, age, power_usage, temperature, sm_clock, util
+  FROM gpu_measurements
+  WHERE batch == :batch AND jobid == :jobid
+);
+
+// Rollups are written whole, step_usage_rollup adds up
+const char *STEP_ROLLUP_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT OR REPLACE INTO step_rollup(
+    jobid, stepid, watcherid, sample_cnt, latest_recordid,
+    user_time, sys_time, res_size, peak_res_size, sys_ratio_cnt,
+    sys_ratio_1_10, sys_ratio_1_3, sys_ratio_2_3, sys_ratio_gt_1_milli
+  ) VALUES
+);
+
+const char *STEP_USAGE_ROLLUP_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO step_usage_rollup(
+    jobid, stepid, watcherid, is_gpu, in_use, cnt
+  ) VALUES
+);
+
+const char *STEP_USAGE_ROLLUP_INSERT_TAIL_SQL = SQLITE_CODEBLOCK(
+  ON CONFLICT DO UPDATE SET cnt = cnt + excluded.cnt
+);
+
+const char *STEP_GPU_ROLLUP_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT OR REPLACE INTO step_gpu_rollup(
+    jobid, stepid, watcherid, gpuid, sample_cnt, util_sum,
+    zero_util_cnt, low_util_cnt, zero_util_run, longest_zero_util_run,
+    sm_clock_sum, power_usage_sum, temperature_sum,
+    age, power_usage, temperature, sm_clock, util
+  ) VALUES
+);
+
+const char *ROLLUP_BACKFILL_PENDING_SQL = SQLITE_CODEBLOCK(
+  SELECT rollup_backfill FROM worker_task_info
+);
+
+const char *ROLLUP_BACKFILL_CLEAR_SQL = SQLITE_CODEBLOCK(
+  DELETE FROM step_rollup;
+  DELETE FROM step_usage_rollup;
+  DELETE FROM step_gpu_rollup;
+);
+
+const char *ROLLUP_BACKFILL_DONE_SQL = SQLITE_CODEBLOCK(
+  UPDATE worker_task_info SET rollup_backfill = 0
+);
+
+// All measurements of steps in the order they were inserted, along with the
+// scrape interval logged for them, or the first one logged
+const char *ROLLUP_BACKFILL_LIST_SQL = SQLITE_CODEBLOCK(
+  SELECT recordid, watcherid, jobid, stepid,
+         user_sec * 1000000 + user_usec AS user_time,
+         sys_sec * 1000000 + sys_usec AS sys_time,
+         res_size, gpu_measurement_batch,
+         ifnull(
+           (SELECT scrape_interval FROM scrape_freq_log_internal
+            WHERE start <= recordid ORDER BY start DESC LIMIT 1),
+           (SELECT scrape_interval FROM scrape_freq_log_internal
+            ORDER BY start LIMIT 1)) AS scrape_interval
+  FROM measurements
+  WHERE stepid IS NOT NULL
+  ORDER BY recordid
+);
@@ -3,10 +3,10 @@
 #define DECLSQL(NAME, ...) extern const char * NAME __VA_ARGS__;
 #ifdef __cplusplus
 #include <cstdint>
-#define DB_SCHEMA_VERSION                     6
-#define DB_SCHEMA_VERSION_STR                "6"
-#define MIGRATE_TARGET_DB_SCHEMA_VERSION      6
-#define MIGRATE_TARGET_DB_SCHEMA_VERSION_STR "6"
+#define DB_SCHEMA_VERSION                     9
+#define DB_SCHEMA_VERSION_STR                "9"
+#define MIGRATE_TARGET_DB_SCHEMA_VERSION      9
+#define MIGRATE_TARGET_DB_SCHEMA_VERSION_STR "9"
 
 #if MIGRATE_TARGET_DB_SCHEMA_VERSION != DB_SCHEMA_VERSION
   #if ENABLE_DEBUGOUT
@@ -19,22 +19,53 @@
 constexpr uint32_t schema_version = DB_SCHEMA_VERSION;
 #endif
 DECLSQL(INIT_DB_SQL);
+DECLSQL(CONFIGURE_WRITER_CONN_SQL);
+DECLSQL(PARTITION_INIT_SQL);
+DECLSQL(MEASUREMENT_COLUMNS_SQL);
+DECLSQL(GPU_MEASUREMENT_COLUMNS_SQL);
+DECLSQL(PARTITION_SEED_SQL);
 DECLSQL(UPSERT_WATCHER_SQL_RETURNING_TIMESTAMP_RANGE);
 DECLSQL(REGISTER_WATCHER_SQL_RETURNING_TIMESTAMPS_AND_WATCHERID);
 DECLSQL(JOBINFO_INSERT_SQL);
 DECLSQL(GPU_MEASUREMENT_INSERT_SQL);
 DECLSQL(GET_SCHEMA_VERSION_SQL);
-DECLSQL(UPDATE_GPU_BATCH_SQL);
+DECLSQL(UPDATE_GPU_BATCHES_SQL);
 DECLSQL(MEASUREMENTS_INSERT_SQL);
+DECLSQL(PENDING_MEASUREMENTS_INSERT_SQL);
+DECLSQL(LIST_RESOLVED_PENDING_MEASUREMENTS_SQL);
+DECLSQL(DELETE_RESOLVED_PENDING_MEASUREMENTS_SQL);
+DECLSQL(JOBINFO_EXISTS_SQL);
+DECLSQL(WATCHER_RANK_SQL);
+DECLSQL(ACCURACY_INDEX_LOAD_SQL);
+DECLSQL(STEP_ROLLUP_LOAD_SQL);
+DECLSQL(STEP_GPU_ROLLUP_LOAD_SQL);
+DECLSQL(GPU_BATCH_READINGS_SQL);
+DECLSQL(STEP_ROLLUP_INSERT_SQL);
+DECLSQL(STEP_USAGE_ROLLUP_INSERT_SQL);
+DECLSQL(STEP_USAGE_ROLLUP_INSERT_TAIL_SQL);
+DECLSQL(STEP_GPU_ROLLUP_INSERT_SQL);
+DECLSQL(ROLLUP_BACKFILL_PENDING_SQL);
+DECLSQL(ROLLUP_BACKFILL_CLEAR_SQL);
+DECLSQL(ROLLUP_BACKFILL_DONE_SQL);
+DECLSQL(ROLLUP_BACKFILL_LIST_SQL);
 DECLSQL(JOBSTEP_AVAILABLE_CPU_INSERT_SQL);
 DECLSQL(UPDATE_SCRAPE_FREQ_LOG_SQL);
+DECLSQL(INIT_SCRAPE_FREQ_LOG_SQL);
 DECLSQL(APPLICATION_USAGE_INSERT_SQL);
+DECLSQL(APPLICATION_USAGE_INSERT_TAIL_SQL);
 DECLSQL(RENEW_ANALYSIS_OFFSET_SQL);
 DECLSQL(RENEW_DB_SCHEMA_VERSION_SQL);
 
+DECLSQL(ANALYZE_ATTACH_CACHE_SQL);
+DECLSQL(ANALYZE_DETACH_CACHE_SQL);
 DECLSQL(PRE_ANALYZE_SQL);
+DECLSQL(ANALYZE_ADD_USER_SQL);
 DECLSQL(ANALYZE_LIST_ACTIVE_USERS);
 DECLSQL(ANALYZE_CREATE_BASE_TABLES, []);
+DECLSQL(ANALYZE_READ_GPUCPU_USAGE_STEPS_SQL);
+DECLSQL(ANALYZE_READ_GPUCPU_USAGE_SQL);
+DECLSQL(ANALYZE_INSERT_GPUCPU_USAGE_SQL);
+DECLSQL(ANALYZE_CREATE_USAGE_TABLES, []);
 DECLSQL(ANALYZE_RESOURCE_USAGE_SQL)
 DECLSQL(ANALYZE_LATEST_GPU_USAGE_SQL);
 DECLSQL(ANALYZE_GPU_USAGE_HISTORY_SQL);
@@ -0,0 +1,158 @@
+#ifndef _TURINGWATCHER_SQL_STMTS_H
+#define _TURINGWATCHER_SQL_STMTS_H
+#include "sql.h"
+#include "stmt_registry.h"
+
+// Statements of the registry, named after the SQL they prepare. Parameters
+// and columns are listed in the order bind and row take them
+
+inline stmt_t<params_t<pid_t, const char *, uint32_t, uint32_t, bool>,
+              columns_t<time_t, time_t, int>>
+  REGISTER_WATCHER_STMT(
+    REGISTER_WATCHER_SQL_RETURNING_TIMESTAMPS_AND_WATCHERID,
+    {":pid", ":target_node", ":jobid", ":stepid", ":privileged"},
+    {"start", "end", "id"},
+    "(register_watcher)");
+
+inline stmt_t<params_t<pid_t, const char *, uint32_t, uint32_t, bool>,
+              columns_t<time_t, time_t>>
+  UPSERT_WATCHER_STMT(
+    UPSERT_WATCHER_SQL_RETURNING_TIMESTAMP_RANGE,
+    {":pid", ":target_node", ":jobid", ":stepid", ":privileged"},
+    {"start", "end"},
+    "(upsert_watcher)");
+
+// Log the scrape interval the watcher runs with
+typedef stmt_t<params_t<int>, columns_t<>> scrape_freq_stmt_t;
+
+inline scrape_freq_stmt_t
+  UPDATE_SCRAPE_FREQ_LOG_STMT(
+    UPDATE_SCRAPE_FREQ_LOG_SQL, {":scrape_interval"}, {},
+    "(update_scraper_freq_log)");
+
+inline scrape_freq_stmt_t
+  INIT_SCRAPE_FREQ_LOG_STMT(
+    INIT_SCRAPE_FREQ_LOG_SQL, {":scrape_interval"}, {},
+    "(init_scraper_freq_log)");
+
+inline stmt_t<params_t<>, columns_t<int>>
+  GET_SCHEMA_VERSION_STMT(
+    GET_SCHEMA_VERSION_SQL, {}, {"schema_version"}, "(get_schema_version)");
+
+inline stmt_t<params_t<>, columns_t<int, int>>
+  RENEW_DB_SCHEMA_VERSION_STMT(
+    RENEW_DB_SCHEMA_VERSION_SQL, {}, {"start", "end"},
+    "(renew_schema_version)");
+
+inline stmt_t<params_t<>, columns_t<int, int>>
+  RENEW_ANALYSIS_OFFSET_STMT(
+    RENEW_ANALYSIS_OFFSET_SQL, {}, {"start", "end"}, "(renew_analyzer)");
+
+inline stmt_t<params_t<int>, columns_t<int, int>>
+  UPDATE_GPU_BATCHES_STMT(
+    UPDATE_GPU_BATCHES_SQL, {":cnt"}, {"start", "end"},
+    "(gpu_measurement_batch)");
+
+inline stmt_t<params_t<uint32_t>, columns_t<int>>
+  JOBINFO_EXISTS_STMT(
+    JOBINFO_EXISTS_SQL, {":jobid"}, {"found"}, "(jobinfo_exists)");
+
+// stepid and peak_res_size are NULL for the job itself, the user and what
+// was allocated for its steps
+inline stmt_t<params_t<uint32_t, std::optional<uint32_t>, const char *,
+                       const char *, const char *,
+                       std::optional<uint32_t>, time_t, time_t,
+                       std::optional<uint64_t>, std::optional<uint64_t>,
+                       std::optional<uint64_t>, std::optional<uint64_t>,
+                       std::optional<uint64_t>>,
+              columns_t<>>
+  JOBINFO_INSERT_STMT(
+    JOBINFO_INSERT_SQL,
+    {":jobid", ":stepid", ":user", ":name", ":submit_line",
+     ":timelimit", ":started_at", ":ended_at",
+     ":mem", ":peak_res_size", ":nnodes", ":ncpu", ":ngpu"},
+    {},
+    "(jobinfo_insert)");
+
+inline stmt_t<params_t<>,
+              columns_t<int, uint32_t, uint32_t,
+                        std::optional<int64_t>, std::optional<int64_t>,
+                        int64_t, int64_t, int64_t, int64_t,
+                        int64_t, std::optional<int64_t>,
+                        std::optional<int64_t>, std::optional<int64_t>>>
+  LIST_RESOLVED_PENDING_MEASUREMENTS_STMT(
+    LIST_RESOLVED_PENDING_MEASUREMENTS_SQL, {},
+    {"watcherid", "jobid", "stepid", "dev_in", "dev_out",
+     "user_sec", "user_usec", "sys_sec", "sys_usec",
+     "res_size", "minor_pagefault", "peak_mem_usage",
+     "gpu_measurement_batch"},
+    "(resolve_pending_measurements)");
+
+inline stmt_t<params_t<int>, columns_t<int, std::optional<std::string>>>
+  WATCHER_RANK_STMT(
+    WATCHER_RANK_SQL, {":id"}, {"accuracy", "target_node"},
+    "(get_watcher_rank)");
+
+inline stmt_t<params_t<>, columns_t<>>
+  PARTITION_SEED_STMT(PARTITION_SEED_SQL, {}, {}, "(seed_partition)");
+
+inline stmt_t<params_t<uint32_t, uint32_t>,
+              columns_t<int, std::optional<const char *>, int64_t>>
+  ACCURACY_INDEX_LOAD_STMT(
+    ACCURACY_INDEX_LOAD_SQL, {":jobid", ":stepid"},
+    {"accuracy", "target_node", "tot_time"},
+    "(accuracy_index_load)");
+
+inline stmt_t<params_t<uint32_t, uint32_t, int>,
+              columns_t<int64_t, int64_t, int64_t, int64_t,
+                        std::optional<int64_t>, std::optional<int64_t>,
+                        int64_t, int64_t, int64_t, int64_t, int64_t>>
+  STEP_ROLLUP_LOAD_STMT(
+    STEP_ROLLUP_LOAD_SQL, {":jobid", ":stepid", ":watcherid"},
+    {"sample_cnt", "latest_recordid", "user_time", "sys_time",
+     "res_size", "peak_res_size", "sys_ratio_cnt",
+     "sys_ratio_1_10", "sys_ratio_1_3", "sys_ratio_2_3",
+     "sys_ratio_gt_1_milli"},
+    "(step_rollup_load)");
+
+inline stmt_t<params_t<uint32_t, uint32_t, int>,
+              columns_t<int64_t, int64_t, int64_t, int64_t, int64_t,
+                        int64_t, int64_t, int64_t, int64_t, int64_t,
+                        std::optional<int64_t>, std::optional<int64_t>,
+                        std::optional<int64_t>, std::optional<int64_t>,
+                        std::optional<int64_t>>>
+  STEP_GPU_ROLLUP_LOAD_STMT(
+    STEP_GPU_ROLLUP_LOAD_SQL, {":jobid", ":stepid", ":watcherid"},
+    {"gpuid", "sample_cnt", "util_sum", "zero_util_cnt", "low_util_cnt",
+     "zero_util_run", "longest_zero_util_run",
+     "sm_clock_sum", "power_usage_sum", "temperature_sum",
+     "age", "power_usage", "temperature", "sm_clock", "util"},
+    "(step_gpu_rollup_load)");
+
+inline stmt_t<params_t<int64_t, uint32_t>,
+              columns_t<int64_t, std::optional<int64_t>,
+                        std::optional<int64_t>, std::optional<int64_t>,
+                        std::optional<int64_t>, std::optional<int64_t>>>
+  GPU_BATCH_READINGS_STMT(
+    GPU_BATCH_READINGS_SQL, {":batch", ":jobid"},
+    {"gpuid", "age", "power_usage", "temperature", "sm_clock", "util"},
+    "(gpu_batch_readings)");
+
+inline stmt_t<params_t<>, columns_t<int>>
+  ROLLUP_BACKFILL_PENDING_STMT(
+    ROLLUP_BACKFILL_PENDING_SQL, {}, {"rollup_backfill"},
+    "(rollup_backfill_pending)");
+
+inline stmt_t<params_t<>, columns_t<>>
+  ROLLUP_BACKFILL_DONE_STMT(
+    ROLLUP_BACKFILL_DONE_SQL, {}, {}, "(rollup_backfill_done)");
+
+inline stmt_t<params_t<>,
+              columns_t<int64_t, int, uint32_t, uint32_t, int64_t, int64_t,
+                        std::optional<int64_t>, std::optional<int64_t>, int>>
+  ROLLUP_BACKFILL_LIST_STMT(
+    ROLLUP_BACKFILL_LIST_SQL, {},
+    {"recordid", "watcherid", "jobid", "stepid", "user_time", "sys_time",
+     "res_size", "gpu_measurement_batch", "scrape_interval"},
+    "(rollup_backfill_list)");
+#endif
@@ -0,0 +1,146 @@
+#include "accuracy_index.h"
+#include "stmts.h"
+
+struct watcher_rank_t {
+  int accuracy;
+  // Interned target_node, -1 for NULL
+  int node;
+};
+
+struct accuracy_entry_t {
+  // -1 while no measurement of the step is known
+  int accuracy = -1;
+  // Latest tot_time of every target node at accuracy
+  std::vector<std::pair<int, int64_t>> latest;
+  time_t used = 0;
+};
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<uint64_t, accuracy_entry_t> entries;
+static std::unordered_map<int, watcher_rank_t> watchers;
+static std::map<std::string, int> nodes;
+// Admitted to in the open transaction of the thread
+static thread_local std::vector<uint64_t> touched;
+
+static inline uint64_t step_key(uint32_t jobid, uint32_t stepid) {
+  return (uint64_t)jobid << 32 | stepid;
+}
+
+template<typename T>
+static int intern_node(const std::optional<T> &name) {
+  if (!name) {
+    return -1;
+  }
+  return nodes.emplace(*name, nodes.size()).first->second;
+}
+
+static bool get_watcher_rank(int watcherid, watcher_rank_t &rank) {
+  auto it = watchers.find(watcherid);
+  if (it != watchers.end()) {
+    rank = it->second;
+    return true;
+  }
+  decltype(WATCHER_RANK_STMT)::row_t row;
+  if (!WATCHER_RANK_STMT.fetch_one(row, watcherid)) {
+    return false;
+  }
+  const auto &[accuracy, target_node] = row;
+  rank.accuracy = accuracy;
+  rank.node = intern_node(target_node);
+  watchers[watcherid] = rank;
+  return true;
+}
+
+static bool load_entry(uint32_t jobid, uint32_t stepid,
+                       accuracy_entry_t &entry) {
+  entry.accuracy = -1;
+  return ACCURACY_INDEX_LOAD_STMT.for_each([&](const auto &row) {
+    const auto &[accuracy, target_node, tot_time] = row;
+    if (accuracy < entry.accuracy) {
+      return;
+    } else if (accuracy > entry.accuracy) {
+      entry.accuracy = accuracy;
+      entry.latest.clear();
+    }
+    entry.latest.emplace_back(intern_node(target_node), tot_time);
+  }, jobid, stepid);
+}
+
+bool accuracy_index_admit(int watcherid, uint32_t jobid, uint32_t stepid,
+                          int64_t tot_time) {
+  if (!tot_time) {
+    return false;
+  }
+  const uint64_t key = step_key(jobid, stepid);
+  pthread_mutex_lock(&index_lock);
+  watcher_rank_t rank;
+  if (!get_watcher_rank(watcherid, rank)) {
+    pthread_mutex_unlock(&index_lock);
+    return false;
+  }
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    accuracy_entry_t entry;
+    if (!load_entry(jobid, stepid, entry)) {
+      pthread_mutex_unlock(&index_lock);
+      return false;
+    }
+    it = entries.emplace(key, std::move(entry)).first;
+  }
+  auto &entry = it->second;
+  entry.used = time(NULL);
+  bool admit = rank.accuracy >= entry.accuracy;
+  if (rank.accuracy > entry.accuracy) {
+    entry.accuracy = rank.accuracy;
+    entry.latest.clear();
+  }
+  if (admit) {
+    auto latest = std::find_if(
+      entry.latest.begin(), entry.latest.end(),
+      [&](const auto &node_latest) { return node_latest.first == rank.node; });
+    if (latest == entry.latest.end()) {
+      entry.latest.emplace_back(rank.node, tot_time);
+    } else if (latest->second == tot_time) {
+      admit = false;
+    } else {
+      latest->second = std::max(latest->second, tot_time);
+    }
+  }
+  pthread_mutex_unlock(&index_lock);
+  if (admit) {
+    touched.push_back(key);
+  }
+  return admit;
+}
+
+void accuracy_index_forget(uint32_t jobid, uint32_t stepid) {
+  pthread_mutex_lock(&index_lock);
+  entries.erase(step_key(jobid, stepid));
+  pthread_mutex_unlock(&index_lock);
+}
+
+void accuracy_index_commit() {
+  touched.clear();
+}
+
+void accuracy_index_rollback() {
+  pthread_mutex_lock(&index_lock);
+  for (const auto key : touched) {
+    entries.erase(key);
+  }
+  pthread_mutex_unlock(&index_lock);
+  touched.clear();
+}
+
+void accuracy_index_evict() {
+  const time_t idle_since = time(NULL) - ACCURACY_INDEX_IDLE_SECS;
+  pthread_mutex_lock(&index_lock);
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (it->second.used < idle_since) {
+      it = entries.erase(it);
+    } else {
+      it++;
+    }
+  }
+  pthread_mutex_unlock(&index_lock);
+}
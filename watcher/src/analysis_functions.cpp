@@ -0,0 +1,57 @@
+#include "analysis_functions.h"
+
+// Aggregate context of max_by, zeroed by SQLite at the first row
+struct max_by_t {
+  sqlite3_value *value;
+  sqlite3_value *key;
+};
+
+static bool is_greater(sqlite3_value *key, sqlite3_value *than) {
+  if (sqlite3_value_numeric_type(key) == SQLITE_INTEGER
+      && sqlite3_value_numeric_type(than) == SQLITE_INTEGER) {
+    return sqlite3_value_int64(key) > sqlite3_value_int64(than);
+  }
+  return sqlite3_value_double(key) > sqlite3_value_double(than);
+}
+
+static void max_by_step(sqlite3_context *ctx, int, sqlite3_value **argv) {
+  auto max_by = (max_by_t *)sqlite3_aggregate_context(ctx, sizeof(max_by_t));
+  if (!max_by) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  sqlite3_value *key = argv[1];
+  if (sqlite3_value_type(key) == SQLITE_NULL
+      || (max_by->key && !is_greater(key, max_by->key))) {
+    return;
+  }
+  sqlite3_value_free(max_by->value);
+  sqlite3_value_free(max_by->key);
+  max_by->value = sqlite3_value_dup(argv[0]);
+  max_by->key = sqlite3_value_dup(key);
+  if (!max_by->value || !max_by->key) {
+    sqlite3_result_error_nomem(ctx);
+  }
+}
+
+static void max_by_final(sqlite3_context *ctx) {
+  auto max_by = (max_by_t *)sqlite3_aggregate_context(ctx, 0);
+  if (!max_by) {
+    return;
+  }
+  if (max_by->value) {
+    sqlite3_result_value(ctx, max_by->value);
+  }
+  sqlite3_value_free(max_by->value);
+  sqlite3_value_free(max_by->key);
+}
+
+bool analysis_functions_register() {
+  if (!IS_SQLITE_OK(sqlite3_create_function_v2(
+        SQL_CONN_NAME, "max_by", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+        NULL, max_by_step, max_by_final, NULL))) {
+    SQLITE3_PERROR("create_function(max_by)");
+    return false;
+  }
+  return true;
+}
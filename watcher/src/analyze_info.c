@@ -74,7 +74,7 @@ const char *summary_letter_usage[] = {
   NULL
 };
 
-const char *row_group_top_style = "style=\"border-top-style: ridge\"";
+const char *row_group_top_style = "class=\"group-top\"";
 
 const char *analyze_letter_stylesheet = STRINGIFY_BLOCK(
   <style>
@@ -102,6 +102,32 @@ const char *analyze_letter_stylesheet = STRINGIFY_BLOCK(
   code {
     white-space: pre;
   }
+  tr.group-top {
+    border-top-style: ridge;
+  }
+  td.problems {
+    padding: 0;
+    height: 0;
+    vertical-align: top;
+  }
+  div.problem-list {
+    height: 100%;
+    display: flex;
+    flex-direction: column;
+  }
+  div.problem-fill {
+    width: 100%;
+    flex-grow: 1;
+  }
+  div.problem {
+    text-align: center;
+    padding: 0.5rem 0.5rem 0.5rem 0.5rem;
+  }
+  a.problem-link {
+    text-decoration: none;
+    white-space: nowrap;
+    font-weight: bold;
+  }
   </style>
 );
 
@@ -1,8 +1,48 @@
 #include "analyzer.h"
 
+// Of an analysis in analysis_list, prepared on the reader of a worker
+struct analysis_stmts_t {
+  sqlite3_stmt *latest_analysis = NULL;
+  sqlite3_stmt *latest_problem = NULL;
+  sqlite3_stmt *history_analysis = NULL;
+};
+
+// What the analysis of a user leaves for the tarball and raw.json, gathered
+// in the order of users once all workers are done
+struct user_result_t {
+  // Its letter and shard of the report, compressed by the worker
+  archive_part_t archive;
+  archive_part_t shard;
+  std::optional<std::string> json;
+  // Of the report, none if the letter is empty
+  std::vector<report_section_t> sections;
+};
+
+// Analyzes the users hashed to it on a reader of its own, so that the cache
+// of the results of steps of a user stays on the same reader. The base tables
+// are built once a round for all its users, the letters select theirs. The
+// reader and statements prepared on it are kept until analyzer_finalize
+struct analysis_worker_t {
+  sqlite3 *reader = NULL;
+  sqlite3_stmt *add_user_stmt = NULL;
+  sqlite3_stmt *insert_problem_listing_stmt = NULL;
+  sqlite3_stmt *dump_json_stmt = NULL;
+  std::vector<sqlite3_stmt *> create_base_table_stmt;
+  std::vector<sqlite3_stmt *> create_usage_table_stmt;
+  gpucpu_usage_t gpucpu_usage;
+  std::vector<analysis_stmts_t> analysis_stmts;
+  // Indices into users of this round
+  std::vector<size_t> user_indices;
+  pthread_t thread;
+};
+
+static std::vector<analysis_worker_t> workers;
+// Prepared on the reader of the first worker
 static sqlite3_stmt *list_active_user_stmt;
-static std::vector<sqlite3_stmt *> create_base_table_stmt;
 static int offset_start, offset_end;
+// Of the round, read by workers
+static std::vector<std::string> users;
+static std::vector<user_result_t> user_results;
 
 // For compatibility with Microsoft Word, use anchor
 #define ANCHORED_TAG(TAG, ANCHOR, TEXT) \
@@ -21,41 +61,82 @@ static int offset_start, offset_end;
 #define CENTER(TEXT, ...) WRAPTAG(center, TEXT, __VA_ARGS__)
 #define BOLD(TEXT, ...) WRAPTAG(b, TEXT, __VA_ARGS__)
 #define COLSPAN(X) "colspan=\"" #X "\""
+// Of 32 bits, as "%08x" prints them
+#define SEVERITY_BACKGROUND(SEVERITY) \
+  html_hex{(uint32_t)ANLAYZE_COMPOSITE_COLOR_BACKGROUND(SEVERITY), 8}
+#define SEVERITY_FOREGROUND(SEVERITY) \
+  html_hex{(uint32_t)ANLAYZE_COMPOSITE_COLOR_FOREGROUND(SEVERITY), 8}
+
+// Problems are colored by classes of their severity rather than styles of
+// their own, see severity_stylesheet
+static const struct {
+  analyze_problem_severity_t severity;
+  const char *class_name;
+} severity_classes[] = {
+  {ANALYZE_SEVERITY_SERIOUS, "severity-serious"},
+  {ANALYZE_SEVERITY_MEDIUM, "severity-medium"},
+  {ANALYZE_SEVERITY_INFO, "severity-info"},
+};
+
+static inline const char *severity_class(analyze_problem_severity_t severity) {
+  for (const auto &cls : severity_classes) {
+    if (cls.severity == severity) {
+      return cls.class_name;
+    }
+  }
+  return "";
+}
+
+// Of the letter head, the background of problems and the color of their
+// names. webserver/static/style.css repeats these for the report
+static const std::string &severity_stylesheet() {
+  static const std::string stylesheet = []() {
+    std::string css = "<style>";
+    for (const auto &cls : severity_classes) {
+      HTML_RENDER(css,
+                  "div.%s { background: #%s; }"
+                  " div.%s > a, b.%s { color: #%s; }",
+                  cls.class_name, SEVERITY_BACKGROUND(cls.severity),
+                  cls.class_name, cls.class_name,
+                  SEVERITY_FOREGROUND(cls.severity));
+    }
+    return css + "</style>";
+  }();
+  return stylesheet;
+}
 
 const auto mkdir_mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
+// Filled before workers start, only looked up by them
 static std::map<std::string, const analyze_problem_t *> problem_info;
+// Of analysis_list, in its order
+static std::vector<std::string> analysis_machine_names;
 
-static inline void reset_analyze_stmts(bool finalize) {
-  #define OP "(reset_analyze_stmts)"
-  std::vector<sqlite3_stmt *> stmt_to_finalize;
-  for (auto &stmt : create_base_table_stmt) {
-    if (finalize) {
-      stmt_to_finalize.push_back(stmt);
-      stmt = NULL;
-    } else {
-      reset_stmt(stmt, OP);
-    }
-  }
-  auto cur = analysis_list;
-  while (const auto &info = *cur) {
-    #define CLEANUP(NAME) \
-      if (info->NAME##_stmt) { \
-        if (finalize) { \
-          stmt_to_finalize.push_back(info->NAME##_stmt); \
-          info->NAME##_stmt = NULL; \
-        } else { \
-          reset_stmt(info->NAME##_stmt, OP); \
-        } \
-      }
-    CLEANUP(latest_analysis);
-    CLEANUP(latest_problem);
-    CLEANUP(history_analysis);
-    #undef CLEANUP
-    cur++;
+static inline void finalize_worker_stmts(analysis_worker_t &worker) {
+  std::vector<sqlite3_stmt *> stmt_to_finalize{
+    worker.add_user_stmt,
+    worker.insert_problem_listing_stmt,
+    worker.dump_json_stmt
+  };
+  worker.add_user_stmt = NULL;
+  worker.insert_problem_listing_stmt = NULL;
+  worker.dump_json_stmt = NULL;
+  for (auto &stmt : worker.create_base_table_stmt) {
+    stmt_to_finalize.push_back(stmt);
+  }
+  worker.create_base_table_stmt.clear();
+  for (auto &stmt : worker.create_usage_table_stmt) {
+    stmt_to_finalize.push_back(stmt);
   }
+  worker.create_usage_table_stmt.clear();
+  worker.gpucpu_usage.finalize();
+  for (auto &stmts : worker.analysis_stmts) {
+    stmt_to_finalize.push_back(stmts.latest_analysis);
+    stmt_to_finalize.push_back(stmts.latest_problem);
+    stmt_to_finalize.push_back(stmts.history_analysis);
+  }
+  worker.analysis_stmts.clear();
   stmt_to_finalize.push_back(FINALIZE_END_ADDR);
   finalize_stmt_array(stmt_to_finalize.data());
-  #undef OP
 }
 
 void analyzer_finalize() {
@@ -63,14 +144,39 @@ void analyzer_finalize() {
     list_active_user_stmt,
     FINALIZE_END_ADDR
   };
-  reset_analyze_stmts(true);
   finalize_stmt_array(stmt_to_finalize);
+  list_active_user_stmt = NULL;
+  for (auto &worker : workers) {
+    finalize_worker_stmts(worker);
+    sqlite_conn_scope_t reader_scope(worker.reader);
+    sqlite3_exec_wrap(ANALYZE_DETACH_CACHE_SQL, "(detach_analysis_cache)");
+    if (!IS_SQLITE_OK(sqlite3_close(worker.reader))) {
+      SQLITE3_PERROR("close(analysis_reader)");
+    }
+  }
+  workers.clear();
 }
 
 #define BIND_OFFSET(STMT) \
   NAMED_BIND_INT(STMT, ":offset_start", offset_start); \
   NAMED_BIND_INT(STMT, ":offset_end", offset_end);
 
+// Of the user and offsets, those the statement has
+static bool bind_analysis_params(sqlite3_stmt *stmt, const char *user) {
+  SQLITE3_BIND_START
+  if (BIND_NAME(stmt, ":user")) {
+    NAMED_BIND_TEXT(stmt, ":user", user);
+  }
+  if (BIND_NAME(stmt, ":offset_start")) {
+    NAMED_BIND_INT(stmt, ":offset_start", offset_start);
+  }
+  if (BIND_NAME(stmt, ":offset_end")) {
+    NAMED_BIND_INT(stmt, ":offset_end", offset_end);
+  }
+  return !BIND_FAILED;
+  SQLITE3_BIND_END
+}
+
 static inline std::string get_machine_name(const char *in) {
   std::string str = std::string(in);
   for (auto &c : str) {
@@ -87,24 +193,51 @@ static inline std::string get_machine_name(const char *in) {
 
 static inline
 void run_analysis_stmt(
-  sqlite3_stmt *stmt, analysis_info_t *info, const char *title,
-  std::string &tldr, bool &toc_added, bool new_toc_row, bool highlight,
-  FILE *fp, FILE *header_fp) {
+  sqlite3_stmt *stmt, sqlite3_stmt *insert_problem_listing_stmt,
+  const analysis_info_t *info,
+  const std::string &info_machine_name, const analysis_stmts_t &stmts,
+  const char *title, const std::string &title_machine_name, std::string &tldr,
+  bool &toc_added, bool new_toc_row, bool highlight, FILE *fp,
+  FILE *header_fp, report_letter_t &letter) {
   if (!stmt) {
     return;
   }
   bool first_run = 0;
-  auto title_machine_name = get_machine_name(title);
   const char *title_machine_name_str = title_machine_name.c_str();
-  std::string info_machine_name = get_machine_name(info->name);
   const char *info_machine_name_str = info_machine_name.c_str();
   int sqlite_ret;
   bool has_total = 0;
-  std::map<const analyze_problem_t *, int> problem_cnt;
+  // In the order of problems, few per analysis
+  std::vector<std::pair<const analyze_problem_t *, int>> problem_cnt;
   DEBUGOUT_VERBOSE(fprintf(stderr, "%s\n", sqlite3_expanded_sql(stmt)));
   int tot = 0;
   int stepid = -1, jobid = -1;
-  bool is_history_analysis = info->history_analysis_stmt == stmt;
+  bool is_history_analysis = stmts.history_analysis == stmt;
+  // Fields shown of the columns of stmt, NULL for columns without one, so
+  // that rows do not compare column names
+  std::vector<const analyze_result_field_t *> column_fields;
+  {
+    auto cur = info->fields;
+    for (int i = 0; i < sqlite3_column_count(stmt) && cur->sql_column_name;
+         i++) {
+      if (strcmp(sqlite3_column_name(stmt, i), cur->sql_column_name)) {
+        column_fields.push_back(NULL);
+        continue;
+      }
+      column_fields.push_back(cur);
+      do {
+        cur++;
+      } while (cur->flags & ANALYZE_FIELD_NOT_IN_ACROSS_HISTORY
+               && is_history_analysis);
+    }
+    if (cur->sql_column_name && !(cur->flags & ANALYZE_FIELD_PROBLEMS)) {
+      fprintf(stderr, "warning: mismatching fields -- looking for %s\n",
+                      cur->sql_column_name);
+    }
+  }
+  // Of a row, kept for the capacity
+  std::vector<double> percentages;
+  std::vector<int> colspans;
   while ((sqlite_ret = sqlite3_step(stmt)) == SQLITE_ROW) {
     tot++;
     if (!first_run) {
@@ -119,9 +252,11 @@ void run_analysis_stmt(
                 new_toc_row ? "<tr>" : "",
                 info_machine_name_str, info->name,
                 info_machine_name_str, info_machine_name_str);
+        letter.mark(fp, info_machine_name, info->name, true);
         fprintf(fp, HEADER_TEXT("%s", "%s") "\n" PARAGRAPH("%s"),
                     info_machine_name_str, info->name,
                     info->analysis_description);
+        letter.mark(fp, info_machine_name + "_metrics", "Metrics", true);
         fprintf(fp, SUBHEADER_TEXT("%s_metrics", "Metrics") "\n",
                 info_machine_name_str);
         if (info->headers_description) {
@@ -147,8 +282,10 @@ void run_analysis_stmt(
                     cur_metric->help);
           }
         }
+        fputs("</table>", fp);
+        letter.mark(fp, info_machine_name + "_problems",
+                    "Possible problems in the category", true);
         fprintf(fp,
-                "</table>"
                 SUBHEADER_TEXT(
                   "%s_problems", "Possible problems in the category")
                 "<table>", info_machine_name_str);
@@ -183,6 +320,8 @@ void run_analysis_stmt(
               info_machine_name_str, title_machine_name_str,
               highlight ? CSS("color: revert; font-weight: bold") : "",
               title);
+      letter.mark(fp, info_machine_name + "_" + title_machine_name, title,
+                  false);
       fprintf(fp, SUBHEADER_TEXT("%s_%s", "%s"),
                   info_machine_name_str, title_machine_name_str, title);
       fputs("<table><tr>", fp);
@@ -214,21 +353,21 @@ void run_analysis_stmt(
       }
       fputs("</tr>", fp);
     }
-    fprintf(fp, "<tr %s>", row_group_top_style);
-    auto cur = info->fields;
+    HTML_RENDER(fp, "<tr %s>", row_group_top_style);
     int tot = 0;
-    std::queue<double> percentages;
-    std::queue<int> colspans;
+    percentages.clear();
+    colspans.clear();
     const double not_an_number = std::nan("0");
     int cnt_percentage = 0;
     bool met_stepid = 0;
     analyze_problem_severity_t last_problem_severity;
     SQLITE3_FETCH_COLUMNS_START(NULL)
     SQLITE3_FETCH_COLUMNS_LOOP_HEADER(i, stmt)
-      if (!cur->sql_column_name) {
+      if ((size_t)i == column_fields.size()) {
         break;
       }
-      if (strcmp(GET_COLUMN_NAME(), cur->sql_column_name)) {
+      const auto cur = column_fields[i];
+      if (!cur) {
         continue;
       }
       if (cur->flags & ANALYZE_FIELD_TOTAL) {
@@ -236,24 +375,23 @@ void run_analysis_stmt(
       }
       bool is_percentage = cur->flags & ANALYZE_FIELD_SHOW_PERCENTAGE;
       bool is_null_data = SQLITE3_IS_NULL();
-      std::string td_styling = "";
       if (!cur->printed_name) {
-        goto finalize_table_row_loop;
+        continue;
       }
       if (is_percentage) {
         cnt_percentage++;
       } else if (cnt_percentage) {
-        colspans.push(cnt_percentage);
+        colspans.push_back(cnt_percentage);
         cnt_percentage = 0;
       }
+      html_put(fp, "<td");
       if (has_total && !is_percentage) {
-        td_styling += std::string(" rowspan=\"3\"");
+        html_put(fp, " rowspan=\"3\"");
       }
       if (cur->flags & ANALYZE_FIELD_PROBLEMS) {
-        td_styling += std::string(" " CSS("padding: 0; height: 0;"
-                                          "vertical-align: top;"));
+        html_put(fp, " class=\"problems\"");
       }
-      fprintf(fp, "<td%s>", td_styling.c_str());
+      html_put(fp, ">");
       if (cur->flags & ANALYZE_FIELD_STEP_ID) {
         met_stepid = 1;
         stepid = -1;
@@ -265,25 +403,22 @@ void run_analysis_stmt(
           while (cur_id->name && cur_id->stepid != id) {
             cur_id++;
           }
-          fputs("<center>", fp);
           if (cur_id->name) {
-            fprintf(fp, "%s", cur_id->name);
+            HTML_RENDER(fp, "<center>%s</center>", cur_id->name);
           } else {
-            fprintf(fp, "%d", id);
+            HTML_RENDER(fp, "<center>%s</center>", id);
           }
-          fputs("</center>", fp);
         }
       } else if (cur->flags & ANALYZE_FIELD_SHOW_PERCENTAGE
                  && cur->type != ANALYZE_RESULT_STR) {
         double val = SQLITE3_FETCH(double);
-        fprintf(fp,
-                cur->type == ANALYZE_RESULT_INT
-                  ? CENTER("%'.0lf") : CENTER("%'.2lf"),
-                val);
+        HTML_RENDER(fp, CENTER("%s"),
+                    html_fixed{val, cur->type == ANALYZE_RESULT_INT ? 0 : 2,
+                               true});
         if (tot) {
-          percentages.push(val / tot * 100);
+          percentages.push_back(val / tot * 100);
         } else {
-          percentages.push(not_an_number);
+          percentages.push_back(not_an_number);
           fprintf(stderr,
                   "%s/%s: no total value available or divison by zero\n",
                   title_machine_name_str, cur->sql_column_name);
@@ -291,14 +426,10 @@ void run_analysis_stmt(
       } else if (cur->flags & ANALYZE_FIELD_PROBLEMS) {
         auto str = (const char *)SQLITE3_FETCH_STR();
         std::string cur_problem = "";
-        sqlite3_stmt *insert_problem_listing_stmt = NULL;
         bool bind_failed = false;
         if (!is_history_analysis) {
-          if (!setup_stmt(
-            insert_problem_listing_stmt, ANALYZE_INSERT_PROBLEM_LISTING_SQL,
-            "(insert_problem_listing)")) {
-            exit(1);
-          }
+          // Stepped for the problems of the rows before
+          sqlite3_reset(insert_problem_listing_stmt);
           SQLITE3_BIND_START
           NAMED_BIND_INT(insert_problem_listing_stmt, ":jobid", jobid);
           if (stepid != -1) {
@@ -320,32 +451,33 @@ void run_analysis_stmt(
               cur_problem.append(1, c);
             } else if (c == '|' || c == '\0') {
               if (cur_problem.length()) {
-                if (problem_info.count(cur_problem)) {
-                  auto &info = problem_info[cur_problem];
+                const auto found = problem_info.find(cur_problem);
+                if (found != problem_info.end()) {
+                  const auto &info = found->second;
                   if (first) {
-                    fprintf(fp, "<div " CSS("height: 100%; display: flex;"
-                                " flex-direction: column;") ">"
-                                WRAPTAG(div, "",
-                                        CSS("width: 100%; flex-grow: 1;"
-                                        " background: #%08x")) "\n",
-                            ANLAYZE_COMPOSITE_COLOR_BACKGROUND(info->severity));
+                    HTML_RENDER(fp,
+                                "<div class=\"problem-list\">"
+                                WRAPTAG(div, "", "class=\"problem-fill %s\"")
+                                "\n", severity_class(info->severity));
                     first = 0;
                   }
-                  problem_cnt[info]++;
-                  fprintf(fp,
-                          WRAPTAG(div,
-                                  ANCHOR_LINK("%s_%s", "%s",
-                                              CSS("color: #%08x;"
-                                                  " text-decoration: none;"
-                                                  " white-space: nowrap;"
-                                                  " font-weight: bold;")),
-                                  CSS("background: #%08x; text-align: center;"
-                                      " padding: 0.5rem 0.5rem 0.5rem 0.5rem;"))
-                          "\n",
-                          ANLAYZE_COMPOSITE_COLOR_BACKGROUND(info->severity),
-                          info_machine_name_str, info->sql_name,
-                          ANLAYZE_COMPOSITE_COLOR_FOREGROUND(info->severity),
-                          info->printed_name);
+                  auto cnt = problem_cnt.begin();
+                  while (cnt != problem_cnt.end() && cnt->first != info) {
+                    cnt++;
+                  }
+                  if (cnt == problem_cnt.end()) {
+                    problem_cnt.emplace_back(info, 1);
+                  } else {
+                    cnt->second++;
+                  }
+                  HTML_RENDER(fp,
+                              WRAPTAG(div,
+                                      ANCHOR_LINK("%s_%s", "%s",
+                                                  " class=\"problem-link\""),
+                                      "class=\"problem %s\"") "\n",
+                              severity_class(info->severity),
+                              info_machine_name, info->sql_name,
+                              info->printed_name);
                   last_problem_severity = info->severity;
                   if (!bind_failed) {
                     sqlite3_reset(insert_problem_listing_stmt);
@@ -373,13 +505,10 @@ void run_analysis_stmt(
           }
           str++;
         }
-        sqlite3_finalize(insert_problem_listing_stmt);
         if (!first) {
-          fprintf(fp, WRAPTAG(div, "",
-                              CSS("width: 100%; flex-grow: 1;"
-                                  " background: #%08x")
-                      ) "</div>\n",
-                  ANLAYZE_COMPOSITE_COLOR_BACKGROUND(last_problem_severity));
+          HTML_RENDER(fp,
+                      WRAPTAG(div, "", "class=\"problem-fill %s\"")
+                      "</div>\n", severity_class(last_problem_severity));
         }
       } else if (!is_null_data) {
         switch (cur->type) {
@@ -387,22 +516,23 @@ void run_analysis_stmt(
           {
             int val = SQLITE3_FETCH(int);
             if (met_stepid) {
-              fprintf(fp, CENTER("%'d"), val);
+              HTML_RENDER(fp, CENTER("%s"), html_grouped{val});
             } else {
-              fprintf(fp, ANCHOR_LINK("%s_%s", CENTER("%d")),
-                          info_machine_name_str, title_machine_name_str, val);
+              HTML_RENDER(fp, ANCHOR_LINK("%s_%s", CENTER("%s")),
+                          info_machine_name, title_machine_name, val);
               jobid = val;
             }
             break;
           }
           case ANALYZE_RESULT_FLOAT:
-            fprintf(fp, CENTER("%'.2lf"), SQLITE3_FETCH(double));
+            HTML_RENDER(fp, CENTER("%s"),
+                        html_fixed{SQLITE3_FETCH(double), 2, true});
             break;
           case ANALYZE_RESULT_STR:
             {
               const char *str = (const char *)SQLITE3_FETCH_STR();
               bool multiline = str ? strchr(str, '\n') : 0;
-              fprintf(fp, "%s" WRAPTAG(pre, WRAPTAG(code, "%s")) "%s",
+              HTML_RENDER(fp, "%s" WRAPTAG(pre, WRAPTAG(code, "%s")) "%s",
                           multiline ? "" : "<center>",
                           str,
                           multiline ? "" : "</center>");
@@ -413,44 +543,33 @@ void run_analysis_stmt(
                     title_machine_name_str, cur->sql_column_name);
         }
       }
-      fputs("</td>", fp);
-      finalize_table_row_loop:
-      do {
-        cur++;
-      } while (cur->flags & ANALYZE_FIELD_NOT_IN_ACROSS_HISTORY
-               && is_history_analysis);
+      html_put(fp, "</td>");
     SQLITE3_FETCH_COLUMNS_END
-    if (cur->sql_column_name && !(cur->flags & ANALYZE_FIELD_PROBLEMS)) {
-      fprintf(stderr, "warning: mismatching fields -- looking for %s\n",
-                      cur->sql_column_name);
-    }
-    fputs("</tr>\n", fp);
+    html_put(fp, "</tr>\n");
     if (cnt_percentage) {
-      colspans.push(cnt_percentage);
+      colspans.push_back(cnt_percentage);
     }
     if (colspans.size()) {
-      fputs("<tr>", fp);
-      while (!colspans.empty()) {
-        int c = colspans.front();
-        fprintf(fp, "<td " COLSPAN(%d) ">" CENTER("out of %'d records"),
-                    c, tot);
-        colspans.pop();
+      html_put(fp, "<tr>");
+      for (int c : colspans) {
+        HTML_RENDER(fp, "<td " COLSPAN(%s) ">" CENTER("out of %s records"),
+                    c, html_grouped{tot});
       }
-      fputs("</tr>\n<tr>", fp);
-      while (!percentages.empty()) {
-        double p = percentages.front();
+      html_put(fp, "</tr>\n<tr>");
+      for (double p : percentages) {
         if (p == not_an_number) {
-          fputs(TABLECELL(CENTER("--")), fp);
+          html_put(fp, TABLECELL(CENTER("--")));
         } else {
-          fprintf(fp, TABLECELL(CENTER("%.2lf\%")), p);
+          HTML_RENDER(fp, TABLECELL(CENTER("%s%")), html_fixed{p, 2, false});
         }
-        percentages.pop();
       }
-      fputs("</tr>\n", fp);
+      html_put(fp, "</tr>\n");
     }
   }
+  // In the order of the definitions of problems, as the TL;DR always was
+  std::sort(problem_cnt.begin(), problem_cnt.end());
   bool has_named_problem = problem_cnt.size();
-  if (has_named_problem || (stmt == info->latest_problem_stmt && tot)) {
+  if (has_named_problem || (stmt == stmts.latest_problem && tot)) {
     auto title_str = std::string(title);
     {
     char &title_lead = title_str[0];
@@ -458,15 +577,14 @@ void run_analysis_stmt(
       title_lead = title_lead - 'A' + 'a';
     }
     }
-    std::stringstream out;
-    out << "<li>" << (has_named_problem ? "Within" : "Found") << " " << tot
-        << " " << (has_named_problem ? "record" : "")
-        << (has_named_problem && tot > 1 ? "s" : "")
-        << (has_named_problem ? " in " : "")
-        << "<a href=\"#" << info_machine_name_str << "_" << title_machine_name
-        << "\" " << (highlight ? CSS("color: revert") : "") << ">"
-        << "<b>" << title_str << "</b></a>"
-        << (has_named_problem ? "<ul>" : "</li>\n");
+    HTML_RENDER(tldr, "<li>%s %s %s%s%s<a href=\"#%s_%s\" %s><b>%s</b></a>%s",
+                has_named_problem ? "Within" : "Found", tot,
+                has_named_problem ? "record" : "",
+                has_named_problem && tot > 1 ? "s" : "",
+                has_named_problem ? " in " : "",
+                info_machine_name, title_machine_name,
+                highlight ? CSS("color: revert") : "", title_str,
+                has_named_problem ? "<ul>" : "</li>\n");
     for (const auto &[problem, cnt] : problem_cnt) {
       const char *solution_str = NULL;
       switch (problem->solution_type) {
@@ -487,24 +605,21 @@ void run_analysis_stmt(
           solution_str = "requesting a consultation session if needed.";
           break;
       }
-      out << "<li>" << cnt << " entr" << (cnt == 1 ? "y has" : "ies have")
-          << " problem <a href=\"#"
-          << info_machine_name_str << "_" << problem->sql_name << "\">"
-          << "<b " << "style=\"color: #"
-          << std::hex << std::setw(8) << std::setfill('0')
-          << ANLAYZE_COMPOSITE_COLOR_FOREGROUND(problem->severity)
-          << std::dec << std::setw(0) << std::setfill(' ')
-          << "\">" << problem->printed_name << "</b></a>\n";
+      HTML_RENDER(tldr,
+                  "<li>%s entr%s problem <a href=\"#%s_%s\">"
+                  "<b class=\"%s\">%s</b></a>\n",
+                  cnt, cnt == 1 ? "y has" : "ies have", info_machine_name,
+                  problem->sql_name, severity_class(problem->severity),
+                  problem->printed_name);
       if (solution_str) {
-        out << " and could be solved by " << solution_str;
+        HTML_RENDER(tldr, " and could be solved by %s", solution_str);
       } else if (problem->solution_type != ANALYZE_SOLUTION_TYPE_OTHER) {
         fputs("warning: unknown solution type.\n", stderr);
       }
     }
     if (has_named_problem) {
-      out << "</ul></li>";
+      html_put(tldr, "</ul></li>");
     }
-    tldr += out.str();
   }
   if (first_run) {
     fputs("</table>\n", fp);
@@ -515,25 +630,32 @@ void run_analysis_stmt(
   }
 }
 
+// Every other analysis ends a row of the table of contents, newline is of
+// the letter
 static inline
 bool do_analyze(
-  analysis_info_t *info, std::string &tldr, FILE *fp, FILE *header_fp) {
+  sqlite3_stmt *insert_problem_listing_stmt, const analysis_info_t *info,
+  const std::string &machine_name, const analysis_stmts_t &stmts,
+  std::string &tldr, bool &newline, FILE *fp, FILE *header_fp,
+  report_letter_t &letter) {
   bool toc_added = 0;
-  static bool newline = 0;
   const auto tldr_len_old = tldr.length();
-  std::stringstream out;
-  out << "<li>For analysis <a href=\"#" << get_machine_name(info->name)
-      << "\"><b>" << info->name << "</b></a><ul>";
-  tldr += out.str();
+  HTML_RENDER(tldr, "<li>For analysis <a href=\"#%s\"><b>%s</b></a><ul>",
+              machine_name, info->name);
   const auto tldr_len = tldr.length();
   #define ANALYZE(STMT, TITLE, HIGHLIGHT) \
-    run_analysis_stmt( \
-      STMT, info, TITLE, tldr, toc_added, !newline, HIGHLIGHT, fp, header_fp)
-  ANALYZE(info->latest_problem_stmt, "Latest concerning submissions", 1);
-  ANALYZE(info->latest_analysis_stmt,
+    do { \
+      static const std::string title_machine_name = get_machine_name(TITLE); \
+      run_analysis_stmt( \
+        STMT, insert_problem_listing_stmt, info, machine_name, stmts, TITLE, \
+        title_machine_name, tldr, toc_added, !newline, HIGHLIGHT, fp, \
+        header_fp, letter); \
+    } while (0)
+  ANALYZE(stmts.latest_problem, "Latest concerning submissions", 1);
+  ANALYZE(stmts.latest_analysis,
           "All latest submissions",
-          !info->latest_problem_stmt);
-  ANALYZE(info->history_analysis_stmt, "Across submission history", 0);
+          !stmts.latest_problem);
+  ANALYZE(stmts.history_analysis, "Across submission history", 0);
   #undef ANALYZE
   if (toc_added) {
     fputs("</ul></td>", header_fp);
@@ -550,8 +672,286 @@ bool do_analyze(
   return toc_added;
 }
 
+// Of users[idx], on the reader of the worker in the calling thread
+static void analyze_user(analysis_worker_t &worker, size_t idx) {
+  const auto &user_str = users[idx];
+  auto &result = user_results[idx];
+  // Added to the archive in the order opened
+  report_letter_t letter;
+  const auto analyze_fopen = [&letter](std::string name) {
+    auto fp = letter.open(name);
+    if (!fp) {
+      exit(1);
+    }
+    return fp;
+  };
+  auto user = user_str.c_str();
+  {
+  size_t i = 0;
+  for (auto cur = analysis_list; auto info = *cur; cur++, i++) {
+    if (i >= worker.analysis_stmts.size()) {
+      worker.analysis_stmts.emplace_back();
+    }
+    auto &stmts = worker.analysis_stmts[i];
+    #define SETUP(NAME) \
+      if (info->NAME##_sql \
+          && !(setup_stmt(stmts.NAME, info->NAME##_sql, #NAME) \
+               && bind_analysis_params(stmts.NAME, user))) { \
+        exit(1); \
+      }
+    SETUP(latest_analysis);
+    SETUP(latest_problem);
+    SETUP(history_analysis);
+    #undef SETUP
+  }
+  }
+  if (!setup_stmt(worker.insert_problem_listing_stmt,
+                  ANALYZE_INSERT_PROBLEM_LISTING_SQL,
+                  "(insert_problem_listing)")
+      || !bind_analysis_params(worker.insert_problem_listing_stmt, user)) {
+    exit(1);
+  }
+  bool has_analysis = 0;
+  std::string mail_path = std::string(user) + std::string(".mail");
+  auto fp = analyze_fopen(mail_path + std::string(".header"));
+  if (analyze_letter_reply_address) {
+    fprintf(fp, "Reply-To: %s\n", analyze_letter_reply_address);
+  }
+  fprintf(fp, "To: %s@%s\n", user, analyze_letter_domain);
+  {
+    const char **cur = analyze_mail_cc;
+    while (auto cc = *cur) {
+      fprintf(fp, "Cc: %s\n", cc);
+      cur++;
+    }
+  }
+  fprintf(fp,
+          "Subject: %s\n"
+          "Content-Type: text/html; charset=UTF-8\n",
+          analyze_letter_subject);
+  // Separate message header and mail header
+  fputs("\n", fp);
+  bool has_usage = summary_letter_usage[0];
+  std::string tldr = "";
+  fprintf(fp, "<head>%s%s</head><body>", analyze_letter_stylesheet,
+          severity_stylesheet().c_str());
+  letter.mark(fp, "greeting", "Greeting", true);
+  fprintf(fp, "%s\n", analyze_letter_header);
+  letter.mark(fp, "toc", "Table of Contents", false);
+  fprintf(fp,
+          HEADER_TEXT("toc", "Table of Contents") "\n<table>\n"
+          WRAPTAG(tr,
+            TABLECELL(ANCHOR_LINK("tldr", CENTER(BOLD("TL; DR"))),
+                      COLSPAN(2)))
+          WRAPTAG(tr,
+          "%s"
+          TABLECELL(ANCHOR_LINK("news", CENTER(BOLD("News"))), "%s"))
+          "\n",
+          has_usage ?
+            TABLECELL(
+              ANCHOR_LINK("usage", CENTER(BOLD("Usage Instructions")))
+            ) : "",
+          has_usage ? "" : COLSPAN(2));
+  auto header_fp = fp;
+  std::string analysis_id =
+    std::to_string(offset_start) + std::string(":") + std::string(user);
+  fp = analyze_fopen(mail_path);
+  letter.mark(fp, "news", "NEWS", true);
+  fprintf(fp,
+          HEADER_TEXT("news", "NEWS") "\n<table><td>%s</td></table>",
+          analyze_news);
+  {
+    bool newline = 0;
+    size_t i = 0;
+    for (auto cur = analysis_list; auto info = *cur; cur++, i++) {
+      has_analysis |= do_analyze(worker.insert_problem_listing_stmt, info,
+                                 analysis_machine_names[i],
+                                 worker.analysis_stmts[i], tldr, newline, fp,
+                                 header_fp, letter);
+    }
+  }
+  letter.mark(fp, "footer", "Footer", true);
+  fprintf(fp, ANCHORED_TAG(p, "footer", "%s")
+              WRAPTAG(sub,
+                      WRAPTAG(code, "Analysis ID: %s")
+                      "<br>"
+                      ANCHOR_LINK("toc", "Top")),
+              analyze_letter_footer, analysis_id.c_str());
+  letter.end(fp);
+  fputs("</body>", fp);
+  letter.close(fp);
+  fp = header_fp;
+  fputs(WRAPTAG(tr,
+          TABLECELL(
+            ANCHOR_LINK("footer", CENTER(BOLD("Ending"))), COLSPAN(2))
+        )
+        "</table>\n",
+        fp);
+
+  letter.mark(fp, "tldr", "TL; DR", false);
+  fputs(HEADER_TEXT("tldr", "TL; DR"), fp);
+  if (tldr.length()) {
+    fprintf(fp,
+            WRAPTAG(table,
+              TABLECELL(
+                PARAGRAPH("All " BOLD("Bold")
+                          " texts in this section are clickable!")
+                WRAPTAG(ul, "%s")
+                PARAGRAPH("Check out the instructions below for the best way"
+                          " of reading this summary letter."))),
+            tldr.c_str());
+  } else {
+    fputs(PARAGRAPH(
+              "Nice! No problem identified and please check out the data"
+              " to have a better comprehension of your job characteristics."
+              " Feel free to send us any problem identified by yourself and"
+              " it would be truly helpful for all cluster users."),
+            fp);
+  }
+
+  if (has_usage) {
+    letter.mark(fp, "usage", "Usage Instructions", true);
+    fputs(HEADER_TEXT("usage", "Usage Instructions"), fp);
+    bool is_list = summary_letter_usage[1];
+    fprintf(fp, "<table><td>%s", is_list ? "<ul>" : "");
+    for (auto cur = summary_letter_usage; *cur; cur++) {
+      fprintf(fp, LISTITEM(PARAGRAPH("%s"))"\n", *cur);
+    }
+    if (analyze_letter_feedback_link) {
+      std::string analysis_id_param = "";
+      if (analyze_letter_feedback_link_analysis_id_var) {
+        analysis_id_param
+          = std::string(strchr(analyze_letter_feedback_link, '?') ? "&" : "?")
+            + std::string(analyze_letter_feedback_link_analysis_id_var)
+            + std::string("=")
+            + analysis_id;
+      }
+      fprintf(fp,
+              LISTITEM(PARAGRAPH(
+                "Make sure to complete <a href=\"%s%s\"> the feedback"
+                " form</a> for this summary letter to be continuously"
+                " improved and bring you more valuable information!")),
+              analyze_letter_feedback_link,
+              analysis_id_param.c_str());
+    }
+    fprintf(fp, "%s</td></table>", is_list ? "</ul>" : "");
+  }
+  letter.close(fp);
+  if (!has_analysis) {
+    letter.close(analyze_fopen(mail_path + std::string(".empty")));
+  }
+  for (const auto &file : letter.files) {
+    result.archive.add_file(file.name, std::string(file.buf, file.len));
+  }
+  if (!result.archive.compress()) {
+    exit(1);
+  }
+  if (has_analysis) {
+    auto &dump_json_stmt = worker.dump_json_stmt;
+    if (setup_stmt(
+      dump_json_stmt, ANALYZE_DUMP_DATA_TO_JSON_SQL, "(dump_json)")) {
+      SQLITE3_BIND_START
+        NAMED_BIND_TEXT(dump_json_stmt, ":user", user);
+        if (BIND_FAILED) {
+          cleanup_all_stmts();
+          return;
+        }
+      SQLITE3_BIND_END
+      if (step_and_verify(dump_json_stmt, 1, "(dump_json)")) {
+        SQLITE3_FETCH_COLUMNS_START("data")
+        SQLITE3_FETCH_COLUMNS_LOOP_HEADER(i, dump_json_stmt)
+          if (i > 0) {
+            break;
+          }
+          result.json = (const char *)SQLITE3_FETCH_STR();
+        SQLITE3_FETCH_COLUMNS_END
+      }
+    }
+    // The report shows the same letter to everyone allowed to see it
+    result.sections = letter.sections(
+      analysis_id, std::to_string(offset_start) + std::string(":web"));
+    for (auto &section : result.sections) {
+      if (section.machine_name == "greeting") {
+        section.html.insert(0, "<a name=\"greeting\"></a>");
+      }
+    }
+    report_add_shard(result.shard, user_str, result.json, result.sections);
+    if (!result.shard.compress()) {
+      exit(1);
+    }
+  }
+  cleanup_all_stmts();
+}
+
+// Of the statements of sqls, prepared into stmts at the first round
+static bool create_tables(std::vector<sqlite3_stmt *> &stmts,
+                          const char **sqls) {
+  #define OP "(analyze_create_table)"
+  for (size_t i = 0; sqls[i]; i++) {
+    if (i >= stmts.size()) {
+      stmts.push_back(NULL);
+    }
+    auto &stmt = stmts[i];
+    if (!setup_stmt(stmt, sqls[i], OP)
+        || !bind_analysis_params(stmt, NULL)) {
+      return false;
+    }
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      SQLITE3_PERROR("step" OP);
+      return false;
+    }
+  }
+  return true;
+  #undef OP
+}
+
+static void *analysis_worker_loop(void *arg) {
+  auto &worker = *(analysis_worker_t *)arg;
+  if (worker.user_indices.empty()) {
+    return NULL;
+  }
+  sqlite_conn_scope_t reader_scope(worker.reader);
+  auto post_analyze = []() {
+    cleanup_all_stmts();
+    if (!sqlite3_exec_wrap(POST_ANALYZE_SQL, "(post_analyze)")) {
+      exit(1);
+    }
+  };
+  if (!sqlite3_exec_wrap(PRE_ANALYZE_SQL, "(prepare_analyze)")) {
+    exit(1);
+  }
+  #define OP "(analyze_add_user)"
+  for (const auto idx : worker.user_indices) {
+    if (!setup_stmt(worker.add_user_stmt, ANALYZE_ADD_USER_SQL, OP)
+        || !bind_analysis_params(worker.add_user_stmt, users[idx].c_str())
+        || !step_and_verify(worker.add_user_stmt, 0, OP)) {
+      post_analyze();
+      exit(1);
+    }
+  }
+  #undef OP
+  if (!create_tables(worker.create_base_table_stmt,
+                     ANALYZE_CREATE_BASE_TABLES)
+      || !worker.gpucpu_usage.fill()
+      || !create_tables(worker.create_usage_table_stmt,
+                        ANALYZE_CREATE_USAGE_TABLES)) {
+    post_analyze();
+    exit(1);
+  }
+  for (const auto idx : worker.user_indices) {
+    analyze_user(worker, idx);
+  }
+  post_analyze();
+  return NULL;
+}
+
+// One per core online, each holds the tables of a user in memory
+static inline size_t analysis_worker_cnt() {
+  const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return std::clamp<long>(cores, 1, ANALYZE_MAX_WORKER_CNT);
+}
+
 void do_analyze() {
-  sqlite3_stmt *renew_analyzer_stmt = NULL;
   static time_t next_period_update = 0;
   std::string path = "analysis_result";
   auto makedir = [&path](bool allow_existing) {
@@ -562,15 +962,11 @@ void do_analyze() {
     }
   };
   makedir(1);
-  #define OPACTIVEUSER "(analyze_list_active_user)"
-  fill_analysis_list_sql();
-  setup_stmt(list_active_user_stmt, ANALYZE_LIST_ACTIVE_USERS,
-             OPACTIVEUSER);
-  #define OP "(renew_analyzer)"
   sqlite3_begin_transaction();
-  setup_stmt(renew_analyzer_stmt, RENEW_ANALYSIS_OFFSET_SQL, OP);
-  step_renew(renew_analyzer_stmt, OP, offset_start, offset_end);
-  sqlite3_finalize(renew_analyzer_stmt);
+  decltype(RENEW_ANALYSIS_OFFSET_STMT)::row_t offsets;
+  if (RENEW_ANALYSIS_OFFSET_STMT.fetch_one(offsets)) {
+    std::tie(offset_start, offset_end) = offsets;
+  }
 
   bool expired = next_period_update && time(NULL) > next_period_update;
   bool update_period = !next_period_update || expired;
@@ -585,27 +981,48 @@ void do_analyze() {
     next_period_update = time(NULL) + ANALYZE_PERIOD_LENGTH;
   }
 
+  // Read snapshots of their own, the ingest keeps committing meanwhile. The
+  // cache of the results of steps lives as long as the reader
+  if (workers.empty()) {
+    workers.resize(analysis_worker_cnt());
+    for (auto &worker : workers) {
+      if (!(worker.reader = open_sqlite_reader())) {
+        exit(1);
+      }
+      sqlite_conn_scope_t reader_scope(worker.reader);
+      if (!analysis_functions_register()
+          || !sqlite3_exec_wrap(ANALYZE_ATTACH_CACHE_SQL,
+                                "(attach_analysis_cache)")) {
+        exit(1);
+      }
+    }
+  }
+  // Kept across periods, unlike the readers acquired for a while
+  for (auto &worker : workers) {
+    sqlite_conn_scope_t reader_scope(worker.reader);
+    if (!partitions_sync()) {
+      exit(1);
+    }
+  }
+  if (problem_info.empty()) {
+    fill_analysis_list_sql();
+    for (auto cur = analysis_list; auto info = *cur; cur++) {
+      analysis_machine_names.push_back(get_machine_name(info->name));
+      for (auto problem = info->problems; problem->sql_name; problem++) {
+        problem_info[std::string(problem->sql_name)] = problem;
+      }
+    }
+  }
+
   std::string out_tar_final_filename
     = path + std::string("/") + std::to_string(offset_start) + ".tar.gz";
 
-  std::string out_tar_tmp_filename = out_tar_final_filename + ".tmp";
-
-  path += "/working";
-  makedir(1);
-
-  std::vector<std::string> tar_command {
-    "tar", "-czf", out_tar_tmp_filename, "-C", path, "--remove-files"
-  };
-  const auto empty_tar_command_length = tar_command.size();
-  const auto analyze_fopen = [&tar_command](std::string path) {
-    auto fp = fopen(path.c_str(), "w");
-    if (!fp) {
-      perror("open");
-      exit(1);
-    }
-    tar_command.push_back(std::string(basename(path.c_str())));
-    return fp;
-  };
+  users.clear();
+  {
+  #define OPACTIVEUSER "(analyze_list_active_user)"
+  sqlite_conn_scope_t reader_scope(workers[0].reader);
+  setup_stmt(list_active_user_stmt, ANALYZE_LIST_ACTIVE_USERS,
+             OPACTIVEUSER);
   SQLITE3_BIND_START
   BIND_OFFSET(list_active_user_stmt);
   if (BIND_FAILED) {
@@ -613,283 +1030,68 @@ void do_analyze() {
     exit(1);
   }
   SQLITE3_BIND_END
+  #if ENABLE_DEBUGOUT
+  {
+  const char *col = sqlite3_column_name(list_active_user_stmt, 0);
+  if (strcmp(col, "user")) {
+    fprintf(stderr, OPACTIVEUSER ": expecting column 'user', got '%s'", col);
+  }
+  }
+  #endif
   int sqlite_ret;
-  path += "/";
-  std::vector<std::string> users;
   while ((sqlite_ret = sqlite3_step(list_active_user_stmt)) == SQLITE_ROW) {
     users.push_back(
       std::string((const char *)sqlite3_column_text(list_active_user_stmt, 0)));
   }
+  reset_stmt(list_active_user_stmt, OPACTIVEUSER);
   if (!verify_sqlite_ret(sqlite_ret, OPACTIVEUSER)) {
     return;
   }
-  auto json_fp = analyze_fopen(path + std::string("raw.json"));
-  fprintf(json_fp, "{\"started\": %ld, \"updated\": %ld, \"data\":{",
-                   program_start, time(NULL));
-  bool first_json_entry = 0;
-  for (const auto &user_str : users) {
-    auto post_analyze = []() {
-      cleanup_all_stmts();
-      if (!sqlite3_exec_wrap(POST_ANALYZE_SQL, "(post_analyze)")) {
-        exit(1);
-      }
-    };
-    #if ENABLE_DEBUGOUT
-    {
-    const char *col = sqlite3_column_name(list_active_user_stmt, 0);
-    if (strcmp(col, "user")) {
-      fprintf(stderr, OPACTIVEUSER ": expecting column 'user', got '%s'", col);
-    }
-    }
-    #endif
-    auto user = user_str.c_str();
-    if (!sqlite3_exec_wrap(PRE_ANALYZE_SQL, "(prepare_analyze)")) {
+  #undef OPACTIVEUSER
+  }
+
+  user_results.assign(users.size(), user_result_t());
+  for (auto &worker : workers) {
+    worker.user_indices.clear();
+  }
+  const std::hash<std::string> user_hash;
+  for (size_t i = 0; i < users.size(); i++) {
+    workers[user_hash(users[i]) % workers.size()].user_indices.push_back(i);
+  }
+  for (auto &worker : workers) {
+    if (pthread_create(&worker.thread, NULL, analysis_worker_loop, &worker)) {
+      perror("pthread_create");
       exit(1);
     }
-    #undef OP
-    #define OP "(analyze_create_base_table)"
-    auto cur_stmt = ANALYZE_CREATE_BASE_TABLES;
-    for (size_t i = 0; *cur_stmt; i++, cur_stmt++) {
-      if (i <= create_base_table_stmt.size()) {
-        create_base_table_stmt.push_back(NULL);
-      }
-      auto &stmt = create_base_table_stmt[i];
-      setup_stmt(stmt, *cur_stmt, OP);
-      if (i <= 2) {
-        SQLITE3_BIND_START
-        if (i <= 1) {
-          NAMED_BIND_TEXT(stmt, ":user", user);
-        } else if (i == 2) {
-          BIND_OFFSET(stmt);
-        }
-        if (BIND_FAILED) {
-          SQLITE3_PERROR("bind" OP);
-          post_analyze();
-          exit(1);
-        }
-        SQLITE3_BIND_END
-      }
-      if (sqlite3_step(stmt) != SQLITE_DONE) {
-        SQLITE3_PERROR("step" OP);
-        post_analyze();
-        exit(1);
-      }
-    }
-    auto cur = analysis_list;
-    {
-    static bool first = 1;
-    while (auto &info = *cur) {
-      const auto set_problem_info
-        = [&](const analyze_problem_t *info) {
-          while (info->sql_name) {
-            problem_info[std::string(info->sql_name)] = info;
-            info++;
-          }
-        };
-      #define SETUP(NAME) \
-        if (info->NAME##_sql) { \
-          if (first) { \
-            set_problem_info(info->problems); \
-          } \
-          if (!setup_stmt(info->NAME##_stmt, info->NAME##_sql, #NAME)) { \
-            exit(1); \
-          } \
-        }
-      SETUP(latest_analysis);
-      SETUP(latest_problem);
-      SETUP(history_analysis);
-      #undef SETUP
-      cur++;
-    }
-    first = 0;
-    }
-    bool has_analysis = 0;
-    std::string mail_path = path + std::string(user) + std::string(".mail");
-    auto fp = analyze_fopen(mail_path + std::string(".header"));
-    if (analyze_letter_reply_address) {
-      fprintf(fp, "Reply-To: %s\n", analyze_letter_reply_address);
-    }
-    fprintf(fp, "To: %s@%s\n", user, analyze_letter_domain);
-    {
-      const char **cur = analyze_mail_cc;
-      while (auto cc = *cur) {
-        fprintf(fp, "Cc: %s\n", cc);
-        cur++;
-      }
-    }
-    fprintf(fp,
-            "Subject: %s\n"
-            "Content-Type: text/html; charset=UTF-8\n",
-            analyze_letter_subject);
-    // Separate message header and mail header
-    fputs("\n", fp);
-    bool has_usage = summary_letter_usage[0];
-    std::string tldr = "";
-    fprintf(fp, "<head>%s</head><body>", analyze_letter_stylesheet);
-    fprintf(fp,
-            "%s\n" HEADER_TEXT("toc", "Table of Contents") "\n<table>\n"
-            WRAPTAG(tr,
-              TABLECELL(ANCHOR_LINK("tldr", CENTER(BOLD("TL; DR"))),
-                        COLSPAN(2)))
-            WRAPTAG(tr,
-            "%s"
-            TABLECELL(ANCHOR_LINK("news", CENTER(BOLD("News"))), "%s"))
-            "\n",
-            analyze_letter_header,
-            has_usage ?
-              TABLECELL(
-                ANCHOR_LINK("usage", CENTER(BOLD("Usage Instructions")))
-              ) : "",
-            has_usage ? "" : COLSPAN(2));
-    auto header_fp = fp;
-    std::string analysis_id =
-      std::to_string(offset_start) + std::string(":") + std::string(user);
-    fp = analyze_fopen(mail_path);
-    fprintf(fp,
-            HEADER_TEXT("news", "NEWS") "\n<table><td>%s</td></table>",
-            analyze_news);
-    {
-      auto cur = analysis_list;
-      while (auto info = *cur) {
-        has_analysis |= do_analyze(info, tldr, fp, header_fp);
-        cur++;
-      }
-    }
-    fprintf(fp, ANCHORED_TAG(p, "footer", "%s")
-                WRAPTAG(sub,
-                        WRAPTAG(code, "Analysis ID: %s")
-                        "<br>"
-                        ANCHOR_LINK("toc", "Top"))
-                "</body>",
-                analyze_letter_footer, analysis_id.c_str());
-    fclose(fp);
-    fp = header_fp;
-    fputs(WRAPTAG(tr,
-            TABLECELL(
-              ANCHOR_LINK("footer", CENTER(BOLD("Ending"))), COLSPAN(2))
-          )
-          "</table>\n",
-          fp);
+  }
+  // All letters and shards are compressed before the index and the tarball
+  for (auto &worker : workers) {
+    pthread_join(worker.thread, NULL);
+  }
 
-    fputs(HEADER_TEXT("tldr", "TL; DR"), fp);
-    if (tldr.length()) {
-      fprintf(fp,
-              WRAPTAG(table,
-                TABLECELL(
-                  PARAGRAPH("All " BOLD("Bold")
-                            " texts in this section are clickable!")
-                  WRAPTAG(ul, "%s")
-                  PARAGRAPH("Check out the instructions below for the best way"
-                            " of reading this summary letter."))),
-              tldr.c_str());
-    } else {
-      fputs(PARAGRAPH(
-                "Nice! No problem identified and please check out the data"
-                " to have a better comprehension of your job characteristics."
-                " Feel free to send us any problem identified by yourself and"
-                " it would be truly helpful for all cluster users."),
-              fp);
-    }
-
-    if (has_usage) {
-      fputs(HEADER_TEXT("usage", "Usage Instructions"), fp);
-      bool is_list = summary_letter_usage[1];
-      fprintf(fp, "<table><td>%s", is_list ? "<ul>" : "");
-      for (auto cur = summary_letter_usage; *cur; cur++) {
-        fprintf(fp, LISTITEM(PARAGRAPH("%s"))"\n", *cur);
-      }
-      if (analyze_letter_feedback_link) {
-        std::string analysis_id_param = "";
-        if (analyze_letter_feedback_link_analysis_id_var) {
-          analysis_id_param
-            = std::string(strchr(analyze_letter_feedback_link, '?') ? "&" : "?")
-              + std::string(analyze_letter_feedback_link_analysis_id_var)
-              + std::string("=")
-              + analysis_id;
-        }
-        fprintf(fp,
-                LISTITEM(PARAGRAPH(
-                  "Make sure to complete <a href=\"%s%s\"> the feedback"
-                  " form</a> for this summary letter to be continuously"
-                  " improved and bring you more valuable information!")),
-                analyze_letter_feedback_link,
-                analysis_id_param.c_str());
-      }
-      fprintf(fp, "%s</td></table>", is_list ? "</ul>" : "");
-    }
-    fclose(fp);
-    if (!has_analysis) {
-      fclose(analyze_fopen(mail_path + std::string(".empty")));
-    } else {
-      sqlite3_stmt *dump_json_stmt = NULL;
-      if (setup_stmt(
-        dump_json_stmt, ANALYZE_DUMP_DATA_TO_JSON_SQL, "(dump_json)")) {
-        SQLITE3_BIND_START
-          NAMED_BIND_TEXT(dump_json_stmt, ":user", user);
-          if (BIND_FAILED) {
-            post_analyze();
-            continue;
-          }
-        SQLITE3_BIND_END
-        if (step_and_verify(dump_json_stmt, 1, "(dump_json)")) {
-          SQLITE3_FETCH_COLUMNS_START("data")
-          SQLITE3_FETCH_COLUMNS_LOOP_HEADER(i, dump_json_stmt)
-            if (i > 0) {
-              break;
-            }
-            if (first_json_entry) {
-              fputc(',', json_fp);
-            } else {
-              first_json_entry = 1;
-            }
-            fputs((const char *)SQLITE3_FETCH_STR(), json_fp);
-          SQLITE3_FETCH_COLUMNS_END
-        }
-        sqlite3_finalize(dump_json_stmt);
-      }
+  report_index_t index;
+  std::vector<const archive_part_t *> parts(1);
+  for (size_t i = 0; i < users.size(); i++) {
+    const auto &result = user_results[i];
+    if (!result.sections.empty()) {
+      index.add_user(users[i], result.sections);
+      parts.push_back(&result.shard);
     }
-    post_analyze();
   }
-  fputs("}}", json_fp);
-  fclose(json_fp);
-
-  const auto tar_command_length = tar_command.size();
-  if (tar_command_length > empty_tar_command_length) {
-    std::vector<char *> tar_exec_arglist(tar_command_length + 1);
-    for (int i = 0; i < tar_command_length; i++) {
-      tar_exec_arglist[i] = (char *) tar_command[i].c_str();
-    }
-    tar_exec_arglist[tar_command_length] = NULL;
-    const auto cpid = fork();
-    if (cpid == -1) {
-      perror("fork");
-      return;
-    } else if (cpid > 0) {
-      int wstatus;
-      do {
-        if (waitpid(cpid, &wstatus, WUNTRACED | WCONTINUED) == -1) {
-          perror("waitpid");
-          return;
-        }
-        if (WIFEXITED(wstatus) && !WEXITSTATUS(wstatus)) {
-          if (rename(
-                out_tar_tmp_filename.c_str(), out_tar_final_filename.c_str())) {
-            perror("rename");
-            return;
-          }
-          fclose(fopen((out_tar_final_filename + std::string(".renew")).c_str(),
-                       "w"));
-        }
-      } while (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus));
-    } else {
-      if (execvp(tar_exec_arglist[0], tar_exec_arglist.data()) == -1) {
-        perror("execvp");
-        exit(1);
-      }
-    }
+  for (const auto &result : user_results) {
+    parts.push_back(&result.archive);
+  }
+  // Ahead of the shards and letters, compressed on the cores the workers left
+  archive_part_t head;
+  index.add_files(head, program_start, time(NULL));
+  if (!head.compress(workers.size())) {
+    return;
+  }
+  parts[0] = &head;
+  if (archive_write(out_tar_final_filename, parts)) {
+    fclose(fopen((out_tar_final_filename + std::string(".renew")).c_str(),
+                 "w"));
   }
-  #undef OP
-  #undef OPACTIVEUSER
 }
 
 #undef PARAGRAPH
@@ -901,3 +1103,5 @@ void do_analyze() {
 #undef STYLE
 #undef SUBHEADER_TEXT
 #undef COLSPAN
+#undef SEVERITY_BACKGROUND
+#undef SEVERITY_FOREGROUND
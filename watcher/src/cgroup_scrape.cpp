@@ -0,0 +1,347 @@
+#include "cgroup_scrape.h"
+
+cgroup_version_t cgroup_scrape_version;
+
+// v2: directory with job_<jobid>/step_<stepid>
+// v1: mount point, controllers are under <mount>/<controller>/slurm
+static std::string cgroup_root;
+// Large enough for cgroup.procs of a step with thousands of processes
+#define CGROUP_READ_BUF_SIZE 65536
+static char buf[CGROUP_READ_BUF_SIZE];
+
+int read_cpuset_cpu_cnt(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  size_t cnt;
+  int val[2] = {0, 0}; bool cur_side = 0; int ncpu = 0;
+  while ((cnt = fread(buf, 1, CGROUP_READ_BUF_SIZE - 1, fp))) {
+    buf[cnt] = '\0';
+    auto cur = buf;
+    while (cur) {
+      auto c = *cur;
+      if (c == '-') {
+        cur_side = !cur_side;
+      } else if (c == ',' || c == '\n' || c == '\0') {
+        if (!cur_side) {
+          val[1] = val[0];
+        }
+        ncpu += val[1] - val[0] + 1;
+        val[0] = val[1] = 0;
+        cur_side = 0;
+        if (c == '\n' || c == '\0') {
+          break;
+        }
+      } else {
+        val[cur_side] = val[cur_side] * 10 + c - '0';
+      }
+      cur++;
+    }
+  }
+  fclose(fp);
+  return ncpu;
+}
+
+bool init_cgroup_scrape() {
+  const char *mode = getenv(SCRAPE_CGROUP_ENV);
+  const char *mount_point = getenv(SLURM_CGROUP_MOUNT_POINT_ENV);
+  if (!mode || !*mode) {
+    return true;
+  }
+  if (!mount_point || !*mount_point) {
+    fputs("error: " SCRAPE_CGROUP_ENV " requires "
+          SLURM_CGROUP_MOUNT_POINT_ENV "\n", stderr);
+    return false;
+  }
+  const std::string mount(mount_point);
+  if (!access((mount + "/cgroup.controllers").c_str(), F_OK)) {
+    cgroup_scrape_version = CGROUP_V2;
+    cgroup_root
+      = *mode == '/' ? std::string(mode) : mount + CGROUP_V2_SLURM_ROOT;
+  } else {
+    cgroup_scrape_version = CGROUP_V1;
+    cgroup_root = mount;
+  }
+  DEBUGOUT(
+    fprintf(stderr, "cgroup v%d scraping at %s\n",
+            cgroup_scrape_version == CGROUP_V2 ? 2 : 1, cgroup_root.c_str());
+  )
+  return true;
+}
+
+static inline bool parse_stepid(const char *name, uint32_t &step_id) {
+  int consumed = 0;
+  if (sscanf(name, "%u%n", &step_id, &consumed) == 1 && !name[consumed]) {
+    return true;
+  }
+  #include "def/slurm_stepid.inc"
+  for (auto *cur = slurm_stepid_mapping; cur->name; cur++) {
+    if (!strcmp(name, cur->name)) {
+      step_id = cur->stepid;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Value of "<key> <value>" line, as in cpu.stat, cpuacct.stat and memory.stat
+static inline bool find_keyed_value(const char *str, const char *key,
+                                    size_t &val) {
+  const size_t len = strlen(key);
+  for (const char *cur = str; cur && *cur; cur = strchr(cur, '\n')) {
+    if (*cur == '\n') {
+      cur++;
+    }
+    if (!strncmp(cur, key, len) && cur[len] == ' ') {
+      return sscanf(cur + len, "%zu", &val) == 1;
+    }
+  }
+  return false;
+}
+
+static inline ssize_t read_at(int dir_fd, const char *name) {
+  return read_proc_file(dir_fd, name, buf, CGROUP_READ_BUF_SIZE);
+}
+
+// Pids of the cgroup and all its descendants, as processes may only live in
+// leaves under v2 and slurm creates task_<id> children for them
+static void collect_cgroup_pids(int dir_fd, std::vector<pid_t> &pids) {
+  if (read_at(dir_fd, "cgroup.procs") > 0) {
+    const char *cur = buf;
+    int consumed;
+    pid_t pid;
+    while (sscanf(cur, "%d%n", &pid, &consumed) == 1) {
+      pids.push_back(pid);
+      cur += consumed;
+    }
+  }
+  DIR *dir = fdopendir(dup(dir_fd));
+  if (!dir) {
+    return;
+  }
+  while (auto entry = readdir(dir)) {
+    if (entry->d_type != DT_DIR || *entry->d_name == '.') {
+      continue;
+    }
+    int child_fd
+      = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (child_fd >= 0) {
+      collect_cgroup_pids(child_fd, pids);
+      close(child_fd);
+    }
+  }
+  closedir(dir);
+}
+
+static void fill_step_result(int step_fd, int controller_fd[],
+                             cgroup_step_result_t &step_result) {
+  static const size_t clk_tck = sysconf(_SC_CLK_TCK);
+  auto &stat = step_result.stat;
+  size_t val;
+  stat.rchar = stat.wchar = PRIVILEGED_STAT_NULL;
+  if (cgroup_scrape_version == CGROUP_V2) {
+    if (read_at(step_fd, "cpu.stat") > 0) {
+      if (find_keyed_value(buf, "user_usec", val)) {
+        stat.utime = val * clk_tck / 1000000;
+      }
+      if (find_keyed_value(buf, "system_usec", val)) {
+        stat.stime = val * clk_tck / 1000000;
+      }
+    }
+    // Anonymous memory is what rss of the processes would add up to,
+    // memory.current would include page cache
+    if (read_at(step_fd, "memory.stat") > 0) {
+      find_keyed_value(buf, "anon", stat.res);
+      if (find_keyed_value(buf, "pgfault", stat.minor_pagefault)
+          && find_keyed_value(buf, "pgmajfault", val)) {
+        stat.minor_pagefault -= val;
+      }
+    }
+    if (read_at(step_fd, "memory.peak") > 0) {
+      stat.peak_mem_usage = strtoull(buf, NULL, 10);
+    }
+    if (read_at(step_fd, "io.stat") > 0) {
+      stat.rchar = stat.wchar = 0;
+      for (const char *cur = buf; (cur = strstr(cur, "bytes=")); cur++) {
+        if (cur - buf >= 1 && (cur[-1] == 'r' || cur[-1] == 'w')) {
+          (cur[-1] == 'r' ? stat.rchar : stat.wchar)
+            += strtoull(cur + strlen("bytes="), NULL, 10);
+        }
+      }
+    }
+    collect_cgroup_pids(step_fd, step_result.pids);
+  } else {
+    // controller_fd: cpuacct, memory, blkio, any could be missing
+    if (controller_fd[0] >= 0
+        && read_at(controller_fd[0], "cpuacct.stat") > 0) {
+      if (find_keyed_value(buf, "user", val)) {
+        stat.utime = val;
+      }
+      if (find_keyed_value(buf, "system", val)) {
+        stat.stime = val;
+      }
+    }
+    if (controller_fd[1] >= 0) {
+      if (read_at(controller_fd[1], "memory.stat") > 0) {
+        find_keyed_value(buf, "total_rss", stat.res);
+        if (find_keyed_value(buf, "total_pgfault", stat.minor_pagefault)
+            && find_keyed_value(buf, "total_pgmajfault", val)) {
+          stat.minor_pagefault -= val;
+        }
+      }
+      if (read_at(controller_fd[1], "memory.max_usage_in_bytes") > 0) {
+        stat.peak_mem_usage = strtoull(buf, NULL, 10);
+      }
+    }
+    if (controller_fd[2] >= 0
+        && read_at(controller_fd[2],
+                   "blkio.throttle.io_service_bytes_recursive") > 0) {
+      stat.rchar = stat.wchar = 0;
+      char op[8];
+      int consumed;
+      for (const char *cur = buf;
+           sscanf(cur, "%*s %7s %zu%n", op, &val, &consumed) == 2;
+           cur += consumed) {
+        if (!strcmp(op, "Read")) {
+          stat.rchar += val;
+        } else if (!strcmp(op, "Write")) {
+          stat.wchar += val;
+        }
+      }
+    }
+    for (int i = 0; i < 3 && step_result.pids.empty(); i++) {
+      if (controller_fd[i] >= 0) {
+        collect_cgroup_pids(controller_fd[i], step_result.pids);
+      }
+    }
+  }
+  for (const auto &pid : step_result.pids) {
+    ssize_t cnt = read_proc_pid_file(pid, "comm", buf, CGROUP_READ_BUF_SIZE);
+    if (cnt > 0) {
+      if (buf[cnt - 1] == '\n') {
+        buf[cnt - 1] = '\0';
+      }
+      step_result.apps.emplace(buf);
+    }
+  }
+}
+
+// Calls fn(relative path, job id) for every job_<jobid> under root_fd. Under
+// v1 the jobs are grouped in uid_<uid> first.
+template<typename F>
+static void foreach_job_cgroup(int root_fd, const std::string &prefix, F fn) {
+  DIR *dir = fdopendir(dup(root_fd));
+  if (!dir) {
+    return;
+  }
+  while (auto entry = readdir(dir)) {
+    const char *name = entry->d_name;
+    uint32_t job_id;
+    if (entry->d_type != DT_DIR) {
+      continue;
+    }
+    if (sscanf(name, "job_%u", &job_id) == 1) {
+      fn(prefix + name, job_id);
+    } else if (!strncmp(name, "uid_", 4)) {
+      int uid_fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (uid_fd >= 0) {
+        foreach_job_cgroup(uid_fd, prefix + name + "/", fn);
+        close(uid_fd);
+      }
+    }
+  }
+  closedir(dir);
+}
+
+void scrape_cgroups(cgroup_step_results_t &results,
+                    cgroup_cpu_available_map_t &cpu_available) {
+  if (cgroup_scrape_version == CGROUP_NONE) {
+    return;
+  }
+  const bool is_v2 = cgroup_scrape_version == CGROUP_V2;
+  // v2 has all controllers in one hierarchy
+  static const char *v1_controllers[] = { "cpuacct", "memory", "blkio" };
+  int v1_root_fd[3] = {-1, -1, -1};
+  int root_fd = -1;
+  if (is_v2) {
+    root_fd = open(cgroup_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    for (int i = 0; i < 3; i++) {
+      v1_root_fd[i] = open(
+        (cgroup_root + "/" + v1_controllers[i] + CGROUP_V1_SLURM_ROOT).c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (root_fd < 0 && v1_root_fd[i] >= 0) {
+        root_fd = dup(v1_root_fd[i]);
+      }
+    }
+  }
+  if (root_fd < 0) {
+    DEBUGOUT(perror("open(cgroup)"));
+    return;
+  }
+  foreach_job_cgroup(root_fd, "", [&](const std::string &job_path,
+                                      uint32_t job_id) {
+    int job_fd
+      = openat(root_fd, job_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job_fd < 0) {
+      return;
+    }
+    DIR *dir = fdopendir(dup(job_fd));
+    if (!dir) {
+      close(job_fd);
+      return;
+    }
+    while (auto entry = readdir(dir)) {
+      slurm_step_id_t step;
+      step.job_id = job_id;
+      if (entry->d_type != DT_DIR || strncmp(entry->d_name, "step_", 5)
+          || !parse_stepid(entry->d_name + 5, step.step_id)) {
+        continue;
+      }
+      int step_fd
+        = openat(job_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (step_fd < 0) {
+        continue;
+      }
+      const std::string step_path = job_path + "/" + entry->d_name;
+      int controller_fd[3] = {-1, -1, -1};
+      for (int i = 0; !is_v2 && i < 3; i++) {
+        if (v1_root_fd[i] >= 0) {
+          controller_fd[i] = openat(v1_root_fd[i], step_path.c_str(),
+                                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+      }
+      results.emplace_back();
+      auto &step_result = results.back();
+      memset(&step_result.stat, 0, sizeof(step_result.stat));
+      step_result.stat.step = step;
+      fill_step_result(step_fd, controller_fd, step_result);
+      auto jobstep_pair = std::make_pair(step.job_id, step.step_id);
+      if (!cpu_available.count(jobstep_pair)) {
+        const std::string cpuset_path = is_v2
+          ? cgroup_root + "/" + step_path + "/cpuset.cpus.effective"
+          : cgroup_root + "/cpuset" CGROUP_V1_SLURM_ROOT "/" + step_path
+            + "/cpuset.effective_cpus";
+        int ncpu = read_cpuset_cpu_cnt(cpuset_path.c_str());
+        if (ncpu > 0) {
+          cpu_available.try_emplace(jobstep_pair, ncpu);
+        }
+      }
+      for (int i = 0; i < 3; i++) {
+        if (controller_fd[i] >= 0) {
+          close(controller_fd[i]);
+        }
+      }
+      close(step_fd);
+    }
+    closedir(dir);
+    close(job_fd);
+  });
+  for (int i = 0; i < 3; i++) {
+    if (v1_root_fd[i] >= 0) {
+      close(v1_root_fd[i]);
+    }
+  }
+  close(root_fd);
+}
@@ -1,6 +1,85 @@
 #include "db_common.h"
+#include "partition.h"
+#include "stmts.h"
 
-static sqlite3_stmt *end_transaction_stmt = NULL;
+// Of the connection of each thread
+static thread_local sqlite3_stmt *end_transaction_stmt = NULL;
+
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_released = PTHREAD_COND_INITIALIZER;
+static std::vector<sqlite3 *> idle_readers;
+static int reader_cnt;
+
+bool open_sqlite_conn() {
+  if (!IS_SQLITE_OK(sqlite3_open(db_path, &SQL_CONN_NAME))) {
+    SQLITE3_PERROR("open");
+    return false;
+  }
+  sqlite3_busy_timeout(SQL_CONN_NAME, SQLITE_BUSY_TIMEOUT_MS);
+  // Readers keep their snapshots while the writer commits
+  if (!sqlite3_exec_wrap(CONFIGURE_WRITER_CONN_SQL, "(configure_conn)")) {
+    return false;
+  }
+  sqlite3_wal_autocheckpoint(SQL_CONN_NAME, SQLITE_WAL_CHECKPOINT_PAGES);
+  return true;
+}
+
+sqlite3 *open_sqlite_reader() {
+  sqlite3 *conn = NULL;
+  if (!IS_SQLITE_OK(sqlite3_open_v2(
+        db_path, &conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL))) {
+    fprintf(stderr, "sqlite3_open_v2(reader): %s\n", sqlite3_errmsg(conn));
+    sqlite3_close(conn);
+    return NULL;
+  }
+  sqlite3_busy_timeout(conn, SQLITE_BUSY_TIMEOUT_MS);
+  return conn;
+}
+
+sqlite3 *acquire_sqlite_reader() {
+  pthread_mutex_lock(&reader_lock);
+  while (idle_readers.empty() && reader_cnt >= SQLITE_READER_POOL_SIZE) {
+    pthread_cond_wait(&reader_released, &reader_lock);
+  }
+  sqlite3 *conn = NULL;
+  if (!idle_readers.empty()) {
+    conn = idle_readers.back();
+    idle_readers.pop_back();
+  } else if ((conn = open_sqlite_reader())) {
+    reader_cnt++;
+  }
+  pthread_mutex_unlock(&reader_lock);
+  if (conn) {
+    sqlite_conn_scope_t conn_scope(conn);
+    if (!partitions_sync()) {
+      release_sqlite_reader(conn);
+      return NULL;
+    }
+  }
+  return conn;
+}
+
+void release_sqlite_reader(sqlite3 *conn) {
+  if (!conn) {
+    return;
+  }
+  pthread_mutex_lock(&reader_lock);
+  idle_readers.push_back(conn);
+  pthread_cond_signal(&reader_released);
+  pthread_mutex_unlock(&reader_lock);
+}
+
+void close_sqlite_readers() {
+  pthread_mutex_lock(&reader_lock);
+  for (auto conn : idle_readers) {
+    if (!IS_SQLITE_OK(sqlite3_close(conn))) {
+      fprintf(stderr, "sqlite3_close(reader): %s\n", sqlite3_errmsg(conn));
+    }
+    reader_cnt--;
+  }
+  idle_readers.clear();
+  pthread_mutex_unlock(&reader_lock);
+}
 
 void finalize_stmt_array(sqlite3_stmt *stmt_to_finalize[]) {
   auto cur = stmt_to_finalize;
@@ -18,6 +97,7 @@ void db_common_finalize() {
     FINALIZE_END_ADDR
   };
   finalize_stmt_array(stmt_to_finalize);
+  stmt_registry_finalize();
 }
 
 bool step_and_verify(sqlite3_stmt *stmt, bool expect_rows, const char *op) {
@@ -47,70 +127,30 @@ bool verify_sqlite_ret(int ret, const char *op) {
   return 1;
 }
 
-bool step_renew(sqlite3_stmt *stmt, const char *op, int &start, int &end) {
-  if (!step_and_verify(stmt, true, op)) {
-    return false;
-  }
-  SQLITE3_FETCH_COLUMNS_START("start", "end");
-  SQLITE3_FETCH_COLUMNS_LOOP_HEADER(i, stmt)
-    if (!IS_EXPECTED_COLUMN) {
-      PRINT_COLUMN_MISMATCH_MSG(op);
+bool renew_watcher(bool with_id, worker_info_t *worker) {
+  const auto &jobstep = worker->jobstep_info;
+  if (with_id) {
+    decltype(REGISTER_WATCHER_STMT)::row_t row;
+    if (!REGISTER_WATCHER_STMT.fetch_one(
+          row, worker->pid, worker->hostname, jobstep.job_id,
+          jobstep.step_id, worker->is_privileged)) {
       return false;
     }
-    switch(i) {
-      case 0: start = SQLITE3_FETCH(int); break;
-      case 1: end = SQLITE3_FETCH(int); break;
-      default: fprintf(stderr, "%s: ", op); PRINT_UNEXPECTED_COLUMN_MSG("");
-    }
-  SQLITE3_FETCH_COLUMNS_END;
-  return true;
-}
-
-bool renew_watcher(const char *query, worker_info_t *worker) {
-  #define OP "(renew_watcher)"
-  sqlite3_stmt *insert_watcher = NULL;
-  if (!IS_SQLITE_OK(
-      PREPARE_STMT(query, &insert_watcher, 0)
-    )) {
-    SQLITE3_PERROR("prepare" OP);
-    return false;
-  }
-  SQLITE3_BIND_START;
-  NAMED_BIND_INT(insert_watcher, ":pid", worker->pid);
-  NAMED_BIND_TEXT(insert_watcher, ":target_node", worker->hostname);
-  NAMED_BIND_INT(insert_watcher, ":jobid", worker->jobstep_info.job_id);
-  NAMED_BIND_INT(insert_watcher, ":stepid", worker->jobstep_info.step_id);
-  NAMED_BIND_INT(insert_watcher, ":privileged", worker->is_privileged);
-  if (BIND_FAILED) {
-    return false;
-  }
-  SQLITE3_BIND_END;
-  if (!step_and_verify(insert_watcher, true, OP)) {
-    return false;
-  }
-  SQLITE3_FETCH_COLUMNS_START("start", "end", "id");
-  SQLITE3_FETCH_COLUMNS_LOOP_HEADER(i, insert_watcher)
-    if (!IS_EXPECTED_COLUMN) {
-      PRINT_COLUMN_MISMATCH_MSG(OP);
+    std::tie(time_range_start, time_range_end, watcher_id) = row;
+  } else {
+    decltype(UPSERT_WATCHER_STMT)::row_t row;
+    if (!UPSERT_WATCHER_STMT.fetch_one(
+          row, worker->pid, worker->hostname, jobstep.job_id,
+          jobstep.step_id, worker->is_privileged)) {
       return false;
     }
-    switch(i) {
-      case 0: time_range_start = SQLITE3_FETCH(int); break;
-      case 1: time_range_end = SQLITE3_FETCH(int); break;
-      case 2: watcher_id = SQLITE3_FETCH(int64); break;
-      default: PRINT_UNEXPECTED_COLUMN_MSG(OP);
-    }
-  SQLITE3_FETCH_COLUMNS_END;
+    std::tie(time_range_start, time_range_end) = row;
+  }
   DEBUGOUT(
     fprintf(stderr,
             "watcher_id=%d, time_range_start=%ld, time_range_end=%ld\n",
             watcher_id, time_range_start, time_range_end));
-  if (!IS_SQLITE_OK(sqlite3_finalize(insert_watcher))) {
-    SQLITE3_PERROR("finalize" OP);
-    return false;
-  }
   return true;
-  #undef OP
 }
 
 bool sqlite3_exec_wrap(const char *sql, const char *op) {
@@ -127,6 +167,21 @@ void sqlite3_begin_transaction() {
   sqlite3_exec(SQL_CONN_NAME, "BEGIN TRANSACTION;", NULL, NULL, NULL);
 }
 
+bool sqlite3_begin_immediate_transaction() {
+  // Writes go to the partition of the period the write lock is taken in
+  while (partitions_sync()) {
+    if (!sqlite3_exec_wrap("BEGIN IMMEDIATE TRANSACTION;",
+                           "(begin_immediate)")) {
+      return false;
+    }
+    if (partitions_synced()) {
+      return partitions_seed();
+    }
+    sqlite3_exec(SQL_CONN_NAME, "ROLLBACK;", NULL, NULL, NULL);
+  }
+  return false;
+}
+
 void cleanup_all_stmts() {
   sqlite3_stmt *cur = NULL;
   while (cur = sqlite3_next_stmt(sqlite_conn, cur)) {
@@ -143,9 +198,8 @@ bool sqlite3_end_transaction() {
     SQLITE3_PERROR("prepare" OP);
     exit(1);
   }
-  int ret;
-  while ((ret = sqlite3_step(end_transaction_stmt)) == SQLITE_BUSY)
-    ;
+  // Waits in the busy handler instead of spinning
+  int ret = sqlite3_step(end_transaction_stmt);
   if (ret != SQLITE_DONE) {
     SQLITE3_PERROR("step" OP);
     return false;
@@ -187,3 +241,75 @@ bool setup_stmt(sqlite3_stmt *&stmt, const char *sql, const char *op) {
   }
   return true;
 }
+
+bulk_insert_t::bulk_insert_t(const char *head, const char *tail)
+  : head(head), tail(tail), ncol(1) {
+  for (const char *cur = strchr(head, '('); *cur && *cur != ')'; cur++) {
+    ncol += *cur == ',';
+  }
+}
+
+sqlite3_stmt *bulk_insert_t::prepare(int level, const char *op) {
+  auto &stmt = stmts[level];
+  if (stmt) {
+    return stmt;
+  }
+  std::string row = "(?";
+  for (int col = 1; col < ncol; col++) {
+    row += ",?";
+  }
+  row += ")";
+  std::string sql = head;
+  for (int i = 0; i < 1 << level; i++) {
+    sql += i ? "," : " ";
+    sql += row;
+  }
+  sql += " ";
+  sql += tail;
+  if (!IS_SQLITE_OK(PREPARE_STMT(sql.c_str(), &stmt, 1))) {
+    fprintf(stderr, "Within %s: ", op);
+    SQLITE3_PERROR("prepare");
+    stmt = NULL;
+  }
+  return stmt;
+}
+
+void bulk_insert_t::finalize() {
+  for (auto &stmt : stmts) {
+    if (stmt && !IS_SQLITE_OK(sqlite3_finalize(stmt))) {
+      SQLITE3_PERROR("finalize");
+    }
+    stmt = NULL;
+  }
+}
+
+void bulk_columns_t::clear() {
+  for (auto &col : cols) {
+    col.clear();
+  }
+  next = 0;
+  owned.clear();
+}
+
+bool bulk_columns_t::bind_row(sqlite3_stmt *stmt, int param,
+                              size_t row) const {
+  for (const auto &col : cols) {
+    const auto &cell = col[row];
+    int ret;
+    switch (cell.type) {
+      case SQLITE_INTEGER:
+        ret = sqlite3_bind_int64(stmt, param, cell.num);
+        break;
+      case SQLITE_TEXT:
+        ret = sqlite3_bind_text(stmt, param, cell.text, -1, SQLITE_STATIC);
+        break;
+      default:
+        ret = sqlite3_bind_null(stmt, param);
+    }
+    if (!IS_SQLITE_OK(ret)) {
+      return false;
+    }
+    param++;
+  }
+  return true;
+}
@@ -0,0 +1,189 @@
+#include "gpucpu_usage.h"
+
+// Columns of ANALYZE_READ_GPUCPU_USAGE_STEPS_SQL
+enum {
+  STEP_USER,
+  STEP_JOBID,
+  STEP_STEPID,
+  STEP_NGPU,
+  STEP_NNODES
+};
+
+// Of ANALYZE_READ_GPUCPU_USAGE_SQL
+enum {
+  USAGE_NODE,
+  USAGE_IS_GPU,
+  USAGE_IN_USE,
+  USAGE_NCPU,
+  USAGE_CNT
+};
+
+// Of ANALYZE_INSERT_GPUCPU_USAGE_SQL
+#define GPUCPU_USAGE_NCOL 12
+#define GPUCPU_USAGE_USER 0
+#define GPUCPU_USAGE_NODE 3
+#define GPUCPU_USAGE_NODE_TOT 10
+
+// Rows of the node being added to, node_tot is set once it ends
+struct node_span_t {
+  size_t first = 0;
+  int64_t tot = 0;
+};
+
+gpucpu_usage_t::gpucpu_usage_t()
+  : insert(ANALYZE_INSERT_GPUCPU_USAGE_SQL),
+    gpu_rows(GPUCPU_USAGE_NCOL), cpu_rows(GPUCPU_USAGE_NCOL) {}
+
+static std::optional<int64_t> column_int(sqlite3_stmt *stmt, int col) {
+  if (sqlite3_column_type(stmt, col) == SQLITE_NULL) {
+    return std::nullopt;
+  }
+  return sqlite3_column_int64(stmt, col);
+}
+
+static void add(bulk_columns_t &rows, const std::optional<int64_t> &val) {
+  if (val) {
+    rows.add(*val);
+  } else {
+    rows.add_null();
+  }
+}
+
+// Rows come by step and node, so that a text is mostly the one of the row
+// before and kept once
+static const char *own_text(bulk_columns_t &rows, int col, const char *text) {
+  const auto &cells = rows.cols[col];
+  if (!cells.empty() && !strcmp(cells.back().text, text)) {
+    return cells.back().text;
+  }
+  return rows.own(text);
+}
+
+static void end_node(bulk_columns_t &rows, node_span_t &node) {
+  auto &node_tot = rows.cols[GPUCPU_USAGE_NODE_TOT];
+  for (size_t row = node.first; row < node_tot.size(); row++) {
+    node_tot[row].num = node.tot;
+  }
+  node.first = node_tot.size();
+  node.tot = 0;
+}
+
+bool gpucpu_usage_t::fill() {
+  #define OP "(gpucpu_usage)"
+  if (!read_steps_stmt
+      && !IS_SQLITE_OK(PREPARE_STMT(ANALYZE_READ_GPUCPU_USAGE_STEPS_SQL,
+                                    &read_steps_stmt, 1))) {
+    SQLITE3_PERROR("prepare" OP);
+    read_steps_stmt = NULL;
+    return false;
+  }
+  if (!read_stmt
+      && !IS_SQLITE_OK(PREPARE_STMT(ANALYZE_READ_GPUCPU_USAGE_SQL,
+                                    &read_stmt, 1))) {
+    SQLITE3_PERROR("prepare" OP);
+    read_stmt = NULL;
+    return false;
+  }
+  gpu_rows.clear();
+  cpu_rows.clear();
+  node_span_t gpu_node, cpu_node;
+  int step_ret, ret = SQLITE_DONE;
+  while (ret == SQLITE_DONE
+         && (step_ret = sqlite3_step(read_steps_stmt)) == SQLITE_ROW) {
+    const auto user_text
+      = (const char *)sqlite3_column_text(read_steps_stmt, STEP_USER);
+    const int64_t jobid = sqlite3_column_int64(read_steps_stmt, STEP_JOBID);
+    const int64_t stepid = sqlite3_column_int64(read_steps_stmt, STEP_STEPID);
+    const auto ngpu = column_int(read_steps_stmt, STEP_NGPU);
+    const auto nnodes = column_int(read_steps_stmt, STEP_NNODES);
+    const char *gpu_user = NULL, *cpu_user = NULL;
+    const char *node_name = NULL;
+    sqlite3_bind_int64(read_stmt, 1, jobid);
+    sqlite3_bind_int64(read_stmt, 2, stepid);
+    while ((ret = sqlite3_step(read_stmt)) == SQLITE_ROW) {
+      const auto node_text
+        = (const char *)sqlite3_column_text(read_stmt, USAGE_NODE);
+      if (!node_name || strcmp(node_name, node_text)) {
+        end_node(gpu_rows, gpu_node);
+        end_node(cpu_rows, cpu_node);
+        node_name = NULL;
+      }
+      const bool is_gpu = sqlite3_column_int(read_stmt, USAGE_IS_GPU);
+      auto &rows = is_gpu ? gpu_rows : cpu_rows;
+      auto &node = is_gpu ? gpu_node : cpu_node;
+      auto &user = is_gpu ? gpu_user : cpu_user;
+      if (!user) {
+        user = own_text(rows, GPUCPU_USAGE_USER, user_text);
+      }
+      const auto node_own = own_text(rows, GPUCPU_USAGE_NODE, node_text);
+      if (!node_name) {
+        node_name = node_own;
+      }
+      const int64_t in_use = sqlite3_column_int64(read_stmt, USAGE_IN_USE);
+      const int64_t cnt = sqlite3_column_int64(read_stmt, USAGE_CNT);
+
+      rows.add(user);
+      rows.add(jobid);
+      rows.add(stepid);
+      rows.add(node_own);
+      if (is_gpu) {
+        rows.add(in_use);
+        rows.add(cnt);
+        add(rows, ngpu);
+        rows.add_null();
+        rows.add_null();
+        rows.add_null();
+        node.tot += cnt;
+      } else {
+        const auto ncpu = column_int(read_stmt, USAGE_NCPU);
+        rows.add_null();
+        rows.add_null();
+        rows.add_null();
+        if (ncpu && in_use >= 1 && in_use <= *ncpu + 1) {
+          rows.add(in_use);
+          node.tot += cnt;
+        } else {
+          rows.add_null();
+        }
+        rows.add(cnt);
+        add(rows, ncpu);
+      }
+      rows.add((int64_t)0);
+      add(rows, nnodes);
+    }
+    if (ret != SQLITE_DONE) {
+      SQLITE3_PERROR("step" OP);
+    }
+    sqlite3_reset(read_stmt);
+  }
+  if (ret == SQLITE_DONE && step_ret != SQLITE_DONE) {
+    SQLITE3_PERROR("step" OP);
+  }
+  sqlite3_reset(read_steps_stmt);
+  if (ret != SQLITE_DONE || step_ret != SQLITE_DONE) {
+    return false;
+  }
+  end_node(gpu_rows, gpu_node);
+  end_node(cpu_rows, cpu_node);
+
+  bool ok = true;
+  const auto failed = [&](size_t) {
+    ok = false;
+  };
+  insert.insert(gpu_rows, failed, OP);
+  insert.insert(cpu_rows, failed, OP);
+  return ok;
+  #undef OP
+}
+
+void gpucpu_usage_t::finalize() {
+  sqlite3_stmt *stmt_to_finalize[] = {
+    read_steps_stmt,
+    read_stmt,
+    FINALIZE_END_ADDR
+  };
+  finalize_stmt_array(stmt_to_finalize);
+  read_steps_stmt = NULL;
+  read_stmt = NULL;
+  insert.finalize();
+}
@@ -1,7 +1,7 @@
 #include "main.h"
 
 // Connections
-sqlite3 *SQL_CONN_NAME;
+thread_local sqlite3 *SQL_CONN_NAME;
 void *slurm_conn;
 
 // Watcher Metadata
@@ -14,9 +14,9 @@ char *db_path;
 std::string slurm_conf_path;
 
 // Watcher Parameters
-int watcher_id;
-time_t time_range_start;
-time_t time_range_end;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
 
 time_t program_start;
 
@@ -88,48 +88,35 @@ void tres_t::print() {
 }
 
 static inline void build_sqlite_conn() {
-  if (!IS_SQLITE_OK(sqlite3_open(db_path, &sqlite_conn))) {
-    SQLITE3_PERROR("open");
+  if (!open_sqlite_conn()) {
     exit(1);
   }
   if (!sqlite3_exec_wrap(INIT_DB_SQL, "(init_db)")) {
     exit(1);
   }
-  sqlite3_stmt *stmt;
-  #define OP "(get_schema_version)"
-  if (!IS_SQLITE_OK(PREPARE_STMT(GET_SCHEMA_VERSION_SQL, &stmt, 0))) {
+  decltype(GET_SCHEMA_VERSION_STMT)::row_t schema_version;
+  if (!GET_SCHEMA_VERSION_STMT.fetch_one(schema_version)) {
     exit(1);
   }
-  if (!step_and_verify(stmt, true, OP)) {
+  migrate_db(std::get<0>(schema_version));
+  // Measurements are stored by analysis period from here on
+  if (!partitions_attach(ANALYZE_PERIOD_LENGTH)) {
     exit(1);
   }
-  int schema_version = 0;
-  SQLITE3_FETCH_COLUMNS_START("schema_version");
-  SQLITE3_FETCH_COLUMNS_LOOP_HEADER(i, stmt)
-    if (!IS_EXPECTED_COLUMN) {
-      PRINT_COLUMN_MISMATCH_MSG(OP);
-      exit(1);
-    }
-
-    switch(i) {
-      case 0: schema_version = SQLITE3_FETCH(int); break;
-      default: PRINT_UNEXPECTED_COLUMN_MSG(OP);
-    }
-  SQLITE3_FETCH_COLUMNS_END;
-
-  if (!IS_SQLITE_OK(sqlite3_finalize(stmt))) {
-    SQLITE3_PERROR("finalize" OP);
+  // Every statement of the registry against the schema migrated to
+  if (!stmt_registry_check()) {
+    exit(1);
+  }
+  // Of the measurements taken before rollups were kept at ingest
+  if (!rollup_backfill()) {
     exit(1);
   }
-  #undef OP
-  migrate_db(schema_version);
   // Register watcher
   sqlite3_begin_transaction();
-  if (!log_scraper_freq(UPDATE_SCRAPE_FREQ_LOG_SQL,
-                        "(update_scraper_freq_log)")) {
+  if (!log_scraper_freq(UPDATE_SCRAPE_FREQ_LOG_STMT)) {
     exit(1);
   }
-  if (!renew_watcher(REGISTER_WATCHER_SQL_RETURNING_TIMESTAMPS_AND_WATCHERID)) {
+  if (!renew_watcher()) {
     exit(1);
   }
   if (update_jobinfo_only) {
@@ -173,8 +160,11 @@ static void finalize(void) {
   if (is_analyzer || is_watcher) {
     analyzer_finalize();
   }
+  close_sqlite_readers();
   if (is_scraper || is_parent) {
     finalize_gpu_measurement();
+    finalize_proc_events();
+    finalize_proc_scrape();
   } else {
     close_slurmdb_conn();
   }
@@ -285,6 +275,13 @@ static inline bool initialize(int argc, char *argv[]) {
     if (!init_gpu_measurement()) {
       return false;
     }
+    if (!init_proc_scrape() || !init_cgroup_scrape()) {
+      return false;
+    }
+    // cgroups already give step totals
+    if (cgroup_scrape_version == CGROUP_NONE && !init_proc_events()) {
+      return false;
+    }
   }
   return true;
 }
@@ -1,20 +1,12 @@
 #include "messaging.h"
-
-static std::queue<scrape_result_t> scrape_result_queue[2];
-static std::queue<application_usage_t> application_usage_queue[2];
-static std::queue<header_t> header_queue[2];
-static std::queue<gpu_measurement_t> gpu_result_queue[2];
-static std::queue<cpu_available_info_t> cpu_available_info[2];
-static char *buf;
-static size_t buf_size;
-static size_t buf_used;
+#include "protocol_v3.h"
 
 int sock;
-bool deduplicate;
 
-std::atomic<bool> in_flip;
-bool cur;
-static thread_local bool is_my_flip;
+// Batch scrapers stage into until sendout takes it
+static std::unique_ptr<batch_t> staging;
+// Received batches not taken yet, newest first, linked through next
+static std::atomic<batch_t *> received_batches;
 
 void build_socket() {
   if ((sock = socket(SOCK_FAMILY, SOCK_TYPE, SOCK_PROTOCOL)) < 0) {
@@ -49,215 +41,605 @@ void build_socket() {
   }
 }
 
-static inline void ensure_unused_size(size_t size) {
-  bool updated = 0;
-  while (buf_used + size > buf_size) {
-    updated = 1;
-    buf_size *= 2;
-  }
-  if (updated) {
-    buf = (char *)realloc(buf, buf_size);
-    memset(buf + buf_used, 0, buf_size - buf_used);
+static inline batch_t &staging_batch() {
+  if (!staging) {
+    staging.reset(new batch_t());
   }
+  return *staging;
 }
 
-static inline char *stage_str(const char *str) {
-  if (!str) {
-    return NULL;
-  }
-  if (!buf) {
-    buf_size = INIT_BUF_SIZE * sizeof(char);
-    buf = (char *)malloc(buf_size);
-    memset(buf, 0, buf_size);
-  }
-  int len = strlen(str) + 1;
-  if (deduplicate) {
-    if (auto dest = (char *)memmem(buf, buf_used, str, len)) {
-      return (char *)(dest - buf);
-    }
-  }
-  ensure_unused_size(len);
-  char *dest = buf + buf_used;
-  strcpy(dest, str);
-  buf_used += len;
-  return (char *)(dest - buf);
+void stage_message(gpu_measurement_t result) {
+  staging_batch().gpu_results.push_back(result);
 }
 
-static inline bool decide_queue_id(int queue_id) {
-  return queue_id == -1 ? cur : queue_id;
+void stage_message(scrape_result_t result) {
+  staging_batch().results.push_back(result);
 }
 
-void stage_message(gpu_measurement_t result, int queue_id) {
-  bool cur_used = decide_queue_id(queue_id);
-  gpu_result_queue[cur_used].push(result);
+void stage_message(cpu_available_info_t info) {
+  staging_batch().cpu_available_infos.push_back(info);
 }
 
-void stage_message(scrape_result_t result, int queue_id) {
-  bool cur_used = decide_queue_id(queue_id);
-  scrape_result_queue[cur_used].push(result);
+void stage_message(slurm_step_id_t step, const char *app) {
+  auto &batch = staging_batch();
+  application_usage_t usage;
+  usage.step = step;
+  // Version 2 bounds the length
+  usage.app = batch.strings.intern(
+    app, std::min(strlen(app), INIT_BUF_SIZE - 1ul));
+  batch.usages.push_back(usage);
 }
 
-void stage_message(cpu_available_info_t info, int queue_id) {
-  bool cur_used = decide_queue_id(queue_id);
-  cpu_available_info[cur_used].push(info);
+std::unique_ptr<batch_t> take_batch() {
+  // Oldest first, only ever touched by the one consumer
+  static batch_t *taken;
+  if (!taken) {
+    batch_t *batch
+      = received_batches.exchange(NULL, std::memory_order_acquire);
+    while (batch) {
+      batch_t *next = batch->next;
+      batch->next = taken;
+      taken = batch;
+      batch = next;
+    }
+  }
+  if (!taken) {
+    return NULL;
+  }
+  batch_t *batch = taken;
+  taken = batch->next;
+  batch->next = NULL;
+  return std::unique_ptr<batch_t>(batch);
 }
 
-void stage_message(application_usage_t usage, int queue_id) {
-  bool cur_used = decide_queue_id(queue_id);
-  usage.app = stage_str(usage.app);
-  application_usage_queue[cur_used].push(usage);
+// ============================= INGESTION SERVER =============================
+// A handful of epoll loops serve all scraper connections. Every connection
+// keeps the batch it is receiving along with the position of the parser, so
+// that each byte is looked at once however the batch is split up on the wire
+
+static std::atomic<uint64_t> ingest_accepted;
+static std::atomic<uint64_t> ingest_active;
+static std::atomic<uint64_t> ingest_failed;
+static std::atomic<uint64_t> ingest_bytes;
+static std::atomic<uint64_t> ingest_batches;
+static std::atomic<uint64_t> ingest_parse_ns;
+static std::atomic<uint64_t> ingest_parse_max_ns;
+
+// Follows the wire format in messaging.h
+enum parse_stage_t {
+  PARSE_STAGE_MAGIC,
+  PARSE_STAGE_HEADER,
+  PARSE_STAGE_HOSTNAME,
+  PARSE_STAGE_BODY,
+  // Version 3
+  PARSE_STAGE_PAYLOAD_LEN,
+  PARSE_STAGE_PAYLOAD,
+  // Version 2
+  PARSE_STAGE_RESULT,
+  PARSE_STAGE_GPU,
+  PARSE_STAGE_USAGE,
+  PARSE_STAGE_APP_LEN,
+  PARSE_STAGE_APP,
+  PARSE_STAGE_CPU_INFO,
+};
+
+enum parse_status_t {
+  PARSE_NEED_MORE,
+  PARSE_DONE,
+  PARSE_ERROR,
+};
+
+struct connection_t {
+  int fd;
+  // Received bytes, the first pos of them are already parsed
+  std::string in;
+  size_t pos;
+  parse_stage_t stage;
+  // Bytes of the pending batch parsed so far
+  size_t batch_len;
+  // Length of the payload or application name being waited for
+  uint32_t len;
+  // GPU measurements still to come for the last result
+  int gpu_left;
+  std::unique_ptr<batch_t> batch;
+  // Parse time spent on the pending batch
+  uint64_t parse_ns;
+  v3_state_t state;
+  time_t last_active;
+};
+
+// Lock-free, any number of connection threads push while the consumer takes
+static inline void push_batch(std::unique_ptr<batch_t> batch) {
+  batch_t *head = received_batches.load(std::memory_order_relaxed);
+  do {
+    batch->next = head;
+  } while (!received_batches.compare_exchange_weak(
+             head, batch.get(),
+             std::memory_order_release, std::memory_order_relaxed));
+  batch.release();
 }
 
-void freeze_queue() {
-  bool in_flip_desired = 0;
-  if (!in_flip.compare_exchange_strong(
-      in_flip_desired, 1,
-      std::memory_order_relaxed, std::memory_order_relaxed)) {
-    return;
+// Spool payload: [header_t][time_t received_at][version 3 payload]. The
+// payload is encoded with a fresh state, so every record stands on its own
+static inline void spool_batch(batch_t &batch) {
+  std::string record((const char *)&batch.header, sizeof(header_t));
+  record.append((const char *)&batch.received_at, sizeof(time_t));
+  v3_state_t state = {};
+  v3_encode_batch(state, batch, record);
+  if (!spool_append(record, batch.spool_ref)) {
+    fputs("warning: spool is full, batch is kept in memory only\n", stderr);
   }
-  cur = !cur;
-  is_my_flip = 1;
 }
 
-bool recombine_queue(result_group_t &result) {
-  if (!in_flip || !is_my_flip) {
+static inline void resolve_hostname(batch_t &batch) {
+  batch.header.worker.hostname = batch.hostname == STRING_ID_NONE
+    ? NULL : (char *)batch.strings.str(batch.hostname);
+}
+
+// Nothing is handed off before the whole batch arrived
+static inline void hand_off_batch(std::unique_ptr<batch_t> batch) {
+  batch->received_at = time(NULL);
+  resolve_hostname(*batch);
+  DEBUGOUT(
+    fprintf(stderr, "recv: %s | %zu results\n",
+      batch->header.worker.hostname, batch->results.size());
+  )
+  if (spool_is_open()) {
+    spool_batch(*batch);
+  }
+  push_batch(std::move(batch));
+}
+
+// Returns false if the n bytes have not arrived yet
+static inline bool take(connection_t &conn, void *dst, size_t n) {
+  if (conn.in.size() - conn.pos < n) {
     return false;
   }
-  bool cur = !::cur;
-  bool ret = false;
-  if (header_queue[cur].size()) {
-    while (result.scrape_results.size()) {
-      result.scrape_results.pop();
+  memcpy(dst, conn.in.data() + conn.pos, n);
+  conn.pos += n;
+  conn.batch_len += n;
+  return true;
+}
+
+// Continues the pending batch with what is in conn.in. On PARSE_DONE the
+// complete batch is left in conn.batch
+static inline parse_status_t parse_batch(connection_t &conn) {
+  if (!conn.batch) {
+    conn.batch.reset(new batch_t());
+  }
+  auto &batch = *conn.batch;
+  auto &header = batch.header;
+  char buf[INIT_BUF_SIZE];
+  while (conn.batch_len <= MAX_BATCH_SIZE) {
+    switch (conn.stage) {
+    case PARSE_STAGE_MAGIC: {
+      turing_watch_comm_magic_t magic_in;
+      if (!take(conn, &magic_in, sizeof(client_magic))) {
+        return PARSE_NEED_MORE;
+      }
+      if (magic_in != client_magic) {
+        return PARSE_ERROR;
+      }
+      conn.stage = PARSE_STAGE_HEADER;
+      break;
     }
-    while (result.usages.size()) {
-      result.usages.pop();
+    case PARSE_STAGE_HEADER:
+      if (!take(conn, &header, sizeof(header))) {
+        return PARSE_NEED_MORE;
+      }
+      DEBUGOUT(
+        fprintf(stderr, "recv: %d %d\n", header.result_cnt, header.usage_cnt);
+      )
+      if (header.protocol_ver < min_protocol_version
+          || header.protocol_ver > protocol_version
+          || header.schema_ver != schema_version) {
+        fprintf(stderr, "warning: mismatching version information --"
+                        " expecting schema %d protocol %d-%d, got schema %d"
+                        " protocol %d\n",
+                        schema_version, min_protocol_version,
+                        protocol_version, header.schema_ver,
+                        header.protocol_ver);
+        return PARSE_ERROR;
+      }
+      if (header.hostname_len > INIT_BUF_SIZE) {
+        return PARSE_ERROR;
+      }
+      conn.stage
+        = header.hostname_len ? PARSE_STAGE_HOSTNAME : PARSE_STAGE_BODY;
+      break;
+    case PARSE_STAGE_HOSTNAME:
+      if (!take(conn, buf, header.hostname_len)) {
+        return PARSE_NEED_MORE;
+      }
+      buf[header.hostname_len - 1] = '\0';
+      batch.hostname = batch.strings.intern(buf);
+      conn.stage = PARSE_STAGE_BODY;
+      break;
+    case PARSE_STAGE_BODY:
+      if (header.protocol_ver < 3) {
+        conn.gpu_left = 0;
+        conn.stage = PARSE_STAGE_RESULT;
+        break;
+      }
+      // The client waits for the echo before sending its first payload
+      if (!conn.state.negotiated) {
+        if (send(conn.fd, &header.protocol_ver, sizeof(header.protocol_ver),
+                 MSG_NOSIGNAL) != sizeof(header.protocol_ver)) {
+          perror("send");
+          return PARSE_ERROR;
+        }
+        conn.state.negotiated = true;
+      }
+      conn.stage = PARSE_STAGE_PAYLOAD_LEN;
+      break;
+    case PARSE_STAGE_PAYLOAD_LEN:
+      if (!take(conn, &conn.len, sizeof(conn.len))) {
+        return PARSE_NEED_MORE;
+      }
+      if (conn.len > MAX_PAYLOAD_SIZE) {
+        return PARSE_ERROR;
+      }
+      conn.stage = PARSE_STAGE_PAYLOAD;
+      break;
+    case PARSE_STAGE_PAYLOAD: {
+      if (conn.in.size() - conn.pos < conn.len) {
+        return PARSE_NEED_MORE;
+      }
+      const std::string payload(conn.in.data() + conn.pos, conn.len);
+      conn.pos += conn.len;
+      conn.batch_len += conn.len;
+      if (!v3_decode_batch(conn.state, payload, batch)
+          || batch.results.size() != header.result_cnt
+          || batch.usages.size() != header.usage_cnt
+          || batch.cpu_available_infos.size()
+             != header.available_cpu_info_cnt) {
+        fputs("error: malformed protocol version 3 batch\n", stderr);
+        return PARSE_ERROR;
+      }
+      batch.hostname = batch.strings.intern(conn.state.hostname.c_str());
+      header.hostname_len = conn.state.hostname.length() + 1;
+      return PARSE_DONE;
     }
-    auto header = header_queue[cur].front();
-    result.worker = header.worker;
-    header_queue[cur].pop();
-    for (uint32_t i = 0; i < header.result_cnt; i++) {
-      const auto &front = scrape_result_queue[cur].front();
-      result.scrape_results.push(front);
-      for (uint32_t j = 0; j < front.gpu_measurement_cnt; j++) {
-        result.gpu_results.push(gpu_result_queue[cur].front());
-        gpu_result_queue[cur].pop();
+    case PARSE_STAGE_RESULT:
+      if (conn.gpu_left > 0) {
+        conn.stage = PARSE_STAGE_GPU;
+        break;
+      }
+      if (batch.results.size() == header.result_cnt) {
+        conn.stage = PARSE_STAGE_USAGE;
+        break;
+      }
+      batch.results.emplace_back();
+      if (!take(conn, &batch.results.back(), sizeof(scrape_result_t))) {
+        batch.results.pop_back();
+        return PARSE_NEED_MORE;
+      }
+      conn.gpu_left = batch.results.back().gpu_measurement_cnt;
+      break;
+    case PARSE_STAGE_GPU:
+      batch.gpu_results.emplace_back();
+      if (!take(conn, &batch.gpu_results.back(), sizeof(gpu_measurement_t))) {
+        batch.gpu_results.pop_back();
+        return PARSE_NEED_MORE;
+      }
+      if (!--conn.gpu_left) {
+        conn.stage = PARSE_STAGE_RESULT;
+      }
+      break;
+    case PARSE_STAGE_USAGE:
+      if (batch.usages.size() == header.usage_cnt) {
+        conn.stage = PARSE_STAGE_CPU_INFO;
+        break;
+      }
+      batch.usages.emplace_back();
+      if (!take(conn, &batch.usages.back(), sizeof(application_usage_t))) {
+        batch.usages.pop_back();
+        return PARSE_NEED_MORE;
+      }
+      conn.stage = PARSE_STAGE_APP_LEN;
+      break;
+    case PARSE_STAGE_APP_LEN:
+      if (!take(conn, &conn.len, sizeof(conn.len))) {
+        return PARSE_NEED_MORE;
+      }
+      if (!conn.len || conn.len > INIT_BUF_SIZE) {
+        return PARSE_ERROR;
+      }
+      conn.stage = PARSE_STAGE_APP;
+      break;
+    case PARSE_STAGE_APP:
+      if (!take(conn, buf, conn.len)) {
+        return PARSE_NEED_MORE;
+      }
+      buf[conn.len - 1] = '\0';
+      DEBUGOUT(
+        fprintf(stderr, "recv: %d %d %s\n", batch.usages.back().step.job_id,
+          batch.usages.back().step.step_id, buf);
+      )
+      batch.usages.back().app = batch.strings.intern(buf);
+      conn.stage = PARSE_STAGE_USAGE;
+      break;
+    case PARSE_STAGE_CPU_INFO:
+      if (batch.cpu_available_infos.size() == header.available_cpu_info_cnt) {
+        return PARSE_DONE;
+      }
+      batch.cpu_available_infos.emplace_back();
+      if (!take(conn, &batch.cpu_available_infos.back(),
+                sizeof(cpu_available_info_t))) {
+        batch.cpu_available_infos.pop_back();
+        return PARSE_NEED_MORE;
       }
-      scrape_result_queue[cur].pop();
+      break;
     }
-    for (uint32_t i = 0; i < header.usage_cnt; i++) {
-      result.usages.push(application_usage_queue[cur].front());
-      application_usage_queue[cur].pop();
+  }
+  return PARSE_ERROR;
+}
+
+static inline uint64_t monotonic_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Parses and stages whatever complete batches conn.in holds. Returns false
+// on error and once a version 2 batch is done, which ends its connection
+static inline bool parse_input(connection_t &conn) {
+  while (1) {
+    const uint64_t start = monotonic_ns();
+    const auto status = parse_batch(conn);
+    if (status == PARSE_ERROR) {
+      return false;
     }
-    for (uint32_t i = 0; i < header.available_cpu_info_cnt; i++) {
-      result.cpu_available_info.push(cpu_available_info[cur].front());
-      cpu_available_info[cur].pop();
+    if (status == PARSE_NEED_MORE) {
+      conn.parse_ns += monotonic_ns() - start;
+      break;
+    }
+    const bool last = conn.batch->header.protocol_ver < 3;
+    hand_off_batch(std::move(conn.batch));
+    const uint64_t elapsed = conn.parse_ns + monotonic_ns() - start;
+    uint64_t max_ns = ingest_parse_max_ns;
+    while (elapsed > max_ns
+           && !ingest_parse_max_ns.compare_exchange_weak(max_ns, elapsed));
+    ingest_parse_ns += elapsed;
+    ingest_batches++;
+    conn.stage = PARSE_STAGE_MAGIC;
+    conn.batch_len = 0;
+    conn.parse_ns = 0;
+    if (last) {
+      return false;
     }
-    result.buf = &buf;
-    ret = true;
   }
-  if (!header_queue[cur].size()) {
-    is_my_flip = 0;
-    in_flip = 0;
+  // Only the unparsed tail is kept, which is at most one field or payload
+  if (conn.pos) {
+    conn.in.erase(0, conn.pos);
+    conn.pos = 0;
   }
-  return ret;
+  return true;
 }
 
-static inline void takein(int from) {
-  auto do_recv = [from](void *buf, size_t len) {
-    size_t ret;
-    if ((ret = recv(from, buf, len, MSG_WAITALL)) < 0) {
+// Returns false once the client closed the connection or on error
+static inline bool takein(connection_t &conn) {
+  char chunk[INGEST_READ_SIZE];
+  conn.last_active = time(NULL);
+  while (1) {
+    ssize_t ret = recv(conn.fd, chunk, sizeof(chunk), 0);
+    if (ret > 0) {
+      conn.in.append(chunk, ret);
+      ingest_bytes += ret;
+      if (!parse_input(conn)) {
+        return false;
+      }
+      continue;
+    }
+    if (!ret) {
+      return false;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
       perror("recv");
+      return false;
     }
-  };
-  auto finalize = [&]() {
-    close(from);
-  };
-  auto cur_copy = cur;
-  header_t header;
-  scrape_result_t result;
-  gpu_measurement_t gpu_result;
-  application_usage_t usage;
-  cpu_available_info_t cpu_available_info;
-  uint32_t len;
-  {
-    size_t expected_size = sizeof(server_magic);
-    if (send(from, &server_magic, expected_size, 0) != expected_size) {
-      perror("send");
-      finalize();
+    return true;
+  }
+}
+
+static inline void close_connection(
+  int epoll_fd, std::map<int, connection_t> &conns, int fd, bool failed) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  conns.erase(fd);
+  ingest_active--;
+  if (failed) {
+    ingest_failed++;
+  }
+}
+
+static inline void accept_connections(
+  int epoll_fd, std::map<int, connection_t> &conns) {
+  while (1) {
+    int incoming = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (incoming < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+      }
       return;
     }
+    ingest_accepted++;
+    const size_t expected_size = sizeof(server_magic);
+    if (send(incoming, &server_magic, expected_size, MSG_NOSIGNAL)
+        != (ssize_t)expected_size) {
+      perror("send");
+      close(incoming);
+      ingest_failed++;
+      continue;
+    }
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = incoming;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, incoming, &event)) {
+      perror("epoll_ctl");
+      close(incoming);
+      ingest_failed++;
+      continue;
+    }
+    auto &conn = conns[incoming];
+    conn.fd = incoming;
+    conn.stage = PARSE_STAGE_MAGIC;
+    conn.last_active = time(NULL);
+    ingest_active++;
   }
-  turing_watch_comm_magic_t magic_in;
-  do_recv(&magic_in, sizeof(client_magic));
-  if (magic_in != client_magic) {
-    finalize();
-    return;
-  }
-  char buf[INIT_BUF_SIZE];
-  do_recv(&header, sizeof(header));
-  DEBUGOUT(
-    fprintf(stderr, "recv: %d %d\n", header.result_cnt, header.usage_cnt);
-  )
-  if (header.protocol_ver != protocol_version
-      || header.schema_ver != schema_version) {
-    fprintf(stderr, "warning: mismatching version information -- expecting"
-                    " schema %d protocol %d, got schema %d protocol %d\n",
-                    schema_version, protocol_version,
-                    header.schema_ver, header.protocol_ver);
-    finalize();
-    return;
+}
+
+static void *ingest_loop(void *arg) {
+  (void)arg;
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("epoll_create1");
+    exit(1);
   }
-  if (header.hostname_len) {
-    do_recv(buf, header.hostname_len);
-    header.worker.hostname = stage_str(buf);
-    DEBUGOUT(
-      fprintf(stderr, "recv: %s[buf = %s] | %d\n",
-        (size_t)header.worker.hostname + ::buf, buf, header.hostname_len);
-    )
+  // Only one of the loops is woken up per incoming connection
+  epoll_event event;
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.fd = sock;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event)) {
+    perror("epoll_ctl");
+    exit(1);
   }
-  header_queue[cur_copy].push(header);
-  for (uint32_t i = 0; i < header.result_cnt; i++) {
-    do_recv(&result, sizeof(result));
-    stage_message(result, cur_copy);
-    for (int j = 0; j < result.gpu_measurement_cnt; j++) {
-      do_recv(&gpu_result, sizeof(gpu_result));
-      stage_message(gpu_result, cur_copy);
+  std::map<int, connection_t> conns;
+  epoll_event events[INGEST_MAX_EVENTS];
+  time_t last_sweep = time(NULL);
+  while (1) {
+    int cnt = epoll_wait(
+      epoll_fd, events, INGEST_MAX_EVENTS, INGEST_SWEEP_INTERVAL * 1000);
+    if (cnt < 0) {
+      if (errno != EINTR) {
+        perror("epoll_wait");
+      }
+      continue;
+    }
+    for (int i = 0; i < cnt; i++) {
+      const int fd = events[i].data.fd;
+      if (fd == sock) {
+        accept_connections(epoll_fd, conns);
+        continue;
+      }
+      auto it = conns.find(fd);
+      if (it == conns.end()) {
+        continue;
+      }
+      // Whatever is still readable is parsed before a hangup is honored
+      auto &conn = it->second;
+      if (!takein(conn)) {
+        close_connection(
+          epoll_fd, conns, fd, conn.batch_len || !conn.in.empty());
+      }
+    }
+    const time_t now = time(NULL);
+    if (now - last_sweep >= INGEST_SWEEP_INTERVAL) {
+      last_sweep = now;
+      for (auto it = conns.begin(); it != conns.end();) {
+        const int fd = it->first;
+        const bool idle = now - (it++)->second.last_active
+                          >= SOCK_IDLE_TIMEOUT;
+        if (idle) {
+          close_connection(epoll_fd, conns, fd, true);
+        }
+      }
     }
   }
-  for (uint32_t i = 0; i < header.usage_cnt; i++) {
-    do_recv(&usage, sizeof(usage));
-    do_recv(&len, sizeof(len));
-    do_recv(buf, len);
-    DEBUGOUT(
-      fprintf(stderr, "recv: %d %d %s\n",
-        usage.step.job_id, usage.step.step_id, buf);
-    )
-    usage.app = buf;
-    stage_message(usage, cur_copy);
-  }
-  for (uint32_t i = 0; i < header.available_cpu_info_cnt; i++) {
-    do_recv(&cpu_available_info, sizeof(cpu_available_info));
-    stage_message(cpu_available_info, cur_copy);
-  }
-  finalize();
+  return NULL;
 }
 
 void *conn_mgr(void *arg) {
   (void)arg;
-  deduplicate = 1;
-  while (1) {
-    int incoming;
-    if ((incoming = accept(sock, NULL, NULL)) < 0) {
-      perror("accept");
-      continue;
+  int flags = fcntl(sock, F_GETFL);
+  if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK)) {
+    perror("fcntl");
+    exit(1);
+  }
+  pthread_t threads[INGEST_THREAD_CNT];
+  for (int i = 1; i < INGEST_THREAD_CNT; i++) {
+    if (pthread_create(&threads[i], NULL, ingest_loop, NULL)) {
+      perror("pthread_create");
+      exit(1);
     }
-    takein(incoming);
+  }
+  return ingest_loop(NULL);
+}
+
+ingest_stats_t get_ingest_stats() {
+  ingest_stats_t stats;
+  stats.accepted = ingest_accepted;
+  stats.active = ingest_active;
+  stats.failed = ingest_failed;
+  stats.bytes = ingest_bytes;
+  stats.batches = ingest_batches;
+  stats.parse_ns = ingest_parse_ns;
+  stats.parse_max_ns = ingest_parse_max_ns.exchange(0);
+  return stats;
+}
+
+static inline size_t batch_size(const batch_t &batch) {
+  return batch.results.size() * sizeof(scrape_result_t)
+         + batch.gpu_results.size() * sizeof(gpu_measurement_t)
+         + batch.usages.size()
+           * (sizeof(application_usage_t) + sizeof(uint32_t))
+         + batch.cpu_available_infos.size() * sizeof(cpu_available_info_t)
+         + batch.strings.bytes();
+}
+
+size_t staged_message_size() {
+  return staging ? batch_size(*staging) : 0;
+}
+
+static bool connected;
+// Lowered for good once the server turned out to be older
+static protocol_version_t server_protocol_version = protocol_version;
+static v3_state_t client_state;
+// Batches not sent in full yet, oldest first. They are encoded on the
+// connection they finally go out on, so they outlive a reconnect
+static std::deque<std::unique_ptr<batch_t>> unsent_batches;
+static size_t unsent_size;
+
+// Queues the staged batch for sending as is
+static inline void take_staged_messages() {
+  if (!staging || (staging->results.empty() && staging->usages.empty()
+                   && staging->cpu_available_infos.empty())) {
+    return;
+  }
+  unsent_size += batch_size(*staging);
+  unsent_batches.push_back(std::move(staging));
+  while (unsent_size > MAX_UNSENT_SIZE && unsent_batches.size() > 1) {
+    auto &oldest = *unsent_batches.front();
+    auto &next = *unsent_batches[1];
+    fprintf(stderr, "warning: server unreachable, dropping a batch of %zu "
+                    "results\n", oldest.results.size());
+    unsent_size -= batch_size(oldest);
+    // Staged only once per step, so they are carried over
+    next.cpu_available_infos.insert(next.cpu_available_infos.end(),
+      oldest.cpu_available_infos.begin(), oldest.cpu_available_infos.end());
+    unsent_size
+      += oldest.cpu_available_infos.size() * sizeof(cpu_available_info_t);
+    unsent_batches.pop_front();
   }
 }
 
-// cur should not change throughout the function
-void sendout() {
+static inline void disconnect() {
+  close(sock);
+  sock = -1;
+  connected = false;
+}
+
+static bool connect_server() {
   static addrinfo addr_to_use;
+  if (sock < 0) {
+    build_socket();
+  }
   if (!addr_to_use.ai_addr) {
     addrinfo hint;
     addrinfo *result;
@@ -268,7 +650,7 @@ void sendout() {
     hint.ai_protocol = SOCK_PROTOCOL;
     if (auto ret = getaddrinfo(hostname, getenv(PORT_ENV), &hint, &result)) {
       fprintf(stderr, "%s: %s\n", hostname, gai_strerror(ret));
-      return;
+      return false;
     }
     addrinfo *addr = result;
     for (; addr; addr = addr->ai_next) {
@@ -281,37 +663,54 @@ void sendout() {
     }
     if (!addr) {
       fprintf(stderr, "error: no viable address for host %s\n", hostname);
-      return;
+      return false;
     }
   } else if (connect(sock, addr_to_use.ai_addr, addr_to_use.ai_addrlen)) {
     perror("connect");
-    return;
-  }
-  header_t header;
-  header.result_cnt = scrape_result_queue[cur].size();
-  header.usage_cnt = application_usage_queue[cur].size();
-  header.available_cpu_info_cnt = cpu_available_info[cur].size();
-  DEBUGOUT(
-    fprintf(stderr, "send: %d %d %s\n",
-      header.result_cnt, header.usage_cnt, header.worker.hostname);
-  )
-  header.worker = worker;
-  if (const auto &hostname = header.worker.hostname) {
-    header.hostname_len = strlen(hostname) + 1;
+    return false;
   }
   turing_watch_comm_magic_t magic_in;
   if ((recv(sock, &magic_in, sizeof(server_magic), MSG_WAITALL)) < 0) {
     perror("recv");
-    return;
+    return false;
   }
   if (magic_in != server_magic) {
     fputs("error: the server sent mismatching magic\n", stderr);
-    return;
+    return false;
+  }
+  client_state = {};
+  connected = true;
+  return true;
+}
+
+// Returns false if the batch did not go out in full
+static bool send_batch(batch_t &batch) {
+  auto &header = batch.header;
+  header.protocol_ver = server_protocol_version;
+  header.result_cnt = batch.results.size();
+  header.usage_cnt = batch.usages.size();
+  header.available_cpu_info_cnt = batch.cpu_available_infos.size();
+  DEBUGOUT(
+    fprintf(stderr, "send: %d %d %s\n",
+      header.result_cnt, header.usage_cnt, worker.hostname);
+  )
+  header.worker = worker;
+  if (header.protocol_ver >= 3) {
+    header.hostname_len = 0;
+  } else if (const auto &hostname = header.worker.hostname) {
+    header.hostname_len = strlen(hostname) + 1;
   }
   size_t tot = 1;
+  bool failed = false;
   auto do_send = [&](const void *buf, size_t len) {
     int ret;
-    if ((ret = send(sock, buf, len, --tot == 0 ? 0 : MSG_MORE)) != len) {
+    if (failed) {
+      return;
+    }
+    // Server may have closed a kept connection, which is not worth a SIGPIPE
+    const int flags = MSG_NOSIGNAL | (--tot == 0 ? 0 : MSG_MORE);
+    if ((ret = send(sock, buf, len, flags)) != len) {
+      failed = true;
       if (ret == -1) {
         perror("send");
       } else {
@@ -320,75 +719,139 @@ void sendout() {
     }
   };
   do_send(&client_magic, sizeof(client_magic));
+  if (header.protocol_ver >= 3) {
+    std::string payload;
+    if (!client_state.negotiated) {
+      // Not held back by MSG_MORE, the server answers to it
+      tot = 1;
+      do_send(&header, sizeof(header));
+      protocol_version_t version_in;
+      const ssize_t ret = failed ? -1 : recv(
+        sock, &version_in, sizeof(version_in), MSG_WAITALL);
+      if (ret != sizeof(version_in)) {
+        // Only a server older than version 3 closes the connection right
+        // after the header, anything else is retried on the next connection
+        if (!ret) {
+          DEBUGOUT(fputs("falling back to protocol version 2\n", stderr);)
+          server_protocol_version = 2;
+        } else if (ret < 0 && !failed) {
+          perror("recv");
+        }
+        return false;
+      }
+      client_state.negotiated = true;
+      tot = 2;
+    } else {
+      tot = 3;
+      do_send(&header, sizeof(header));
+    }
+    v3_encode_batch(client_state, batch, payload);
+    const uint32_t payload_len = payload.length();
+    do_send(&payload_len, sizeof(payload_len));
+    do_send(payload.data(), payload_len);
+    return !failed;
+  }
   // * 3: structure, len, string
-  tot = header.usage_cnt * 3 + header.result_cnt;
+  tot = 1 + !!header.hostname_len + header.result_cnt
+        + batch.gpu_results.size() + header.usage_cnt * 3
+        + header.available_cpu_info_cnt;
   do_send(&header, sizeof(header));
   if (header.hostname_len) {
     do_send(header.worker.hostname, header.hostname_len);
     DEBUGOUT(fprintf(stderr, "send: %s\n", header.worker.hostname);)
   }
-  while (!scrape_result_queue[cur].empty()) {
-    const auto &front = scrape_result_queue[cur].front();
-    do_send(&front, sizeof(front));
-    for (int i = 0; i < front.gpu_measurement_cnt; i++) {
-      const auto &gpu_front = gpu_result_queue[cur].front();
-      do_send(&gpu_front, sizeof(gpu_front));
-      gpu_result_queue[cur].pop();
-    }
-    scrape_result_queue[cur].pop();
-  }
-  while (!application_usage_queue[cur].empty()) {
-    const auto &front = application_usage_queue[cur].front();
-    do_send(&front, sizeof(front));
-    const auto app_addr = (size_t)(front.app) + buf;
-    uint32_t len = strlen(app_addr) + 1;
-    if (len > INIT_BUF_SIZE) {
-      len = INIT_BUF_SIZE;
-      app_addr[len - 1] = '\0';
+  auto gpu_front = batch.gpu_results.begin();
+  for (const auto &result : batch.results) {
+    do_send(&result, sizeof(result));
+    for (int i = 0; i < result.gpu_measurement_cnt; i++, gpu_front++) {
+      do_send(&*gpu_front, sizeof(*gpu_front));
     }
+  }
+  for (const auto &usage : batch.usages) {
+    const char *app = batch.strings.str(usage.app);
+    const uint32_t len = strlen(app) + 1;
     DEBUGOUT(
       fprintf(stderr, "send: %d %d %s [%s]\n",
-        front.step.job_id, front.step.step_id, app_addr,
-        header.worker.hostname);
+        usage.step.job_id, usage.step.step_id, app, header.worker.hostname);
     )
+    do_send(&usage, sizeof(usage));
     do_send(&len, sizeof(len));
-    do_send(app_addr, len);
-    application_usage_queue[cur].pop();
+    do_send(app, len);
   }
-  while (!cpu_available_info[cur].empty()) {
-    const auto &front = cpu_available_info[cur].front();
-    do_send(&front, sizeof(front));
-    cpu_available_info[cur].pop();
+  for (const auto &info : batch.cpu_available_infos) {
+    do_send(&info, sizeof(info));
   }
+  return !failed;
 }
 
-void dump_message() {
-  for (int i = 0; i < 2; i++) {
-    freeze_queue();
-    sleep(5);
-    if (header_queue[!cur].size()) {
-      std::string dump_path = std::string(db_path) + ".turingwatch.dump.XXXXXX";
-      int fd = mkstemp((char *)dump_path.c_str());
-      write(fd, &header_queue[!cur].front(), sizeof(header_t));
-      result_group_t result;
-      recombine_queue(result);
-      while (!result.scrape_results.empty()) {
-        write(fd, &result.scrape_results.front(), sizeof(scrape_result_t));
-        result.scrape_results.pop();
-      }
-      while (!result.usages.empty()) {
-        write(fd, &result.usages.front(), sizeof(application_usage_t));
-        result.usages.pop();
-      }
-      if (buf_used) {
-        write(fd, &buf_size, sizeof(buf_size));
-        write(fd, buf, buf_size);
-      }
-      close(fd);
+bool sendout(bool keep_open) {
+  take_staged_messages();
+  while (!unsent_batches.empty()) {
+    if (!connected && !connect_server()) {
+      disconnect();
+      return false;
+    }
+    const auto version = server_protocol_version;
+    auto &batch = *unsent_batches.front();
+    const bool sent = send_batch(batch);
+    // Version 2 carries one batch per connection
+    if (!sent || server_protocol_version < 3) {
+      disconnect();
+    }
+    if (!sent) {
+      if (server_protocol_version != version) {
+        // Retried right away with the older protocol
+        continue;
+      }
+      return false;
     }
+    unsent_size -= batch_size(batch);
+    unsent_batches.pop_front();
+  }
+  if (connected && !keep_open) {
+    disconnect();
   }
+  return true;
+}
+
+void dump_message() {
+  spool_close();
 }
 
 void collect_dumped_messages() {
-  assert(0 && "unimplemented");
+  const std::string prefix = std::string(db_path) + ".turingwatch.spool";
+  if (!spool_open(prefix.c_str())) {
+    fputs("warning: no spool, received batches are lost on restart\n",
+          stderr);
+    return;
+  }
+  size_t replayed = 0, malformed = 0;
+  spool_replay([&](const char *record, size_t len, spool_ref_t ref) {
+    std::unique_ptr<batch_t> batch(new batch_t());
+    const size_t prefix_len = sizeof(header_t) + sizeof(time_t);
+    v3_state_t state = {};
+    if (len < prefix_len
+        || (memcpy((void *)&batch->header, record, sizeof(header_t)),
+            batch->header.schema_ver != schema_version)
+        || !v3_decode_batch(
+             state, std::string(record + prefix_len, len - prefix_len),
+             *batch)) {
+      // Would fail again on every start
+      spool_commit(ref);
+      malformed++;
+      return;
+    }
+    memcpy(&batch->received_at, record + sizeof(header_t), sizeof(time_t));
+    if (!state.hostname.empty()) {
+      batch->hostname = batch->strings.intern(state.hostname.c_str());
+    }
+    resolve_hostname(*batch);
+    batch->spool_ref = ref;
+    push_batch(std::move(batch));
+    replayed++;
+  });
+  if (replayed || malformed) {
+    printf("Replayed %zu spooled batches, dropped %zu malformed\n",
+      replayed, malformed);
+  }
 }
@@ -0,0 +1,202 @@
+#include "partition.h"
+#include "stmts.h"
+
+#include <glob.h>
+
+// Zero until partitions_attach, the tables of the main database alone then
+static time_t partition_length;
+static int partition_retained;
+
+std::string partition_path(long period) {
+  return std::string(db_path) + PARTITION_SUFFIX + std::to_string(period);
+}
+
+static inline long current_period() {
+  return time(NULL) / partition_length;
+}
+
+// Of SQL_CONN_NAME, -1 if it was never synced
+static long synced_period() {
+  sqlite3_stmt *stmt = NULL;
+  long period = -1;
+  if (IS_SQLITE_OK(PREPARE_STMT("SELECT period FROM temp.partition_period",
+                                &stmt, 0))
+      && sqlite3_step(stmt) == SQLITE_ROW) {
+    period = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return period;
+}
+
+// On a connection of its own, all tables at once so that no reader attaches
+// the file without them
+static bool partition_create(const std::string &path) {
+  sqlite3 *conn = NULL;
+  bool ok = IS_SQLITE_OK(sqlite3_open(path.c_str(), &conn));
+  if (ok) {
+    sqlite_conn_scope_t conn_scope(conn);
+    sqlite3_busy_timeout(conn, SQLITE_BUSY_TIMEOUT_MS);
+    ok = sqlite3_exec_wrap(PARTITION_INIT_SQL, "(init_partition)");
+  } else {
+    fprintf(stderr, "sqlite3_open(partition): %s\n", sqlite3_errmsg(conn));
+  }
+  sqlite3_close(conn);
+  return ok;
+}
+
+// Of the periods before first. Connections that still have one attached
+// read on from the unlinked file until they sync
+static void partitions_drop(long first) {
+  const std::string pattern = std::string(db_path) + PARTITION_SUFFIX "*";
+  glob_t found;
+  if (glob(pattern.c_str(), 0, NULL, &found)) {
+    return;
+  }
+  for (size_t i = 0; i < found.gl_pathc; i++) {
+    const char *suffix = found.gl_pathv[i] + pattern.size() - 1;
+    char *end;
+    const long period = strtol(suffix, &end, 10);
+    // Journals are matched too, and unlinked along with their partition
+    if (end == suffix || *end || period >= first) {
+      continue;
+    }
+    for (const char *journal : {"", "-wal", "-shm"}) {
+      const std::string path = found.gl_pathv[i] + std::string(journal);
+      if (unlink(path.c_str()) && errno != ENOENT) {
+        perror("unlink(partition)");
+      }
+    }
+    printf("Dropped measurement partition %s\n", found.gl_pathv[i]);
+  }
+  globfree(&found);
+}
+
+static bool partition_attach(const std::string &path, const std::string &name) {
+  #define OP "(attach_partition)"
+  const std::string sql = "ATTACH DATABASE ? AS " + name;
+  sqlite3_stmt *stmt = NULL;
+  bool ok = IS_SQLITE_OK(PREPARE_STMT(sql.c_str(), &stmt, 0));
+  if (!ok) {
+    SQLITE3_PERROR("prepare" OP);
+  } else {
+    ok = IS_SQLITE_OK(sqlite3_bind_text(stmt, 1, path.c_str(), -1,
+                                        SQLITE_STATIC))
+         && step_and_verify(stmt, false, OP);
+  }
+  sqlite3_finalize(stmt);
+  if (!ok) {
+    return false;
+  }
+  // Readers may find a file that is being created
+  ok = false;
+  const std::string check_sql =
+    "SELECT count(*) FROM " + name + ".sqlite_master WHERE type == 'table'"
+    " AND name IN ('measurements', 'gpu_measurements')";
+  if (IS_SQLITE_OK(PREPARE_STMT(check_sql.c_str(), &stmt, 0))
+      && sqlite3_step(stmt) == SQLITE_ROW) {
+    ok = sqlite3_column_int(stmt, 0) == 2;
+  }
+  sqlite3_finalize(stmt);
+  if (!ok) {
+    sqlite3_exec_wrap(("DETACH DATABASE " + name).c_str(), OP);
+  }
+  return ok;
+  #undef OP
+}
+
+static bool partitions_detach() {
+  std::vector<std::string> names;
+  sqlite3_stmt *stmt = NULL;
+  if (!IS_SQLITE_OK(PREPARE_STMT("PRAGMA database_list", &stmt, 0))) {
+    SQLITE3_PERROR("prepare(database_list)");
+    return false;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 1);
+    if (!strncmp(name, PARTITION_PREFIX, strlen(PARTITION_PREFIX))) {
+      names.push_back(name);
+    }
+  }
+  sqlite3_finalize(stmt);
+  for (const auto &name : names) {
+    if (!sqlite3_exec_wrap(("DETACH DATABASE " + name).c_str(),
+                           "(detach_partition)")) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool partitions_sync() {
+  if (!partition_length) {
+    return true;
+  }
+  const long period = current_period();
+  if (synced_period() == period) {
+    return true;
+  }
+  const long first = period - partition_retained + 1;
+  if (!sqlite3_db_readonly(SQL_CONN_NAME, "main")) {
+    const std::string path = partition_path(period);
+    struct stat st;
+    if (stat(path.c_str(), &st) && !partition_create(path)) {
+      return false;
+    }
+    partitions_drop(first);
+  }
+  if (!partitions_detach()) {
+    return false;
+  }
+  std::vector<std::string> schemas = {"main"};
+  for (long cur = first; cur <= period; cur++) {
+    const std::string path = partition_path(cur);
+    struct stat st;
+    if (stat(path.c_str(), &st)) {
+      continue;
+    }
+    const std::string name = cur == period
+      ? PARTITION_CUR : PARTITION_PREFIX + std::to_string(cur);
+    if (partition_attach(path, name)) {
+      schemas.push_back(name);
+    }
+  }
+  const auto union_of = [&](const char *select, const char *table) {
+    std::string sql;
+    for (const auto &schema : schemas) {
+      sql += sql.empty() ? "" : " UNION ALL ";
+      sql += std::string("SELECT ") + select + " FROM " + schema + "."
+             + table;
+    }
+    return sql;
+  };
+  const std::string views_sql =
+    "DROP VIEW IF EXISTS temp.measurements;"
+    "CREATE TEMP VIEW measurements AS "
+    + union_of(MEASUREMENT_COLUMNS_SQL, "measurements") + ";"
+    "DROP VIEW IF EXISTS temp.gpu_measurements;"
+    "CREATE TEMP VIEW gpu_measurements AS "
+    + union_of(GPU_MEASUREMENT_COLUMNS_SQL, "gpu_measurements") + ";"
+    // Each part finds its latest recordid right away, unlike the view
+    "DROP VIEW IF EXISTS temp.measurements_latest;"
+    "CREATE TEMP VIEW measurements_latest AS"
+    " SELECT max(recordid) AS recordid FROM ("
+    + union_of("max(recordid) AS recordid", "measurements") + ");"
+    "DROP VIEW IF EXISTS temp.partition_period;"
+    "CREATE TEMP VIEW partition_period AS SELECT "
+    + std::to_string(period) + " AS period;";
+  return sqlite3_exec_wrap(views_sql.c_str(), "(partition_views)");
+}
+
+bool partitions_attach(time_t length, int retained) {
+  partition_length = length;
+  partition_retained = retained;
+  return partitions_sync();
+}
+
+bool partitions_synced() {
+  return !partition_length || synced_period() == current_period();
+}
+
+bool partitions_seed() {
+  return !partition_length || PARTITION_SEED_STMT.exec();
+}
@@ -0,0 +1,438 @@
+#include "proc_events.h"
+#include "proc_scrape.h"
+
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+
+// Large enough for a full batch of taskstats replies of a busy node
+#define NETLINK_BUF_SIZE 65536
+// Scraper stopped draining or events arrive faster than it can keep up
+#define MAX_PENDING_EVENTS (1 << 20)
+// Exit counters whose exit event never came, e.g. of an early exiting leader
+// thread of a multithreaded process
+#define MAX_PENDING_EXIT_STATS 4096
+
+bool proc_events_enabled;
+
+static int cn_fd = -1;
+static int ts_fd = -1;
+static int stop_pipe[2] = {-1, -1};
+static pthread_t event_thread;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+// Guarded by event_lock
+static proc_event_list_t pending_events;
+static bool events_lost;
+// Only touched by event thread. taskstats delivers final counters of a task
+// right before the proc connector reports its exit
+static std::map<pid_t, scrape_result_t> exit_stats;
+// Counters of threads exited before their leader, keyed by thread group and
+// added to those of the leader once it exits
+static std::map<pid_t, scrape_result_t> thread_exit_stats;
+// Exit events may trigger a read of taskstats while their buffer is in use
+static char cn_buf[NETLINK_BUF_SIZE];
+static char ts_buf[NETLINK_BUF_SIZE];
+
+static bool cn_send_op(proc_cn_mcast_op op) {
+  char buf[NLMSG_SPACE(sizeof(cn_msg) + sizeof(op))];
+  memset(buf, 0, sizeof(buf));
+  auto *nl = (nlmsghdr *)buf;
+  nl->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(op));
+  nl->nlmsg_type = NLMSG_DONE;
+  auto *cn = (cn_msg *)NLMSG_DATA(nl);
+  cn->id.idx = CN_IDX_PROC;
+  cn->id.val = CN_VAL_PROC;
+  cn->len = sizeof(op);
+  memcpy(cn->data, &op, sizeof(op));
+  return send(cn_fd, buf, nl->nlmsg_len, 0) == (ssize_t)nl->nlmsg_len;
+}
+
+static bool genl_send(
+  uint16_t family, uint8_t cmd, uint16_t attr, const void *data, size_t len) {
+  char buf[NLMSG_SPACE(GENL_HDRLEN + NLA_HDRLEN + 64)];
+  if (len > 64) {
+    return false;
+  }
+  memset(buf, 0, sizeof(buf));
+  auto *nl = (nlmsghdr *)buf;
+  nl->nlmsg_type = family;
+  nl->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  auto *genl = (genlmsghdr *)NLMSG_DATA(nl);
+  genl->cmd = cmd;
+  genl->version = 1;
+  auto *na = (nlattr *)((char *)genl + GENL_HDRLEN);
+  na->nla_type = attr;
+  na->nla_len = NLA_HDRLEN + len;
+  memcpy((char *)na + NLA_HDRLEN, data, len);
+  nl->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(na->nla_len));
+  return send(ts_fd, buf, nl->nlmsg_len, 0) == (ssize_t)nl->nlmsg_len;
+}
+
+#define FOREACH_NLA(NA, START, LEN) \
+  for (auto *NA = (nlattr *)(START); \
+       (char *)NA + NLA_HDRLEN <= (char *)(START) + (LEN) \
+       && NA->nla_len >= NLA_HDRLEN \
+       && (char *)NA + NA->nla_len <= (char *)(START) + (LEN); \
+       NA = (nlattr *)((char *)NA + NLA_ALIGN(NA->nla_len)))
+#define NLA_PAYLOAD(NA) ((char *)(NA) + NLA_HDRLEN)
+#define NLA_PAYLOAD_LEN(NA) ((NA)->nla_len - NLA_HDRLEN)
+
+// Reads up to the ack of a request. Returns family id for GETFAMILY, 0 for
+// other requests and -1 on error
+static int genl_recv_reply() {
+  int ret = 0;
+  ssize_t cnt;
+  while ((cnt = recv(ts_fd, ts_buf, NETLINK_BUF_SIZE, 0)) > 0) {
+    for (auto *nl = (nlmsghdr *)ts_buf; NLMSG_OK(nl, cnt);
+         nl = NLMSG_NEXT(nl, cnt)) {
+      if (nl->nlmsg_type == NLMSG_ERROR) {
+        const auto *err = (nlmsgerr *)NLMSG_DATA(nl);
+        if (err->error) {
+          errno = -err->error;
+          return -1;
+        }
+        return ret;
+      }
+      auto *genl = (genlmsghdr *)NLMSG_DATA(nl);
+      FOREACH_NLA(na, (char *)genl + GENL_HDRLEN,
+                  nl->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN)) {
+        if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+          ret = *(uint16_t *)NLA_PAYLOAD(na);
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+static bool init_taskstats() {
+  if ((ts_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC))
+      < 0) {
+    return false;
+  }
+  sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(ts_fd, (sockaddr *)&addr, sizeof(addr))) {
+    return false;
+  }
+  static const char family_name[] = TASKSTATS_GENL_NAME;
+  if (!genl_send(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+                 family_name, sizeof(family_name))) {
+    return false;
+  }
+  const int family = genl_recv_reply();
+  if (family <= 0) {
+    return false;
+  }
+  char cpumask[32];
+  snprintf(cpumask, sizeof(cpumask), "0-%ld",
+           sysconf(_SC_NPROCESSORS_CONF) - 1);
+  if (!genl_send(family, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK,
+                 cpumask, strlen(cpumask) + 1)
+      || genl_recv_reply() < 0) {
+    return false;
+  }
+  // Replies are only read by event thread from now on
+  fcntl(ts_fd, F_SETFL, fcntl(ts_fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+static inline void taskstats_to_result(
+  const char *payload, size_t len, scrape_result_t &result) {
+  static const size_t clk_tck = sysconf(_SC_CLK_TCK);
+  // Fields used here exist since the first version of the struct, older
+  // kernels just send a shorter one
+  taskstats stats;
+  memset(&stats, 0, sizeof(stats));
+  memcpy(&stats, payload, std::min(len, sizeof(stats)));
+  memset(&result, 0, sizeof(result));
+  const size_t comm_len
+    = std::min(sizeof(stats.ac_comm), (size_t)TASK_COMM_LEN);
+  memcpy(result.comm, stats.ac_comm, comm_len);
+  result.comm[comm_len] = '\0';
+  result.pid = stats.ac_pid;
+  result.res = stats.hiwater_rss * 1024;
+  result.minor_pagefault = stats.ac_minflt;
+  result.utime = stats.ac_utime * clk_tck / 1000000;
+  result.stime = stats.ac_stime * clk_tck / 1000000;
+  result.rchar = stats.read_char;
+  result.wchar = stats.write_char;
+}
+
+static inline void add_thread_stats(
+  scrape_result_t &dst, const scrape_result_t &src) {
+  // Threads share one mm, so its high-water mark is the same for all of them
+  dst.res = std::max(dst.res, src.res);
+  dst.minor_pagefault += src.minor_pagefault;
+  dst.utime += src.utime;
+  dst.stime += src.stime;
+  dst.rchar += src.rchar;
+  dst.wchar += src.wchar;
+}
+
+static void read_taskstats() {
+  ssize_t cnt;
+  while ((cnt = recv(ts_fd, ts_buf, NETLINK_BUF_SIZE, 0)) > 0) {
+    for (auto *nl = (nlmsghdr *)ts_buf; NLMSG_OK(nl, cnt);
+         nl = NLMSG_NEXT(nl, cnt)) {
+      if (nl->nlmsg_type == NLMSG_ERROR || nl->nlmsg_type == NLMSG_DONE) {
+        continue;
+      }
+      auto *genl = (genlmsghdr *)NLMSG_DATA(nl);
+      FOREACH_NLA(aggr, (char *)genl + GENL_HDRLEN,
+                  nl->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN)) {
+        // The whole thread group is reported too after its last thread, but
+        // the kernel only fills delay accounting and context switches there,
+        // so threads are added up from their own reports instead
+        if (aggr->nla_type != TASKSTATS_TYPE_AGGR_PID) {
+          continue;
+        }
+        pid_t pid = 0;
+        FOREACH_NLA(na, NLA_PAYLOAD(aggr), NLA_PAYLOAD_LEN(aggr)) {
+          if (na->nla_type == TASKSTATS_TYPE_PID) {
+            pid = *(uint32_t *)NLA_PAYLOAD(na);
+          } else if (na->nla_type == TASKSTATS_TYPE_STATS && pid) {
+            if (exit_stats.size() >= MAX_PENDING_EXIT_STATS) {
+              exit_stats.clear();
+            }
+            taskstats_to_result(
+              NLA_PAYLOAD(na), NLA_PAYLOAD_LEN(na), exit_stats[pid]);
+          }
+        }
+      }
+    }
+  }
+  if (cnt < 0 && errno == ENOBUFS) {
+    // Exit counters lost, the exit events themselves still arrive
+    DEBUGOUT(fputs("taskstats: receive buffer overrun\n", stderr);)
+  }
+}
+
+static inline void push_event(const proc_event_t &event) {
+  pthread_mutex_lock(&event_lock);
+  if (pending_events.size() >= MAX_PENDING_EVENTS) {
+    pending_events.clear();
+    events_lost = true;
+  }
+  pending_events.push_back(event);
+  pthread_mutex_unlock(&event_lock);
+}
+
+static void read_connector() {
+  ssize_t cnt;
+  proc_event_t event;
+  while ((cnt = recv(cn_fd, cn_buf, NETLINK_BUF_SIZE, 0)) > 0) {
+    for (auto *nl = (nlmsghdr *)cn_buf; NLMSG_OK(nl, cnt);
+         nl = NLMSG_NEXT(nl, cnt)) {
+      const auto *cn = (cn_msg *)NLMSG_DATA(nl);
+      const auto *ev = (proc_event *)cn->data;
+      memset(&event, 0, sizeof(event));
+      switch (ev->what) {
+      case proc_event::PROC_EVENT_FORK: {
+        const auto &fork = ev->event_data.fork;
+        if (fork.child_pid != fork.child_tgid) {
+          continue;
+        }
+        event.type = PROC_EVENT_TYPE_FORK;
+        event.pid = fork.child_tgid;
+        event.ppid = fork.parent_tgid;
+        break;
+      }
+      case proc_event::PROC_EVENT_EXEC: {
+        const auto &exec = ev->event_data.exec;
+        if (exec.process_pid != exec.process_tgid) {
+          continue;
+        }
+        event.type = PROC_EVENT_TYPE_EXEC;
+        event.pid = exec.process_tgid;
+        break;
+      }
+      case proc_event::PROC_EVENT_EXIT: {
+        const auto &exit = ev->event_data.exit;
+        auto stats = exit_stats.find(exit.process_pid);
+        if (stats == exit_stats.end() && ts_fd >= 0) {
+          // Counters may have been queued after the last read of taskstats
+          read_taskstats();
+          stats = exit_stats.find(exit.process_pid);
+        }
+        auto threads = thread_exit_stats.find(exit.process_tgid);
+        if (exit.process_pid != exit.process_tgid) {
+          if (stats == exit_stats.end()) {
+            continue;
+          }
+          if (threads != thread_exit_stats.end()) {
+            add_thread_stats(threads->second, stats->second);
+          } else {
+            // Leaders exited before their threads leave entries behind
+            if (thread_exit_stats.size() >= MAX_PENDING_EXIT_STATS) {
+              thread_exit_stats.clear();
+            }
+            thread_exit_stats.emplace(exit.process_tgid, stats->second);
+          }
+          exit_stats.erase(stats);
+          continue;
+        }
+        event.type = PROC_EVENT_TYPE_EXIT;
+        event.pid = exit.process_tgid;
+        if (stats != exit_stats.end()) {
+          event.has_stats = true;
+          event.stat = stats->second;
+          exit_stats.erase(stats);
+          if (threads != thread_exit_stats.end()) {
+            add_thread_stats(event.stat, threads->second);
+          }
+        } else {
+          // Not reaped yet at this point most of the time
+          char comm[TASK_COMM_LEN + 1];
+          if (read_proc_pid_file(event.pid, "comm", comm, sizeof(comm)) > 0) {
+            comm[strcspn(comm, "\n")] = '\0';
+            strcpy(event.stat.comm, comm);
+          }
+        }
+        if (threads != thread_exit_stats.end()) {
+          thread_exit_stats.erase(threads);
+        }
+        break;
+      }
+      default:
+        continue;
+      }
+      push_event(event);
+    }
+  }
+  if (cnt < 0 && errno == ENOBUFS) {
+    pthread_mutex_lock(&event_lock);
+    events_lost = true;
+    pthread_mutex_unlock(&event_lock);
+  }
+}
+
+static void *event_loop(void *) {
+  pollfd fds[3] = {
+    {stop_pipe[0], POLLIN, 0},
+    {ts_fd, POLLIN, 0},
+    {cn_fd, POLLIN, 0},
+  };
+  while (true) {
+    if (poll(fds, 3, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll(proc_events)");
+      break;
+    }
+    if (fds[0].revents) {
+      break;
+    }
+    // Counters of a task are sent before its exit event
+    if (ts_fd >= 0) {
+      read_taskstats();
+    }
+    read_connector();
+  }
+  pthread_mutex_lock(&event_lock);
+  events_lost = true;
+  pthread_mutex_unlock(&event_lock);
+  return NULL;
+}
+
+// Waits for the ack of the subscription, the kernel reports lacking
+// privileges only through it
+static bool cn_wait_listen_ack() {
+  timeval timeout = {1, 0};
+  setsockopt(cn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ssize_t cnt;
+  while ((cnt = recv(cn_fd, cn_buf, NETLINK_BUF_SIZE, 0)) > 0) {
+    for (auto *nl = (nlmsghdr *)cn_buf; NLMSG_OK(nl, cnt);
+         nl = NLMSG_NEXT(nl, cnt)) {
+      const auto *ev = (proc_event *)((cn_msg *)NLMSG_DATA(nl))->data;
+      if (ev->what == proc_event::PROC_EVENT_NONE) {
+        errno = ev->event_data.ack.err;
+        return !errno;
+      }
+    }
+  }
+  return false;
+}
+
+static void close_fds() {
+  for (int *fd : {&cn_fd, &ts_fd, &stop_pipe[0], &stop_pipe[1]}) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
+
+bool init_proc_events() {
+  const char *mode = getenv(SCRAPE_PROC_EVENTS_ENV);
+  if (!mode || !*mode || *mode == '0') {
+    return true;
+  }
+  if ((cn_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR))
+      < 0) {
+    perror("socket(NETLINK_CONNECTOR)");
+    return true;
+  }
+  sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  if (bind(cn_fd, (sockaddr *)&addr, sizeof(addr))
+      || !cn_send_op(PROC_CN_MCAST_LISTEN) || !cn_wait_listen_ack()) {
+    perror("proc connector");
+    fputs("warning: falling back to scraping without proc events\n", stderr);
+    close_fds();
+    return true;
+  }
+  fcntl(cn_fd, F_SETFL, fcntl(cn_fd, F_GETFL) | O_NONBLOCK);
+  if (!init_taskstats()) {
+    DEBUGOUT(perror("taskstats");)
+    fputs("warning: no taskstats, exit counters of processes are lost\n",
+          stderr);
+    if (ts_fd >= 0) {
+      close(ts_fd);
+      ts_fd = -1;
+    }
+  }
+  if (pipe2(stop_pipe, O_CLOEXEC)) {
+    perror("pipe");
+    close_fds();
+    return false;
+  }
+  if (pthread_create(&event_thread, NULL, event_loop, NULL)) {
+    perror("pthread_create");
+    close_fds();
+    return false;
+  }
+  proc_events_enabled = true;
+  return true;
+}
+
+void finalize_proc_events() {
+  if (!proc_events_enabled) {
+    return;
+  }
+  if (write(stop_pipe[1], "", 1) == 1) {
+    pthread_join(event_thread, NULL);
+  }
+  cn_send_op(PROC_CN_MCAST_IGNORE);
+  close_fds();
+  proc_events_enabled = false;
+}
+
+bool drain_proc_events(proc_event_list_t &events) {
+  events.clear();
+  pthread_mutex_lock(&event_lock);
+  events.swap(pending_events);
+  const bool lost = events_lost;
+  events_lost = false;
+  pthread_mutex_unlock(&event_lock);
+  return !lost;
+}
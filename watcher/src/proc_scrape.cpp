@@ -0,0 +1,400 @@
+#include "proc_scrape.h"
+
+#include <sys/mman.h>
+#if PROC_SCRAPE_USE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+static const char *proc_file_name[PROC_FILE_CNT] = {
+  "stat",
+  "io",
+};
+
+// Size includes terminating \0
+static const size_t proc_file_buf_size[PROC_FILE_CNT] = {
+  PROC_STAT_BUF_SIZE,
+  512,
+};
+
+struct proc_scrape_slot_t {
+  pid_t pid;
+  int fd[PROC_FILE_CNT];
+  ssize_t len[PROC_FILE_CNT];
+  char *buf[PROC_FILE_CNT];
+};
+
+static int proc_fd = -1;
+static DIR *proc_dir;
+static proc_scrape_slot_t slots[PROC_SCRAPE_BATCH];
+static char *slot_buf;
+
+static void alloc_slot_buf() {
+  size_t slot_size = 0;
+  for (int i = 0; i < PROC_FILE_CNT; i++) {
+    slot_size += proc_file_buf_size[i];
+  }
+  slot_buf = (char *)malloc(slot_size * PROC_SCRAPE_BATCH);
+  for (int i = 0; i < PROC_SCRAPE_BATCH; i++) {
+    char *cur = slot_buf + slot_size * i;
+    for (int j = 0; j < PROC_FILE_CNT; j++) {
+      slots[i].buf[j] = cur;
+      cur += proc_file_buf_size[j];
+    }
+  }
+}
+
+#if PROC_SCRAPE_USE_IO_URING
+// The kernel may still write into the buffers, so they are leaked on purpose
+static void abandon_slot_buf() {
+  alloc_slot_buf();
+}
+#endif
+
+#if PROC_SCRAPE_USE_IO_URING
+constexpr unsigned RING_ENTRIES = PROC_SCRAPE_BATCH * PROC_FILE_CNT;
+
+// Overridden by tests to get reads refused as by a kernel without the opcode
+static uint8_t ring_read_op = IORING_OP_READ;
+
+static struct {
+  int fd = -1;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+} ring;
+
+static void finalize_ring() {
+  if (ring.sqes) {
+    munmap(ring.sqes, RING_ENTRIES * sizeof(io_uring_sqe));
+  }
+  if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr) {
+    munmap(ring.cq_ptr, ring.cq_size);
+  }
+  if (ring.sq_ptr) {
+    munmap(ring.sq_ptr, ring.sq_size);
+  }
+  if (ring.fd >= 0) {
+    close(ring.fd);
+  }
+  ring = {};
+}
+
+// Kernels from 5.1 to 5.5 set up rings but fail every IORING_OP_READ with
+// -EINVAL. The probe came with the opcode in 5.6, so failing it means no
+static bool ring_supports(uint8_t op) {
+  constexpr unsigned PROBE_OPS = 256;
+  auto probe = (io_uring_probe *)
+    calloc(1, sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op));
+  const bool supported = probe
+    && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe,
+               PROBE_OPS) >= 0
+    && op < probe->ops_len && probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+  free(probe);
+  return supported;
+}
+
+static bool init_ring() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if ((ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params)) < 0) {
+    DEBUGOUT(perror("io_uring_setup"));
+    ring.fd = -1;
+    return false;
+  }
+  if (params.sq_entries < RING_ENTRIES) {
+    finalize_ring();
+    return false;
+  }
+  ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    ring.sq_size = ring.cq_size = std::max(ring.sq_size, ring.cq_size);
+  }
+  const auto map = [](size_t size, off_t offset) {
+    void *ret = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, offset);
+    return ret == MAP_FAILED ? NULL : ret;
+  };
+  ring.sq_ptr = map(ring.sq_size, IORING_OFF_SQ_RING);
+  ring.cq_ptr
+    = single_mmap ? ring.sq_ptr : map(ring.cq_size, IORING_OFF_CQ_RING);
+  ring.sqes = (io_uring_sqe *)
+    map(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+  if (!ring.sq_ptr || !ring.cq_ptr || !ring.sqes) {
+    perror("mmap(io_uring)");
+    finalize_ring();
+    return false;
+  }
+  #define RING_FIELD(PTR, OFF) (unsigned *)((char *)ring.PTR + params.OFF)
+  ring.sq_tail = RING_FIELD(sq_ptr, sq_off.tail);
+  ring.sq_mask = RING_FIELD(sq_ptr, sq_off.ring_mask);
+  ring.sq_array = RING_FIELD(sq_ptr, sq_off.array);
+  ring.cq_head = RING_FIELD(cq_ptr, cq_off.head);
+  ring.cq_tail = RING_FIELD(cq_ptr, cq_off.tail);
+  ring.cq_mask = RING_FIELD(cq_ptr, cq_off.ring_mask);
+  ring.cqes = (io_uring_cqe *)((char *)ring.cq_ptr + params.cq_off.cqes);
+  #undef RING_FIELD
+  if (!ring_supports(ring_read_op)) {
+    fputs("io_uring cannot read files on this kernel, using read()\n", stderr);
+    finalize_ring();
+    return false;
+  }
+  return true;
+}
+
+// Waits for cnt completions and stores their results into the slots. Returns
+// false if the kernel stopped reporting them. refused is set if any read
+// failed with -EINVAL, which no readable /proc file does
+static bool ring_reap(unsigned cnt, bool &refused) {
+  unsigned completed = 0;
+  refused = false;
+  while (completed < cnt) {
+    unsigned head = __atomic_load_n(ring.cq_head, __ATOMIC_RELAXED);
+    const unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    if (head == cq_tail) {
+      if (syscall(__NR_io_uring_enter, ring.fd, 0, cnt - completed,
+                  IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        perror("io_uring_enter");
+        return false;
+      }
+      continue;
+    }
+    for (; head != cq_tail; head++, completed++) {
+      const io_uring_cqe &cqe = ring.cqes[head & *ring.cq_mask];
+      auto &slot = slots[cqe.user_data / PROC_FILE_CNT];
+      slot.len[cqe.user_data % PROC_FILE_CNT] = cqe.res;
+      refused |= cqe.res == -EINVAL;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+// Returns false if nothing was submitted and caller should read by itself
+static bool ring_read_batch(int nslots) {
+  if (ring.fd < 0) {
+    return false;
+  }
+  unsigned tail = __atomic_load_n(ring.sq_tail, __ATOMIC_ACQUIRE);
+  const unsigned mask = *ring.sq_mask;
+  unsigned submitted = 0;
+  for (int i = 0; i < nslots; i++) {
+    auto &slot = slots[i];
+    for (int j = 0; j < PROC_FILE_CNT; j++) {
+      if (slot.fd[j] < 0) {
+        continue;
+      }
+      const unsigned idx = tail & mask;
+      io_uring_sqe *sqe = &ring.sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = ring_read_op;
+      sqe->fd = slot.fd[j];
+      sqe->addr = (uint64_t)slot.buf[j];
+      sqe->len = proc_file_buf_size[j] - 1;
+      sqe->off = 0;
+      sqe->user_data = i * PROC_FILE_CNT + j;
+      ring.sq_array[idx] = idx;
+      tail++;
+      submitted++;
+    }
+  }
+  if (!submitted) {
+    return true;
+  }
+  __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+  int ret = syscall(__NR_io_uring_enter, ring.fd, submitted, submitted,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+  // Errors are only returned when nothing was consumed
+  const unsigned inflight = ret < 0 ? 0 : ret;
+  if (ret < 0) {
+    perror("io_uring_enter");
+  } else if (inflight != submitted) {
+    fprintf(stderr, "io_uring_enter: %u of %u reads submitted\n", inflight,
+            submitted);
+  }
+  // Submitted reads write into the slot buffers until they complete, so they
+  // have to land before the caller may read on its own
+  bool refused;
+  const bool reaped = ring_reap(inflight, refused);
+  if (!reaped) {
+    abandon_slot_buf();
+  }
+  if (refused) {
+    fputs("io_uring refused to read files, using read()\n", stderr);
+  }
+  if (!reaped || refused || inflight != submitted) {
+    // Ring is now in an unknown state or of no use, do not reuse it
+    finalize_ring();
+    return false;
+  }
+  return true;
+}
+
+void proc_scrape_set_ring_op(uint8_t op) {
+  ring_read_op = op;
+}
+#endif
+
+bool init_proc_scrape(const char *root) {
+  if ((proc_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror("open(proc)");
+    return false;
+  }
+  // readdir works on its own copy so proc_fd stays usable for openat
+  if (!(proc_dir = fdopendir(dup(proc_fd)))) {
+    perror("fdopendir(proc)");
+    return false;
+  }
+  alloc_slot_buf();
+  #if PROC_SCRAPE_USE_IO_URING
+  init_ring();
+  #endif
+  return true;
+}
+
+bool proc_scrape_uses_ring() {
+  #if PROC_SCRAPE_USE_IO_URING
+  return ring.fd >= 0;
+  #else
+  return false;
+  #endif
+}
+
+void finalize_proc_scrape() {
+  #if PROC_SCRAPE_USE_IO_URING
+  finalize_ring();
+  #endif
+  if (proc_dir) {
+    closedir(proc_dir);
+    proc_dir = NULL;
+  }
+  if (proc_fd >= 0) {
+    close(proc_fd);
+    proc_fd = -1;
+  }
+  free(slot_buf);
+  slot_buf = NULL;
+}
+
+ssize_t read_proc_file(int dir_fd, const char *name, char *buf, size_t size) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t cnt = read(fd, buf, size - 1);
+  close(fd);
+  buf[cnt < 0 ? 0 : cnt] = '\0';
+  return cnt;
+}
+
+ssize_t read_proc_pid_file(
+  pid_t pid, const char *name, char *buf, size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%d/%s", pid, name);
+  return read_proc_file(proc_fd, path, buf, size);
+}
+
+bool proc_pid_exited(pid_t pid) {
+  char name[16];
+  snprintf(name, sizeof(name), "%d", pid);
+  return faccessat(proc_fd, name, F_OK, 0) && errno == ENOENT;
+}
+
+static inline void scrape_batch(
+  int nslots, const proc_reading_callback_t &callback) {
+  bool read_done = false;
+  #if PROC_SCRAPE_USE_IO_URING
+  read_done = ring_read_batch(nslots);
+  #endif
+  proc_reading_t reading;
+  for (int i = 0; i < nslots; i++) {
+    auto &slot = slots[i];
+    reading.pid = slot.pid;
+    for (int j = 0; j < PROC_FILE_CNT; j++) {
+      auto &len = slot.len[j];
+      if (slot.fd[j] >= 0) {
+        if (!read_done) {
+          len = read(slot.fd[j], slot.buf[j], proc_file_buf_size[j] - 1);
+        }
+        close(slot.fd[j]);
+      } else {
+        len = -1;
+      }
+      slot.buf[j][len < 0 ? 0 : len] = '\0';
+      reading.buf[j] = slot.buf[j];
+      reading.len[j] = len;
+    }
+    callback(reading);
+  }
+}
+
+// Files are opened relative to proc_fd so that a process costs no more than
+// one openat and close per file. Returns false if the process is already gone
+static inline bool open_slot(proc_scrape_slot_t &slot, pid_t pid) {
+  // A pid and the longest of proc_file_name
+  char path[sizeof("-2147483648/stat")];
+  for (int j = 0; j < PROC_FILE_CNT; j++) {
+    snprintf(path, sizeof(path), "%d/%s", pid, proc_file_name[j]);
+    slot.fd[j] = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+  }
+  if (slot.fd[PROC_FILE_STAT] < 0) {
+    for (int j = 0; j < PROC_FILE_CNT; j++) {
+      if (slot.fd[j] >= 0) {
+        close(slot.fd[j]);
+      }
+    }
+    return false;
+  }
+  slot.pid = pid;
+  return true;
+}
+
+void scrape_proc(const proc_reading_callback_t &callback) {
+  if (!proc_dir) {
+    return;
+  }
+  rewinddir(proc_dir);
+  int nslots = 0;
+  while (auto entry = readdir(proc_dir)) {
+    const char *name = entry->d_name;
+    if (*name < '0' || *name > '9') {
+      continue;
+    }
+    const pid_t pid = atoi(name);
+    // Exited after being listed otherwise
+    if (open_slot(slots[nslots], pid) && ++nslots == PROC_SCRAPE_BATCH) {
+      scrape_batch(nslots, callback);
+      nslots = 0;
+    }
+  }
+  if (nslots) {
+    scrape_batch(nslots, callback);
+  }
+}
+
+void scrape_proc_pids(
+  const std::vector<pid_t> &pids, const proc_reading_callback_t &callback) {
+  if (proc_fd < 0) {
+    return;
+  }
+  int nslots = 0;
+  for (const auto &pid : pids) {
+    if (open_slot(slots[nslots], pid) && ++nslots == PROC_SCRAPE_BATCH) {
+      scrape_batch(nslots, callback);
+      nslots = 0;
+    }
+  }
+  if (nslots) {
+    scrape_batch(nslots, callback);
+  }
+}
@@ -0,0 +1,373 @@
+#include "proc_tree.h"
+
+static inline void unlink_cached_child(
+  process_tree_t &child, pid_t ppid, pid_t pid) {
+  auto it = child.find(ppid);
+  if (it == child.end()) {
+    return;
+  }
+  auto &childs = it->second;
+  auto pos = std::find(childs.begin(), childs.end(), pid);
+  if (pos != childs.end()) {
+    *pos = childs.back();
+    childs.pop_back();
+  }
+}
+
+static inline void evict_cached_process(process_cache_t &cache, pid_t pid) {
+  auto it = cache.processes.find(pid);
+  if (it != cache.processes.end()) {
+    unlink_cached_child(cache.child, it->second.ppid, pid);
+    cache.processes.erase(it);
+  }
+  // Remaining children are linked again once seen with their new parent
+  cache.child.erase(pid);
+  cache.result.erase(pid);
+  cache.stepd_pids.erase(pid);
+  cache.exited_children.erase(pid);
+}
+
+static inline pid_t find_cached_stepd(const process_cache_t &cache, pid_t pid) {
+  // Bounded in case of a stale loop in the tree
+  for (int depth = 0; pid && depth < 256; depth++) {
+    if (cache.stepd_pids.count(pid)) {
+      return pid;
+    }
+    auto it = cache.processes.find(pid);
+    if (it == cache.processes.end()) {
+      break;
+    }
+    pid = it->second.ppid;
+  }
+  return 0;
+}
+
+static inline void apply_proc_events(
+  process_cache_t &cache, const proc_event_list_t &events) {
+  auto &processes = cache.processes;
+  for (const auto &event : events) {
+    const pid_t pid = event.pid;
+    auto it = processes.find(pid);
+    switch (event.type) {
+    case PROC_EVENT_TYPE_FORK:
+      if (it != processes.end()) {
+        // Exit was missed
+        evict_cached_process(cache, pid);
+      }
+      // Swept at the end of next scrape if it is never seen there
+      processes[pid] = {0, event.ppid, cache.generation, true};
+      cache.child[event.ppid].push_back(pid);
+      break;
+    case PROC_EVENT_TYPE_EXEC:
+      if (it != processes.end()) {
+        it->second.stale_cmdline = true;
+      }
+      break;
+    case PROC_EVENT_TYPE_EXIT: {
+      if (it == processes.end()) {
+        break;
+      }
+      const pid_t ppid = it->second.ppid;
+      if (processes.count(ppid)) {
+        auto &STAT_MERGE_DST = cache.exited_children[ppid];
+        auto exited = cache.exited_children.find(pid);
+        if (exited != cache.exited_children.end()) {
+          // Grandchildren that exited before
+          const auto &STAT_MERGE_SRC = exited->second;
+          ACCUMULATE_PRIVILEGED_SCRAPER_STAT(rchar);
+          ACCUMULATE_PRIVILEGED_SCRAPER_STAT(wchar);
+          AGGERGATE_SCRAPER_STAT_MAX(res);
+        }
+        if (event.has_stats) {
+          // cpu time is in c____ of the parent once reaped
+          const auto &STAT_MERGE_SRC = event.stat;
+          ACCUMULATE_PRIVILEGED_SCRAPER_STAT(rchar);
+          ACCUMULATE_PRIVILEGED_SCRAPER_STAT(wchar);
+          AGGERGATE_SCRAPER_STAT_MAX(res);
+        }
+      }
+      const pid_t stepd = find_cached_stepd(cache, ppid);
+      if (stepd && *event.stat.comm) {
+        const auto &step = cache.stepd_pids.at(stepd);
+        cache.exited_apps[std::make_pair(step.job_id, step.step_id)].emplace(
+          std::string(event.stat.comm));
+      }
+      evict_cached_process(cache, pid);
+      break;
+    }
+    }
+  }
+}
+
+void fetch_proc_stats(process_cache_t &cache,
+                      cgroup_cpu_available_map_t &jobstep_cpu_available) {
+  auto &child = cache.child;
+  auto &result = cache.result;
+  auto &stepd_pids = cache.stepd_pids;
+  // The tree is only rediscovered from /proc when events could not keep it
+  bool rescan = true;
+  if (proc_events_enabled) {
+    proc_event_list_t events;
+    rescan = !drain_proc_events(events) || !cache.generation;
+    apply_proc_events(cache, events);
+  }
+  const uint32_t generation = ++cache.generation;
+  const size_t page_size = sysconf(_SC_PAGE_SIZE);
+  const char *slurm_cgroup_mount_point
+    = getenv(SLURM_CGROUP_MOUNT_POINT_ENV);
+  const std::string slurm_cgroup_mount_point_str
+    = std::string(slurm_cgroup_mount_point ? slurm_cgroup_mount_point : "");
+  char buf[READ_BUF_SIZE];
+  scrape_result_t cur_result;
+  memset(&cur_result, 0, sizeof(cur_result));
+  /* Build process tree and get stats */
+  const auto on_reading = [&](const proc_reading_t &reading) {
+    const pid_t pid = reading.pid;
+    pid_t ppid = 0;
+    size_t starttime = 0;
+    bool success = 0;
+    {
+      const auto cnt = reading.len[PROC_FILE_STAT];
+      if (cnt <= 0) {
+        return;
+      }
+      const char *buf = reading.buf[PROC_FILE_STAT];
+      const char *end = buf + cnt;
+      const char *cur = buf;
+      int col = 1;
+      size_t val = 0;
+      for (; !success && cur != end; cur++) {
+        const char c = *cur;
+        // printf("%c[%ld]  ", c, val); fflush(stdout);
+        if (c == ' ') {
+          #define ASSIGNRAW(COL, ASSIGNMENT, ...) \
+            case COL: ASSIGNMENT = val; __VA_ARGS__ break;
+          #define ASSIGN(COL, ASSIGNMENT, ...) \
+            ASSIGNRAW(COL, cur_result.ASSIGNMENT, __VA_ARGS__)
+          #define ASSIGNLAST(COL, ASSIGNMENT) \
+            ASSIGN(COL, ASSIGNMENT, success = 1;)
+          switch (col) {
+            ASSIGN(1, pid);
+            ASSIGNRAW(4, ppid);
+            ASSIGN(10, minor_pagefault);
+            ASSIGN(11, cminor_pagefault);
+            ASSIGN(14, utime);
+            ASSIGN(15, stime);
+            ASSIGN(16, cutime);
+            ASSIGN(17, cstime);
+            ASSIGNRAW(22, starttime);
+            ASSIGNLAST(24, res);
+          }
+          #undef ASSIGNLAST
+          #undef ASSIGNRAW
+          #undef ASSIGN
+          col++;
+          val = 0;
+          continue;
+        } else if (c >= '0' && c <= '9') {
+          val = val * 10 + c - '0';
+        } else if (c == '(') {
+          assert(col == 2 /*(comm)*/);
+          if (col != 2) {
+            fprintf(stderr,
+              "error: unrecognized proc/stat format having character "
+              ") outside field 2\n");
+            break;
+          }
+          const char *tail = NULL;
+          const char *search_end = end - 1;
+          for (auto end = search_end; end > cur; end--)
+            if (*end == ')') {
+              tail = end - 1;
+              break;
+            }
+          if (!tail) {
+            fprintf(stderr,
+                    "Error: Could not locate end of comm field in the"
+                    "following proc/stat data [%ld bytes read]:\n", cnt);
+            for (auto i = buf; i != end; i++) {
+              if (i == cur) {
+                fputs(">>>", stderr);
+              }
+              fputc(*i, stderr);
+              if (i == search_end) {
+                fputs("<<<", stderr);
+              }
+            }
+            fputs("\n", stderr);
+            break;
+          }
+          int comm_len = std::min(tail - cur, (long)TASK_COMM_LEN);
+          for (auto i = 0; i < comm_len; i++)
+            cur_result.comm[i] = cur[i + 1];
+          cur_result.comm[comm_len] = '\0';
+          cur = tail;
+        }
+      }
+      if (!success) {
+        // Did not reach last column
+        return;
+      } else {
+        cur_result.res *= page_size;
+      }
+    }
+    if (reading.len[PROC_FILE_IO] <= 0
+        || sscanf(reading.buf[PROC_FILE_IO], "rchar: %ld wchar: %ld",
+                  &cur_result.rchar, &cur_result.wchar) != 2) {
+      cur_result.rchar = cur_result.wchar = PRIVILEGED_STAT_NULL;
+    }
+    DEBUGOUT_VERBOSE(
+      fprintf(stderr,
+        "\n[%s] %d res=%ld minor=%ld utime=%ld stime=%ld rchar=%ld wchar=%ld\n",
+        cur_result.comm, pid, cur_result.res,
+        cur_result.minor_pagefault, cur_result.utime, cur_result.stime,
+        cur_result.rchar, cur_result.wchar);
+    );
+    auto cached = cache.processes.find(pid);
+    if (cached != cache.processes.end() && cached->second.starttime
+        && cached->second.starttime != starttime) {
+      // pid reused since last scrape
+      evict_cached_process(cache, pid);
+      cached = cache.processes.end();
+    }
+    bool stale_cmdline = true;
+    if (cached == cache.processes.end()) {
+      cache.processes[pid] = {starttime, ppid, generation, false};
+      child[ppid].push_back(pid);
+    } else {
+      auto &process = cached->second;
+      if (process.ppid != ppid) {
+        // Reparented after its parent exited
+        unlink_cached_child(child, process.ppid, pid);
+        child[ppid].push_back(pid);
+        process.ppid = ppid;
+      }
+      process.starttime = starttime;
+      process.generation = generation;
+      stale_cmdline = process.stale_cmdline;
+      process.stale_cmdline = false;
+    }
+    if (stale_cmdline) {
+      stepd_pids.erase(pid);
+    }
+    // slurmstepd only sets its title some time after it started, so until
+    // one shows a step its cmdline is looked at again on every scrape
+    const bool unresolved_stepd = !stepd_pids.count(pid)
+                                  && !strcmp(cur_result.comm, SLURMSTEPD_COMM);
+    // A fresh fork of slurmstepd still shows its cmdline until it execs,
+    // it is accounted as a child of the stepd rather than a stepd itself
+    if ((stale_cmdline || unresolved_stepd) && !stepd_pids.count(ppid)
+        && read_proc_pid_file(
+          pid, "cmdline", buf, READ_BUF_SIZE) > 0) {
+      const char *cmdline = buf;
+      slurm_step_id_t step;
+      int consumed = 0;
+      #define STEP_MAX_LENGTH 32
+      char step_str[STEP_MAX_LENGTH + 1];
+      // Step string must be the end of the first argument
+      if (sscanf(cmdline, "slurmstepd: [%d.%" STRINGIFY(STEP_MAX_LENGTH) "s%n",
+                 &step.job_id, step_str, &consumed) == 2
+          && !cmdline[consumed]) {
+        // From slurm protocol definition source, reordered with possibility
+        #include "def/slurm_stepid.inc"
+        const auto &mapping = slurm_stepid_mapping;
+        bool found_stepid = sscanf(step_str, "%d]", &step.step_id);
+        if (!found_stepid) {
+          size_t len = strlen(step_str) - 1;
+          if (step_str[len] == ']') {
+            step_str[len] = '\0';
+            for (auto *cur = mapping; cur->name; cur++) {
+              if (*step_str == *(cur->name) && !strcmp(step_str, cur->name)) {
+                step.step_id = cur->stepid;
+                found_stepid = true;
+                break;
+              }
+            }
+          }
+        }
+        if (found_stepid) {
+          stepd_pids[pid] = step;
+        }
+      }
+      #undef STEP_MAX_LENGTH
+    }
+    // Retried on every scrape until the step cgroup is readable
+    auto stepd = stepd_pids.find(pid);
+    if (stepd != stepd_pids.end() && slurm_cgroup_mount_point_str.length()) {
+      const auto &step = stepd->second;
+      auto jobstep_pair = std::make_pair(step.job_id, step.step_id);
+      if (!jobstep_cpu_available.count(jobstep_pair)
+          && read_proc_pid_file(
+               pid, "cpuset", buf, READ_BUF_SIZE) > 0) {
+        std::string cgroup_path
+          = slurm_cgroup_mount_point_str + std::string("/cpuset");
+        cgroup_path += std::string(buf);
+        cgroup_path.pop_back();
+        cgroup_path += std::string("/cpuset.effective_cpus");
+        DEBUGOUT(fprintf(stderr, "%s\n", cgroup_path.c_str());)
+        int ncpu = read_cpuset_cpu_cnt(cgroup_path.c_str());
+        DEBUGOUT(
+          fprintf(stderr, "fetch: %d.%d available cpu %d\n",
+                  step.job_id, step.step_id, ncpu);
+        )
+        if (ncpu >= 0) {
+          jobstep_cpu_available.try_emplace(jobstep_pair, ncpu);
+        }
+      }
+    }
+    auto &my_result = result[pid] = cur_result;
+    auto exited = cache.exited_children.find(pid);
+    if (exited != cache.exited_children.end()) {
+      const auto &STAT_MERGE_SRC = exited->second;
+      auto &STAT_MERGE_DST = my_result;
+      ACCUMULATE_PRIVILEGED_SCRAPER_STAT(rchar);
+      ACCUMULATE_PRIVILEGED_SCRAPER_STAT(wchar);
+      AGGERGATE_SCRAPER_STAT_MAX(res);
+      cache.exited_children.erase(exited);
+    }
+    if (proc_events_enabled) {
+      // Exits are already known exactly
+      return;
+    }
+    // Only children already scraped in this round carry fresh counters
+    auto &childs = child[pid];
+    for (size_t i = 0; i < childs.size();) {
+      const pid_t cpid = childs[i];
+      auto cached_child = cache.processes.find(cpid);
+      if (cached_child != cache.processes.end()
+          && cached_child->second.generation == generation
+          && proc_pid_exited(cpid)) {
+        // child has terminated approximately at the time of scraping parent
+        // this would double count the c____ fields
+        const auto &STAT_MERGE_SRC = result[cpid];
+        auto &STAT_MERGE_DST = result[pid];
+        ACCUMULATE_PRIVILEGED_SCRAPER_STAT(rchar);
+        ACCUMULATE_PRIVILEGED_SCRAPER_STAT(wchar);
+        AGGERGATE_SCRAPER_STAT_MAX(res);
+        // Swaps the last child into position i
+        evict_cached_process(cache, cpid);
+        continue;
+      }
+      i++;
+    }
+  };
+  if (rescan) {
+    scrape_proc(on_reading);
+  } else {
+    std::vector<pid_t> pids;
+    pids.reserve(cache.processes.size());
+    for (const auto &[pid, process] : cache.processes) {
+      pids.push_back(pid);
+    }
+    scrape_proc_pids(pids, on_reading);
+  }
+  std::vector<pid_t> exited;
+  for (const auto &[pid, process] : cache.processes) {
+    if (process.generation != generation) {
+      exited.push_back(pid);
+    }
+  }
+  for (const auto &pid : exited) {
+    evict_cached_process(cache, pid);
+  }
+}
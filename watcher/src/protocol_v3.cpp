@@ -0,0 +1,204 @@
+#include "protocol_v3.h"
+
+static inline void put_varint(std::string &out, uint64_t val) {
+  while (val >= 0x80) {
+    out.push_back((char)(val | 0x80));
+    val >>= 7;
+  }
+  out.push_back((char)val);
+}
+
+static inline void put_delta(std::string &out, uint64_t val, uint64_t prev) {
+  const int64_t delta = (int64_t)(val - prev);
+  put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+struct v3_reader_t {
+  const char *cur;
+  const char *end;
+  bool ok = true;
+
+  uint64_t varint() {
+    uint64_t val = 0;
+    for (int shift = 0; shift < 64 && cur != end; shift += 7) {
+      const uint8_t byte = *cur++;
+      val |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return val;
+      }
+    }
+    ok = false;
+    return 0;
+  }
+
+  uint64_t delta(uint64_t prev) {
+    const uint64_t zigzag = varint();
+    return prev + (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+  }
+};
+
+static inline uint32_t v3_string_id(
+  v3_state_t &state, std::string &payload, const char *str) {
+  auto it = state.string_ids.find(str);
+  if (it != state.string_ids.end()) {
+    return it->second;
+  }
+  const uint32_t id = state.string_ids.size();
+  state.string_ids.emplace(str, id);
+  const size_t len = strlen(str);
+  put_varint(payload, V3_RECORD_STRING);
+  put_varint(payload, len);
+  payload.append(str, len);
+  return id;
+}
+
+#define V3_PUT_DELTAS(OUT, CUR, PREV) \
+  put_delta(OUT, CUR.res, PREV.res); \
+  put_delta(OUT, CUR.minor_pagefault, PREV.minor_pagefault); \
+  put_delta(OUT, CUR.utime, PREV.utime); \
+  put_delta(OUT, CUR.stime, PREV.stime); \
+  put_delta(OUT, CUR.rchar, PREV.rchar); \
+  put_delta(OUT, CUR.wchar, PREV.wchar); \
+  put_delta(OUT, CUR.peak_mem_usage, PREV.peak_mem_usage);
+
+#define V3_GET_DELTAS(IN, CUR) \
+  CUR.res = IN.delta(CUR.res); \
+  CUR.minor_pagefault = IN.delta(CUR.minor_pagefault); \
+  CUR.utime = IN.delta(CUR.utime); \
+  CUR.stime = IN.delta(CUR.stime); \
+  CUR.rchar = IN.delta(CUR.rchar); \
+  CUR.wchar = IN.delta(CUR.wchar); \
+  CUR.peak_mem_usage = IN.delta(CUR.peak_mem_usage);
+
+void v3_encode_batch(
+  v3_state_t &state, const batch_t &batch, std::string &payload) {
+  const char *hostname = batch.header.worker.hostname;
+  if (hostname && state.hostname != hostname) {
+    state.hostname = hostname;
+    const uint32_t id = v3_string_id(state, payload, hostname);
+    put_varint(payload, V3_RECORD_HOSTNAME);
+    put_varint(payload, id);
+  }
+  auto gpu_front = batch.gpu_results.begin();
+  for (const auto &result : batch.results) {
+    auto &prev = state.last_results[
+      std::make_pair(result.step.job_id, result.step.step_id)];
+    put_varint(payload, V3_RECORD_RESULT);
+    put_varint(payload, result.step.job_id);
+    put_varint(payload, result.step.step_id);
+    put_varint(payload, result.gpu_measurement_cnt);
+    V3_PUT_DELTAS(payload, result, prev);
+    prev = result;
+    for (int i = 0; i < result.gpu_measurement_cnt; i++, gpu_front++) {
+      put_varint(payload, gpu_front->gpu_id);
+      put_varint(payload, gpu_front->pid);
+      put_varint(payload, gpu_front->age);
+      put_varint(payload, gpu_front->temp);
+      put_varint(payload, gpu_front->sm_clock);
+      put_varint(payload, gpu_front->util);
+      put_varint(payload, gpu_front->power_usage);
+      put_varint(payload, gpu_front->clock_limit_reason_mask);
+      put_varint(payload, gpu_front->step.job_id);
+      put_varint(payload, gpu_front->step.step_id);
+      put_varint(payload, gpu_front->source);
+    }
+  }
+  for (const auto &usage : batch.usages) {
+    const uint32_t id = v3_string_id(
+      state, payload, batch.strings.str(usage.app));
+    put_varint(payload, V3_RECORD_USAGE);
+    put_varint(payload, usage.step.job_id);
+    put_varint(payload, usage.step.step_id);
+    put_varint(payload, id);
+  }
+  for (const auto &info : batch.cpu_available_infos) {
+    put_varint(payload, V3_RECORD_CPU_AVAILABLE);
+    put_varint(payload, info.step.job_id);
+    put_varint(payload, info.step.step_id);
+    put_varint(payload, info.cpu_available);
+  }
+  put_varint(payload, V3_RECORD_END);
+}
+
+bool v3_decode_batch(
+  v3_state_t &state, const std::string &payload, batch_t &batch) {
+  auto &results = batch.results;
+  auto &gpu_results = batch.gpu_results;
+  auto &usages = batch.usages;
+  auto &cpu_available_infos = batch.cpu_available_infos;
+  v3_reader_t in = {payload.data(), payload.data() + payload.size()};
+  const auto read_step = [&](slurm_step_id_t &step) {
+    step.job_id = in.varint();
+    step.step_id = in.varint();
+    step.step_het_comp = NO_VAL;
+  };
+  const auto read_string = [&]() -> const std::string * {
+    const uint64_t id = in.varint();
+    if (id >= state.strings.size()) {
+      in.ok = false;
+      return NULL;
+    }
+    return &state.strings[id];
+  };
+  while (in.ok) {
+    switch (in.varint()) {
+    case V3_RECORD_END:
+      return in.ok && in.cur == in.end;
+    case V3_RECORD_STRING: {
+      const uint64_t len = in.varint();
+      if (len >= INIT_BUF_SIZE || len > (uint64_t)(in.end - in.cur)) {
+        return false;
+      }
+      state.strings.emplace_back(in.cur, len);
+      in.cur += len;
+      break;
+    }
+    case V3_RECORD_HOSTNAME:
+      if (auto str = read_string()) {
+        state.hostname = *str;
+      }
+      break;
+    case V3_RECORD_RESULT: {
+      slurm_step_id_t step;
+      read_step(step);
+      auto &result
+        = state.last_results[std::make_pair(step.job_id, step.step_id)];
+      result.step = step;
+      result.gpu_measurement_cnt = in.varint();
+      V3_GET_DELTAS(in, result);
+      results.push_back(result);
+      for (int i = 0; in.ok && i < result.gpu_measurement_cnt; i++) {
+        gpu_results.emplace_back();
+        auto &gpu_result = gpu_results.back();
+        gpu_result.gpu_id = in.varint();
+        gpu_result.pid = in.varint();
+        gpu_result.age = in.varint();
+        gpu_result.temp = in.varint();
+        gpu_result.sm_clock = in.varint();
+        gpu_result.util = in.varint();
+        gpu_result.power_usage = in.varint();
+        gpu_result.clock_limit_reason_mask = in.varint();
+        read_step(gpu_result.step);
+        // Source of the scraper, not of this process
+        gpu_result.source = in.varint();
+      }
+      break;
+    }
+    case V3_RECORD_USAGE:
+      usages.emplace_back();
+      read_step(usages.back().step);
+      if (auto str = read_string()) {
+        usages.back().app = batch.strings.intern(str->data(), str->size());
+      }
+      break;
+    case V3_RECORD_CPU_AVAILABLE:
+      cpu_available_infos.emplace_back();
+      read_step(cpu_available_infos.back().step);
+      cpu_available_infos.back().cpu_available = in.varint();
+      break;
+    default:
+      return false;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,193 @@
+#include "report_sections.h"
+
+report_letter_t::~report_letter_t() {
+  for (auto &file : files) {
+    if (file.fp) {
+      fclose(file.fp);
+    }
+    free(file.buf);
+  }
+}
+
+FILE *report_letter_t::open(const std::string &name) {
+  auto &file = files.emplace_back();
+  file.name = name;
+  file.fp = open_memstream(&file.buf, &file.len);
+  if (!file.fp) {
+    perror("open_memstream");
+  }
+  return file.fp;
+}
+
+void report_letter_t::close(FILE *fp) {
+  for (auto &file : files) {
+    if (file.fp == fp) {
+      fclose(fp);
+      file.fp = NULL;
+      return;
+    }
+  }
+}
+
+void report_letter_t::mark(FILE *fp, const std::string &machine_name,
+                           const std::string &name, bool shared) {
+  for (size_t i = 0; i < files.size(); i++) {
+    if (files[i].fp == fp) {
+      marks.push_back({i, (size_t)ftell(fp),
+                       report_section_t{machine_name, name, shared, ""}});
+      return;
+    }
+  }
+}
+
+void report_letter_t::end(FILE *fp) {
+  for (size_t i = 0; i < files.size(); i++) {
+    if (files[i].fp == fp) {
+      marks.push_back({i, (size_t)ftell(fp), std::nullopt});
+      return;
+    }
+  }
+}
+
+std::vector<report_section_t> report_letter_t::sections(
+  const std::string &from, const std::string &to) const {
+  std::vector<report_section_t> sections;
+  for (size_t i = 0; i < files.size(); i++) {
+    const auto &file = files[i];
+    const mark_t *last = NULL;
+    const auto add_last = [&](size_t offset) {
+      if (!last || !last->section) {
+        return;
+      }
+      auto &section = sections.emplace_back(*last->section);
+      section.html.assign(file.buf + last->offset, offset - last->offset);
+      if (from.empty()) {
+        return;
+      }
+      for (size_t pos = 0;
+           (pos = section.html.find(from, pos)) != std::string::npos;
+           pos += to.size()) {
+        section.html.replace(pos, from.size(), to);
+      }
+    };
+    for (const auto &mark : marks) {
+      if (mark.file == i) {
+        add_last(mark.offset);
+        last = &mark;
+      }
+    }
+    add_last(file.len);
+  }
+  return sections;
+}
+
+std::string report_json_quote(const std::string &str) {
+  std::string out;
+  // Letters are mostly HTML without quotes or newlines to escape, so the runs
+  // of characters in between are copied at once
+  out.reserve(str.size() + str.size() / 16 + 2);
+  out += '"';
+  size_t run = 0;
+  for (size_t i = 0; i < str.size(); i++) {
+    const char c = str[i];
+    if (c != '"' && c != '\\' && (unsigned char)c >= 0x20) {
+      continue;
+    }
+    out.append(str, run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+    }
+  }
+  out.append(str, run);
+  out += '"';
+  return out;
+}
+
+std::string report_section_id(const std::string &html) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char c : html) {
+    hash = (hash ^ (unsigned char)c) * 0x100000001b3ULL;
+  }
+  char id[17];
+  snprintf(id, sizeof(id), "%016llx", (unsigned long long)hash);
+  return id;
+}
+
+void report_add_shard(archive_part_t &part, const std::string &user,
+                      const std::optional<std::string> &json,
+                      const std::vector<report_section_t> &sections) {
+  std::string shard = "{\"data\":{" + json.value_or("") + "},\"sections\":{";
+  bool first = true;
+  for (const auto &section : sections) {
+    if (section.shared) {
+      continue;
+    }
+    if (!first) {
+      shard += ',';
+    }
+    first = false;
+    shard += report_json_quote(section.machine_name) + ':'
+             + report_json_quote(section.html);
+  }
+  shard += "}}";
+  part.add_file("users/" + user + ".json", shard);
+}
+
+void report_index_t::add_user(const std::string &user,
+                              const std::vector<report_section_t> &sections) {
+  users_json += users_json.empty() ? "" : ",";
+  users_json += report_json_quote(user) + ":[";
+  bool first = true;
+  for (const auto &section : sections) {
+    std::string id;
+    if (section.shared) {
+      id = report_section_id(section.html);
+      store.emplace(id, &section.html);
+    }
+    names[section.machine_name] = section.name;
+    if (!first) {
+      users_json += ',';
+    }
+    first = false;
+    users_json += '[' + report_json_quote(section.machine_name) + ','
+                  + report_json_quote(id) + ']';
+  }
+  users_json += ']';
+}
+
+void report_index_t::add_files(archive_part_t &part, time_t started,
+                               time_t updated) const {
+  std::string index = "{\"started\":" + std::to_string(started)
+                      + ",\"updated\":" + std::to_string(updated)
+                      + ",\"names\":{";
+  bool first = true;
+  for (const auto &[machine_name, name] : names) {
+    if (!first) {
+      index += ',';
+    }
+    first = false;
+    index += report_json_quote(machine_name) + ':' + report_json_quote(name);
+  }
+  index += "},\"users\":{" + users_json + "}}";
+  part.add_file("index.json", index);
+  for (const auto &[id, html] : store) {
+    part.add_file("sections/" + id + ".html", *html);
+  }
+}
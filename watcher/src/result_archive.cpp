@@ -0,0 +1,203 @@
+#include "result_archive.h"
+
+#include <zlib.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_END_BLOCKS 2
+
+// The fields of a ustar header this writer sets, the rest are zero
+struct tar_header_t {
+  char name[TAR_NAME_SIZE];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char pad[247];
+};
+static_assert(sizeof(tar_header_t) == TAR_BLOCK_SIZE);
+
+static void add_entry(std::string &tar, const std::string &name, char type,
+                      const std::string &data) {
+  tar_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.name, name.c_str(),
+         std::min(name.size(), (size_t)TAR_NAME_SIZE));
+  snprintf(header.mode, sizeof(header.mode), "%07o", 0644);
+  snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+  snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+  snprintf(header.size, sizeof(header.size), "%011llo",
+           (unsigned long long)data.size());
+  snprintf(header.mtime, sizeof(header.mtime), "%011llo",
+           (unsigned long long)time(NULL));
+  header.typeflag = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+  // Summed with the checksum as spaces
+  memset(header.chksum, ' ', sizeof(header.chksum));
+  unsigned int chksum = 0;
+  for (size_t i = 0; i < sizeof(header); i++) {
+    chksum += ((const unsigned char *)&header)[i];
+  }
+  snprintf(header.chksum, sizeof(header.chksum), "%06o", chksum);
+
+  tar.append((const char *)&header, sizeof(header));
+  tar += data;
+  tar.append((TAR_BLOCK_SIZE - data.size() % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE,
+             '\0');
+}
+
+void archive_part_t::add_file(const std::string &name,
+                              const std::string &data) {
+  if (name.size() > TAR_NAME_SIZE) {
+    // A record is its length in decimal, which counts itself
+    const std::string record = " path=" + name + "\n";
+    size_t len = record.size() + 1;
+    while (std::to_string(len).size() + record.size() != len) {
+      len++;
+    }
+    add_entry(tar, "././@PaxHeader", 'x', std::to_string(len) + record);
+  }
+  add_entry(tar, name, '0', data);
+}
+
+// Into a gzip member of its own appended to out
+static bool gzip_member(const char *buf, size_t len, std::string &out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 over the window bits asks for the gzip header and trailer
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "deflateInit2: %s\n", stream.msg ? stream.msg : "");
+    return false;
+  }
+  const size_t start = out.size();
+  out.resize(start + deflateBound(&stream, len));
+  stream.next_in = (Bytef *)buf;
+  stream.avail_in = len;
+  stream.next_out = (Bytef *)&out[start];
+  stream.avail_out = out.size() - start;
+  const int ret = deflate(&stream, Z_FINISH);
+  out.resize(start + stream.total_out);
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    fprintf(stderr, "deflate: %d\n", ret);
+    return false;
+  }
+  return true;
+}
+
+// Compresses every threads-th block from first on
+struct compress_task_t {
+  const std::string *tar;
+  size_t first;
+  size_t threads;
+  std::vector<std::string> *blocks;
+  bool ok;
+};
+
+static void *compress_blocks(void *arg) {
+  auto &task = *(compress_task_t *)arg;
+  for (size_t i = task.first; task.ok && i < task.blocks->size();
+       i += task.threads) {
+    const size_t offset = i * ARCHIVE_BLOCK_SIZE;
+    task.ok = gzip_member(
+      task.tar->data() + offset,
+      std::min(task.tar->size() - offset, (size_t)ARCHIVE_BLOCK_SIZE),
+      (*task.blocks)[i]);
+  }
+  return NULL;
+}
+
+bool archive_part_t::compress(size_t threads) {
+  std::vector<std::string> blocks(
+    (tar.size() + ARCHIVE_BLOCK_SIZE - 1) / ARCHIVE_BLOCK_SIZE);
+  threads = std::clamp<size_t>(threads, 1, std::max<size_t>(blocks.size(), 1));
+  std::vector<compress_task_t> tasks(threads);
+  std::vector<pthread_t> tids(threads);
+  size_t started = 1;
+  for (size_t i = 0; i < threads; i++) {
+    tasks[i] = {&tar, i, threads, &blocks, true};
+  }
+  // The calling thread takes the first share
+  for (; started < threads; started++) {
+    if (pthread_create(&tids[started], NULL, compress_blocks,
+                       &tasks[started])) {
+      perror("pthread_create");
+      break;
+    }
+  }
+  compress_blocks(&tasks[0]);
+  bool ok = true;
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(tids[i], NULL);
+    ok &= tasks[i].ok;
+  }
+  ok &= tasks[0].ok && started == threads;
+  tar.clear();
+  tar.shrink_to_fit();
+  for (const auto &block : blocks) {
+    gz += block;
+  }
+  return ok;
+}
+
+static bool write_all(int fd, const std::string &buf) {
+  for (size_t done = 0; done < buf.size();) {
+    const ssize_t ret = write(fd, buf.data() + done, buf.size() - done);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      return false;
+    }
+    done += ret;
+  }
+  return true;
+}
+
+bool archive_write(const std::string &path,
+                   const std::vector<const archive_part_t *> &parts) {
+  static const std::string end = []() {
+    std::string end;
+    const std::string zeros(TAR_END_BLOCKS * TAR_BLOCK_SIZE, '\0');
+    if (!gzip_member(zeros.data(), zeros.size(), end)) {
+      end.clear();
+    }
+    return end;
+  }();
+  if (end.empty()) {
+    return false;
+  }
+  const std::string tmp_path = path + ".tmp";
+  const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+  bool ok = true;
+  for (const auto part : parts) {
+    ok = ok && write_all(fd, part->gz);
+  }
+  ok = ok && write_all(fd, end);
+  if (ok && fsync(fd)) {
+    perror("fsync");
+    ok = false;
+  }
+  close(fd);
+  if (ok && rename(tmp_path.c_str(), path.c_str())) {
+    perror("rename");
+    ok = false;
+  }
+  if (!ok) {
+    unlink(tmp_path.c_str());
+  }
+  return ok;
+}
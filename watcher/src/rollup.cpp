@@ -0,0 +1,326 @@
+#include "rollup.h"
+#include "stmts.h"
+
+#include <cmath>
+#include <tuple>
+
+typedef std::tuple<uint32_t, uint32_t, int> rollup_key_t;
+typedef decltype(GPU_BATCH_READINGS_STMT)::row_t gpu_reading_t;
+
+struct gpu_rollup_t {
+  int64_t sample_cnt = 0;
+  int64_t util_sum = 0;
+  int64_t zero_util_cnt = 0;
+  int64_t low_util_cnt = 0;
+  int64_t zero_util_run = 0;
+  int64_t longest_zero_util_run = 0;
+  int64_t sm_clock_sum = 0;
+  int64_t power_usage_sum = 0;
+  int64_t temperature_sum = 0;
+  // The reading before, repeated or not
+  std::optional<gpu_reading_t> latest;
+};
+
+struct step_rollup_t {
+  int64_t sample_cnt = 0;
+  int64_t latest_recordid = 0;
+  int64_t user_time = 0;
+  int64_t sys_time = 0;
+  std::optional<int64_t> res_size;
+  std::optional<int64_t> peak_res_size;
+  int64_t sys_ratio_cnt = 0;
+  int64_t sys_ratio_1_10 = 0;
+  int64_t sys_ratio_1_3 = 0;
+  int64_t sys_ratio_2_3 = 0;
+  int64_t sys_ratio_gt_1_milli = 0;
+  // Loaded at the first reading
+  bool gpus_loaded = false;
+  std::map<int64_t, gpu_rollup_t> gpus;
+};
+
+// Prepared on the connection of the thread using them
+static thread_local bulk_insert_t step_rollup_insert(STEP_ROLLUP_INSERT_SQL);
+static thread_local bulk_insert_t
+  step_usage_rollup_insert(STEP_USAGE_ROLLUP_INSERT_SQL,
+                           STEP_USAGE_ROLLUP_INSERT_TAIL_SQL);
+static thread_local bulk_insert_t
+  step_gpu_rollup_insert(STEP_GPU_ROLLUP_INSERT_SQL);
+// Added to since the last flush of the thread
+static thread_local std::map<rollup_key_t, step_rollup_t> staged;
+static thread_local std::map<std::tuple<rollup_key_t, bool, int64_t>, int64_t>
+  staged_usage;
+
+static bool load_step(const rollup_key_t &key, step_rollup_t &step) {
+  const auto &[jobid, stepid, watcherid] = key;
+  return STEP_ROLLUP_LOAD_STMT.for_each([&](const auto &row) {
+    std::tie(step.sample_cnt, step.latest_recordid,
+             step.user_time, step.sys_time,
+             step.res_size, step.peak_res_size, step.sys_ratio_cnt,
+             step.sys_ratio_1_10, step.sys_ratio_1_3, step.sys_ratio_2_3,
+             step.sys_ratio_gt_1_milli) = row;
+  }, jobid, stepid, watcherid);
+}
+
+static bool load_gpus(const rollup_key_t &key, step_rollup_t &step) {
+  const auto &[jobid, stepid, watcherid] = key;
+  step.gpus_loaded = STEP_GPU_ROLLUP_LOAD_STMT.for_each([&](const auto &row) {
+    const auto &[gpuid, sample_cnt, util_sum, zero_util_cnt, low_util_cnt,
+                 zero_util_run, longest_zero_util_run,
+                 sm_clock_sum, power_usage_sum, temperature_sum,
+                 age, power_usage, temperature, sm_clock, util] = row;
+    auto &gpu = step.gpus[gpuid];
+    gpu.sample_cnt = sample_cnt;
+    gpu.util_sum = util_sum;
+    gpu.zero_util_cnt = zero_util_cnt;
+    gpu.low_util_cnt = low_util_cnt;
+    gpu.zero_util_run = zero_util_run;
+    gpu.longest_zero_util_run = longest_zero_util_run;
+    gpu.sm_clock_sum = sm_clock_sum;
+    gpu.power_usage_sum = power_usage_sum;
+    gpu.temperature_sum = temperature_sum;
+    gpu.latest = gpu_reading_t(gpuid, age, power_usage, temperature,
+                               sm_clock, util);
+  }, jobid, stepid, watcherid);
+  return step.gpus_loaded;
+}
+
+// Repeated by the driver if older than the one before, with the same values
+static bool gpu_reading_repeated(const gpu_rollup_t &gpu,
+                                 const gpu_reading_t &reading) {
+  if (!gpu.latest) {
+    return false;
+  }
+  const auto &[gpuid, age, power_usage, temperature, sm_clock, util] = reading;
+  const auto &latest = *gpu.latest;
+  return age && *age && std::get<1>(latest) && *age > *std::get<1>(latest)
+         && power_usage == std::get<2>(latest)
+         && temperature == std::get<3>(latest)
+         && sm_clock == std::get<4>(latest)
+         && util == std::get<5>(latest);
+}
+
+static void add_gpu_reading(gpu_rollup_t &gpu, const gpu_reading_t &reading) {
+  const auto &[gpuid, age, power_usage, temperature, sm_clock, util] = reading;
+  const bool repeated = gpu_reading_repeated(gpu, reading);
+  gpu.latest = reading;
+  if (repeated || !util) {
+    return;
+  }
+  gpu.sample_cnt++;
+  gpu.util_sum += *util;
+  gpu.sm_clock_sum += sm_clock.value_or(0);
+  gpu.power_usage_sum += power_usage.value_or(0);
+  gpu.temperature_sum += temperature.value_or(0);
+  if (*util == 0) {
+    gpu.zero_util_cnt++;
+    gpu.zero_util_run++;
+    gpu.longest_zero_util_run
+      = std::max(gpu.longest_zero_util_run, gpu.zero_util_run);
+  } else {
+    gpu.zero_util_run = 0;
+    gpu.low_util_cnt += *util < 13;
+  }
+}
+
+// Of the sample, with the number of GPUs it read
+static bool add_gpu_readings(const rollup_key_t &key, step_rollup_t &step,
+                             const rollup_sample_t &sample, int64_t &ngpu) {
+  ngpu = 0;
+  if (!sample.gpu_measurement_batch) {
+    return true;
+  }
+  std::vector<gpu_reading_t> readings;
+  if (!GPU_BATCH_READINGS_STMT.for_each([&](const auto &row) {
+        readings.push_back(row);
+      }, *sample.gpu_measurement_batch, sample.jobid)) {
+    return false;
+  }
+  if (readings.empty()) {
+    return true;
+  } else if (!step.gpus_loaded && !load_gpus(key, step)) {
+    return false;
+  }
+  std::set<int64_t> gpuids;
+  for (const auto &reading : readings) {
+    const int64_t gpuid = std::get<0>(reading);
+    gpuids.insert(gpuid);
+    add_gpu_reading(step.gpus[gpuid], reading);
+  }
+  ngpu = gpuids.size();
+  return true;
+}
+
+static void add_sys_ratio(step_rollup_t &step, int64_t delta_user_time,
+                          int64_t delta_sys_time) {
+  if (delta_sys_time < 1'000'000 || delta_user_time <= 0) {
+    return;
+  }
+  const double sys_ratio = (double)delta_sys_time / delta_user_time;
+  step.sys_ratio_cnt++;
+  if (sys_ratio <= 0.1) {
+    return;
+  } else if (sys_ratio <= 1.0 / 3) {
+    step.sys_ratio_1_10++;
+  } else if (sys_ratio <= 2.0 / 3) {
+    step.sys_ratio_1_3++;
+  } else if (sys_ratio <= 1) {
+    step.sys_ratio_2_3++;
+  } else {
+    step.sys_ratio_gt_1_milli += std::llround(sys_ratio * 1000);
+  }
+}
+
+bool rollup_add(const rollup_sample_t &sample) {
+  const rollup_key_t key(sample.jobid, sample.stepid, sample.watcherid);
+  auto it = staged.find(key);
+  if (it == staged.end()) {
+    step_rollup_t step;
+    if (!load_step(key, step)) {
+      return false;
+    }
+    it = staged.emplace(key, std::move(step)).first;
+  }
+  auto &step = it->second;
+  int64_t ngpu;
+  if (!add_gpu_readings(key, step, sample, ngpu)) {
+    return false;
+  }
+  // Nothing passed before the first sample
+  const int64_t delta_user_time
+    = step.sample_cnt ? sample.user_time - step.user_time : 0;
+  const int64_t delta_sys_time
+    = step.sample_cnt ? sample.sys_time - step.sys_time : 0;
+  add_sys_ratio(step, delta_user_time, delta_sys_time);
+  const int64_t ncpu = std::ceil(
+    (double)(delta_user_time + delta_sys_time)
+    / (sample.scrape_interval * 1e6));
+  staged_usage[std::make_tuple(key, false, ncpu)]++;
+  staged_usage[std::make_tuple(key, true, ngpu)]++;
+  step.sample_cnt++;
+  step.latest_recordid = std::max(step.latest_recordid, sample.recordid);
+  step.user_time = sample.user_time;
+  step.sys_time = sample.sys_time;
+  if (sample.res_size) {
+    step.res_size = sample.res_size;
+    step.peak_res_size = std::max(step.peak_res_size.value_or(0),
+                                  *sample.res_size);
+  }
+  return true;
+}
+
+bool rollup_flush() {
+  static thread_local bulk_columns_t step_rows(step_rollup_insert.ncol);
+  static thread_local bulk_columns_t
+    usage_rows(step_usage_rollup_insert.ncol);
+  static thread_local bulk_columns_t gpu_rows(step_gpu_rollup_insert.ncol);
+  const auto add_key = [](bulk_columns_t &rows, const rollup_key_t &key) {
+    const auto &[jobid, stepid, watcherid] = key;
+    rows.add((int64_t)jobid);
+    rows.add((int64_t)stepid);
+    rows.add((int64_t)watcherid);
+  };
+  const auto add = [](bulk_columns_t &rows, const auto &val) {
+    if (val) {
+      rows.add((int64_t)*val);
+    } else {
+      rows.add_null();
+    }
+  };
+  for (const auto &[key, step] : staged) {
+    // In the column order of STEP_ROLLUP_INSERT_SQL
+    add_key(step_rows, key);
+    for (int64_t val : {step.sample_cnt, step.latest_recordid,
+                        step.user_time, step.sys_time}) {
+      step_rows.add(val);
+    }
+    add(step_rows, step.res_size);
+    add(step_rows, step.peak_res_size);
+    for (int64_t val : {step.sys_ratio_cnt, step.sys_ratio_1_10,
+                        step.sys_ratio_1_3, step.sys_ratio_2_3,
+                        step.sys_ratio_gt_1_milli}) {
+      step_rows.add(val);
+    }
+    for (const auto &[gpuid, gpu] : step.gpus) {
+      // In the column order of STEP_GPU_ROLLUP_INSERT_SQL
+      add_key(gpu_rows, key);
+      for (int64_t val : {gpuid, gpu.sample_cnt, gpu.util_sum,
+                          gpu.zero_util_cnt, gpu.low_util_cnt,
+                          gpu.zero_util_run, gpu.longest_zero_util_run,
+                          gpu.sm_clock_sum, gpu.power_usage_sum,
+                          gpu.temperature_sum}) {
+        gpu_rows.add(val);
+      }
+      const auto &[_, age, power_usage, temperature, sm_clock, util]
+        = *gpu.latest;
+      for (const auto *val : {&age, &power_usage, &temperature,
+                              &sm_clock, &util}) {
+        add(gpu_rows, *val);
+      }
+    }
+  }
+  for (const auto &[usage, cnt] : staged_usage) {
+    const auto &[key, is_gpu, in_use] = usage;
+    // In the column order of STEP_USAGE_ROLLUP_INSERT_SQL
+    add_key(usage_rows, key);
+    usage_rows.add((int64_t)is_gpu);
+    usage_rows.add(in_use);
+    usage_rows.add(cnt);
+  }
+  bool ok = true;
+  const auto failed = [&](size_t) { ok = false; };
+  step_rollup_insert.insert(step_rows, failed, "(step_rollup_insert)");
+  step_usage_rollup_insert.insert(usage_rows, failed,
+                                  "(step_usage_rollup_insert)");
+  step_gpu_rollup_insert.insert(gpu_rows, failed, "(step_gpu_rollup_insert)");
+  for (auto rows : {&step_rows, &usage_rows, &gpu_rows}) {
+    rows->clear();
+  }
+  staged.clear();
+  staged_usage.clear();
+  return ok;
+}
+
+bool rollup_backfill() {
+  #define OP "(rollup_backfill)"
+  decltype(ROLLUP_BACKFILL_PENDING_STMT)::row_t pending;
+  if (!ROLLUP_BACKFILL_PENDING_STMT.fetch_one(pending)) {
+    return false;
+  } else if (!std::get<0>(pending)) {
+    return true;
+  }
+  if (!sqlite3_begin_immediate_transaction()) {
+    return false;
+  }
+  fputs("Rolling up measurements taken before rollups were kept...\n",
+        stderr);
+  bool added = true;
+  size_t cnt = 0;
+  const bool ok = sqlite3_exec_wrap(ROLLUP_BACKFILL_CLEAR_SQL, OP)
+    && ROLLUP_BACKFILL_LIST_STMT.for_each([&](const auto &row) {
+      rollup_sample_t sample;
+      std::tie(sample.recordid, sample.watcherid, sample.jobid, sample.stepid,
+               sample.user_time, sample.sys_time, sample.res_size,
+               sample.gpu_measurement_batch, sample.scrape_interval) = row;
+      added = added && rollup_add(sample);
+      if (added && ++cnt % ROLLUP_BACKFILL_FLUSH_SAMPLES == 0) {
+        added = rollup_flush();
+      }
+    })
+    && added && rollup_flush() && ROLLUP_BACKFILL_DONE_STMT.exec();
+  if (!ok || !sqlite3_end_transaction()) {
+    staged.clear();
+    staged_usage.clear();
+    sqlite3_exec(SQL_CONN_NAME, "ROLLBACK;", NULL, NULL, NULL);
+    return false;
+  }
+  fprintf(stderr, "Rolled up %zu measurements\n", cnt);
+  return true;
+  #undef OP
+}
+
+void rollup_finalize() {
+  for (auto insert : {&step_rollup_insert, &step_usage_rollup_insert,
+                      &step_gpu_rollup_insert}) {
+    insert->finalize();
+  }
+}
@@ -0,0 +1,299 @@
+#include "spool.h"
+
+#include <array>
+#include <atomic>
+
+struct spool_segment_t {
+  int fd = -1;
+  char *base;
+  // Of the file, the next record goes to tail
+  size_t size;
+  size_t tail;
+  // Start of what changed since the last sync, tail if nothing did
+  size_t dirty;
+  // The file size changed since the last sync
+  bool grown;
+  uint64_t appended;
+  uint64_t committed;
+};
+
+static spool_segment_t segments[SPOOL_SEGMENT_CNT];
+static int active;
+static uint64_t next_seq = 1;
+static bool opened;
+static std::atomic<bool> stopping;
+static pthread_t sync_thread;
+// Guards segments, active and next_seq once the sync thread runs
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+// Uncommitted records found by spool_open, by seq
+static std::vector<std::pair<uint64_t, spool_ref_t>> pending;
+
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len) {
+  static const auto table = []() {
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+    return table;
+  }();
+  auto cur = (const uint8_t *)buf;
+  crc = ~crc;
+  while (len--) {
+    crc = table[(crc ^ *cur++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static inline size_t record_size(size_t len) {
+  return (sizeof(spool_record_t) + len + 7) & ~(size_t)7;
+}
+
+static inline uint32_t record_crc(uint32_t payload_crc, uint64_t seq) {
+  return checksum_crc32(payload_crc, &seq, sizeof(seq));
+}
+
+// Extends the file to hold at least need bytes. Space is allocated for real,
+// a write to the mapping past what the disk can hold would be a SIGBUS
+static bool grow_segment(spool_segment_t &seg, size_t need) {
+  const size_t size
+    = (need + SPOOL_GROW_SIZE - 1) / SPOOL_GROW_SIZE * SPOOL_GROW_SIZE;
+  if (size > SPOOL_MAP_SIZE) {
+    return false;
+  }
+  if (const int err = posix_fallocate(seg.fd, 0, size)) {
+    fprintf(stderr, "spool: posix_fallocate: %s\n", strerror(err));
+    return false;
+  }
+  seg.size = size;
+  seg.grown = true;
+  return true;
+}
+
+static void scan_segment(int idx, uint64_t &last_seq) {
+  auto &seg = segments[idx];
+  size_t off = 0;
+  uint64_t seq = 0;
+  while (off + sizeof(spool_record_t) <= seg.size) {
+    const auto rec = (const spool_record_t *)(seg.base + off);
+    if (rec->magic != SPOOL_RECORD_MAGIC || rec->seq <= seq
+        || rec->len > seg.size - off - sizeof(spool_record_t)
+        || record_crc(checksum_crc32(0, rec + 1, rec->len), rec->seq)
+           != rec->crc) {
+      break;
+    }
+    seq = rec->seq;
+    seg.appended++;
+    if (rec->committed) {
+      seg.committed++;
+    } else {
+      pending.emplace_back(rec->seq, spool_ref_t{idx, off});
+    }
+    off += record_size(rec->len);
+  }
+  seg.tail = seg.dirty = off;
+  last_seq = seq;
+}
+
+static bool open_segment(int idx, const char *prefix, uint64_t &last_seq) {
+  auto &seg = segments[idx];
+  const std::string path = std::string(prefix) + "." + std::to_string(idx);
+  seg.fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (seg.fd < 0) {
+    perror("open(spool)");
+    return false;
+  }
+  struct stat st;
+  if (fstat(seg.fd, &st)) {
+    perror("fstat(spool)");
+    return false;
+  }
+  seg.size = std::min((size_t)st.st_size, SPOOL_MAP_SIZE);
+  void *base = mmap(NULL, SPOOL_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    seg.fd, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap(spool)");
+    return false;
+  }
+  seg.base = (char *)base;
+  scan_segment(idx, last_seq);
+  // Torn or stale records past the tail must not reappear behind new ones
+  if (ftruncate(seg.fd, seg.tail)) {
+    perror("ftruncate(spool)");
+    return false;
+  }
+  seg.size = seg.tail;
+  return grow_segment(seg, std::max(seg.tail, (size_t)SPOOL_GROW_SIZE));
+}
+
+static void reset_segment(spool_segment_t &seg) {
+  if (ftruncate(seg.fd, 0)) {
+    perror("ftruncate(spool)");
+    return;
+  }
+  pthread_mutex_lock(&spool_lock);
+  seg.size = 0;
+  grow_segment(seg, SPOOL_GROW_SIZE);
+  seg.tail = seg.dirty = 0;
+  seg.appended = seg.committed = 0;
+  pthread_mutex_unlock(&spool_lock);
+  fdatasync(seg.fd);
+}
+
+static void sync_segments() {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  for (int idx = 0; idx < SPOOL_SEGMENT_CNT; idx++) {
+    auto &seg = segments[idx];
+    pthread_mutex_lock(&spool_lock);
+    const size_t from = seg.dirty / page_size * page_size;
+    const size_t to = seg.tail;
+    const bool grown = seg.grown;
+    // Appends only go to segments that are empty or active
+    const bool drained
+      = idx != active && seg.tail && seg.committed == seg.appended;
+    seg.dirty = seg.tail;
+    seg.grown = false;
+    pthread_mutex_unlock(&spool_lock);
+    if (from < to && msync(seg.base + from, to - from, MS_SYNC)) {
+      perror("msync(spool)");
+    }
+    if (grown && fdatasync(seg.fd)) {
+      perror("fdatasync(spool)");
+    }
+    if (drained) {
+      reset_segment(seg);
+    }
+  }
+}
+
+static void *sync_loop(void *arg) {
+  (void)arg;
+  while (!stopping) {
+    usleep(SPOOL_SYNC_INTERVAL_MS * 1000);
+    sync_segments();
+  }
+  return NULL;
+}
+
+static void close_segments() {
+  for (auto &seg : segments) {
+    if (seg.fd >= 0) {
+      munmap(seg.base, SPOOL_MAP_SIZE);
+      close(seg.fd);
+    }
+    seg = spool_segment_t();
+  }
+}
+
+bool spool_open(const char *prefix) {
+  uint64_t max_seq = 0;
+  for (int idx = 0; idx < SPOOL_SEGMENT_CNT; idx++) {
+    uint64_t last_seq;
+    if (!open_segment(idx, prefix, last_seq)) {
+      close_segments();
+      pending.clear();
+      return false;
+    }
+    // Appends continue where they left off
+    if (last_seq > max_seq) {
+      max_seq = last_seq;
+      active = idx;
+    }
+  }
+  next_seq = max_seq + 1;
+  std::sort(pending.begin(), pending.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  stopping = false;
+  if (pthread_create(&sync_thread, NULL, sync_loop, NULL)) {
+    perror("pthread_create");
+    close_segments();
+    pending.clear();
+    return false;
+  }
+  opened = true;
+  return true;
+}
+
+bool spool_is_open() {
+  return opened;
+}
+
+void spool_replay(
+  const std::function<void(const char *, size_t, spool_ref_t)> &fn) {
+  for (const auto &record : pending) {
+    const auto &ref = record.second;
+    const auto rec = (const spool_record_t *)(
+      segments[ref.segment].base + ref.offset);
+    fn((const char *)(rec + 1), rec->len, ref);
+  }
+  pending.clear();
+  pending.shrink_to_fit();
+}
+
+bool spool_append(const std::string &payload, spool_ref_t &ref) {
+  if (!opened || payload.size() > UINT32_MAX) {
+    return false;
+  }
+  const size_t len = record_size(payload.size());
+  const uint32_t payload_crc
+    = checksum_crc32(0, payload.data(), payload.size());
+  pthread_mutex_lock(&spool_lock);
+  if (segments[active].tail >= SPOOL_SEGMENT_SIZE) {
+    for (int i = 1; i < SPOOL_SEGMENT_CNT; i++) {
+      const int idx = (active + i) % SPOOL_SEGMENT_CNT;
+      if (!segments[idx].tail) {
+        active = idx;
+        break;
+      }
+    }
+  }
+  auto &seg = segments[active];
+  if (seg.tail + len > seg.size && !grow_segment(seg, seg.tail + len)) {
+    pthread_mutex_unlock(&spool_lock);
+    return false;
+  }
+  spool_record_t rec;
+  rec.magic = SPOOL_RECORD_MAGIC;
+  rec.len = payload.size();
+  rec.committed = 0;
+  rec.seq = next_seq++;
+  rec.crc = record_crc(payload_crc, rec.seq);
+  char *dst = seg.base + seg.tail;
+  memcpy(dst, &rec, sizeof(rec));
+  memcpy(dst + sizeof(rec), payload.data(), payload.size());
+  ref.segment = active;
+  ref.offset = seg.tail;
+  seg.tail += len;
+  seg.appended++;
+  pthread_mutex_unlock(&spool_lock);
+  return true;
+}
+
+void spool_commit(const spool_ref_t &ref) {
+  if (ref.segment < 0 || !opened) {
+    return;
+  }
+  pthread_mutex_lock(&spool_lock);
+  auto &seg = segments[ref.segment];
+  auto rec = (spool_record_t *)(seg.base + ref.offset);
+  if (!rec->committed) {
+    rec->committed = 1;
+    seg.committed++;
+    seg.dirty = std::min(seg.dirty, ref.offset);
+  }
+  pthread_mutex_unlock(&spool_lock);
+}
+
+void spool_close() {
+  if (!opened) {
+    return;
+  }
+  stopping = true;
+  pthread_join(sync_thread, NULL);
+  sync_segments();
+  close_segments();
+  opened = false;
+}
@@ -0,0 +1,97 @@
+#include "stmt_registry.h"
+
+// By id of the statement, prepared on the connection of the thread
+static thread_local std::vector<prepared_stmt_t> prepared_stmts;
+
+std::vector<registered_stmt_t *> &stmt_registry() {
+  static std::vector<registered_stmt_t *> registry;
+  return registry;
+}
+
+registered_stmt_t::registered_stmt_t(const char *const &sql,
+                                     const char *const *params, size_t nparam,
+                                     const char *const *columns, size_t ncol,
+                                     const char *op)
+  : sql(sql), param_names(params, params + nparam),
+    column_names(columns, columns + ncol), op(op) {
+  id = stmt_registry().size();
+  stmt_registry().push_back(this);
+}
+
+prepared_stmt_t *registered_stmt_t::get() {
+  if (prepared_stmts.size() <= id) {
+    prepared_stmts.resize(stmt_registry().size());
+  }
+  auto &prepared = prepared_stmts[id];
+  // Threads may point SQL_CONN_NAME to another connection for a while
+  if (prepared.stmt && sqlite3_db_handle(prepared.stmt) == SQL_CONN_NAME) {
+    return &prepared;
+  }
+  sqlite3_finalize(prepared.stmt);
+  prepared.stmt = NULL;
+  if (!IS_SQLITE_OK(PREPARE_STMT(sql, &prepared.stmt, 1))) {
+    fprintf(stderr, "Within %s: ", op);
+    SQLITE3_PERROR("prepare");
+    sqlite3_finalize(prepared.stmt);
+    prepared.stmt = NULL;
+    return NULL;
+  }
+  prepared.params.clear();
+  for (const char *name : param_names) {
+    prepared.params.push_back(
+      sqlite3_bind_parameter_index(prepared.stmt, name));
+  }
+  return &prepared;
+}
+
+bool registered_stmt_t::check() {
+  const auto prepared = get();
+  if (!prepared) {
+    return false;
+  }
+  bool ok = true;
+  const int nparam = sqlite3_bind_parameter_count(prepared->stmt);
+  if (nparam != (int)param_names.size()) {
+    fprintf(stderr, "%s: %d parameters declared, %d in the statement\n",
+            op, (int)param_names.size(), nparam);
+    ok = false;
+  }
+  for (size_t i = 0; i < param_names.size(); i++) {
+    if (!prepared->params[i]) {
+      fprintf(stderr, "%s: no parameter '%s'\n", op, param_names[i]);
+      ok = false;
+    }
+  }
+  const int ncol = sqlite3_column_count(prepared->stmt);
+  if (ncol != (int)column_names.size()) {
+    fprintf(stderr, "%s: %d columns declared, %d in the statement\n",
+            op, (int)column_names.size(), ncol);
+    ok = false;
+  }
+  for (int i = 0; i < std::min(ncol, (int)column_names.size()); i++) {
+    const char *name = sqlite3_column_name(prepared->stmt, i);
+    if (strcmp(column_names[i], name)) {
+      fprintf(stderr, "%s: expecting column '%s', got '%s'\n",
+              op, column_names[i], name);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool stmt_registry_check() {
+  bool ok = true;
+  for (auto stmt : stmt_registry()) {
+    ok &= stmt->check();
+  }
+  return ok;
+}
+
+void stmt_registry_finalize() {
+  for (auto &prepared : prepared_stmts) {
+    if (!IS_SQLITE_OK(sqlite3_finalize(prepared.stmt))) {
+      SQLITE3_PERROR("finalize");
+    }
+  }
+  prepared_stmts.clear();
+}
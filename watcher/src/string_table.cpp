@@ -0,0 +1,49 @@
+#include "string_table.h"
+
+char *string_table_t::allocate(size_t len) {
+  if (len > STRING_ARENA_CHUNK_SIZE) {
+    large.emplace_back(new char[len]);
+    return large.back().get();
+  }
+  while (chunks.empty() || chunk_used + len > chunk_sizes[chunk_idx]) {
+    if (!chunks.empty()) {
+      chunk_idx++;
+    }
+    if (chunk_idx == chunks.size()) {
+      const size_t size = chunks.empty() ? STRING_ARENA_FIRST_CHUNK_SIZE
+                          : std::min(chunk_sizes.back() * 2,
+                                     (size_t)STRING_ARENA_CHUNK_SIZE);
+      chunks.emplace_back(new char[size]);
+      chunk_sizes.push_back(size);
+    }
+    chunk_used = 0;
+  }
+  char *dst = chunks[chunk_idx].get() + chunk_used;
+  chunk_used += len;
+  return dst;
+}
+
+string_id_t string_table_t::intern(const char *str, size_t len) {
+  auto it = ids.find(std::string_view(str, len));
+  if (it != ids.end()) {
+    return it->second;
+  }
+  char *dst = allocate(len + 1);
+  memcpy(dst, str, len);
+  dst[len] = '\0';
+  used_bytes += len + 1;
+  const string_id_t id = strs.size();
+  strs.push_back(dst);
+  ids.emplace(std::string_view(dst, len), id);
+  return id;
+}
+
+void string_table_t::clear() {
+  // Buckets and chunks are kept, the next use is about as large
+  ids.clear();
+  strs.clear();
+  large.clear();
+  chunk_idx = 0;
+  chunk_used = 0;
+  used_bytes = 0;
+}
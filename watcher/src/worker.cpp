@@ -1,158 +1,223 @@
 #include "worker.h"
 
-static sqlite3_stmt *measurement_insert;
-static sqlite3_stmt *jobinfo_insert;
-static sqlite3_stmt *application_usage_insert;
-static sqlite3_stmt *jobstep_available_cpu_insert;
-static sqlite3_stmt *gpu_measurement_insert;
-static sqlite3_stmt *gpu_measurement_batch_renew;
+// Prepared on the connection of the thread using them
+static thread_local bulk_insert_t measurement_insert(MEASUREMENTS_INSERT_SQL);
+static thread_local bulk_insert_t
+  pending_measurement_insert(PENDING_MEASUREMENTS_INSERT_SQL);
+static thread_local bulk_insert_t
+  application_usage_insert(APPLICATION_USAGE_INSERT_SQL,
+                           APPLICATION_USAGE_INSERT_TAIL_SQL);
+static thread_local bulk_insert_t
+  jobstep_available_cpu_insert(JOBSTEP_AVAILABLE_CPU_INSERT_SQL);
+static thread_local bulk_insert_t
+  gpu_measurement_insert(GPU_MEASUREMENT_INSERT_SQL);
+// Rows staged for the bulk inserts above, by column
+static thread_local bulk_columns_t measurement_rows(measurement_insert.ncol);
+static thread_local bulk_columns_t
+  pending_measurement_rows(pending_measurement_insert.ncol);
 
-static void collect_msg_queue();
+static pthread_t ingest_thread;
+static bool ingest_started;
+static std::atomic<bool> ingest_stopping;
+
+static void finalize_thread_stmts() {
+  for (auto insert : {&measurement_insert, &pending_measurement_insert,
+                      &application_usage_insert,
+                      &jobstep_available_cpu_insert,
+                      &gpu_measurement_insert}) {
+    insert->finalize();
+  }
+  rollup_finalize();
+}
 
 void worker_finalize() {
-  sqlite3_stmt *stmt_to_finalize[] = {
-    measurement_insert,
-    jobinfo_insert,
-    application_usage_insert,
-    jobstep_available_cpu_insert,
-    gpu_measurement_insert,
-    gpu_measurement_batch_renew,
-    FINALIZE_END_ADDR
-  };
-  finalize_stmt_array(stmt_to_finalize);
-  if (is_watcher) {
-    for (int i = 0; i < 2; i++) {
-      freeze_queue();
-      collect_msg_queue();
-    }
+  if (ingest_started) {
+    // Drains whatever was received before returning
+    ingest_stopping = true;
+    pthread_join(ingest_thread, NULL);
+    ingest_started = false;
+    dump_message();
   }
+  finalize_thread_stmts();
 }
 
 static void jobinfo_record_insert(slurmdb_job_rec_t *job) {
-  #define OP "(jobinfo_insert)"
-  if (!setup_stmt(jobinfo_insert, JOBINFO_INSERT_SQL, OP)) {
-    return;
-  }
   tres_t tres_alloc(job->tres_alloc_str);
   auto nnodes = tres_alloc[NODE_TRES];
   if (!nnodes) {
     return;
   }
-  SQLITE3_BIND_START
-  #define BIND(TY, VAR, VAL) SQLITE3_NAMED_BIND(TY, jobinfo_insert, VAR, VAL);
-  #define BIND_TEXT(VAR, VAL) NAMED_BIND_TEXT(jobinfo_insert, VAR, VAL);
-  BIND(int, ":jobid", job->jobid);
-  BIND(int64, ":mem", tres_alloc[MEM_TRES] * 1024 * 1024);
-  BIND(int, ":timelimit", job->timelimit);
-  BIND(int, ":started_at", job->start);
-  BIND(int, ":ended_at", job->end);
-  BIND(int, ":ncpu", tres_alloc[CPU_TRES]);
-  BIND(int, ":ngpu", tres_alloc[GPU_TRES]);
-  BIND(int, ":nnodes", nnodes);
-  if (job->user) {
-    BIND_TEXT(":user", job->user);
-  } else if (auto info = getpwuid(job->uid)) {
-    BIND_TEXT(":user", info->pw_name);
-  }
-  BIND_TEXT(":name", job->jobname);
-  BIND_TEXT(":submit_line", job->submit_line);
-  if (BIND_FAILED) {
-    SQLITE3_PERROR("bind" OP);
-    return;
+  const char *user = job->user;
+  if (!user) {
+    if (auto info = getpwuid(job->uid)) {
+      user = info->pw_name;
+    }
   }
-  SQLITE3_BIND_END
-  if (sqlite3_step(jobinfo_insert) != SQLITE_DONE) {
-    SQLITE3_PERROR("step" OP);
+  const uint64_t mem = tres_alloc[MEM_TRES] * 1024 * 1024;
+  const uint64_t ncpu = tres_alloc[CPU_TRES];
+  const uint64_t ngpu = tres_alloc[GPU_TRES];
+  if (!JOBINFO_INSERT_STMT.exec(
+        job->jobid, std::nullopt, user, job->jobname, job->submit_line,
+        job->timelimit, job->start, job->end,
+        mem, std::nullopt, nnodes, ncpu, ngpu)) {
     return;
   }
   #if !SLURM_TRACK_STEPS_REMOVED
   if (job->track_steps)
   #endif
   {
-    reset_stmt(jobinfo_insert, OP);
-    SQLITE3_BIND_START
-    BIND(int, ":jobid", job->jobid);
-    if (BIND_FAILED) {
-      SQLITE3_PERROR("bind" OP);
-      return;
-    }
-    SQLITE3_BIND_END
     ListIterator step_it = slurm_list_iterator_create(job->steps);
     while (const auto step = (slurmdb_step_rec_t *) slurm_list_next(step_it)) {
-      SQLITE3_BIND_START
       tres_t step_max_usage(step->stats.tres_usage_in_max);
-      BIND(int, ":stepid", step->step_id.step_id);
-      BIND_TEXT(":name", step->stepname);
-      BIND_TEXT(":submit_line", step->submit_line);
-      BIND(int, ":started_at", step->start);
-      BIND(int, ":ended_at", step->end);
-      BIND(int64, ":peak_res_size", step_max_usage[MEM_TRES]);
-      if (BIND_FAILED) {
-        SQLITE3_PERROR("bind" OP);
-        continue;
-      }
-      SQLITE3_BIND_END
-      if (sqlite3_step(jobinfo_insert) != SQLITE_DONE) {
-        SQLITE3_PERROR("step" OP);
-        continue;
-      }
-      if (!IS_SQLITE_OK(sqlite3_reset(jobinfo_insert))) {
-        SQLITE3_PERROR("reset" OP);
-        continue;
-      }
+      // What was allocated is taken from the job
+      JOBINFO_INSERT_STMT.exec(
+        job->jobid, step->step_id.step_id, NULL, step->stepname,
+        step->submit_line, std::nullopt, step->start, step->end,
+        std::nullopt, step_max_usage[MEM_TRES],
+        std::nullopt, std::nullopt, std::nullopt);
     }
     slurm_list_iterator_destroy(step_it);
   }
-  #undef BIND_TEXT
-  #undef BIND
-  #undef OP
 }
 
+// Pending measurements wait for their job to be imported from accounting,
+// the others are only staged if the accuracy index admits them. Staged rows
+// are inserted by measurement_records_flush
 static void
-measurement_record_insert(const measurement_rec_t &m) {
-  #define OP "(measurement_insert)"
-  if (!setup_stmt(measurement_insert, MEASUREMENTS_INSERT_SQL, OP)) {
+measurement_record_stage(const measurement_rec_t &m, bool pending = false) {
+  const int64_t tot_time
+    = (*m.user_cpu_sec + *m.sys_cpu_sec) * 1'000'000
+      + *m.user_cpu_usec + *m.sys_cpu_usec;
+  if (!pending && !accuracy_index_admit(watcher_id, m.step_id->job_id,
+                                        m.step_id->step_id, tot_time)) {
     return;
   }
-  SQLITE3_BIND_START
-  #define BIND(TY, VAR, VAL) \
-    SQLITE3_NAMED_BIND(TY, measurement_insert, VAR, VAL);
-  if (m.recordid) {
-    BIND(int, ":recordid", *m.recordid);
-  }
-  BIND(int, ":watcherid", watcher_id);
-  BIND(int, ":jobid", m.step_id->job_id);
-  BIND(int, ":stepid", m.step_id->step_id);
-  if (m.dev_in) {
-    BIND(int64, ":dev_in", *m.dev_in);
-    BIND(int64, ":dev_out", *m.dev_out);
-  }
-  BIND(int64, ":res_size", *m.res_size);
-  if (m.minor_pagefault) {
-    BIND(int64, ":minor_pagefault", *m.minor_pagefault);
-  }
-  if (m.gpu_measurement_batch) {
-    BIND(int, ":gpu_measurement_batch", *m.gpu_measurement_batch);
-  }
-  #define BINDTIMING(VAR) \
-    BIND(int64, ":" #VAR "_sec", *m.VAR##_cpu_sec); \
-    BIND(int, ":" #VAR "_usec", *m.VAR##_cpu_usec);
-  BINDTIMING(sys); BINDTIMING(user);
-  #undef BINDTIMING
-  #undef BIND
-  if (BIND_FAILED) {
-    SQLITE3_PERROR("bind" OP);
-    return;
+  auto &rows = pending ? pending_measurement_rows : measurement_rows;
+  const auto add = [&](const auto *val) {
+    if (val) {
+      rows.add((int64_t)*val);
+    } else {
+      rows.add_null();
+    }
+  };
+  // In the column order of MEASUREMENTS_INSERT_SQL
+  if (!pending) {
+    add(m.recordid);
   }
-  SQLITE3_BIND_END
-  if (sqlite3_step(measurement_insert) != SQLITE_DONE) {
-    SQLITE3_PERROR("step" OP);
-    return;
+  rows.add((int64_t)watcher_id);
+  rows.add((int64_t)m.step_id->job_id);
+  rows.add((int64_t)m.step_id->step_id);
+  add(m.dev_in);
+  add(m.dev_out);
+  add(m.user_cpu_sec);
+  add(m.user_cpu_usec);
+  add(m.sys_cpu_sec);
+  add(m.sys_cpu_usec);
+  add(m.res_size);
+  add(m.minor_pagefault);
+  add(m.peak_mem_usage);
+  add(m.gpu_measurement_batch);
+}
+
+// Rolls up the measurements inserted, which all take the latest recordid
+static void measurement_records_rollup(const std::vector<bool> &failed) {
+  const auto &cols = measurement_rows.cols;
+  const int64_t recordid = sqlite3_last_insert_rowid(SQL_CONN_NAME);
+  for (size_t row = 0; row < measurement_rows.rows(); row++) {
+    if (failed[row]) {
+      continue;
+    }
+    const auto col = [&](int idx) -> std::optional<int64_t> {
+      const auto &cell = cols[idx][row];
+      if (cell.type == SQLITE_NULL) {
+        return std::nullopt;
+      }
+      return cell.num;
+    };
+    // In the column order of MEASUREMENTS_INSERT_SQL
+    rollup_sample_t sample;
+    sample.watcherid = cols[1][row].num;
+    sample.jobid = cols[2][row].num;
+    sample.stepid = cols[3][row].num;
+    sample.recordid = recordid;
+    sample.user_time = cols[6][row].num * 1'000'000 + cols[7][row].num;
+    sample.sys_time = cols[8][row].num * 1'000'000 + cols[9][row].num;
+    sample.res_size = col(10);
+    sample.gpu_measurement_batch = col(13);
+    sample.scrape_interval = SCRAPE_INTERVAL;
+    if (!rollup_add(sample)) {
+      fputs("warning: measurement left out of the rollups\n", stderr);
+    }
   }
+  rollup_flush();
+}
+
+static void measurement_records_flush() {
+  #define OP "(measurement_insert)"
+  // recordid comes first in measurements only
+  const auto &cols = measurement_rows.cols;
+  std::vector<bool> failed(measurement_rows.rows());
+  measurement_insert.insert(measurement_rows, [&](size_t row) {
+    accuracy_index_forget(cols[2][row].num, cols[3][row].num);
+    failed[row] = true;
+  }, OP);
+  measurement_records_rollup(failed);
+  pending_measurement_insert.insert(pending_measurement_rows,
+                                    [](size_t) {}, OP);
+  measurement_rows.clear();
+  pending_measurement_rows.clear();
   #undef OP
 }
 
-static inline void measurement_record_insert(
+// Moves the pending measurements of imported jobs into measurements, within
+// the transaction of the import
+static void resolve_pending_measurements() {
+  #define OP "(resolve_pending_measurements)"
+  const int import_watcher_id = watcher_id;
+  LIST_RESOLVED_PENDING_MEASUREMENTS_STMT.for_each([&](const auto &row) {
+    const auto &[watcherid, jobid, stepid, dev_in_col, dev_out_col,
+                 user_sec, user_usec, sys_sec, sys_usec, res_size_col,
+                 minor_pagefault_col, peak_mem_usage_col, batch_col] = row;
+    const auto col_ptr = [](const auto &col, auto &val) {
+      if (col) {
+        val = *col;
+      }
+      return col ? &val : NULL;
+    };
+    watcher_id = watcherid;
+    slurm_step_id_t step;
+    step.job_id = jobid;
+    step.step_id = stepid;
+    step.step_het_comp = NO_VAL;
+    size_t dev_in, dev_out, minor_pagefault, peak_mem_usage;
+    size_t res_size = res_size_col;
+    pid_t gpu_measurement_batch;
+    uint64_t user_cpu_sec = user_sec;
+    uint32_t user_cpu_usec = user_usec;
+    uint64_t sys_cpu_sec = sys_sec;
+    uint32_t sys_cpu_usec = sys_usec;
+    measurement_rec_t m;
+    m.recordid = NULL;
+    m.step_id = &step;
+    m.dev_in = col_ptr(dev_in_col, dev_in);
+    m.dev_out = col_ptr(dev_out_col, dev_out);
+    m.res_size = &res_size;
+    m.minor_pagefault = col_ptr(minor_pagefault_col, minor_pagefault);
+    m.peak_mem_usage = col_ptr(peak_mem_usage_col, peak_mem_usage);
+    m.gpu_measurement_batch = col_ptr(batch_col, gpu_measurement_batch);
+    m.user_cpu_sec = &user_cpu_sec;
+    m.user_cpu_usec = &user_cpu_usec;
+    m.sys_cpu_sec = &sys_cpu_sec;
+    m.sys_cpu_usec = &sys_cpu_usec;
+    measurement_record_stage(m);
+  });
+  watcher_id = import_watcher_id;
+  measurement_records_flush();
+  sqlite3_exec_wrap(DELETE_RESOLVED_PENDING_MEASUREMENTS_SQL, OP);
+  #undef OP
+}
+
+static inline void measurement_record_stage(
   slurmdb_step_rec_t *step, const jobstep_recordid_map_t &recordid_map) {
   measurement_rec_t m;
   tres_t tres_in(step->stats.tres_usage_in_tot);
@@ -171,6 +236,7 @@ static inline void measurement_record_insert(
   m.dev_out = &tres_out[DISK_TRES];
   m.res_size = &tres_max[MEM_TRES];
   m.minor_pagefault = NULL;
+  m.peak_mem_usage = NULL;
   m.gpu_measurement_batch = NULL;
   #define BINDTIMING(FIELD) \
     m.FIELD##_cpu_sec = &step->FIELD##_cpu_sec; \
@@ -178,16 +244,18 @@ static inline void measurement_record_insert(
   BINDTIMING(sys);
   BINDTIMING(user);
   #undef BINDTIMING
-  measurement_record_insert(m);
+  measurement_record_stage(m);
 }
 
-static inline void measurement_record_insert(const scrape_result_t result) {
+static inline void measurement_record_stage(
+  const scrape_result_t &result, bool pending) {
   static const size_t clk_tck = sysconf(_SC_CLK_TCK);
   measurement_rec_t m;
   m.recordid = NULL;
   m.step_id = &result.step;
   m.res_size = &result.res;
   m.minor_pagefault = &result.minor_pagefault;
+  m.peak_mem_usage = result.peak_mem_usage ? &result.peak_mem_usage : NULL;
   if (result.gpu_measurement_cnt) {
     m.gpu_measurement_batch = &result.gpu_measurement_cnt;
   } else {
@@ -212,74 +280,56 @@ static inline void measurement_record_insert(const scrape_result_t result) {
   BINDTIMING(sys, s);
   BINDTIMING(user, u);
   #undef BINDTIMING
-  if (result.rchar) {
+  if (result.rchar != PRIVILEGED_STAT_NULL) {
     m.dev_in = &result.rchar;
     m.dev_out = &result.wchar;
   } else {
     m.dev_in = NULL;
     m.dev_out = NULL;
   }
-  measurement_record_insert(m);
+  measurement_record_stage(m, pending);
 }
 
-static inline int collect_gpu_measurement_queue(
-  const slurm_step_id_t step,
-  const uint32_t size,
-  std::queue<gpu_measurement_t> &queue) {
-  #define OPC "(gpu_measurement)"
-  if (!setup_stmt(gpu_measurement_batch_renew, UPDATE_GPU_BATCH_SQL, OPC)) {
-    return 0;
+// Looked up once per job and batch in imported
+static bool job_imported(uint32_t jobid, std::map<uint32_t, bool> &imported) {
+  auto it = imported.find(jobid);
+  if (it != imported.end()) {
+    return it->second;
   }
-  int trash, batch;
-  if (!step_renew(gpu_measurement_batch_renew, OPC, trash, batch)) {
-    return 0;
-  }
-  if (!IS_SQLITE_OK(sqlite3_reset(gpu_measurement_batch_renew))) {
-    SQLITE3_PERROR("reset" OPC);
-    return 0;
-  }
-  if (!setup_stmt(gpu_measurement_insert, GPU_MEASUREMENT_INSERT_SQL, OPC)) {
-    return 0;
-  }
-  SQLITE3_BIND_START;
-  #define BIND(VAR, VAL) NAMED_BIND_INT(gpu_measurement_insert, VAR, VAL);
-  BIND(":watcherid", watcher_id);
-  BIND(":batch", batch);
-  BIND(":jobid", step.job_id);
-  if (step.step_id) {
-    BIND(":stepid", step.step_id);
-  } else {
-    BIND_NULL(gpu_measurement_insert, ":stepid");
+  bool found = false;
+  if (auto stmt = JOBINFO_EXISTS_STMT.bind(jobid)) {
+    const int ret = sqlite3_step(stmt);
+    if (ret != SQLITE_ROW && ret != SQLITE_DONE) {
+      SQLITE3_PERROR("step(jobinfo_exists)");
+    }
+    found = ret == SQLITE_ROW;
   }
-  if (BIND_FAILED) {
+  return imported[jobid] = found;
+}
+
+// Takes cnt batch numbers, returning the first one, 0 on failure
+static int reserve_gpu_measurement_batches(int cnt) {
+  decltype(UPDATE_GPU_BATCHES_STMT)::row_t row;
+  if (!UPDATE_GPU_BATCHES_STMT.fetch_one(row, cnt)) {
     return 0;
   }
-  SQLITE3_BIND_END;
-  for (uint32_t i = 0; i < size; i++) {
-    const auto &front = queue.front();
-    std::string reason;
-    const char *source_str;
-    SQLITE3_BIND_START;
-    BIND(":age", front.age);
-    BIND(":pid", front.pid);
-    BIND(":gpuid", front.gpu_id);
-    BIND(":temperature", front.temp);
-    BIND(":sm_clock", front.sm_clock);
-    BIND(":power_usage", front.power_usage);
-    BIND(":util", front.util);
-    source_str =
+  return std::get<0>(row) + 1;
+}
+
+// Stages the gpu measurements of a result as batch
+static inline void stage_gpu_measurement_queue(
+  bulk_columns_t &rows, int batch, const slurm_step_id_t step,
+  const gpu_measurement_t *begin,
+  const gpu_measurement_t *end) {
+  for (auto it = begin; it != end; it++) {
+    const auto &front = *it;
+    const char *source_str =
       gpu_measurement_source_str_table[(gpu_measurement_source_t) front.source];
     if (!source_str) {
       source_str = "unknown";
     }
-    NAMED_BIND_TEXT(gpu_measurement_insert, ":source", source_str);
-    reason = gpu_clock_limit_reason_to_str(front.clock_limit_reason_mask);
-    NAMED_BIND_TEXT(gpu_measurement_insert, ":clock_limit_reason",
-      reason.c_str());
-    if (BIND_FAILED) {
-      continue;
-    }
-    SQLITE3_BIND_END;
+    const char *reason = rows.own(
+      gpu_clock_limit_reason_to_str(front.clock_limit_reason_mask));
     DEBUGOUT(
     fprintf(stderr,
       "[watcher %d batch %d.%d step %d.%d] "
@@ -287,118 +337,152 @@ static inline int collect_gpu_measurement_queue(
       "source %s clock_limit_reason %s\n",
       watcher_id, batch, front.pid, step.job_id, step.step_id, front.gpu_id,
       front.temp, front.sm_clock, front.util, front.power_usage,
-      source_str, reason.c_str());
+      source_str, reason);
     )
-    if (sqlite3_step(gpu_measurement_insert) != SQLITE_DONE) {
-      SQLITE3_PERROR("step" OPC);
-    }
-    if (!IS_SQLITE_OK(sqlite3_reset(gpu_measurement_insert))) {
-      SQLITE3_PERROR("reset" OPC);
+    // In the column order of GPU_MEASUREMENT_INSERT_SQL
+    rows.add((int64_t)watcher_id);
+    rows.add((int64_t)batch);
+    rows.add((int64_t)front.pid);
+    rows.add((int64_t)step.job_id);
+    if (step.step_id) {
+      rows.add((int64_t)step.step_id);
+    } else {
+      rows.add_null();
     }
-    queue.pop();
+    rows.add((int64_t)front.gpu_id);
+    rows.add((int64_t)front.age);
+    rows.add((int64_t)front.power_usage);
+    rows.add((int64_t)front.temp);
+    rows.add((int64_t)front.sm_clock);
+    rows.add((int64_t)front.util);
+    rows.add(reason);
+    rows.add(source_str);
   }
-  return batch;
-  #undef BIND
-  #undef OPC
 }
 
-static void collect_msg_queue() {
-  result_group_t result;
-  while (recombine_queue(result)) {
-    auto old_watcher_id = watcher_id;
-    const auto finalize = [&]() {
-      sqlite3_end_transaction();
-      watcher_id = old_watcher_id;
-    };
-    result.worker.hostname += (size_t) *result.buf;
-    DEBUGOUT(fprintf(stderr, "Source: %s\n", result.worker.hostname);)
-    sqlite3_begin_transaction();
-    renew_watcher(REGISTER_WATCHER_SQL_RETURNING_TIMESTAMPS_AND_WATCHERID,
-      &result.worker);
-    while (!result.scrape_results.empty()) {
-      auto &front = result.scrape_results.front();
-      if (front.gpu_measurement_cnt) {
-        front.gpu_measurement_cnt
-          = collect_gpu_measurement_queue(
-            front.step, front.gpu_measurement_cnt, result.gpu_results);
+// Within the transaction of its group, imported caches jobinfo lookups.
+// Every table gets the rows of the whole batch in as few steps as possible
+static void collect_batch(batch_t &batch, std::map<uint32_t, bool> &imported) {
+  static thread_local bulk_columns_t gpu_rows(gpu_measurement_insert.ncol);
+  static thread_local bulk_columns_t
+    usage_rows(application_usage_insert.ncol);
+  static thread_local bulk_columns_t
+    cpu_rows(jobstep_available_cpu_insert.ncol);
+  auto &worker = batch.header.worker;
+  DEBUGOUT(fprintf(stderr, "Source: %s\n", worker.hostname);)
+  renew_watcher(true, &worker);
+  int gpu_batches = 0;
+  for (const auto &result : batch.results) {
+    gpu_batches += !!result.gpu_measurement_cnt;
+  }
+  int gpu_batch = gpu_batches ? reserve_gpu_measurement_batches(gpu_batches)
+                              : 0;
+  const gpu_measurement_t *gpu_front = batch.gpu_results.data();
+  const gpu_measurement_t *gpu_end = gpu_front + batch.gpu_results.size();
+  for (auto &result : batch.results) {
+    if (result.gpu_measurement_cnt) {
+      // The parser guarantees that every result got all of its own
+      const auto next = std::min(gpu_front + result.gpu_measurement_cnt,
+                                 gpu_end);
+      // Left without gpu measurements if no batch could be taken
+      if (gpu_batch) {
+        stage_gpu_measurement_queue(gpu_rows, gpu_batch, result.step,
+                                    gpu_front, next);
       }
-      measurement_record_insert(front);
-      result.scrape_results.pop();
+      result.gpu_measurement_cnt = gpu_batch ? gpu_batch++ : 0;
+      gpu_front = next;
     }
-    #define OPC "(application_usage)"
-    if (setup_stmt(application_usage_insert,
-                    APPLICATION_USAGE_INSERT_SQL,
-                    OPC)) {
-      while (!result.usages.empty()) {
-        const auto &front = result.usages.front();
-        std::string app(front.app + (size_t) *result.buf);
-        DEBUGOUT(
-          fprintf(stderr, "jobid = %d stepid = %d app = %s\n",
-            front.step.job_id, front.step.step_id, app.c_str());
-        )
-        SQLITE3_BIND_START;
-        NAMED_BIND_INT(application_usage_insert, ":jobid", front.step.job_id);
-        NAMED_BIND_INT(application_usage_insert, ":stepid", front.step.step_id);
-        NAMED_BIND_TEXT(application_usage_insert, ":application", app.c_str());
-        // pop must goes after all bindings
-        result.usages.pop();
-        if (BIND_FAILED) {
-          continue;
-        }
-        SQLITE3_BIND_END;
-        if (sqlite3_step(application_usage_insert) != SQLITE_DONE) {
-          SQLITE3_PERROR("step" OPC);
-          // do not `continue` here. let reset do its job
-        }
-        if (!IS_SQLITE_OK(sqlite3_reset(application_usage_insert))) {
-          SQLITE3_PERROR("reset" OPC);
-          continue;
-        }
-      }
+    measurement_record_stage(result, !job_imported(result.step.job_id,
+                                                   imported));
+  }
+  gpu_measurement_insert.insert(gpu_rows, [](size_t) {}, "(gpu_measurement)");
+  gpu_rows.clear();
+  measurement_records_flush();
+
+  for (const auto &usage : batch.usages) {
+    const char *app = batch.strings.str(usage.app);
+    DEBUGOUT(
+      fprintf(stderr, "jobid = %d stepid = %d app = %s\n",
+        usage.step.job_id, usage.step.step_id, app);
+    )
+    usage_rows.add((int64_t)usage.step.job_id);
+    usage_rows.add((int64_t)usage.step.step_id);
+    usage_rows.add(app);
+  }
+  application_usage_insert.insert(usage_rows, [](size_t) {},
+                                  "(application_usage)");
+  usage_rows.clear();
+
+  for (const auto &info : batch.cpu_available_infos) {
+    DEBUGOUT(
+      fprintf(stderr, "insert: %d.%d available cpu %d\n",
+              info.step.job_id, info.step.step_id, info.cpu_available);
+    )
+    cpu_rows.add((int64_t)watcher_id);
+    cpu_rows.add((int64_t)info.step.job_id);
+    cpu_rows.add((int64_t)info.step.step_id);
+    cpu_rows.add((int64_t)info.cpu_available);
+  }
+  jobstep_available_cpu_insert.insert(cpu_rows, [](size_t) {},
+                                      "(cpu_available_info)");
+  cpu_rows.clear();
+}
+
+// Commits up to INGEST_GROUP_COMMIT_BATCHES from the front of batches in one
+// transaction, so a round pays for a single sync. Returns false if they should
+// be retried later
+static bool collect_batch_group(std::deque<std::unique_ptr<batch_t>> &batches) {
+  const size_t cnt
+    = std::min(batches.size(), (size_t)INGEST_GROUP_COMMIT_BATCHES);
+  if (!sqlite3_begin_immediate_transaction()) {
+    return false;
+  }
+  std::map<uint32_t, bool> imported;
+  for (size_t i = 0; i < cnt; i++) {
+    collect_batch(*batches[i], imported);
+  }
+  if (!sqlite3_end_transaction()) {
+    sqlite3_exec(SQL_CONN_NAME, "ROLLBACK;", NULL, NULL, NULL);
+    accuracy_index_rollback();
+    return false;
+  }
+  accuracy_index_commit();
+  for (size_t i = 0; i < cnt; i++) {
+    spool_commit(batches.front()->spool_ref);
+    batches.pop_front();
+  }
+  return true;
+}
+
+// The single writer of received batches, commits them every INGEST_INTERVAL
+// on a connection of its own, independent of the accounting import
+static void *ingest_worker(void *arg) {
+  (void)arg;
+  if (!open_sqlite_conn() || !partitions_sync()) {
+    exit(1);
+  }
+  std::deque<std::unique_ptr<batch_t>> batches;
+  while (1) {
+    // Read first, so nothing handed off before stopping is left behind
+    const bool stopping = ingest_stopping;
+    while (auto batch = take_batch()) {
+      batches.push_back(std::move(batch));
     }
-    #undef OPC
-    #define OPC "(cpu_available_info)"
-    if (setup_stmt(jobstep_available_cpu_insert,
-                   JOBSTEP_AVAILABLE_CPU_INSERT_SQL,
-                   OPC)) {
-      SQLITE3_BIND_START
-      NAMED_BIND_INT(jobstep_available_cpu_insert, ":watcherid", watcher_id);
-      if (BIND_FAILED) {
-        goto skip_avail_cpu_insert;
-      }
-      SQLITE3_BIND_END
-      while (!result.cpu_available_info.empty()) {
-        const auto &front = result.cpu_available_info.front();
-        SQLITE3_BIND_START
-        NAMED_BIND_INT(jobstep_available_cpu_insert,
-                       ":jobid", front.step.job_id);
-        NAMED_BIND_INT(jobstep_available_cpu_insert,
-                       ":stepid", front.step.step_id);
-        NAMED_BIND_INT(jobstep_available_cpu_insert,
-                       ":ncpu", front.cpu_available);
-        if (BIND_FAILED) {
-          continue;
-        }
-        SQLITE3_BIND_END
-        result.cpu_available_info.pop();
-        DEBUGOUT(
-          fprintf(stderr, "insert: %d.%d available cpu %d\n",
-                  front.step.job_id, front.step.step_id, front.cpu_available);
-        )
-        if (sqlite3_step(jobstep_available_cpu_insert) != SQLITE_DONE) {
-          SQLITE3_PERROR("step" OPC);
-          // do not `continue` here. let reset do its job
-        }
-        if (!IS_SQLITE_OK(sqlite3_reset(jobstep_available_cpu_insert))) {
-          SQLITE3_PERROR("reset" OPC);
-          continue;
-        }
-      }
-      skip_avail_cpu_insert:;
+    while (!batches.empty() && collect_batch_group(batches))
+      ;
+    if (stopping) {
+      break;
     }
-    finalize();
+    sleep(INGEST_INTERVAL);
+  }
+  if (!batches.empty()) {
+    fprintf(stderr, "warning: %zu batches left to the spool\n",
+      batches.size());
   }
-  #undef OPC
+  finalize_thread_stmts();
+  db_common_finalize();
+  sqlite3_close(SQL_CONN_NAME);
+  return NULL;
 }
 
 bool wait_until(time_t timeout) {
@@ -440,7 +524,7 @@ void measurement_record_insert(
       job_step->step_id.job_id = job->jobid;
       job_step->stepname = job->jobname;
       job_step->job_ptr = job;
-      measurement_record_insert(job_step, map);
+      measurement_record_stage(job_step, map);
       free(job_step);
     } else
     #endif
@@ -453,7 +537,7 @@ void measurement_record_insert(
           step->stats = job->stats;
         }
         #endif
-        measurement_record_insert(step, map);
+        measurement_record_stage(step, map);
       }
       slurm_list_iterator_destroy(step_it);
     }
@@ -465,25 +549,11 @@ void measurement_record_insert(
   }
   slurm_list_iterator_destroy(job_it);
   slurm_list_destroy(job_list);
+  measurement_records_flush();
 }
 
-bool log_scraper_freq(const char *sql, const char *op) {
-  sqlite3_stmt *log_scrape_freq_stmt = NULL;
-  if (!setup_stmt(log_scrape_freq_stmt, sql, op)) {
-    return false;
-  }
-  SQLITE3_BIND_START
-  NAMED_BIND_INT(log_scrape_freq_stmt,
-                  ":scrape_interval", SCRAPE_INTERVAL);
-  if (BIND_FAILED) {
-    return false;
-  }
-  SQLITE3_BIND_END
-  if (!step_and_verify(log_scrape_freq_stmt, 0, op)) {
-    return false;
-  }
-  sqlite3_finalize(log_scrape_freq_stmt);
-  return true;
+bool log_scraper_freq(scrape_freq_stmt_t &stmt) {
+  return stmt.exec(SCRAPE_INTERVAL);
 }
 
 void watcher() {
@@ -505,45 +575,47 @@ void watcher() {
       }
     }
   }
+  collect_dumped_messages();
+  if (pthread_create(&ingest_thread, NULL, ingest_worker, NULL)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  ingest_started = true;
   pthread_t conn_mgr_thread;
   pthread_create(&conn_mgr_thread, NULL, conn_mgr, NULL);
   auto condition = setup_job_cond();
   time_t timeout = 0;
-  #if !PROCESS_ALL_MSG_BEFORE_NEXT_ROUND
-  bool first_run = 1;
-  #endif
   condition->state_list = state_list;
   do {
     if (timeout) {
       build_slurmdb_conn();
-      renew_watcher(UPSERT_WATCHER_SQL_RETURNING_TIMESTAMP_RANGE);
+      renew_watcher(false);
     }
     time_t curtime = time(NULL);
     printf("Accounting import started at %ld\n", curtime);
     timeout = time(NULL) + ACCOUNTING_RPC_INTERVAL;
     condition->usage_start = time_range_start;
     condition->usage_end = time_range_end;
-    sqlite3_begin_transaction();
+    // Immediate, the accuracy index is only admitted to under the write lock
+    if (!sqlite3_begin_immediate_transaction()) {
+      exit(1);
+    }
     measurement_record_insert(condition, {});
+    resolve_pending_measurements();
     if (!sqlite3_end_transaction()) {
       // why
       exit(1);
     }
-    #if PROCESS_ALL_MSG_BEFORE_NEXT_ROUND
-    sleep(PROCESS_ALL_MSG_BEFORE_NEXT_ROUND);
-    freeze_queue();
-    sleep(GUARANTEED_FREEZE_WAIT);
-    collect_msg_queue();
-    #else
-    if (!first_run) {
-      collect_msg_queue();
-    } else {
-      first_run = 0;
-    }
-    #endif
-    freeze_queue();
+    accuracy_index_commit();
+    accuracy_index_evict();
     close_slurmdb_conn();
     do_analyze();
+    const auto stats = get_ingest_stats();
+    printf("Ingested %lu batches (%lu bytes) over %lu connections, %lu open,"
+      " %lu failed, parse avg %lu us max %lu us\n",
+      stats.batches, stats.bytes, stats.accepted, stats.active, stats.failed,
+      stats.batches ? stats.parse_ns / stats.batches / 1000 : 0,
+      stats.parse_max_ns / 1000);
     printf("Accounting import ended at %ld, would sleep until %ld\n",
       time(NULL), timeout);
     fflush(stdout);
@@ -552,233 +624,6 @@ void watcher() {
   free(condition);
 }
 
-static inline void fetch_proc_stats (
-  process_tree_t &child,
-  scraper_result_map_t &result,
-  stepd_step_id_map_t &stepd_pids,
-  jobstep_val_map_t &jobstep_cpu_available) {
-  const size_t page_size = sysconf(_SC_PAGE_SIZE);
-  const char *slurm_cgroup_mount_point
-    = getenv(SLURM_CGROUP_MOUNT_POINT_ENV);
-  const std::string slurm_cgroup_mount_point_str
-    = std::string(slurm_cgroup_mount_point ? slurm_cgroup_mount_point : "");
-  char buf[READ_BUF_SIZE];
-  scrape_result_t cur_result;
-  memset(&cur_result, 0, sizeof(cur_result));
-  DIR *proc_dir = opendir("/proc");
-  /* Build process tree and get stats */
-  while (auto child_dir = readdir(proc_dir)) {
-    pid_t pid = 0;
-    pid_t ppid = 0;
-    bool success = 0;
-    if (!sscanf(child_dir->d_name, "%d", &pid)) {
-      continue;
-    }
-    std::string basepath = "/proc/" + std::string(child_dir->d_name) + "/";
-    int fd = open((basepath + "stat").c_str(), O_RDONLY);
-    if (fd) {
-      if (auto cnt = read(fd, buf, READ_BUF_SIZE)) {
-        if (cnt < 0) {
-          continue;
-        }
-        const char *end = buf + cnt;
-        const char *cur = buf;
-        int col = 1;
-        size_t val = 0;
-        for (; !success && cur != end; cur++) {
-          const char c = *cur;
-          // printf("%c[%ld]  ", c, val); fflush(stdout);
-          if (c == ' ') {
-            #define ASSIGNRAW(COL, ASSIGNMENT, ...) \
-              case COL: ASSIGNMENT = val; __VA_ARGS__ break;
-            #define ASSIGN(COL, ASSIGNMENT, ...) \
-              ASSIGNRAW(COL, cur_result.ASSIGNMENT, __VA_ARGS__)
-            #define ASSIGNLAST(COL, ASSIGNMENT) \
-              ASSIGN(COL, ASSIGNMENT, success = 1;)
-            switch (col) {
-              ASSIGN(1, pid);
-              ASSIGNRAW(4, ppid);
-              ASSIGN(10, minor_pagefault);
-              ASSIGN(11, cminor_pagefault);
-              ASSIGN(14, utime);
-              ASSIGN(15, stime);
-              ASSIGN(16, cutime);
-              ASSIGN(17, cstime);
-              ASSIGNLAST(24, res);
-            }
-            #undef ASSIGNLAST
-            #undef ASSIGNRAW
-            #undef ASSIGN
-            col++;
-            val = 0;
-            continue;
-          } else if (c >= '0' && c <= '9') {
-            val = val * 10 + c - '0';
-          } else if (c == '(') {
-            assert(col == 2 /*(comm)*/);
-            if (col != 2) {
-              fprintf(stderr,
-                "error: unrecognized proc/stat format having character "
-                ") outside field 2\n");
-              break;
-            }
-            const char *tail = NULL;
-            const char *search_end = end - 1;
-            for (auto end = search_end; end > cur; end--)
-              if (*end == ')') {
-                tail = end - 1;
-                break;
-              }
-            if (!tail) {
-              fprintf(stderr,
-                      "Error: Could not locate end of comm field in the"
-                      "following proc/stat data [%ld bytes read]:\n", cnt);
-              for (auto i = buf; i != end; i++) {
-                if (i == cur) {
-                  fputs(">>>", stderr);
-                }
-                fputc(*i, stderr);
-                if (i == search_end) {
-                  fputs("<<<", stderr);
-                }
-              }
-              fputs("\n", stderr);
-              break;
-            }
-            int comm_len = std::min(tail - cur, (long)TASK_COMM_LEN);
-            for (auto i = 0; i < comm_len; i++)
-              cur_result.comm[i] = cur[i + 1];
-            cur_result.comm[comm_len] = '\0';
-            cur = tail;
-          }
-        }
-        close(fd);
-        if (!success) {
-          // Did not reach last column
-          continue;
-        } else {
-          cur_result.res *= page_size;
-        }
-      }
-    } else {
-      continue;
-    }
-    if (auto f = fopen((basepath + "io").c_str(), "r")) {
-      fscanf(f, "rchar: %ld wchar: %ld", &cur_result.rchar, &cur_result.wchar);
-      fclose(f);
-    } else {
-      cur_result.rchar = cur_result.wchar = 0;
-    }
-    DEBUGOUT_VERBOSE(
-      fprintf(stderr,
-        "\n[%s] %d res=%ld minor=%ld utime=%ld stime=%ld rchar=%ld wchar=%ld\n",
-        cur_result.comm, pid, cur_result.res,
-        cur_result.minor_pagefault, cur_result.utime, cur_result.stime,
-        cur_result.rchar, cur_result.wchar);
-    );
-    if (auto f = fopen((basepath + "cmdline").c_str(), "r")) {
-      slurm_step_id_t step;
-      char c;
-      #define STEP_MAX_LENGTH 32
-      char step_str[STEP_MAX_LENGTH + 1];
-      if (fscanf(f, "slurmstepd: [%d.%" STRINGIFY(STEP_MAX_LENGTH) "s",
-                 &step.job_id, step_str) == 2
-          && (!fread(&c, sizeof(char), 1, f) || !c)) {
-        // From slurm protocol definition source, reordered with possibility
-        #include "def/slurm_stepid.inc"
-        const auto &mapping = slurm_stepid_mapping;
-        bool found_stepid = sscanf(step_str, "%d]", &step.step_id);
-        if (!found_stepid) {
-          size_t len = strlen(step_str) - 1;
-          if (step_str[len] == ']') {
-            step_str[len] = '\0';
-            for (auto *cur = mapping; cur->name; cur++) {
-              if (*step_str == *(cur->name) && !strcmp(step_str, cur->name)) {
-                step.step_id = cur->stepid;
-                found_stepid = true;
-                break;
-              }
-            }
-          }
-        }
-        if (found_stepid) {
-          stepd_pids[pid] = step;
-          FILE *fp = NULL;
-          auto jobstep_pair = std::make_pair(step.job_id, step.step_id);
-          if (slurm_cgroup_mount_point_str.length()
-              && !jobstep_cpu_available.count(jobstep_pair)
-              && (fp = fopen((basepath + "cpuset").c_str(), "r"))) {
-            std::string cgroup_path
-              = slurm_cgroup_mount_point_str + std::string("/cpuset");
-            size_t cnt;
-            while (cnt = fread(buf, 1, READ_BUF_SIZE, fp)) {
-              buf[cnt] = '\0';
-              cgroup_path += std::string(buf);
-            }
-            cgroup_path.pop_back();
-            cgroup_path += std::string("/cpuset.effective_cpus");
-            fclose(fp);
-            fp = fopen(cgroup_path.c_str(), "r");
-            DEBUGOUT(fprintf(stderr, "%s\n", cgroup_path.c_str());)
-            int val[2] = {0, 0}; bool cur_side = 0; int ncpu = 0;
-            while (fp && (cnt = fread(buf, 1, READ_BUF_SIZE, fp))) {
-              buf[cnt] = '\0';
-              auto cur = buf;
-              while (cur) {
-                auto c = *cur;
-                if (c == '-') {
-                  cur_side = !cur_side;
-                } else if (c == ',' || c == '\n' || c == '\0') {
-                  if (!cur_side) {
-                    val[1] = val[0];
-                  }
-                  ncpu += val[1] - val[0] + 1;
-                  val[0] = val[1] = 0;
-                  cur_side = 0;
-                  if (c == '\n' || c == '\0') {
-                    break;
-                  }
-                } else {
-                  val[cur_side] = val[cur_side] * 10 + c - '0';
-                }
-                cur++;
-              }
-            }
-            DEBUGOUT(
-              fprintf(stderr, "fetch: %d.%d available cpu %d\n",
-                      step.job_id, step.step_id, ncpu);
-            )
-            if (fp) {
-              jobstep_cpu_available.try_emplace(jobstep_pair, ncpu);
-              fclose(fp);
-            }
-          }
-        }
-      }
-      #undef STEP_MAX_LENGTH
-      fclose(f);
-    }
-    child[ppid].push_back(pid);
-    result[pid] = cur_result;
-    for (auto &cpid : child[pid]) {
-      if (auto dir = opendir(("/proc/" + std::to_string(cpid)).c_str())) {
-        closedir(dir);
-      } else if (errno == ENOENT) {
-        // child has terminated approximately at the time of scraping parent
-        // this would double count the c____ fields
-        const auto &STAT_MERGE_SRC = result[cpid];
-        auto &STAT_MERGE_DST = result[pid];
-        ACCUMULATE_SCRAPER_STAT(rchar);
-        ACCUMULATE_SCRAPER_STAT(wchar);
-        AGGERGATE_SCRAPER_STAT_MAX(res);
-        result.erase(cpid);
-        cpid = 0;
-      }
-    }
-  }
-  closedir(proc_dir);
-}
-
 static void walk_scraped_proc_tree (
   pid_t cur,
   process_tree_t &tree,
@@ -815,8 +660,8 @@ static void walk_scraped_proc_tree (
       cpid, tree, stats, application_set,
       pid_gpu_measurement_map, root_step_id);
     // ____ of child is already in c____ of parent, but not recursive
-    ACCUMULATE_SCRAPER_STAT(rchar);
-    ACCUMULATE_SCRAPER_STAT(wchar);
+    ACCUMULATE_PRIVILEGED_SCRAPER_STAT(rchar);
+    ACCUMULATE_PRIVILEGED_SCRAPER_STAT(wchar);
     ACCUMULATE_SCRAPER_STAT(cutime);
     ACCUMULATE_SCRAPER_STAT(cstime);
     ACCUMULATE_SCRAPER_STAT(cminor_pagefault);
@@ -831,24 +676,79 @@ void scraper() {
   time_t timeout = 0;
   int scrape_cnt = run_once ? 1 : SCRAPE_CNT;
   std::vector<std::pair<slurm_step_id_t, scrape_result_t>> stats;
-  // Theoretically this implementation could merge two different steps with same
-  // pid, happening when, within one scraping session, one exits and the pids
-  // somehow rolled rocket fast and *luckily* the next slurmstepd got this pid
-  // again. With this luck it is suggested that you buy a lottery and share me 5
-  // million if u got a jackpot :)
-  std::map<pid_t/* slurmstepd_pid */, step_application_set_t> app_map;
+  jobstep_application_map_t app_map;
   jobstep_val_map_t jobstep_cpu_available;
+  process_cache_t process_cache;
+  process_cache.generation = 0;
+  // sendout holds on to what it could not send yet
+  std::set<std::pair<uint32_t, uint32_t>> cpu_available_staged;
+  int unflushed_cnt = 0;
+  const auto &watching_job_id = worker.jobstep_info.job_id;
+  // Stages everything collected since last flush, so a crash or a killed
+  // allocation only loses what was scraped after it
+  const auto flush = [&](bool keep_open) {
+    const std::vector<std::string> ignored_apps {
+      "slurmstepd", "slurm_script", "srun",
+      "turingwatch"
+    };
+    for (auto &[id, result] : stats) {
+      result.step = id;
+      stage_message(result);
+    }
+    stats.clear();
+    // Steps that exited before being scraped again only have applications
+    slurm_step_id_t step;
+    step.step_het_comp = NO_VAL;
+    for (const auto &[jobstep, apps] : app_map) {
+      step.job_id = jobstep.first;
+      step.step_id = jobstep.second;
+      for (const auto &app : apps) {
+        if (std::find(ignored_apps.begin(), ignored_apps.end(), app)
+            != ignored_apps.end()) {
+          continue;
+        }
+        stage_message(step, app.c_str());
+      }
+    }
+    app_map.clear();
+    for (auto &[id, val] : jobstep_cpu_available) {
+      if (!cpu_available_staged.insert(id).second) {
+        continue;
+      }
+      cpu_available_info_t info;
+      info.step.job_id = id.first;
+      info.step.step_id = id.second;
+      info.cpu_available = val;
+      DEBUGOUT(
+      fprintf(stderr, "stage: %d.%d available cpu %d\n",
+              id.first, id.second, val);
+      )
+      stage_message(info);
+    }
+    // Nothing is left to flush it later once the scraper ends
+    for (int retry = keep_open ? 0 : SCRAPE_SEND_RETRY_CNT;
+         !sendout(keep_open) && retry; retry--) {
+      sleep(SCRAPE_SEND_RETRY_INTERVAL);
+    }
+  };
   while (scrape_cnt-- && wait_until(timeout)) {
     timeout = time(NULL) + SCRAPE_INTERVAL;
-    process_tree_t child;
-    scraper_result_map_t result;
-    stepd_step_id_map_t stepd_pids;
+    auto &child = process_cache.child;
+    auto &result = process_cache.result;
+    auto &stepd_pids = process_cache.stepd_pids;
+    cgroup_step_results_t cgroup_results;
     pid_gpu_measurement_map_t pid_gpu_measurement_map;
-    fetch_proc_stats(child, result, stepd_pids, jobstep_cpu_available);
+    if (cgroup_scrape_version != CGROUP_NONE) {
+      scrape_cgroups(cgroup_results, jobstep_cpu_available);
+    } else {
+      fetch_proc_stats(process_cache, jobstep_cpu_available);
+    }
     measure_gpu_result_t gpu_result;
     std::map<uint32_t, std::vector<gpu_measurement_t *> > mapped_gpu_results;
     std::map<uint32_t, uint32_t> job_step_mapping;
     std::queue<gpu_measurement_t *> gpu_results_to_send;
+    // Points into either result or cgroup_results
+    std::vector<std::pair<slurm_step_id_t, scrape_result_t *>> step_results;
     measure_gpu(gpu_result);
     for (auto &result : gpu_result) {
       if (result.step.job_id) {
@@ -858,11 +758,11 @@ void scraper() {
       }
     }
     for (const auto &[stepd_pid, stepd_step_id] : stepd_pids) {
-      const auto &watching_job_id = worker.jobstep_info.job_id;
       if (watching_job_id && stepd_step_id.job_id != watching_job_id) {
         continue;
       }
-      step_application_set_t &apps = app_map[stepd_pid];
+      step_application_set_t &apps
+        = app_map[std::make_pair(stepd_step_id.job_id, stepd_step_id.step_id)];
       walk_scraped_proc_tree(
         stepd_pid, child, result, apps, pid_gpu_measurement_map, stepd_step_id);
       auto &final_result = result[stepd_pid];
@@ -873,13 +773,41 @@ void scraper() {
       MERGECHILD(utime);
       MERGECHILD(stime);
       #undef MERGECHILD
-      const std::vector<std::string> ignored_apps {
-        "slurmstepd", "slurm_script", "srun",
-        "turingwatch"
-      };
-      for (const auto &x : ignored_apps) {
-        apps.erase(x);
+      step_results.push_back(std::make_pair(stepd_step_id, &final_result));
+    }
+    // Including steps whose stepd exited since last scrape
+    for (auto &[jobstep, apps] : process_cache.exited_apps) {
+      if (watching_job_id && jobstep.first != watching_job_id) {
+        continue;
+      }
+      app_map[jobstep].insert(apps.begin(), apps.end());
+    }
+    process_cache.exited_apps.clear();
+    // Counters are already step totals kept by the kernel
+    for (auto &cgroup_result : cgroup_results) {
+      auto &final_result = cgroup_result.stat;
+      const auto &step_id = final_result.step;
+      if (watching_job_id && step_id.job_id != watching_job_id) {
+        continue;
       }
+      app_map[std::make_pair(step_id.job_id, step_id.step_id)].insert(
+        cgroup_result.apps.begin(), cgroup_result.apps.end());
+      for (const auto &pid : cgroup_result.pids) {
+        if (!pid_gpu_measurement_map.count(pid)) {
+          continue;
+        }
+        for (auto &measurement : pid_gpu_measurement_map[pid]) {
+          measurement->step = step_id;
+          stage_message(*measurement);
+          final_result.gpu_measurement_cnt++;
+        }
+      }
+      step_results.push_back(std::make_pair(step_id, &final_result));
+    }
+    for (auto &[stepd_step_id, final_result_ptr] : step_results) {
+      auto &final_result = *final_result_ptr;
+      const auto &apps
+        = app_map[std::make_pair(stepd_step_id.job_id, stepd_step_id.step_id)];
       DEBUGOUT(
         fputs("===> ", stderr);
         bool first = 1;
@@ -915,33 +843,15 @@ void scraper() {
       stage_message(measurement);
       gpu_results_to_send.pop();
     }
-  }
-  application_usage_t usage;
-  for (auto &[id, result] : stats) {
-    usage.step = id;
-    result.step = id;
-    stage_message(result);
-    if (app_map.count(result.pid)) {
-      auto &apps = app_map[result.pid];
-      for (const auto &app : apps) {
-        usage.app = app.c_str();
-        stage_message(usage);
-      }
-      app_map.erase(result.pid);
+    if (scrape_cnt
+        && (++unflushed_cnt >= SCRAPE_FLUSH_CNT
+            || stats.size() * sizeof(scrape_result_t) + staged_message_size()
+               >= SCRAPE_FLUSH_SIZE)) {
+      flush(true);
+      unflushed_cnt = 0;
     }
   }
-  for (auto &[id, val] : jobstep_cpu_available) {
-    cpu_available_info_t info;
-    info.step.job_id = id.first;
-    info.step.step_id = id.second;
-    info.cpu_available = val;
-    DEBUGOUT(
-    fprintf(stderr, "stage: %d.%d available cpu %d\n",
-            id.first, id.second, val);
-    )
-    stage_message(info);
-  }
-  sendout();
+  flush(false);
 }
 
 static void expand_node_group(
@@ -1229,6 +1139,9 @@ void *node_watcher_distributor(void *arg) {
   const std::string port_env = get_env_str(PORT_ENV, STRINGIFY(DEFAULT_PORT));
   const std::string slurm_cgroup_mount_point_env
     = get_env_str(SLURM_CGROUP_MOUNT_POINT_ENV, "");
+  const std::string scrape_cgroup_env = get_env_str(SCRAPE_CGROUP_ENV, "");
+  const std::string scrape_proc_events_env
+    = get_env_str(SCRAPE_PROC_EVENTS_ENV, "");
   const std::string bright_cert_path_env
     = get_env_str(BRIGHT_CERT_PATH_ENV, "default");
   const std::string bright_key_path_env
@@ -1245,6 +1158,8 @@ void *node_watcher_distributor(void *arg) {
     conf_path_env.c_str(),
     libpath.c_str(),
     slurm_cgroup_mount_point_env.c_str(),
+    scrape_cgroup_env.c_str(),
+    scrape_proc_events_env.c_str(),
     db_host.c_str(),
     port_env.c_str(),
     run_once_env.c_str(),
@@ -0,0 +1,158 @@
+// Checks that the accuracy index keeps the same measurements as the
+// measurement_quality_ensurance trigger it replaced, by inserting the same
+// random measurements into a database with the trigger and, through the
+// index, into one without it. The latter takes them into a partition as the
+// watcher does, and loads steps through the views over all partitions
+#include "accuracy_index.h"
+#include "bench_util.h"
+#include "sql_helper.h"
+
+#include <array>
+
+#define ACCURACY_TEST_ROWS 20000
+#define ACCURACY_TEST_PARTITION_LENGTH (24 * 60 * 60)
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+// As it was in the schema up to version 7
+static const char *MEASUREMENT_QUALITY_ENSURANCE_SQL = SQLITE_CODEBLOCK(
+CREATE TRIGGER measurement_quality_ensurance
+  BEFORE INSERT ON measurements
+  FOR EACH ROW
+  WHEN NEW.tot_time == 0
+    OR EXISTS (
+      WITH newentry_watcher AS MATERIALIZED (
+        SELECT accuracy, target_node FROM watcher
+          WHERE NEW.watcherid == watcher.id
+      )
+      SELECT measurements.jobid FROM measurements, watcher, newentry_watcher
+        WHERE measurements.jobid == NEW.jobid
+              AND measurements.stepid IS NEW.stepid
+              AND measurements.watcherid == watcher.id
+              AND (watcher.accuracy > newentry_watcher.accuracy
+                 OR (watcher.accuracy == newentry_watcher.accuracy
+                     AND tot_time == NEW.tot_time
+                     AND watcher.target_node IS newentry_watcher.target_node
+                 )
+              )
+    )
+BEGIN SELECT RAISE (IGNORE); END;
+);
+
+// Ids 1 to 5: raw readings of two nodes, sacct, privileged and parent
+static const char *WATCHERS_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO watcher(pid, jobid, privileged, target_node) VALUES
+    (1, 0, 0, 'n1'), (1, 0, 0, 'n2'), (1, 0, 0, NULL), (1, 0, 1, 'n1'),
+    (1, 5, 0, 'n1');
+);
+
+// Opens db with the watchers of the test, NULL on failure
+static sqlite3 *open_db(test_db_t &db) {
+  if (!db.open() || !sqlite3_exec_wrap(WATCHERS_SQL, "(watchers)")) {
+    return NULL;
+  }
+  return SQL_CONN_NAME;
+}
+
+static bool insert(bulk_insert_t &insert, int watcherid, int jobid,
+                   int stepid, int64_t user_sec) {
+  // tot_time of 0 fails its CHECK where the trigger does not ignore it
+  if (!user_sec) {
+    return true;
+  }
+  bulk_columns_t rows(insert.ncol);
+  // recordid, watcherid, jobid, stepid, dev_in, dev_out, user_sec,
+  // user_usec, sys_sec, sys_usec, then NULL up to gpu_measurement_batch
+  rows.add_null();
+  for (int64_t val : {watcherid, jobid, stepid}) {
+    rows.add(val);
+  }
+  rows.add_null();
+  rows.add_null();
+  for (int64_t val : {user_sec, (int64_t)0, (int64_t)0, (int64_t)0}) {
+    rows.add(val);
+  }
+  for (int col = 0; col < 4; col++) {
+    rows.add_null();
+  }
+  bool ok = true;
+  insert.insert(rows, [&](size_t) { ok = false; }, "(measurement_insert)");
+  return ok;
+}
+
+static std::vector<std::array<int64_t, 4>> dump() {
+  std::vector<std::array<int64_t, 4>> rows;
+  sqlite3_stmt *stmt;
+  PREPARE_STMT(
+    "SELECT watcherid, jobid, stepid, tot_time FROM measurements"
+    " ORDER BY recordid", &stmt, 0);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    rows.push_back({sqlite3_column_int64(stmt, 0),
+                    sqlite3_column_int64(stmt, 1),
+                    sqlite3_column_int64(stmt, 2),
+                    sqlite3_column_int64(stmt, 3)});
+  }
+  sqlite3_finalize(stmt);
+  return rows;
+}
+
+int main() {
+  test_db_t trigger_db("accuracy_index_trigger");
+  test_db_t index_db("accuracy_index");
+  sqlite3 *trigger_conn = open_db(trigger_db);
+  CHECK(trigger_conn);
+  CHECK(sqlite3_exec_wrap(MEASUREMENT_QUALITY_ENSURANCE_SQL, "(trigger)"));
+  sqlite3 *index_conn = open_db(index_db);
+  CHECK(index_conn);
+  CHECK(partitions_attach(ACCURACY_TEST_PARTITION_LENGTH));
+
+  // The trigger is on the table of the main database
+  const std::string trigger_head = unpartitioned(MEASUREMENTS_INSERT_SQL);
+  bulk_insert_t trigger_insert(trigger_head.c_str());
+  bulk_insert_t index_insert(MEASUREMENTS_INSERT_SQL);
+  // Latest user_sec by watcher and step, tot_time only grows
+  std::map<std::array<int, 3>, int64_t> latest;
+  srand(1);
+  double index_secs = 0;
+  for (int i = 0; i < ACCURACY_TEST_ROWS; i++) {
+    const int watcherid = rand() % 5 + 1;
+    const int jobid = rand() % 8 + 1;
+    const int stepid = rand() % 3;
+    auto &user_sec = latest[{watcherid, jobid, stepid}];
+    // Every other measurement repeats the latest one
+    user_sec += rand() % 2 ? 0 : rand() % 3;
+    SQL_CONN_NAME = trigger_conn;
+    CHECK(insert(trigger_insert, watcherid, jobid, stepid, user_sec));
+    SQL_CONN_NAME = index_conn;
+    const double start = bench_now();
+    if (accuracy_index_admit(watcherid, jobid, stepid, user_sec * 1'000'000)) {
+      CHECK(insert(index_insert, watcherid, jobid, stepid, user_sec));
+    }
+    index_secs += bench_now() - start;
+    // Steps are loaded again from the database now and then
+    if (i % 1000 == 999) {
+      accuracy_index_rollback();
+    }
+    accuracy_index_commit();
+  }
+  index_insert.finalize();
+  const auto index_rows = dump();
+  SQL_CONN_NAME = trigger_conn;
+  trigger_insert.finalize();
+  const auto trigger_rows = dump();
+  CHECK(index_rows.size() == trigger_rows.size());
+  CHECK(index_rows == trigger_rows);
+  printf("%zu of %d measurements kept, %.1f us each through the index\n",
+    index_rows.size(), ACCURACY_TEST_ROWS,
+    index_secs * 1e6 / ACCURACY_TEST_ROWS);
+
+  db_common_finalize();
+  sqlite3_close(trigger_conn);
+  sqlite3_close(index_conn);
+  return 0;
+}
@@ -0,0 +1,223 @@
+// Analyzes a user with many finished jobs, measures one of them again and
+// analyzes the user once more on the same reader. Checks that only the job
+// measured again and the running one are analyzed again, and that the
+// tables of the analysis match those of a reader without a cache
+#include "db_common.h"
+#include "stmts.h"
+#include "partition.h"
+#include "rollup.h"
+#include "gpucpu_usage.h"
+#include "analysis_functions.h"
+#include "analyze_info.h"
+#include "bench_util.h"
+
+#define ANALYSIS_CACHE_TEST_PARTITION_LENGTH (24 * 60 * 60)
+#define ANALYSIS_CACHE_TEST_JOBS 2000
+#define ANALYSIS_CACHE_TEST_STEPS 2
+#define ANALYSIS_CACHE_TEST_SAMPLES 8
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+// Of the tables the letters and the JSON dump are made of
+static const char *analysis_tables[] = {
+  "step_usage", "sys_ratio", "gpu_usage_base", "gpucpu_usage",
+  "resource_usage", NULL
+};
+
+static int64_t recordid;
+
+// Samples of every step of the job, the job runs unless ended
+static bool measure(int jobid, int first_sample, bool ended) {
+  for (int stepid = 0; stepid < ANALYSIS_CACHE_TEST_STEPS; stepid++) {
+    for (int i = first_sample;
+         i < first_sample + ANALYSIS_CACHE_TEST_SAMPLES; i++) {
+      rollup_sample_t sample;
+      sample.watcherid = 1;
+      sample.jobid = jobid;
+      sample.stepid = stepid;
+      sample.recordid = ++recordid;
+      sample.user_time = (int64_t)(i + 1) * (jobid % 4 + 1) * 10'000'000;
+      sample.sys_time = (int64_t)(i + 1) * (stepid + 1) * 2'000'000;
+      sample.res_size = (int64_t)(i + 1) << 20;
+      sample.scrape_interval = 10;
+      if (!rollup_add(sample)) {
+        return false;
+      }
+    }
+  }
+  return rollup_flush()
+         && JOBINFO_INSERT_STMT.exec(jobid, std::nullopt, "u", "job",
+                                     "sbatch", 60, 1, ended ? 1000 : 0,
+                                     1 << 30, std::nullopt, 1, 4, 0);
+}
+
+static bool setup_job(int jobid) {
+  for (int stepid = 0; stepid < ANALYSIS_CACHE_TEST_STEPS; stepid++) {
+    const std::string cpu_available
+      = "INSERT INTO job_step_cpu_available(watcherid, jobid, stepid, ncpu)"
+        "  VALUES (1, " + std::to_string(jobid) + ", "
+        + std::to_string(stepid) + ", 4)";
+    if (!JOBINFO_INSERT_STMT.exec(jobid, stepid, NULL, "step", "srun",
+                                  std::nullopt, 1, 2, std::nullopt, 1 << 20,
+                                  std::nullopt, std::nullopt, std::nullopt)
+        || !sqlite3_exec_wrap(cpu_available.c_str(), "(setup)")) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int64_t query_int(const char *sql) {
+  sqlite3_stmt *stmt = NULL;
+  int64_t val = -1;
+  if (IS_SQLITE_OK(PREPARE_STMT(sql, &stmt, 0))
+      && sqlite3_step(stmt) == SQLITE_ROW) {
+    val = sqlite3_column_int64(stmt, 0);
+  } else {
+    SQLITE3_PERROR("step(query_int)");
+  }
+  sqlite3_finalize(stmt);
+  return val;
+}
+
+static bool run_analysis_stmt(const char *sql, int64_t offset_start,
+                              int64_t offset_end) {
+  sqlite3_stmt *stmt = NULL;
+  bool ok = IS_SQLITE_OK(PREPARE_STMT(sql, &stmt, 0));
+  int idx;
+  if (ok && (idx = sqlite3_bind_parameter_index(stmt, ":user"))) {
+    sqlite3_bind_text(stmt, idx, "u", -1, SQLITE_STATIC);
+  }
+  if (ok && (idx = sqlite3_bind_parameter_index(stmt, ":offset_start"))) {
+    sqlite3_bind_int64(stmt, idx, offset_start);
+  }
+  if (ok && (idx = sqlite3_bind_parameter_index(stmt, ":offset_end"))) {
+    sqlite3_bind_int64(stmt, idx, offset_end);
+  }
+  ok = ok && sqlite3_step(stmt) == SQLITE_DONE;
+  if (!ok) {
+    SQLITE3_PERROR("step(base_table)");
+  }
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+// Adds the user and builds the analysis tables on SQL_CONN_NAME, giving the
+// rows of them along with the number of jobs analyzed again
+static bool analyze(int64_t offset_start, int64_t offset_end,
+                    std::vector<std::string> &rows, int64_t &changed_jobs) {
+  rows.clear();
+  bool ok = sqlite3_exec_wrap(PRE_ANALYZE_SQL, "(pre_analyze)")
+            && run_analysis_stmt(ANALYZE_ADD_USER_SQL, offset_start,
+                                 offset_end);
+  for (int i = 0; ok && ANALYZE_CREATE_BASE_TABLES[i]; i++) {
+    ok = run_analysis_stmt(ANALYZE_CREATE_BASE_TABLES[i], offset_start,
+                           offset_end);
+  }
+  gpucpu_usage_t gpucpu_usage;
+  ok = ok && gpucpu_usage.fill();
+  gpucpu_usage.finalize();
+  for (int i = 0; ok && ANALYZE_CREATE_USAGE_TABLES[i]; i++) {
+    ok = run_analysis_stmt(ANALYZE_CREATE_USAGE_TABLES[i], offset_start,
+                           offset_end);
+  }
+  changed_jobs = ok ? query_int("SELECT count(*) FROM inmem.changed_job") : 0;
+  for (int i = 0; ok && analysis_tables[i]; i++) {
+    const std::string sql = std::string("SELECT * FROM inmem.")
+      + analysis_tables[i] + " ORDER BY 1, 2, 3, 4, 5, 6, 7, 8";
+    sqlite3_stmt *stmt = NULL;
+    ok = IS_SQLITE_OK(PREPARE_STMT(sql.c_str(), &stmt, 0));
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+      std::string row = analysis_tables[i];
+      for (int col = 0; col < sqlite3_column_count(stmt); col++) {
+        const char *text = (const char *)sqlite3_column_text(stmt, col);
+        row += std::string("|") + (text ? text : "NULL");
+      }
+      rows.push_back(row);
+    }
+    sqlite3_finalize(stmt);
+  }
+  return sqlite3_exec_wrap(POST_ANALYZE_SQL, "(post_analyze)") && ok;
+}
+
+int main() {
+  test_db_t db("analysis_cache");
+  CHECK(db.open(ANALYSIS_CACHE_TEST_PARTITION_LENGTH));
+  CHECK(stmt_registry_check());
+  CHECK(sqlite3_exec_wrap(
+    "INSERT INTO watcher(pid, jobid, privileged, target_node)"
+    "  VALUES (1, 0, 0, 'n1')", "(setup)"));
+
+  // The last job still runs
+  CHECK(sqlite3_begin_immediate_transaction());
+  for (int jobid = 1; jobid <= ANALYSIS_CACHE_TEST_JOBS; jobid++) {
+    CHECK(setup_job(jobid));
+    CHECK(measure(jobid, 0, jobid < ANALYSIS_CACHE_TEST_JOBS));
+  }
+  CHECK(sqlite3_end_transaction());
+  const int64_t first_offset_end = recordid;
+
+  sqlite3 *cached_reader = acquire_sqlite_reader();
+  CHECK(cached_reader);
+  std::vector<std::string> full_rows, cached_rows;
+  int64_t changed_jobs;
+  double full_secs, cached_secs;
+  {
+    sqlite_conn_scope_t reader_scope(cached_reader);
+    CHECK(analysis_functions_register());
+    CHECK(sqlite3_exec_wrap(ANALYZE_ATTACH_CACHE_SQL, "(attach_cache)"));
+    const double start = bench_now();
+    CHECK(analyze(0, first_offset_end, cached_rows, changed_jobs));
+    full_secs = bench_now() - start;
+    CHECK(changed_jobs == ANALYSIS_CACHE_TEST_JOBS);
+    CHECK(!cached_rows.empty());
+  }
+
+  // Later in the period, one job is measured again
+  CHECK(sqlite3_begin_immediate_transaction());
+  CHECK(measure(ANALYSIS_CACHE_TEST_JOBS / 2, ANALYSIS_CACHE_TEST_SAMPLES,
+                true));
+  CHECK(sqlite3_end_transaction());
+  {
+    sqlite_conn_scope_t reader_scope(cached_reader);
+    const double start = bench_now();
+    CHECK(analyze(0, recordid, cached_rows, changed_jobs));
+    cached_secs = bench_now() - start;
+    CHECK(changed_jobs == 2);
+    // Up to date, only the running job is analyzed again
+    CHECK(analyze(0, recordid, cached_rows, changed_jobs));
+    CHECK(changed_jobs == 1);
+  }
+
+  sqlite3 *reader = acquire_sqlite_reader();
+  CHECK(reader);
+  {
+    sqlite_conn_scope_t reader_scope(reader);
+    CHECK(analysis_functions_register());
+    CHECK(sqlite3_exec_wrap(ANALYZE_ATTACH_CACHE_SQL, "(attach_cache)"));
+    CHECK(analyze(0, recordid, full_rows, changed_jobs));
+    CHECK(changed_jobs == ANALYSIS_CACHE_TEST_JOBS);
+    CHECK(sqlite3_exec_wrap(ANALYZE_DETACH_CACHE_SQL, "(detach_cache)"));
+  }
+  release_sqlite_reader(reader);
+  CHECK(full_rows == cached_rows);
+  {
+    sqlite_conn_scope_t reader_scope(cached_reader);
+    CHECK(sqlite3_exec_wrap(ANALYZE_DETACH_CACHE_SQL, "(detach_cache)"));
+  }
+  release_sqlite_reader(cached_reader);
+  printf("%zu rows of %d jobs, analyzed in %.1f ms at first, %.1f ms with"
+         " one job measured again\n", full_rows.size(),
+         ANALYSIS_CACHE_TEST_JOBS, full_secs * 1e3, cached_secs * 1e3);
+
+  rollup_finalize();
+  db_common_finalize();
+  close_sqlite_readers();
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
@@ -0,0 +1,249 @@
+// Builds resource_usage of a synthetic analysis, once with the window it was
+// built with over the rows of every node and once with the aggregates of
+// analysis_functions_register, and checks that both give the same rows in
+// the same order. Nodes have GPUs or not, with the most GPUs in use the most
+// common or not, and steps of one node or more
+//
+// Usage: analysis_functions [steps]
+#include "db_common.h"
+#include "worker.h"
+#include "analysis_functions.h"
+#include "gpucpu_usage.h"
+#include "bench_util.h"
+#include "sql_helper.h"
+
+#define ANALYSIS_FUNCTIONS_TEST_NODES 3
+#define ANALYSIS_FUNCTIONS_TEST_NCPU 8
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+// As resource_usage was built before max_by
+static const char *WINDOW_RESOURCE_USAGE_SQL = SQLITE_CODEBLOCK(
+  CREATE TABLE inmem.window_resource_usage AS
+  SELECT ts.user, ts.jobid, ts.stepid, name,
+        format('[%.2lf%%, %.2lf%%]',
+                (1.0 * step_start_offset) / job_length * 100,
+                (1.0 * step_end_offset) / job_length * 100) AS timespan,
+        nnodes AS nnode, NULL AS ncpu, cpu_usage, ngpu, gpu_usage,
+        peak_res_size, sample_cnt,
+        mem_limit / iif(peak_res_size == peak_res_size_slurm, 1, nnodes)
+          AS mem_limit,
+        peak_res_size == peak_res_size_slurm AS is_res_size_from_slurm,
+        rtrim(iif(is_jupyter, 'jupyter | ', '')
+              || iif(low_concurrency, 'low_concurrency | ', '')
+              || iif(peak_res_size > mem_limit, 'oversubscribe | ', '')
+              || iif(gpu_flagged, 'gpu_underusage | ', '')
+              || iif(cpu_flagged, 'cpu_underusage | ', '')
+              , '| ') AS problem
+  FROM (SELECT
+    user, jobid, stepid, name, submit_line, job_length, ngpu,
+    step_start_offset, step_end_offset, nnodes, mem_limit, sample_cnt,
+    max(peak_res_size, sampled_peak_res_size) AS peak_res_size,
+    peak_res_size AS peak_res_size_slurm
+    FROM inmem.step_usage
+    ) AS ts, (
+        SELECT jobid, stepid,
+         iif(sel_ngpu == 0, '',
+             group_concat(iif(gpu_flagged, '** ', '') || node
+                          || x'0a' || node_tot || ' sample'
+                          || iif(node_tot > 1, 's', '') || x'0a'
+                          || gpu_usage, x'0a0a'))
+           AS gpu_usage,
+         group_concat(iif(cpu_flagged, '** ', '') || node
+                          || x'0a' || node_tot || ' sample'
+                          || iif(node_tot > 1, 's', '') || x'0a'
+                          || cpu_usage || x'0a' || ' (' || sel_ncpu || ' core'
+                          || iif(sel_ncpu > 1, 's', '')
+                          || ' available)' || x'0a'
+                          , x'0a0a')
+           AS cpu_usage,
+         count(node) AS nnode,
+         max(gpu_flagged) AS gpu_flagged,
+         max(cpu_flagged) AS cpu_flagged,
+         max(low_concurrency) AS low_concurrency
+  FROM (
+    SELECT
+      jobid, stepid, node,
+      max(ncpu) AS sel_ncpu, max(ngpu) AS sel_ngpu, node_tot, 
+      ' ncpu' || x'0a' || 'inuse percentage' || x'0a' ||  
+      group_concat(iif(ncpu_in_use IS NULL, NULL, format('%5d %6.2lf%%',
+                          ncpu_in_use, (1.0 * cnt_cpu) / node_tot * 100)),
+                  x'0a')
+        AS cpu_usage,
+      ' ngpu' || x'0a' || 'inuse percentage' || x'0a' ||  
+      group_concat(iif(ngpu_in_use IS NULL, NULL, format('%5d %6.2lf%%',
+                          ngpu_in_use, (1.0 * cnt_gpu) / node_tot * 100)),
+                  x'0a')
+        AS gpu_usage,
+      ngpu > 0 AND
+      (first_value(ngpu_in_use) OVER win == 0
+        OR first_value(cnt_gpu) OVER win != max(cnt_gpu)
+        OR (alloc_nnodes == 1 AND first_value(ngpu_in_use) OVER win != ngpu))
+      AS gpu_flagged,
+      max(ncpu) > 1 AND max(ncpu_in_use) <= 1 AND max(ngpu_in_use) IS 0
+        AS low_concurrency,
+      1.0 * total(ncpu_in_use * cnt_cpu) / node_tot < 0.5 * max(ncpu)
+        AS cpu_flagged
+    FROM inmem.gpucpu_usage
+    GROUP BY jobid, stepid, node
+    WINDOW win AS
+      (PARTITION BY jobid, stepid, node
+      ORDER BY ngpu_in_use DESC NULLS LAST, ncpu_in_use DESC NULLS LAST)
+    )
+    GROUP BY jobid, stepid
+    ORDER BY gpu_flagged DESC, cpu_flagged DESC
+  ) AS gpucpuinfo, (
+    SELECT jobid, stepid,
+          max(application IN ('jupyter-noteboo', 'jupyter-lab')) AS is_jupyter
+    FROM application_usage
+    GROUP BY jobid, stepid
+  ) AS jupyterinfo
+  WHERE gpucpuinfo.jobid == ts.jobid AND gpucpuinfo.stepid == ts.stepid
+        AND jupyterinfo.jobid == ts.jobid AND jupyterinfo.stepid == ts.stepid;
+);
+
+// What resource_usage and gpucpu_usage_t read of the steps, as the base
+// tables leave them
+static const char *STEP_USAGE_SQL = SQLITE_CODEBLOCK(
+  CREATE TABLE inmem.step_usage(
+    user TEXT,
+    jobid INT,
+    stepid INT,
+    name TEXT,
+    submit_line TEXT,
+    job_length INT,
+    ngpu INT,
+    step_start_offset INT,
+    step_end_offset INT,
+    nnodes INT,
+    mem_limit INT,
+    sample_cnt INT,
+    peak_res_size INT,
+    sampled_peak_res_size INT,
+    is_new_in_period INT
+  );
+  CREATE INDEX inmem.step_usage_step_index ON step_usage(jobid, stepid);
+  CREATE TABLE application_usage(jobid INT, stepid INT, application TEXT);
+);
+
+// Values below 0 are NULL
+static bool insert(const char *sql, std::initializer_list<int64_t> vals) {
+  sqlite3_stmt *stmt = NULL;
+  bool ok = IS_SQLITE_OK(PREPARE_STMT(sql, &stmt, 0));
+  int param = 1;
+  for (const auto val : vals) {
+    if (val < 0) {
+      sqlite3_bind_null(stmt, param++);
+    } else {
+      sqlite3_bind_int64(stmt, param++, val);
+    }
+  }
+  ok = ok && sqlite3_step(stmt) == SQLITE_DONE;
+  if (!ok) {
+    SQLITE3_PERROR("step(setup)");
+  }
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+static bool setup(int steps) {
+  bool ok = true;
+  for (int i = 0; ok && i < steps; i++) {
+    const int jobid = i / 2 + 1, stepid = i % 2;
+    const int nnodes = i % ANALYSIS_FUNCTIONS_TEST_NODES + 1;
+    const int ngpu = i % 3 == 0 ? -1 : i % 3 == 1 ? 0 : 4;
+    ok = insert("INSERT INTO inmem.step_usage VALUES"
+                "  ('u', ?, ?, 'job', 'srun', 100, ?, 0, 50, ?, 1000, 10,"
+                "   ?, 600, 1)",
+                {jobid, stepid, ngpu, nnodes, i % 4 ? 500 : 2000})
+         && insert("INSERT INTO application_usage VALUES (?, ?, 'app')",
+                   {jobid, stepid});
+    for (int node = 0; ok && node < nnodes; node++) {
+      const std::string target_node = "n" + std::to_string(node);
+      const int ncpu = (i + node) % 3 ? ANALYSIS_FUNCTIONS_TEST_NCPU : 1;
+      for (int in_use = 0; ok && in_use <= ncpu + 2; in_use++) {
+        ok = insert(("INSERT INTO analysis_cache.step_gpucpu_usage VALUES"
+                     "  (?, ?, '" + target_node + "', 0, ?, ?, ?)").c_str(),
+                    {jobid, stepid, in_use, ncpu,
+                     (i * 7 + node * 3 + in_use) % 5});
+      }
+      for (int in_use = (i + node) % 2; ok && ngpu > 0 && in_use <= ngpu;
+           in_use++) {
+        ok = insert(("INSERT INTO analysis_cache.step_gpucpu_usage VALUES"
+                     "  (?, ?, '" + target_node + "', 1, ?, NULL, ?)").c_str(),
+                    {jobid, stepid, in_use,
+                     (i * 5 + node + in_use * (i % 4)) % 6 + 1});
+      }
+    }
+  }
+  return ok;
+}
+
+static bool dump(const char *table, std::vector<std::string> &rows) {
+  const std::string sql
+    = std::string("SELECT * FROM inmem.") + table + " ORDER BY rowid";
+  sqlite3_stmt *stmt = NULL;
+  if (!IS_SQLITE_OK(PREPARE_STMT(sql.c_str(), &stmt, 0))) {
+    SQLITE3_PERROR("prepare(dump)");
+    return false;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    std::string row;
+    for (int col = 0; col < sqlite3_column_count(stmt); col++) {
+      const char *text = (const char *)sqlite3_column_text(stmt, col);
+      row += std::string("|") + (text ? text : "NULL");
+    }
+    rows.push_back(row);
+  }
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const int steps = argc > 1 ? atoi(argv[1]) : 3000;
+  CHECK(IS_SQLITE_OK(sqlite3_open(":memory:", &SQL_CONN_NAME)));
+  CHECK(analysis_functions_register());
+  CHECK(sqlite3_exec_wrap(ANALYZE_ATTACH_CACHE_SQL, "(attach_cache)"));
+  CHECK(sqlite3_exec_wrap(PRE_ANALYZE_SQL, "(pre_analyze)"));
+  CHECK(sqlite3_exec_wrap(STEP_USAGE_SQL, "(step_usage)"));
+  CHECK(setup(steps));
+  CHECK(sqlite3_exec_wrap(
+    "CREATE TABLE inmem.gpucpu_usage(user, jobid, stepid, node,"
+    "  ngpu_in_use, cnt_gpu, ngpu, ncpu_in_use, cnt_cpu, ncpu, node_tot,"
+    "  alloc_nnodes)", "(gpucpu_usage)"));
+  gpucpu_usage_t gpucpu_usage;
+  CHECK(gpucpu_usage.fill());
+  gpucpu_usage.finalize();
+
+  double start = bench_now();
+  CHECK(sqlite3_exec_wrap(WINDOW_RESOURCE_USAGE_SQL, "(window)"));
+  const double window_secs = bench_now() - start;
+  start = bench_now();
+  CHECK(sqlite3_exec_wrap(ANALYZE_CREATE_USAGE_TABLES[1], "(resource_usage)"));
+  const double aggregate_secs = bench_now() - start;
+
+  std::vector<std::string> window_rows, rows;
+  CHECK(dump("window_resource_usage", window_rows));
+  CHECK(dump("resource_usage", rows));
+  CHECK(!rows.empty());
+  CHECK(rows == window_rows);
+  int64_t flagged = 0;
+  for (const auto &row : rows) {
+    flagged += row.find("gpu_underusage") != std::string::npos;
+  }
+  CHECK(flagged > 0 && flagged < (int64_t)rows.size());
+  printf("%zu steps, %ld of them with GPUs underused, %.1f ms with windows,"
+         " %.1f ms aggregated\n", rows.size(), flagged, window_secs * 1e3,
+         aggregate_secs * 1e3);
+
+  CHECK(sqlite3_exec_wrap(POST_ANALYZE_SQL, "(post_analyze)"));
+  CHECK(sqlite3_exec_wrap(ANALYZE_DETACH_CACHE_SQL, "(detach_cache)"));
+  db_common_finalize();
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
@@ -0,0 +1,198 @@
+#ifndef _TURINGWATCHER_BENCH_UTIL_H
+#define _TURINGWATCHER_BENCH_UTIL_H
+#include "common.h"
+#include "db_common.h"
+#include "partition.h"
+#include "sql.h"
+
+#include <ftw.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+// Helpers shared by the tests and benchmarks under tests/
+
+// Reports COND with where it failed and returns RET from the function at hand
+#define CHECK_RETURN(COND, RET) \
+  do { \
+    if (!(COND)) { \
+      fprintf(stderr, "%s:%d: mismatch in %s\n", __FILE__, __LINE__, #COND); \
+      return RET; \
+    } \
+  } while (0)
+// Fails main of a test
+#define CHECK(COND) CHECK_RETURN(COND, 1)
+
+static inline double bench_now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A fresh directory /tmp/<name>.XXXXXX, removed with everything under it when
+// the object goes out of scope, so that a test failing half way through
+// leaves nothing behind either. path is empty if it could not be created
+struct test_dir_t {
+  char path[PATH_MAX];
+
+  explicit test_dir_t(const char *name) {
+    snprintf(path, sizeof(path), "/tmp/%s.XXXXXX", name);
+    if (!mkdtemp(path)) {
+      perror("mkdtemp");
+      *path = '\0';
+    }
+  }
+
+  ~test_dir_t() {
+    if (*path) {
+      nftw(path, [](const char *file, const struct stat *, int, FTW *) {
+        return remove(file);
+      }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+  }
+
+  test_dir_t(const test_dir_t &) = delete;
+  test_dir_t &operator=(const test_dir_t &) = delete;
+};
+
+// A database <dir>/db in a test_dir_t of its own
+struct test_db_t {
+  test_dir_t dir;
+  std::string path;
+
+  explicit test_db_t(const char *name)
+    : dir(name), path(std::string(dir.path) + "/db") {}
+
+  // Points db_path at the database and opens SQL_CONN_NAME of the calling
+  // thread on it with the schema of the watcher, attaching partitions of
+  // partition_length unless it is 0
+  bool open(time_t partition_length = 0,
+            int retained = PARTITION_RETAINED) {
+    if (!*dir.path) {
+      return false;
+    }
+    db_path = (char *)path.c_str();
+    return open_sqlite_conn()
+           && sqlite3_exec_wrap(INIT_DB_SQL, "(init_db)")
+           && (!partition_length
+               || partitions_attach(partition_length, retained));
+  }
+};
+
+// The head of a bulk insert, into the main database instead of PARTITION_CUR
+// as the watcher did before measurements were partitioned
+static inline std::string unpartitioned(const char *head) {
+  std::string sql = head;
+  const std::string schema = PARTITION_CUR ".";
+  const size_t pos = sql.find(schema);
+  if (pos != std::string::npos) {
+    sql.erase(pos, schema.size());
+  }
+  return sql;
+}
+
+// Counts system calls of this thread through the raw_syscalls tracepoint.
+// Stays disabled (fd < 0) where tracefs or perf events are not accessible
+struct syscall_counter_t {
+  int fd = -1;
+
+  syscall_counter_t() {
+    const char *paths[] = {
+      "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+      "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    for (const char *path : paths) {
+      if (FILE *fp = fopen(path, "r")) {
+        unsigned long long id;
+        bool found = fscanf(fp, "%llu", &id) == 1;
+        fclose(fp);
+        if (!found) {
+          continue;
+        }
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        break;
+      }
+    }
+  }
+
+  ~syscall_counter_t() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  void start() {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  // -1 if unavailable
+  long long stop() {
+    long long cnt = -1;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+        cnt = -1;
+      }
+    }
+    return cnt;
+  }
+};
+
+// Populates dir with n fake processes laid out like /proc, pids 1..n, where
+// the parent of pid is pid / 2. Every process has stat, io and cmdline, every
+// stepd_every-th one is a slurmstepd of step <pid>.0. Returns false on error
+static inline bool make_synthetic_proc(const char *dir, int n,
+                                       int stepd_every = 0) {
+  for (int pid = 1; pid <= n; pid++) {
+    const std::string pid_dir = std::string(dir) + "/" + std::to_string(pid);
+    if (mkdir(pid_dir.c_str(), 0755) && errno != EEXIST) {
+      perror("mkdir");
+      return false;
+    }
+    const auto write_file = [&](const char *name, const char *content) {
+      FILE *fp = fopen((pid_dir + "/" + name).c_str(), "w");
+      if (!fp) {
+        perror("fopen");
+        return false;
+      }
+      fputs(content, fp);
+      fclose(fp);
+      return true;
+    };
+    const bool is_stepd = stepd_every && pid % stepd_every == 0;
+    char comm[16];
+    snprintf(comm, sizeof(comm), is_stepd ? "slurmstepd" : "app%d", pid % 7);
+    char stat[512];
+    snprintf(stat, sizeof(stat),
+      "%d (%s) S %d %d %d 0 -1 4194560 %d 0 0 0 %d %d 0 0 20 0 1 0 %d"
+      " 123456789 %d 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 3 0 0"
+      " 0 0 0 1 1 1 1 1 1 1 0\n",
+      pid, comm, pid > 1 ? pid / 2 : 0, pid, pid, pid * 3, pid * 5,
+      pid * 2, 1000 + pid, 2000 + pid);
+    char io[256];
+    snprintf(io, sizeof(io),
+      "rchar: %d\nwchar: %d\nsyscr: 1\nsyscw: 1\nread_bytes: 0\n"
+      "write_bytes: 0\ncancelled_write_bytes: 0\n", pid * 4096, pid * 1024);
+    char cmdline[64];
+    if (is_stepd) {
+      snprintf(cmdline, sizeof(cmdline), "slurmstepd: [%d.0]", pid);
+    } else {
+      snprintf(cmdline, sizeof(cmdline), "/usr/bin/app%d", pid % 7);
+    }
+    if (!write_file("stat", stat) || !write_file("io", io)
+        || !write_file("cmdline", cmdline)) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
@@ -0,0 +1,315 @@
+// Bulk insert benchmark: commits node batches the way the ingest thread does,
+// INGEST_GROUP_COMMIT_BATCHES per transaction in WAL mode. row steps every
+// row on its own with parameters bound by name, as the watcher did before;
+// bulk stages the batch by column and inserts it through bulk_insert_t. A
+// batch holds BATCH_RESULTS measurements, 4 gpu measurements for every 8th
+// of them, BATCH_USAGES application usages and a cpu count per measurement
+//
+// Usage: bulk_insert [batches] [row|bulk]
+#include "db_common.h"
+#include "worker.h"
+#include "bench_util.h"
+#include "sql_helper.h"
+
+#define BATCH_RESULTS 64
+#define BATCH_GPUS 4
+#define BATCH_USAGES 16
+#define BULK_INSERT_PARTITION_LENGTH (24 * 60 * 60)
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+// As they were before the bulk inserts, into the current partition
+static const char *ROW_MEASUREMENTS_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT OR REPLACE INTO partition_cur.measurements(
+    recordid,
+    watcherid, jobid, stepid,
+    dev_in, dev_out,
+    user_sec, user_usec,
+    sys_sec, sys_usec,
+    res_size, minor_pagefault, peak_mem_usage,
+    gpu_measurement_batch
+  ) VALUES (
+    :recordid,
+    :watcherid, :jobid, :stepid,
+    :dev_in, :dev_out,
+    :user_sec, :user_usec,
+    :sys_sec, :sys_usec,
+    :res_size, :minor_pagefault, :peak_mem_usage,
+    :gpu_measurement_batch
+  )
+);
+
+static const char *ROW_GPU_MEASUREMENT_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO partition_cur.gpu_measurements(
+    watcherid, batch, pid, jobid, stepid, gpuid, age,
+    power_usage, temperature, sm_clock, util, clock_limit_reason, source
+  ) VALUES (
+    :watcherid, :batch, :pid, :jobid, :stepid, :gpuid, :age,
+    :power_usage, :temperature, :sm_clock, :util, :clock_limit_reason, :source
+  )
+);
+
+static const char *ROW_APPLICATION_USAGE_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT INTO application_usage(jobid, stepid, application)
+    VALUES(:jobid, :stepid, :application) ON CONFLICT DO NOTHING
+);
+
+static const char *ROW_JOBSTEP_AVAILABLE_CPU_INSERT_SQL = SQLITE_CODEBLOCK(
+  INSERT OR IGNORE INTO job_step_cpu_available(watcherid, jobid, stepid, ncpu)
+    VALUES(:watcherid, :jobid, :stepid, :ncpu);
+);
+
+static const char *APPS[] = {
+  "python", "gromacs", "lammps", "vasp", "orca", "cp2k", "namd", "julia"
+};
+
+struct row_stmts_t {
+  sqlite3_stmt *measurement = NULL;
+  sqlite3_stmt *gpu = NULL;
+  sqlite3_stmt *gpu_batch = NULL;
+  sqlite3_stmt *usage = NULL;
+  sqlite3_stmt *cpu = NULL;
+};
+
+static bool step_row(sqlite3_stmt *stmt) {
+  const int ret = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  return ret == SQLITE_DONE;
+}
+
+// The gpu measurement batch of a result, one statement per result
+static bool row_gpu_batch(row_stmts_t &stmts, int &batch) {
+  if (!setup_stmt(stmts.gpu_batch, UPDATE_GPU_BATCHES_SQL, "(gpu_batch)")) {
+    return false;
+  }
+  SQLITE3_BIND_START
+  NAMED_BIND_INT(stmts.gpu_batch, ":cnt", 1);
+  if (BIND_FAILED || !step_and_verify(stmts.gpu_batch, true, "(gpu_batch)")) {
+    return false;
+  }
+  SQLITE3_BIND_END
+  // start, end
+  batch = sqlite3_column_int(stmts.gpu_batch, 1);
+  sqlite3_reset(stmts.gpu_batch);
+  return true;
+}
+
+static bool insert_batch_rows(row_stmts_t &stmts, int b) {
+  #define OP "(row_insert)"
+  if (!setup_stmt(stmts.measurement, ROW_MEASUREMENTS_INSERT_SQL, OP)
+      || !setup_stmt(stmts.gpu, ROW_GPU_MEASUREMENT_INSERT_SQL, OP)
+      || !setup_stmt(stmts.usage, ROW_APPLICATION_USAGE_INSERT_SQL, OP)
+      || !setup_stmt(stmts.cpu, ROW_JOBSTEP_AVAILABLE_CPU_INSERT_SQL, OP)) {
+    return false;
+  }
+  for (int r = 0; r < BATCH_RESULTS; r++) {
+    const int jobid = b * BATCH_RESULTS + r + 1;
+    int batch = 0;
+    if (r % 8 == 0) {
+      if (!row_gpu_batch(stmts, batch)) {
+        return false;
+      }
+      for (int gpu = 0; gpu < BATCH_GPUS; gpu++) {
+        SQLITE3_BIND_START
+        #define BIND(VAR, VAL) NAMED_BIND_INT(stmts.gpu, VAR, VAL);
+        BIND(":watcherid", 1);
+        BIND(":batch", batch);
+        BIND(":pid", 1000 + r);
+        BIND(":jobid", jobid);
+        BIND(":gpuid", gpu);
+        BIND(":age", 20);
+        BIND(":power_usage", 250);
+        BIND(":temperature", 60);
+        BIND(":sm_clock", 1400);
+        BIND(":util", 90);
+        #undef BIND
+        BIND_NULL(stmts.gpu, ":stepid");
+        NAMED_BIND_TEXT(stmts.gpu, ":clock_limit_reason", "none");
+        NAMED_BIND_TEXT(stmts.gpu, ":source", "nvml");
+        if (BIND_FAILED || !step_row(stmts.gpu)) {
+          return false;
+        }
+        SQLITE3_BIND_END
+      }
+    }
+    SQLITE3_BIND_START
+    #define BIND(TY, VAR, VAL) \
+      SQLITE3_NAMED_BIND(TY, stmts.measurement, VAR, VAL);
+    BIND(int, ":watcherid", 1);
+    BIND(int, ":jobid", jobid);
+    BIND(int, ":stepid", 0);
+    BIND(int64, ":dev_in", jobid * 4096ll);
+    BIND(int64, ":dev_out", jobid * 1024ll);
+    BIND(int64, ":res_size", jobid * 8192ll);
+    BIND(int64, ":minor_pagefault", r);
+    if (batch) {
+      BIND(int, ":gpu_measurement_batch", batch);
+    }
+    BIND(int64, ":sys_sec", r);
+    BIND(int, ":sys_usec", 2);
+    BIND(int64, ":user_sec", b);
+    BIND(int, ":user_usec", 1);
+    #undef BIND
+    if (BIND_FAILED || !step_row(stmts.measurement)) {
+      return false;
+    }
+    SQLITE3_BIND_END
+    SQLITE3_BIND_START
+    NAMED_BIND_INT(stmts.cpu, ":watcherid", 1);
+    NAMED_BIND_INT(stmts.cpu, ":jobid", jobid);
+    NAMED_BIND_INT(stmts.cpu, ":stepid", 0);
+    NAMED_BIND_INT(stmts.cpu, ":ncpu", 16);
+    if (BIND_FAILED || !step_row(stmts.cpu)) {
+      return false;
+    }
+    SQLITE3_BIND_END
+  }
+  for (int u = 0; u < BATCH_USAGES; u++) {
+    SQLITE3_BIND_START
+    NAMED_BIND_INT(stmts.usage, ":jobid", b * BATCH_RESULTS + u + 1);
+    NAMED_BIND_INT(stmts.usage, ":stepid", 0);
+    NAMED_BIND_TEXT(stmts.usage, ":application", APPS[u % 8]);
+    if (BIND_FAILED || !step_row(stmts.usage)) {
+      return false;
+    }
+    SQLITE3_BIND_END
+  }
+  return true;
+  #undef OP
+}
+
+struct bulk_stmts_t {
+  bulk_insert_t measurement{MEASUREMENTS_INSERT_SQL};
+  bulk_insert_t gpu{GPU_MEASUREMENT_INSERT_SQL};
+  bulk_insert_t usage{APPLICATION_USAGE_INSERT_SQL,
+                      APPLICATION_USAGE_INSERT_TAIL_SQL};
+  bulk_insert_t cpu{JOBSTEP_AVAILABLE_CPU_INSERT_SQL};
+  sqlite3_stmt *gpu_batch = NULL;
+  bulk_columns_t measurement_rows{measurement.ncol};
+  bulk_columns_t gpu_rows{gpu.ncol};
+  bulk_columns_t usage_rows{usage.ncol};
+  bulk_columns_t cpu_rows{cpu.ncol};
+};
+
+static bool insert_batch_bulk(bulk_stmts_t &stmts, int b) {
+  // All gpu measurement batches of the node batch in one statement
+  if (!setup_stmt(stmts.gpu_batch, UPDATE_GPU_BATCHES_SQL, "(gpu_batch)")) {
+    return false;
+  }
+  SQLITE3_BIND_START
+  NAMED_BIND_INT(stmts.gpu_batch, ":cnt", BATCH_RESULTS / 8);
+  if (BIND_FAILED || !step_and_verify(stmts.gpu_batch, true, "(gpu_batch)")) {
+    return false;
+  }
+  SQLITE3_BIND_END
+  int batch = sqlite3_column_int(stmts.gpu_batch, 0) + 1;
+  sqlite3_reset(stmts.gpu_batch);
+  for (int r = 0; r < BATCH_RESULTS; r++) {
+    const int64_t jobid = b * BATCH_RESULTS + r + 1;
+    const bool has_gpu = r % 8 == 0;
+    if (has_gpu) {
+      for (int gpu = 0; gpu < BATCH_GPUS; gpu++) {
+        auto &rows = stmts.gpu_rows;
+        for (int64_t val : {(int64_t)1, (int64_t)batch, (int64_t)1000 + r,
+                            jobid}) {
+          rows.add(val);
+        }
+        rows.add_null();
+        for (int64_t val : {gpu, 20, 250, 60, 1400, 90}) {
+          rows.add(val);
+        }
+        rows.add("none");
+        rows.add("nvml");
+      }
+    }
+    auto &rows = stmts.measurement_rows;
+    rows.add_null();
+    for (int64_t val : {(int64_t)1, jobid, (int64_t)0, jobid * 4096,
+                        jobid * 1024, (int64_t)b, (int64_t)1, (int64_t)r,
+                        (int64_t)2, jobid * 8192, (int64_t)r}) {
+      rows.add(val);
+    }
+    rows.add_null();
+    if (has_gpu) {
+      rows.add((int64_t)batch++);
+    } else {
+      rows.add_null();
+    }
+    for (int64_t val : {(int64_t)1, jobid, (int64_t)0, (int64_t)16}) {
+      stmts.cpu_rows.add(val);
+    }
+  }
+  for (int u = 0; u < BATCH_USAGES; u++) {
+    stmts.usage_rows.add((int64_t)b * BATCH_RESULTS + u + 1);
+    stmts.usage_rows.add((int64_t)0);
+    stmts.usage_rows.add(APPS[u % 8]);
+  }
+  bool ok = true;
+  const auto failed = [&](size_t) { ok = false; };
+  stmts.gpu.insert(stmts.gpu_rows, failed, "(gpu_measurement)");
+  stmts.measurement.insert(stmts.measurement_rows, failed,
+                           "(measurement_insert)");
+  stmts.usage.insert(stmts.usage_rows, failed, "(application_usage)");
+  stmts.cpu.insert(stmts.cpu_rows, failed, "(cpu_available_info)");
+  for (auto rows : {&stmts.gpu_rows, &stmts.measurement_rows,
+                    &stmts.usage_rows, &stmts.cpu_rows}) {
+    rows->clear();
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  const int batches = argc > 1 ? atoi(argv[1]) : 4096;
+  const bool bulk = argc <= 2 || !strcmp(argv[2], "bulk");
+  test_db_t db("bulk_insert");
+  if (!db.open(BULK_INSERT_PARTITION_LENGTH)
+      || !sqlite3_exec_wrap(
+           "INSERT INTO watcher(pid, jobid, privileged) VALUES (1, 0, 1);",
+           "(setup)")) {
+    return 1;
+  }
+  row_stmts_t row_stmts;
+  bulk_stmts_t bulk_stmts;
+  const double start = bench_now();
+  for (int b = 0; b < batches; b++) {
+    if (b % INGEST_GROUP_COMMIT_BATCHES == 0
+        && !sqlite3_begin_immediate_transaction()) {
+      return 1;
+    }
+    if (!(bulk ? insert_batch_bulk(bulk_stmts, b)
+               : insert_batch_rows(row_stmts, b))) {
+      fprintf(stderr, "batch %d failed\n", b);
+      return 1;
+    }
+    if (((b + 1) % INGEST_GROUP_COMMIT_BATCHES == 0 || b + 1 == batches)
+        && !sqlite3_end_transaction()) {
+      return 1;
+    }
+  }
+  const double secs = bench_now() - start;
+  const long rows = (long)batches
+    * (BATCH_RESULTS * 2 + BATCH_RESULTS / 8 * BATCH_GPUS + BATCH_USAGES);
+  printf("%s: %d node batches, %ld rows, %.2f s, %.0f rows/s,"
+    " %.1f us per batch\n",
+    bulk ? "bulk" : "row", batches, rows, secs, rows / secs,
+    secs * 1e6 / batches);
+
+  sqlite3_stmt *stmt_to_finalize[] = {
+    row_stmts.measurement, row_stmts.gpu, row_stmts.gpu_batch,
+    row_stmts.usage, row_stmts.cpu, bulk_stmts.gpu_batch,
+    FINALIZE_END_ADDR
+  };
+  finalize_stmt_array(stmt_to_finalize);
+  for (auto insert : {&bulk_stmts.measurement, &bulk_stmts.gpu,
+                      &bulk_stmts.usage, &bulk_stmts.cpu}) {
+    insert->finalize();
+  }
+  db_common_finalize();
+  sqlite3_close(SQL_CONN_NAME);
+  return 0;
+}
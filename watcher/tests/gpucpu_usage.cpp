@@ -0,0 +1,173 @@
+// Fills gpucpu_usage of a synthetic cache of steps, once with the windows it
+// was built with in SQL and once with gpucpu_usage_t, and checks that both
+// give the same rows in the same order. Some steps are not new in the
+// period, some have no CPU count and some samples have more CPUs in use than
+// allocated
+//
+// Usage: gpucpu_usage [steps]
+#include "db_common.h"
+#include "worker.h"
+#include "gpucpu_usage.h"
+#include "bench_util.h"
+#include "sql_helper.h"
+
+#define GPUCPU_USAGE_TEST_NODES 4
+#define GPUCPU_USAGE_TEST_NGPU 4
+#define GPUCPU_USAGE_TEST_NCPU 8
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+// As gpucpu_usage was built before gpucpu_usage_t
+static const char *WINDOW_GPUCPU_USAGE_SQL = SQLITE_CODEBLOCK(
+  CREATE TABLE inmem.window_gpucpu_usage AS
+  SELECT user, jobid, stepid, target_node AS node,
+        in_use AS ngpu_in_use, cnt AS cnt_gpu, ngpu,
+        NULL AS ncpu_in_use, NULL AS cnt_cpu, NULL AS ncpu,
+        sum(cnt) OVER win AS node_tot, nnodes AS alloc_nnodes
+  FROM inmem.step_usage
+       JOIN analysis_cache.step_gpucpu_usage AS usage USING (jobid, stepid)
+  WHERE usage.is_gpu AND is_new_in_period
+  WINDOW win AS (PARTITION BY jobid, stepid, target_node)
+  UNION ALL
+  SELECT user, jobid, stepid, target_node AS node,
+        NULL AS ngpu_in_use, NULL AS cnt_gpu, NULL AS ngpu,
+        iif(in_use BETWEEN 1 AND ncpu + 1, in_use, NULL) AS ncpu_in_use,
+        cnt AS cnt_cpu, ncpu,
+        ifnull(sum(cnt) FILTER (WHERE in_use BETWEEN 1 AND ncpu + 1)
+                 OVER win, 0) AS node_tot,
+        nnodes AS alloc_nnodes
+  FROM inmem.step_usage
+       JOIN analysis_cache.step_gpucpu_usage AS usage USING (jobid, stepid)
+  WHERE NOT usage.is_gpu AND is_new_in_period
+  WINDOW win AS (PARTITION BY jobid, stepid, target_node)
+);
+
+// What gpucpu_usage_t reads of the steps, as the base tables leave them
+static const char *STEP_USAGE_SQL = SQLITE_CODEBLOCK(
+  CREATE TABLE inmem.step_usage(
+    jobid INT,
+    stepid INT,
+    user TEXT,
+    ngpu INT,
+    nnodes INT,
+    is_new_in_period INT
+  );
+  CREATE INDEX inmem.step_usage_step_index ON step_usage(jobid, stepid);
+);
+
+static bool setup(int steps) {
+  sqlite3_stmt *step_stmt = NULL, *usage_stmt = NULL;
+  bool ok = IS_SQLITE_OK(PREPARE_STMT(
+              "INSERT INTO inmem.step_usage VALUES (?, ?, ?, ?, ?, ?)",
+              &step_stmt, 0))
+            && IS_SQLITE_OK(PREPARE_STMT(
+              "INSERT INTO analysis_cache.step_gpucpu_usage"
+              "  VALUES (?, ?, ?, ?, ?, ?, ?)", &usage_stmt, 0));
+  for (int i = 0; ok && i < steps; i++) {
+    const int jobid = i / 2 + 1, stepid = i % 2;
+    const int nnodes = i % GPUCPU_USAGE_TEST_NODES + 1;
+    const std::string user = "u" + std::to_string(jobid % 7);
+    sqlite3_bind_int(step_stmt, 1, jobid);
+    sqlite3_bind_int(step_stmt, 2, stepid);
+    sqlite3_bind_text(step_stmt, 3, user.c_str(), -1, SQLITE_TRANSIENT);
+    if (i % 5) {
+      sqlite3_bind_int(step_stmt, 4, GPUCPU_USAGE_TEST_NGPU);
+    } else {
+      sqlite3_bind_null(step_stmt, 4);
+    }
+    sqlite3_bind_int(step_stmt, 5, nnodes);
+    sqlite3_bind_int(step_stmt, 6, i % 11 != 0);
+    ok = sqlite3_step(step_stmt) == SQLITE_DONE;
+    sqlite3_reset(step_stmt);
+    for (int node = 0; ok && node < nnodes; node++) {
+      const std::string target_node = "n" + std::to_string(node);
+      for (int is_gpu = 0; ok && is_gpu < 2; is_gpu++) {
+        const int max_in_use = is_gpu ? GPUCPU_USAGE_TEST_NGPU
+                                      : GPUCPU_USAGE_TEST_NCPU + 3;
+        for (int in_use = (i + node) % 2; ok && in_use <= max_in_use;
+             in_use++) {
+          sqlite3_bind_int(usage_stmt, 1, jobid);
+          sqlite3_bind_int(usage_stmt, 2, stepid);
+          sqlite3_bind_text(usage_stmt, 3, target_node.c_str(), -1,
+                            SQLITE_TRANSIENT);
+          sqlite3_bind_int(usage_stmt, 4, is_gpu);
+          sqlite3_bind_int(usage_stmt, 5, in_use);
+          if (i % 13) {
+            sqlite3_bind_int(usage_stmt, 6, GPUCPU_USAGE_TEST_NCPU);
+          } else {
+            sqlite3_bind_null(usage_stmt, 6);
+          }
+          sqlite3_bind_int(usage_stmt, 7, (i * 7 + node * 3 + in_use) % 17);
+          ok = sqlite3_step(usage_stmt) == SQLITE_DONE;
+          sqlite3_reset(usage_stmt);
+        }
+      }
+    }
+  }
+  if (!ok) {
+    SQLITE3_PERROR("step(setup)");
+  }
+  sqlite3_finalize(step_stmt);
+  sqlite3_finalize(usage_stmt);
+  return ok;
+}
+
+static bool dump(const char *table, std::vector<std::string> &rows) {
+  const std::string sql
+    = std::string("SELECT * FROM inmem.") + table + " ORDER BY rowid";
+  sqlite3_stmt *stmt = NULL;
+  if (!IS_SQLITE_OK(PREPARE_STMT(sql.c_str(), &stmt, 0))) {
+    SQLITE3_PERROR("prepare(dump)");
+    return false;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    std::string row;
+    for (int col = 0; col < sqlite3_column_count(stmt); col++) {
+      const char *text = (const char *)sqlite3_column_text(stmt, col);
+      row += std::string("|") + (text ? text : "NULL");
+    }
+    rows.push_back(row);
+  }
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const int steps = argc > 1 ? atoi(argv[1]) : 20000;
+  CHECK(IS_SQLITE_OK(sqlite3_open(":memory:", &SQL_CONN_NAME)));
+  CHECK(sqlite3_exec_wrap(ANALYZE_ATTACH_CACHE_SQL, "(attach_cache)"));
+  CHECK(sqlite3_exec_wrap(PRE_ANALYZE_SQL, "(pre_analyze)"));
+  CHECK(sqlite3_exec_wrap(STEP_USAGE_SQL, "(step_usage)"));
+  CHECK(setup(steps));
+
+  double start = bench_now();
+  CHECK(sqlite3_exec_wrap(WINDOW_GPUCPU_USAGE_SQL, "(window)"));
+  const double window_secs = bench_now() - start;
+  CHECK(sqlite3_exec_wrap(
+    "CREATE TABLE inmem.gpucpu_usage AS"
+    "  SELECT * FROM inmem.window_gpucpu_usage WHERE 0", "(gpucpu_usage)"));
+  gpucpu_usage_t gpucpu_usage;
+  start = bench_now();
+  CHECK(gpucpu_usage.fill());
+  const double fill_secs = bench_now() - start;
+  gpucpu_usage.finalize();
+
+  std::vector<std::string> window_rows, rows;
+  CHECK(dump("window_gpucpu_usage", window_rows));
+  CHECK(dump("gpucpu_usage", rows));
+  CHECK(!rows.empty());
+  CHECK(rows == window_rows);
+  printf("%zu rows of %d steps, %.1f ms with windows, %.1f ms filled\n",
+         rows.size(), steps, window_secs * 1e3, fill_secs * 1e3);
+
+  CHECK(sqlite3_exec_wrap(POST_ANALYZE_SQL, "(post_analyze)"));
+  CHECK(sqlite3_exec_wrap(ANALYZE_DETACH_CACHE_SQL, "(detach_cache)"));
+  db_common_finalize();
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
@@ -0,0 +1,119 @@
+// Renders every kind of value through templates and checks the output
+// against printf with the formats the letters used, under the locale of the
+// environment as the watcher sets it. Then times a row of a letter table
+// written with fprintf against the same row rendered, into memory streams
+#include "html_render.h"
+#include "bench_util.h"
+
+#include <cmath>
+#include <cstdarg>
+
+#define CENTER(TEXT) "<center >" TEXT "</center>"
+
+static std::string printed(const char *format, ...) {
+  char buf[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  return buf;
+}
+
+template <size_t SLOTS, typename... ARGS>
+static std::string rendered(const html_template_t<SLOTS> &tmpl,
+                            const ARGS &...args) {
+  std::string out;
+  html_render(out, tmpl, args...);
+  return out;
+}
+
+static void fprintf_row(FILE *fp, int jobid, double val, const char *str) {
+  fprintf(fp, "<tr %s>", "class=\"group-top\"");
+  fprintf(fp, "<td rowspan=\"3\">");
+  fprintf(fp, "<a href=\"#%s_%s\">" CENTER("%d") "</a>",
+          "system_time_ratio", "latest_concerning_submissions", jobid);
+  fputs("</td>", fp);
+  for (int i = 0; i < 4; i++) {
+    fprintf(fp, "<td>");
+    fprintf(fp, CENTER("%'.2lf"), val * i);
+    fputs("</td>", fp);
+  }
+  fprintf(fp, "<td rowspan=\"3\">");
+  fprintf(fp, "%s<pre ><code >%s</code></pre>%s", "<center>", str,
+          "</center>");
+  fputs("</td>", fp);
+  fputs("</tr>\n", fp);
+}
+
+static void rendered_row(FILE *fp, int jobid, double val, const char *str) {
+  HTML_RENDER(fp, "<tr %s>", "class=\"group-top\"");
+  html_put(fp, "<td rowspan=\"3\">");
+  HTML_RENDER(fp, "<a href=\"#%s_%s\">" CENTER("%s") "</a>",
+              "system_time_ratio", "latest_concerning_submissions", jobid);
+  html_put(fp, "</td>");
+  for (int i = 0; i < 4; i++) {
+    html_put(fp, "<td>");
+    HTML_RENDER(fp, CENTER("%s"), html_fixed{val * i, 2, true});
+    html_put(fp, "</td>");
+  }
+  html_put(fp, "<td rowspan=\"3\">");
+  HTML_RENDER(fp, "%s<pre ><code >%s</code></pre>%s", "<center>", str,
+              "</center>");
+  html_put(fp, "</td>");
+  html_put(fp, "</tr>\n");
+}
+
+// Of rows written by row into a memory stream, in seconds
+static double time_rows(void (*row)(FILE *, int, double, const char *),
+                        int rows, std::string &out) {
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *fp = open_memstream(&buf, &len);
+  const double start = bench_now();
+  for (int i = 0; i < rows; i++) {
+    row(fp, i, i * 1234.5678, "job/step");
+  }
+  fclose(fp);
+  const double secs = bench_now() - start;
+  out.assign(buf, len);
+  free(buf);
+  return secs;
+}
+
+int main(int argc, char **argv) {
+  const int rows = argc > 1 ? atoi(argv[1]) : 20000;
+  setlocale(LC_NUMERIC, "");
+  static_assert(html_count_slots("<td>%s%s</td>%") == 2);
+  CHECK(rendered(HTML_TEMPLATE("")) == "");
+  CHECK(rendered(HTML_TEMPLATE("%s"), "a") == "a");
+  CHECK(rendered(HTML_TEMPLATE("<a href=\"#%s_%s\">%s</a>%"),
+                 std::string("x"), "y", (const char *)NULL)
+        == printed("<a href=\"#%s_%s\">%s</a>%%", "x", "y", NULL));
+  for (long long val : {0LL, -1LL, 7LL, 1234567LL, -9876543210LL}) {
+    CHECK(rendered(HTML_TEMPLATE("%s"), val) == std::to_string(val));
+    CHECK(rendered(HTML_TEMPLATE("%s"), (int)val)
+          == std::to_string((int)val));
+    CHECK(rendered(HTML_TEMPLATE("%s"), html_grouped{val})
+          == printed("%'lld", val));
+  }
+  for (double val : {0.0, -0.5, 2.675, 1234567.891, 1e300, std::nan("0")}) {
+    for (int precision : {0, 2}) {
+      CHECK(rendered(HTML_TEMPLATE("%s"), html_fixed{val, precision, true})
+            == printed("%'.*lf", precision, val));
+      CHECK(rendered(HTML_TEMPLATE("%s"), html_fixed{val, precision, false})
+            == printed("%.*lf", precision, val));
+    }
+  }
+  for (uint32_t val : {0U, 0xc3f0ffffU, 0x2bU}) {
+    CHECK(rendered(HTML_TEMPLATE("#%s"), html_hex{val, 8})
+          == printed("#%08x", val));
+  }
+
+  std::string printed_rows, rendered_rows;
+  const double fprintf_secs = time_rows(fprintf_row, rows, printed_rows);
+  const double render_secs = time_rows(rendered_row, rows, rendered_rows);
+  CHECK(printed_rows == rendered_rows);
+  printf("%d rows, %.1f ms with fprintf, %.1f ms rendered\n", rows,
+         fprintf_secs * 1e3, render_secs * 1e3);
+  return 0;
+}
@@ -0,0 +1,136 @@
+// Load test of the ingestion server: forks N scrapers that all connect at
+// once and stream M batches each, then checks that every result was staged.
+// With spool, received batches also go through the on-disk spool first
+//
+// Usage: ingest_load [scrapers] [batches] [results per batch] [spool]
+#include "messaging.h"
+
+worker_info_t worker;
+bool is_server;
+char *db_path;
+const gpu_measurement_source_t gpu_measurement_source = GPU_SOURCE_NONE;
+
+#define LOAD_TEST_PORT "39755"
+
+static void run_scraper(int id, int batches, int results, int start_fd) {
+  close(sock);
+  setenv(DB_HOST_ENV, "127.0.0.1", 1);
+  is_server = 0;
+  char hostname[32];
+  snprintf(hostname, sizeof(hostname), "node%d", id);
+  worker.hostname = hostname;
+  build_socket();
+  char c;
+  // Released all at once by the parent closing the pipe
+  while (read(start_fd, &c, 1) > 0);
+  bool ok = true;
+  for (int b = 0; b < batches; b++) {
+    for (int r = 0; r < results; r++) {
+      scrape_result_t result;
+      memset(&result, 0, sizeof(result));
+      result.step.job_id = id;
+      result.step.step_id = r;
+      result.pid = r + 1;
+      result.res = b;
+      result.utime = b * 20;
+      snprintf(result.comm, sizeof(result.comm), "app%d", r % 4);
+      stage_message(result);
+    }
+    slurm_step_id_t step;
+    step.job_id = id;
+    step.step_id = 0;
+    step.step_het_comp = NO_VAL;
+    stage_message(step, "/usr/bin/app");
+    ok &= sendout(b + 1 < batches);
+  }
+  _exit(!ok);
+}
+
+int main(int argc, char **argv) {
+  const int scrapers = argc > 1 ? atoi(argv[1]) : 256;
+  const int batches = argc > 2 ? atoi(argv[2]) : 5;
+  const int results = argc > 3 ? atoi(argv[3]) : 64;
+  const bool spool = argc > 4 && !strcmp(argv[4], "spool");
+  char dir[] = "/tmp/ingest_load.XXXXXX";
+  std::string spool_db_path;
+  if (spool) {
+    if (!mkdtemp(dir)) {
+      perror("mkdtemp");
+      return 1;
+    }
+    spool_db_path = std::string(dir) + "/db";
+    db_path = (char *)spool_db_path.c_str();
+  }
+  setenv(PORT_ENV, LOAD_TEST_PORT, 1);
+  unsetenv(DB_HOST_ENV);
+  build_socket();
+  int start_pipe[2];
+  if (pipe(start_pipe)) {
+    perror("pipe");
+    return 1;
+  }
+  for (int i = 0; i < scrapers; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (!pid) {
+      close(start_pipe[1]);
+      run_scraper(i, batches, results, start_pipe[0]);
+    }
+  }
+  close(start_pipe[0]);
+  if (spool) {
+    collect_dumped_messages();
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, conn_mgr, NULL);
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  close(start_pipe[1]);
+  int failed_scrapers = 0;
+  for (int i = 0; i < scrapers; i++) {
+    int status;
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      failed_scrapers++;
+    }
+  }
+  // Scrapers are done once the last batch is acknowledged by TCP only
+  size_t expected = (size_t)scrapers * batches;
+  ingest_stats_t stats = get_ingest_stats();
+  uint64_t parse_max_ns = stats.parse_max_ns;
+  for (int i = 0; i < 100 && stats.batches < expected; i++) {
+    usleep(50000);
+    stats = get_ingest_stats();
+    parse_max_ns = std::max(parse_max_ns, stats.parse_max_ns);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  size_t staged_batches = 0;
+  size_t staged_results = 0;
+  while (auto batch = take_batch()) {
+    staged_batches++;
+    staged_results += batch->results.size();
+  }
+  const double secs = end.tv_sec - start.tv_sec
+                      + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%d scrapers x %d batches x %d results in %.3f s\n",
+    scrapers, batches, results, secs);
+  printf("staged %zu/%zu batches, %zu results, %lu bytes (%.1f MiB/s)\n",
+    staged_batches, expected, staged_results, stats.bytes,
+    stats.bytes / secs / (1 << 20));
+  printf("connections %lu accepted %lu failed, parse avg %lu ns max %lu ns%s\n",
+    stats.accepted, stats.failed,
+    stats.batches ? stats.parse_ns / stats.batches : 0, parse_max_ns,
+    spool ? " (spooled)" : "");
+  if (spool) {
+    dump_message();
+    for (int idx = 0; idx < SPOOL_SEGMENT_CNT; idx++) {
+      unlink((spool_db_path + ".turingwatch.spool." + std::to_string(idx))
+             .c_str());
+    }
+    rmdir(dir);
+  }
+  return failed_scrapers || staged_batches != expected
+         || staged_results != expected * results;
+}
@@ -0,0 +1,136 @@
+// Streams a few batches from a forked scraper to the ingestion server over
+// loopback and checks what got staged field by field, covering negotiation,
+// the kept-open connection and deltas across batches
+#include "messaging.h"
+#include "bench_util.h"
+
+worker_info_t worker;
+bool is_server;
+char *db_path;
+const gpu_measurement_source_t gpu_measurement_source = GPU_SOURCE_NONE;
+
+#define LOOPBACK_TEST_PORT "39756"
+#define LOOPBACK_BATCHES 3
+#define LOOPBACK_JOB_ID 123456
+
+static scrape_result_t make_result(int batch, uint32_t step_id) {
+  scrape_result_t result;
+  memset(&result, 0, sizeof(result));
+  result.step.job_id = LOOPBACK_JOB_ID;
+  result.step.step_id = step_id;
+  result.step.step_het_comp = NO_VAL;
+  result.res = step_id == 0 ? 1000000 + batch * 100 : 42;
+  result.utime = 5000 + batch * 20;
+  result.stime = batch;
+  result.rchar = step_id == 0 ? 1ul << 40 : PRIVILEGED_STAT_NULL;
+  result.wchar = step_id == 0 ? batch : PRIVILEGED_STAT_NULL;
+  result.gpu_measurement_cnt = step_id == 0 && batch == 1;
+  return result;
+}
+
+static void run_scraper() {
+  close(sock);
+  setenv(DB_HOST_ENV, "127.0.0.1", 1);
+  is_server = 0;
+  worker.hostname = (char *)"nodeA";
+  build_socket();
+  bool ok = true;
+  for (int b = 0; b < LOOPBACK_BATCHES; b++) {
+    for (uint32_t step_id : {0u, (uint32_t)SLURM_BATCH_SCRIPT}) {
+      auto result = make_result(b, step_id);
+      stage_message(result);
+      if (result.gpu_measurement_cnt) {
+        gpu_measurement_t gpu_result;
+        memset((void *)&gpu_result, 0, sizeof(gpu_result));
+        gpu_result.gpu_id = 3;
+        gpu_result.pid = 77;
+        gpu_result.util = 99;
+        gpu_result.step = result.step;
+        stage_message(gpu_result);
+      }
+    }
+    const auto step = make_result(b, 0).step;
+    stage_message(step, b == 1 ? "python" : "gcc");
+    cpu_available_info_t info;
+    info.step = step;
+    info.cpu_available = 8 + b;
+    stage_message(info);
+    ok &= sendout(b + 1 < LOOPBACK_BATCHES);
+  }
+  _exit(!ok);
+}
+
+#define SAME(COND) CHECK_RETURN(COND, false)
+
+// Of the batch-th batch sent by run_scraper. Mismatches are reported with the
+// batch by the caller
+static bool same_group(const batch_t &group, int batch) {
+  SAME(group.hostname != STRING_ID_NONE);
+  SAME(!strcmp(group.strings.str(group.hostname), "nodeA"));
+  SAME(group.results.size() == 2);
+  for (size_t i = 0; i < 2; i++) {
+    const uint32_t step_id = i ? SLURM_BATCH_SCRIPT : 0;
+    const auto expected = make_result(batch, step_id);
+    const auto &got = group.results[i];
+    SAME(got.step.job_id == LOOPBACK_JOB_ID);
+    SAME(got.step.step_id == step_id);
+    SAME(got.res == expected.res && got.utime == expected.utime);
+    SAME(got.stime == expected.stime);
+    SAME(got.rchar == expected.rchar && got.wchar == expected.wchar);
+    SAME(got.gpu_measurement_cnt == expected.gpu_measurement_cnt);
+  }
+  SAME(group.gpu_results.size() == (batch == 1));
+  if (batch == 1) {
+    const auto &gpu_result = group.gpu_results.front();
+    SAME(gpu_result.gpu_id == 3 && gpu_result.pid == 77);
+    SAME(gpu_result.util == 99);
+    SAME(gpu_result.step.job_id == LOOPBACK_JOB_ID);
+  }
+  SAME(group.usages.size() == 1);
+  SAME(!strcmp(group.strings.str(group.usages.front().app),
+               batch == 1 ? "python" : "gcc"));
+  SAME(group.cpu_available_infos.size() == 1);
+  SAME(group.cpu_available_infos.front().cpu_available == 8u + batch);
+  return true;
+}
+#undef SAME
+
+int main() {
+  setenv(PORT_ENV, LOOPBACK_TEST_PORT, 1);
+  unsetenv(DB_HOST_ENV);
+  build_socket();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (!pid) {
+    run_scraper();
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, conn_mgr, NULL);
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+      || WEXITSTATUS(status)) {
+    fputs("scraper failed to send\n", stderr);
+    return 1;
+  }
+  for (int i = 0; i < 100 && get_ingest_stats().batches < LOOPBACK_BATCHES;
+       i++) {
+    usleep(20000);
+  }
+  int batch = 0;
+  for (; auto got_batch = take_batch(); batch++) {
+    CHECK(batch < LOOPBACK_BATCHES);
+    if (!same_group(*got_batch, batch)) {
+      fprintf(stderr, "batch %d: staged differently than sent\n", batch);
+      return 1;
+    }
+  }
+  CHECK(batch == LOOPBACK_BATCHES);
+  const auto stats = get_ingest_stats();
+  printf("%d batches over %lu connection(s), %lu bytes\n",
+    batch, stats.accepted, stats.bytes);
+  // Streamed over the one kept-open connection
+  return stats.accepted != 1 || stats.failed;
+}
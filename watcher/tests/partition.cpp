@@ -0,0 +1,125 @@
+// Writes measurements over several periods of a second, keeping two
+// partitions. Checks that recordid goes on across partitions, that the
+// views see the retained partitions only, and that readers move on with
+// the writer
+#include "db_common.h"
+#include "stmts.h"
+#include "partition.h"
+#include "bench_util.h"
+
+#define PARTITION_TEST_PERIODS 4
+#define PARTITION_TEST_RETAINED 2
+#define PARTITION_TEST_ROWS 1000
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+static bool insert_period(bulk_insert_t &measurements, bulk_insert_t &gpu,
+                          int idx) {
+  bulk_columns_t rows(measurements.ncol);
+  for (int row = 0; row < PARTITION_TEST_ROWS; row++) {
+    // recordid, watcherid, jobid, stepid, dev_in, dev_out, user_sec,
+    // user_usec, sys_sec, sys_usec, then NULL up to gpu_measurement_batch
+    rows.add_null();
+    for (int64_t val : {1, idx + 1, row}) {
+      rows.add(val);
+    }
+    rows.add_null();
+    rows.add_null();
+    for (int64_t val : {row + 1, 0, 0, 0}) {
+      rows.add(val);
+    }
+    for (int col = 0; col < 3; col++) {
+      rows.add_null();
+    }
+    rows.add((int64_t)idx + 1);
+  }
+  bulk_columns_t gpu_rows(gpu.ncol);
+  // watcherid, batch, pid, jobid, stepid, gpuid, age, then NULL up to source
+  for (int64_t val : {1, idx + 1, 1, idx + 1, 0, 0, 0}) {
+    gpu_rows.add(val);
+  }
+  for (int col = 0; col < 5; col++) {
+    gpu_rows.add_null();
+  }
+  gpu_rows.add("nvml");
+  bool ok = true;
+  const auto failed = [&](size_t) { ok = false; };
+  measurements.insert(rows, failed, "(measurement_insert)");
+  gpu.insert(gpu_rows, failed, "(gpu_measurement_insert)");
+  return ok;
+}
+
+static int64_t query_int(const char *sql) {
+  sqlite3_stmt *stmt = NULL;
+  int64_t val = -1;
+  if (IS_SQLITE_OK(PREPARE_STMT(sql, &stmt, 0))
+      && sqlite3_step(stmt) == SQLITE_ROW) {
+    val = sqlite3_column_int64(stmt, 0);
+  } else {
+    SQLITE3_PERROR("step(query_int)");
+  }
+  sqlite3_finalize(stmt);
+  return val;
+}
+
+int main() {
+  test_db_t db("partition");
+  CHECK(db.open(1, PARTITION_TEST_RETAINED));
+  CHECK(stmt_registry_check());
+
+  bulk_insert_t measurements(MEASUREMENTS_INSERT_SQL);
+  bulk_insert_t gpu(GPU_MEASUREMENT_INSERT_SQL);
+  // Acquired in the first period, moves on once acquired again
+  sqlite3 *reader = acquire_sqlite_reader();
+  CHECK(reader);
+  release_sqlite_reader(reader);
+  long period = 0;
+  for (int i = 0; i < PARTITION_TEST_PERIODS; i++) {
+    // At the start of a second, so the transaction stays within its period
+    while (time(NULL) == period) {
+      usleep(10000);
+    }
+    period = time(NULL);
+    CHECK(sqlite3_begin_immediate_transaction());
+    CHECK(insert_period(measurements, gpu, i));
+    CHECK(sqlite3_end_transaction());
+  }
+
+  // recordid went on in every partition, including the dropped ones
+  const int retained_rows = PARTITION_TEST_RETAINED * PARTITION_TEST_ROWS;
+  CHECK(query_int("SELECT recordid FROM measurements_latest")
+        == PARTITION_TEST_PERIODS * PARTITION_TEST_ROWS);
+  CHECK(query_int("SELECT count(DISTINCT recordid) FROM measurements")
+        == retained_rows);
+  CHECK(query_int("SELECT min(recordid) FROM measurements")
+        == (PARTITION_TEST_PERIODS - PARTITION_TEST_RETAINED)
+           * PARTITION_TEST_ROWS + 1);
+  CHECK(query_int("SELECT count(*) FROM gpu_measurements")
+        == PARTITION_TEST_RETAINED);
+  struct stat st;
+  CHECK(!stat(partition_path(period).c_str(), &st));
+  CHECK(stat(partition_path(period - PARTITION_TEST_RETAINED).c_str(), &st));
+
+  reader = acquire_sqlite_reader();
+  CHECK(reader);
+  {
+    sqlite_conn_scope_t reader_scope(reader);
+    CHECK(query_int("SELECT count(*) FROM measurements") == retained_rows);
+    CHECK(query_int("SELECT period FROM partition_period") == period);
+  }
+  release_sqlite_reader(reader);
+  printf("%d periods of %d rows, %d partitions retained\n",
+    PARTITION_TEST_PERIODS, PARTITION_TEST_ROWS, PARTITION_TEST_RETAINED);
+
+  measurements.finalize();
+  gpu.finalize();
+  db_common_finalize();
+  close_sqlite_readers();
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
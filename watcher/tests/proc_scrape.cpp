@@ -0,0 +1,83 @@
+// Scrapes a synthetic proc tree of several batches and checks every reading
+// against the files. First on a ring the kernel supports if it has io_uring,
+// then on one probed for an opcode it refuses, as a kernel from before
+// IORING_OP_READ would, and finally switching to such an opcode on a ring
+// already in use. Either way batches must fall back to read() intact
+#include "proc_scrape.h"
+#include "bench_util.h"
+
+#include <linux/io_uring.h>
+
+#define PROC_SCRAPE_TEST_PROCESSES (PROC_SCRAPE_BATCH * 3 + 5)
+
+// Of every process of the tree, files in the order of proc_file_t
+static std::map<pid_t, std::array<std::string, PROC_FILE_CNT>> expected;
+
+static bool read_expected(const char *root) {
+  for (pid_t pid = 1; pid <= PROC_SCRAPE_TEST_PROCESSES; pid++) {
+    const char *names[] = {"stat", "io"};
+    for (int i = 0; i < PROC_FILE_CNT; i++) {
+      const std::string path
+        = std::string(root) + "/" + std::to_string(pid) + "/" + names[i];
+      FILE *fp = fopen(path.c_str(), "r");
+      if (!fp) {
+        return false;
+      }
+      char buf[PROC_STAT_BUF_SIZE];
+      expected[pid][i].assign(buf, fread(buf, 1, sizeof(buf), fp));
+      fclose(fp);
+    }
+  }
+  return true;
+}
+
+// Of one pass over the whole tree
+static bool scraped_intact() {
+  size_t cnt = 0;
+  bool ok = true;
+  scrape_proc([&](const proc_reading_t &reading) {
+    cnt++;
+    const auto it = expected.find(reading.pid);
+    ok &= it != expected.end();
+    for (int i = 0; ok && i < PROC_FILE_CNT; i++) {
+      ok &= reading.len[i] >= 0
+            && std::string(reading.buf[i], reading.len[i]) == it->second[i];
+    }
+  });
+  return ok && cnt == expected.size();
+}
+
+int main() {
+  test_dir_t root("proc_scrape");
+  CHECK(*root.path);
+  CHECK(make_synthetic_proc(root.path, PROC_SCRAPE_TEST_PROCESSES));
+  CHECK(read_expected(root.path));
+
+  CHECK(init_proc_scrape(root.path));
+  const bool has_ring = proc_scrape_uses_ring();
+  CHECK(scraped_intact());
+  CHECK(proc_scrape_uses_ring() == has_ring);
+  finalize_proc_scrape();
+
+  #if PROC_SCRAPE_USE_IO_URING
+  // Past any opcode a kernel knows
+  proc_scrape_set_ring_op(UINT8_MAX);
+  CHECK(init_proc_scrape(root.path));
+  CHECK(!proc_scrape_uses_ring());
+  CHECK(scraped_intact());
+  finalize_proc_scrape();
+
+  proc_scrape_set_ring_op(IORING_OP_READ);
+  CHECK(init_proc_scrape(root.path));
+  CHECK(proc_scrape_uses_ring() == has_ring);
+  proc_scrape_set_ring_op(UINT8_MAX);
+  CHECK(scraped_intact());
+  CHECK(!proc_scrape_uses_ring());
+  CHECK(scraped_intact());
+  finalize_proc_scrape();
+  proc_scrape_set_ring_op(IORING_OP_READ);
+  #endif
+  printf("%zu processes scraped intact, io_uring %s\n", expected.size(),
+         has_ring ? "available" : "unavailable");
+  return 0;
+}
@@ -0,0 +1,106 @@
+// Compares the batched /proc scraping engine against the path based reading
+// it replaced, in wall time and system calls per pass
+//
+// Usage: proc_scrape_bench [processes] [passes] [proc root]
+// Without a root a synthetic tree of the given size is created in /tmp
+#include "proc_scrape.h"
+#include "bench_util.h"
+
+// The reading done per process before the engine: a fresh path for every
+// file, stat by plain read, io and cmdline through stdio
+static size_t path_scrape(const char *root) {
+  size_t bytes = 0;
+  char buf[PROC_STAT_BUF_SIZE];
+  DIR *proc_dir = opendir(root);
+  if (!proc_dir) {
+    return 0;
+  }
+  while (auto entry = readdir(proc_dir)) {
+    if (*entry->d_name < '0' || *entry->d_name > '9') {
+      continue;
+    }
+    std::string basepath
+      = std::string(root) + "/" + std::string(entry->d_name) + "/";
+    int fd = open((basepath + "stat").c_str(), O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    ssize_t cnt = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    bytes += cnt > 0 ? cnt : 0;
+    if (FILE *f = fopen((basepath + "io").c_str(), "r")) {
+      while (fgets(buf, sizeof(buf), f)) {
+        bytes += strlen(buf);
+      }
+      fclose(f);
+    }
+    if (FILE *f = fopen((basepath + "cmdline").c_str(), "r")) {
+      bytes += fread(buf, 1, sizeof(buf), f);
+      fclose(f);
+    }
+  }
+  closedir(proc_dir);
+  return bytes;
+}
+
+static size_t engine_scrape() {
+  size_t bytes = 0;
+  scrape_proc([&bytes](const proc_reading_t &reading) {
+    for (int i = 0; i < PROC_FILE_CNT; i++) {
+      bytes += reading.len[i] > 0 ? reading.len[i] : 0;
+    }
+  });
+  return bytes;
+}
+
+template <typename F>
+static void run(const char *name, int passes, int processes, F scrape) {
+  syscall_counter_t counter;
+  size_t bytes = 0;
+  // Warm up dentry and page cache first
+  scrape();
+  counter.start();
+  const double start = bench_now();
+  for (int i = 0; i < passes; i++) {
+    bytes += scrape();
+  }
+  const double elapsed = bench_now() - start;
+  const long long syscalls = counter.stop();
+  printf("%-8s %9.3f ms/pass %8.2f us/process", name,
+    elapsed * 1e3 / passes, elapsed * 1e6 / passes / processes);
+  if (syscalls >= 0) {
+    printf(" %8.2f syscalls/process", (double)syscalls / passes / processes);
+  } else {
+    printf("   syscalls n/a (try strace -c)");
+  }
+  printf(" %zu bytes/pass\n", bytes / passes);
+}
+
+int main(int argc, char **argv) {
+  int processes = argc > 1 ? atoi(argv[1]) : 2000;
+  const int passes = argc > 2 ? atoi(argv[2]) : 20;
+  char tmp_root[] = "/tmp/proc_scrape_bench.XXXXXX";
+  const char *root = argc > 3 ? argv[3] : NULL;
+  if (!root) {
+    if (!mkdtemp(tmp_root) || !make_synthetic_proc(tmp_root, processes)) {
+      return 1;
+    }
+    root = tmp_root;
+  }
+  if (!init_proc_scrape(root)) {
+    return 1;
+  }
+  if (argc > 3) {
+    processes = 0;
+    scrape_proc([&processes](const proc_reading_t &) { processes++; });
+  }
+  printf("%d processes under %s, %d passes\n", processes, root, passes);
+  run("path", passes, processes, [root]() { return path_scrape(root); });
+  run("engine", passes, processes, engine_scrape);
+  finalize_proc_scrape();
+  if (root == tmp_root) {
+    const std::string cmd = std::string("rm -rf ") + tmp_root;
+    return system(cmd.c_str()) != 0;
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Marks sections across the two files of a letter, interleaved as the
+// analyzer writes them, and checks that they tile the letter between the
+// marks. Then checks through SQLite's JSON functions that shards and the
+// index are valid JSON holding the sections, the shared ones stored once
+#include "report_sections.h"
+#include "bench_util.h"
+
+thread_local sqlite3 *SQL_CONN_NAME;
+
+// Files of the tar of part by name
+static std::map<std::string, std::string> read_part(
+  const archive_part_t &part) {
+  std::map<std::string, std::string> files;
+  for (size_t offset = 0; offset + 512 <= part.tar.size();) {
+    const char *header = part.tar.data() + offset;
+    const size_t size = strtoull(header + 124, NULL, 8);
+    files[std::string(header, strnlen(header, 100))]
+      = part.tar.substr(offset + 512, size);
+    offset += 512 + (size + 511) / 512 * 512;
+  }
+  return files;
+}
+
+// Of path in json, NULL if json is invalid
+static std::optional<std::string> json_at(const std::string &json,
+                                          const std::string &path) {
+  sqlite3_stmt *stmt;
+  if (!IS_SQLITE_OK(sqlite3_prepare_v2(
+        SQL_CONN_NAME,
+        "SELECT CASE WHEN json_valid(?1) THEN json_extract(?1, ?2) END",
+        -1, &stmt, NULL))) {
+    return std::nullopt;
+  }
+  sqlite3_bind_text(stmt, 1, json.c_str(), json.size(), SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, path.c_str(), path.size(), SQLITE_STATIC);
+  std::optional<std::string> val;
+  if (sqlite3_step(stmt) == SQLITE_ROW
+      && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    val = (const char *)sqlite3_column_text(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return val;
+}
+
+int main() {
+  CHECK(IS_SQLITE_OK(sqlite3_open(":memory:", &SQL_CONN_NAME)));
+  std::vector<std::vector<report_section_t>> user_sections;
+  std::vector<archive_part_t> shards(2);
+  report_index_t index;
+  for (const char *user : {"alice", "bob"}) {
+    const std::string id = std::string("1:") + user;
+    report_letter_t letter;
+    auto header_fp = letter.open("letter.header");
+    CHECK(header_fp);
+    fputs("<body>", header_fp);
+    letter.mark(header_fp, "greeting", "Greeting", true);
+    fputs("<p>Hi</p>", header_fp);
+    letter.mark(header_fp, "toc", "Table of Contents", false);
+    fprintf(header_fp, "<h3>Table of Contents</h3><ul><li>%s", user);
+    auto fp = letter.open("letter");
+    CHECK(fp);
+    letter.mark(fp, "news", "NEWS", true);
+    fputs("<h3>NEWS</h3>\n\"quoted\"\t\\", fp);
+    fputs("</li></ul>", header_fp);
+    letter.mark(fp, "footer", "Footer", true);
+    fprintf(fp, "<p>Analysis ID: %s</p>", id.c_str());
+    letter.end(fp);
+    fputs("</body>", fp);
+    letter.close(fp);
+    letter.mark(header_fp, "tldr", "TL; DR", false);
+    fprintf(header_fp, "<h3>TL; DR</h3>%s \x01", user);
+    letter.close(header_fp);
+
+    CHECK(letter.files.size() == 2);
+    CHECK(std::string(letter.files[1].buf, letter.files[1].len)
+          == "<h3>NEWS</h3>\n\"quoted\"\t\\<p>Analysis ID: " + id
+             + "</p></body>");
+    auto sections = letter.sections(id, "1:web");
+    CHECK(sections.size() == 5);
+    const char *order[] = {"greeting", "toc", "tldr", "news", "footer"};
+    for (size_t i = 0; i < 5; i++) {
+      CHECK(sections[i].machine_name == order[i]);
+    }
+    CHECK(sections[0].html == "<p>Hi</p>");
+    CHECK(sections[1].html == std::string("<h3>Table of Contents</h3><ul><li>")
+                              + user + "</li></ul>");
+    CHECK(sections[2].html == std::string("<h3>TL; DR</h3>") + user + " \x01");
+    CHECK(sections[4].html == "<p>Analysis ID: 1:web</p>");
+    CHECK(sections[4].shared && !sections[2].shared);
+    user_sections.push_back(std::move(sections));
+
+    const std::string json
+      = std::string("\"") + user + "\":{\"JobInfo\":[1]}";
+    report_add_shard(shards[user_sections.size() - 1], user, json,
+                     user_sections.back());
+    auto files = read_part(shards[user_sections.size() - 1]);
+    const auto &shard = files[std::string("users/") + user + ".json"];
+    CHECK(json_at(shard, std::string("$.data.") + user + ".JobInfo[0]")
+          == "1");
+    CHECK(json_at(shard, "$.sections.tldr") == user_sections.back()[2].html);
+    CHECK(!json_at(shard, "$.sections.news"));
+  }
+  index.add_user("alice", user_sections[0]);
+  index.add_user("bob", user_sections[1]);
+  archive_part_t head;
+  index.add_files(head, 10, 20);
+  auto files = read_part(head);
+  // index.json and greeting, news and footer once for both
+  CHECK(files.size() == 4);
+  const auto &index_json = files["index.json"];
+  CHECK(json_at(index_json, "$.updated") == "20");
+  CHECK(json_at(index_json, "$.names.tldr") == "TL; DR");
+  CHECK(json_at(index_json, "$.users.bob[2][0]") == "tldr");
+  CHECK(json_at(index_json, "$.users.bob[2][1]") == "");
+  const auto footer_id = json_at(index_json, "$.users.bob[4][1]");
+  CHECK(footer_id == report_section_id("<p>Analysis ID: 1:web</p>"));
+  CHECK(json_at(index_json, "$.users.alice[4][1]") == footer_id);
+  CHECK(files["sections/" + *footer_id + ".html"]
+        == "<p>Analysis ID: 1:web</p>");
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
@@ -0,0 +1,140 @@
+// Writes an archive of a part compressed on several threads, another on one
+// and an empty one, then inflates it member by member and reads back the tar
+// the way webserver/main.go does: names, contents and order of the files,
+// with PAX headers for long names. Times compressing the first part on one
+// thread and on several
+#include "result_archive.h"
+#include "bench_util.h"
+
+#include <zlib.h>
+
+#define RESULT_ARCHIVE_TEST_THREADS 4
+
+typedef std::vector<std::pair<std::string, std::string>> archive_files_t;
+
+// Of the concatenated gzip members in gz
+static bool inflate_members(const std::string &gz, std::string &out) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    return false;
+  }
+  stream.next_in = (Bytef *)gz.data();
+  stream.avail_in = gz.size();
+  char buf[1 << 16];
+  int ret;
+  do {
+    stream.next_out = (Bytef *)buf;
+    stream.avail_out = sizeof(buf);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    out.append(buf, sizeof(buf) - stream.avail_out);
+    if (ret == Z_STREAM_END && stream.avail_in) {
+      ret = inflateReset(&stream);
+    }
+  } while (ret == Z_OK);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
+
+static bool read_tar(const std::string &tar, archive_files_t &files) {
+  std::string pax_path;
+  size_t offset = 0;
+  while (offset + 512 <= tar.size()) {
+    const char *header = tar.data() + offset;
+    if (!header[0]) {
+      // Two zero blocks end it
+      return offset + 1024 == tar.size()
+             && tar.find_first_not_of('\0', offset) == std::string::npos;
+    }
+    unsigned int chksum = 0;
+    for (int i = 0; i < 512; i++) {
+      chksum += 148 <= i && i < 156 ? ' ' : (unsigned char)header[i];
+    }
+    if (strtoul(header + 148, NULL, 8) != chksum
+        || memcmp(header + 257, "ustar\0" "00", 8)) {
+      return false;
+    }
+    const size_t size = strtoull(header + 124, NULL, 8);
+    const std::string data = tar.substr(offset + 512, size);
+    offset += 512 + (size + 511) / 512 * 512;
+    if (header[156] == 'x') {
+      const auto pos = data.find(" path=");
+      if (pos == std::string::npos
+          || strtoul(data.c_str(), NULL, 10) != data.size()) {
+        return false;
+      }
+      pax_path = data.substr(pos + 6, data.size() - pos - 7);
+      continue;
+    }
+    if (header[156] != '0') {
+      return false;
+    }
+    files.emplace_back(
+      pax_path.empty() ? std::string(header, strnlen(header, 100)) : pax_path,
+      data);
+    pax_path.clear();
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  const size_t mbytes = argc > 1 ? atoi(argv[1]) : 8;
+  archive_files_t files;
+  files.emplace_back("raw.json", "");
+  srand(1);
+  // Compressible, yet not too much, like letters and JSON
+  while (files[0].second.size() < mbytes << 20) {
+    files[0].second += "{\"user\": \"u" + std::to_string(rand() % 1000)
+                       + "\", \"value\": " + std::to_string(rand()) + "},";
+  }
+  files.emplace_back(std::string(150, 'u') + ".mail.header", "To: u\n\n");
+  files.emplace_back(std::string(150, 'u') + ".mail", "<body></body>");
+  files.emplace_back(std::string(150, 'u') + ".mail.empty", "");
+  files.emplace_back("v.mail", std::string(ARCHIVE_BLOCK_SIZE * 2 + 1, 'v'));
+
+  archive_part_t single;
+  single.add_file(files[0].first, files[0].second);
+  double start = bench_now();
+  CHECK(single.compress());
+  const double single_secs = bench_now() - start;
+  CHECK(single.tar.empty());
+
+  archive_part_t raw, users, empty;
+  raw.add_file(files[0].first, files[0].second);
+  start = bench_now();
+  CHECK(raw.compress(RESULT_ARCHIVE_TEST_THREADS));
+  const double threaded_secs = bench_now() - start;
+  for (size_t i = 1; i < files.size(); i++) {
+    users.add_file(files[i].first, files[i].second);
+  }
+  CHECK(users.compress());
+  CHECK(empty.compress(RESULT_ARCHIVE_TEST_THREADS));
+  CHECK(empty.gz.empty());
+
+  test_dir_t dir("result_archive");
+  CHECK(*dir.path);
+  const std::string path = std::string(dir.path) + "/1.tar.gz";
+  CHECK(archive_write(path, {&raw, &empty, &users}));
+  CHECK(access((path + ".tmp").c_str(), F_OK) == -1);
+  std::string gz;
+  {
+    auto fp = fopen(path.c_str(), "r");
+    CHECK(fp);
+    char buf[1 << 16];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp))) {
+      gz.append(buf, len);
+    }
+    fclose(fp);
+  }
+
+  std::string tar;
+  CHECK(inflate_members(gz, tar));
+  archive_files_t read;
+  CHECK(read_tar(tar, read));
+  CHECK(read == files);
+  printf("%zu MiB compressed into %zu bytes, %.1f ms on one thread,"
+         " %.1f ms on %d\n", mbytes, raw.gz.size(), single_secs * 1e3,
+         threaded_secs * 1e3, RESULT_ARCHIVE_TEST_THREADS);
+  return 0;
+}
@@ -0,0 +1,308 @@
+// Rolls up the samples of a step over two flushes, checks the rollups
+// against what the samples add up to and that a backfill from the
+// measurements arrives at the same, then runs the analysis over them
+#include "db_common.h"
+#include "stmts.h"
+#include "partition.h"
+#include "rollup.h"
+#include "gpucpu_usage.h"
+#include "analysis_functions.h"
+#include "analyze_info.h"
+#include "bench_util.h"
+
+#define ROLLUP_TEST_PARTITION_LENGTH (24 * 60 * 60)
+#define ROLLUP_TEST_SCRAPE_INTERVAL 10
+#define ROLLUP_TEST_JOBID 7
+#define ROLLUP_TEST_STEPS 2000
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+struct test_sample_t {
+  // Cumulative, in sec and usec
+  int64_t user_sec, user_usec, sys_sec, sys_usec;
+  int64_t res_size;
+  // Of GPU 0, GPU 1 is read unless its util is negative
+  int64_t util, age, gpu1_util;
+};
+
+// Between them, one ratio of sys time below 1 sec, one in every bucket
+// and one below 10%. The GPU reading of the last one is a repeated one
+static const test_sample_t samples[] = {
+  {1, 0, 0, 0, 100, 0, 0, -1},
+  {11, 0, 0, 500'000, 300, 0, 0, -1},
+  {21, 0, 2, 500'000, 200, 50, 0, 70},
+  {24, 0, 4, 0, 200, 5, 0, -1},
+  {26, 0, 6, 0, 200, 0, 0, -1},
+  {27, 0, 9, 0, 200, 0, 0, -1},
+  {67, 0, 10, 0, 200, 0, 100, -1},
+};
+#define ROLLUP_TEST_SAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static bool insert(bulk_insert_t &measurements, bulk_insert_t &gpu,
+                   int watcherid, int jobid, int stepid, int64_t batch,
+                   const test_sample_t &sample) {
+  bulk_columns_t rows(measurements.ncol);
+  // recordid, watcherid, jobid, stepid, dev_in, dev_out, user_sec,
+  // user_usec, sys_sec, sys_usec, res_size, minor_pagefault,
+  // peak_mem_usage, gpu_measurement_batch
+  rows.add_null();
+  for (int64_t val : {watcherid, jobid, stepid}) {
+    rows.add(val);
+  }
+  rows.add_null();
+  rows.add_null();
+  for (int64_t val : {sample.user_sec, sample.user_usec,
+                      sample.sys_sec, sample.sys_usec, sample.res_size}) {
+    rows.add(val);
+  }
+  rows.add_null();
+  rows.add_null();
+  rows.add(batch);
+  bulk_columns_t gpu_rows(gpu.ncol);
+  const auto add_gpu = [&](int64_t gpuid, int64_t util, int64_t age) {
+    // watcherid, batch, pid, jobid, stepid, gpuid, age, power_usage,
+    // temperature, sm_clock, util, clock_limit_reason, source
+    for (int64_t val : {(int64_t)watcherid, batch, (int64_t)1,
+                        (int64_t)jobid, (int64_t)stepid, gpuid, age,
+                        (int64_t)10000, (int64_t)40, (int64_t)1000, util}) {
+      gpu_rows.add(val);
+    }
+    gpu_rows.add_null();
+    gpu_rows.add("nvml");
+  };
+  add_gpu(0, sample.util, sample.age);
+  if (sample.gpu1_util >= 0) {
+    add_gpu(1, sample.gpu1_util, 0);
+  }
+  bool ok = true;
+  const auto failed = [&](size_t) { ok = false; };
+  measurements.insert(rows, failed, "(measurement_insert)");
+  rollup_sample_t rollup;
+  rollup.recordid = sqlite3_last_insert_rowid(SQL_CONN_NAME);
+  gpu.insert(gpu_rows, failed, "(gpu_measurement_insert)");
+  rollup.watcherid = watcherid;
+  rollup.jobid = jobid;
+  rollup.stepid = stepid;
+  rollup.user_time = sample.user_sec * 1'000'000 + sample.user_usec;
+  rollup.sys_time = sample.sys_sec * 1'000'000 + sample.sys_usec;
+  rollup.res_size = sample.res_size;
+  rollup.gpu_measurement_batch = batch;
+  rollup.scrape_interval = ROLLUP_TEST_SCRAPE_INTERVAL;
+  return ok && rollup_add(rollup);
+}
+
+static int64_t query_int(const char *sql) {
+  sqlite3_stmt *stmt = NULL;
+  int64_t val = -1;
+  if (IS_SQLITE_OK(PREPARE_STMT(sql, &stmt, 0))
+      && sqlite3_step(stmt) == SQLITE_ROW) {
+    val = sqlite3_column_int64(stmt, 0);
+  } else {
+    SQLITE3_PERROR("step(query_int)");
+  }
+  sqlite3_finalize(stmt);
+  return val;
+}
+
+// Steps the statement through, with the parameters of the analysis
+static bool run_analysis_stmt(const char *sql, int64_t offset_end) {
+  sqlite3_stmt *stmt = NULL;
+  if (!IS_SQLITE_OK(PREPARE_STMT(sql, &stmt, 0))) {
+    SQLITE3_PERROR("prepare(analysis)");
+    return false;
+  }
+  int idx;
+  if ((idx = sqlite3_bind_parameter_index(stmt, ":user"))) {
+    sqlite3_bind_text(stmt, idx, "u", -1, SQLITE_STATIC);
+  }
+  if ((idx = sqlite3_bind_parameter_index(stmt, ":offset_start"))) {
+    sqlite3_bind_int64(stmt, idx, 0);
+  }
+  if ((idx = sqlite3_bind_parameter_index(stmt, ":offset_end"))) {
+    sqlite3_bind_int64(stmt, idx, offset_end);
+  }
+  int ret;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW);
+  if (ret != SQLITE_DONE) {
+    SQLITE3_PERROR("step(analysis)");
+  }
+  sqlite3_finalize(stmt);
+  return ret == SQLITE_DONE;
+}
+
+int main() {
+  test_db_t db("rollup");
+  CHECK(db.open(ROLLUP_TEST_PARTITION_LENGTH));
+  CHECK(stmt_registry_check());
+  CHECK(INIT_SCRAPE_FREQ_LOG_STMT.exec(ROLLUP_TEST_SCRAPE_INTERVAL));
+  CHECK(sqlite3_exec_wrap(
+    "INSERT INTO watcher(pid, jobid, privileged, target_node)"
+    "  VALUES (1, 0, 0, 'n1');"
+    "INSERT INTO application_usage(jobid, stepid, application)"
+    "  VALUES (7, 0, 'python');", "(setup)"));
+  CHECK(JOBINFO_INSERT_STMT.exec(ROLLUP_TEST_JOBID, std::nullopt, "u", "job",
+                                 "sbatch", 60, 1, 2, 1 << 30, std::nullopt,
+                                 1, 4, 0));
+  for (int stepid = 0; stepid <= ROLLUP_TEST_STEPS / 8; stepid++) {
+    CHECK(JOBINFO_INSERT_STMT.exec(ROLLUP_TEST_JOBID, stepid, NULL, "step",
+                                   "srun", std::nullopt, 1, 2, std::nullopt,
+                                   200, std::nullopt, std::nullopt,
+                                   std::nullopt));
+    const std::string cpu_available
+      = "INSERT INTO job_step_cpu_available(watcherid, jobid, stepid, ncpu)"
+        "  VALUES (1, 7, " + std::to_string(stepid) + ", 4)";
+    CHECK(sqlite3_exec_wrap(cpu_available.c_str(), "(setup)"));
+  }
+
+  // The step is loaded again at the first sample of the second flush
+  bulk_insert_t measurements(MEASUREMENTS_INSERT_SQL);
+  bulk_insert_t gpu(GPU_MEASUREMENT_INSERT_SQL);
+  for (size_t i = 0; i < ROLLUP_TEST_SAMPLES; i++) {
+    if (i == 0 || i == 4) {
+      CHECK(sqlite3_begin_immediate_transaction());
+    }
+    CHECK(insert(measurements, gpu, 1, ROLLUP_TEST_JOBID, 0, i + 1,
+                 samples[i]));
+    if (i == 3 || i == ROLLUP_TEST_SAMPLES - 1) {
+      CHECK(rollup_flush());
+      CHECK(sqlite3_end_transaction());
+    }
+  }
+
+  CHECK(query_int("SELECT sample_cnt FROM step_rollup")
+        == ROLLUP_TEST_SAMPLES);
+  CHECK(query_int("SELECT latest_recordid FROM step_rollup")
+        == ROLLUP_TEST_SAMPLES);
+  CHECK(query_int("SELECT user_time + sys_time FROM step_rollup")
+        == 77'000'000);
+  CHECK(query_int("SELECT peak_res_size FROM step_rollup") == 300);
+  CHECK(query_int("SELECT sys_ratio_cnt FROM step_rollup") == 5);
+  CHECK(query_int(
+    "SELECT sys_ratio_1_10 || sys_ratio_1_3 || sys_ratio_2_3"
+    "  FROM step_rollup") == 111);
+  CHECK(query_int("SELECT sys_ratio_gt_1_milli FROM step_rollup") == 3000);
+  // No CPU is taken before the first sample
+  CHECK(query_int(
+    "SELECT group_concat(in_use || ':' || cnt, ' ') == '0:1 1:3 2:2 5:1'"
+    "  FROM step_usage_rollup WHERE NOT is_gpu") == 1);
+  CHECK(query_int(
+    "SELECT group_concat(in_use || ':' || cnt, ' ') == '1:6 2:1'"
+    "  FROM step_usage_rollup WHERE is_gpu") == 1);
+  CHECK(query_int(
+    "SELECT sample_cnt || util_sum || zero_util_cnt || low_util_cnt"
+    "       || longest_zero_util_run"
+    "  FROM step_gpu_rollup WHERE gpuid == 0") == 655412);
+  CHECK(query_int("SELECT age FROM step_gpu_rollup WHERE gpuid == 0") == 100);
+
+  // Steps of their own over many flushes, to time
+  const double start = bench_now();
+  CHECK(sqlite3_begin_immediate_transaction());
+  for (int i = 0; i < ROLLUP_TEST_STEPS; i++) {
+    const int stepid = i % (ROLLUP_TEST_STEPS / 8) + 1;
+    test_sample_t sample = samples[1];
+    sample.user_sec += i;
+    CHECK(insert(measurements, gpu, 1, ROLLUP_TEST_JOBID, stepid,
+                 ROLLUP_TEST_SAMPLES + i + 1, sample));
+    if (i % 64 == 63) {
+      CHECK(rollup_flush());
+    }
+  }
+  CHECK(rollup_flush());
+  CHECK(sqlite3_end_transaction());
+  const double secs = bench_now() - start;
+  const int64_t latest_recordid
+    = query_int("SELECT recordid FROM measurements_latest");
+
+  // From the measurements, as after the migration
+  CHECK(sqlite3_exec_wrap(
+    "CREATE TEMP TABLE step_rollup_before AS SELECT * FROM step_rollup;"
+    "CREATE TEMP TABLE step_usage_rollup_before AS"
+    "  SELECT * FROM step_usage_rollup;"
+    "CREATE TEMP TABLE step_gpu_rollup_before AS"
+    "  SELECT * FROM step_gpu_rollup;"
+    "UPDATE worker_task_info SET rollup_backfill = 1", "(backfill)"));
+  CHECK(rollup_backfill());
+  CHECK(query_int("SELECT rollup_backfill FROM worker_task_info") == 0);
+  for (const char *table : {"step_rollup", "step_usage_rollup",
+                            "step_gpu_rollup"}) {
+    const std::string diff = std::string("SELECT count(*) FROM (")
+      + "SELECT * FROM " + table + " EXCEPT SELECT * FROM " + table
+      + "_before UNION ALL SELECT * FROM " + table + "_before EXCEPT"
+      + " SELECT * FROM " + table + ")";
+    CHECK(query_int(diff.c_str()) == 0);
+  }
+  CHECK(query_int("SELECT count(*) FROM step_rollup")
+        == ROLLUP_TEST_STEPS / 8 + 1);
+
+  // The analysis of the user, within the period of all samples
+  sqlite3 *reader = acquire_sqlite_reader();
+  CHECK(reader);
+  {
+    sqlite_conn_scope_t reader_scope(reader);
+    CHECK(analysis_functions_register());
+    CHECK(sqlite3_exec_wrap(ANALYZE_ATTACH_CACHE_SQL, "(attach_cache)"));
+    CHECK(sqlite3_exec_wrap(PRE_ANALYZE_SQL, "(pre_analyze)"));
+    const double analysis_start = bench_now();
+    CHECK(run_analysis_stmt(ANALYZE_ADD_USER_SQL, latest_recordid));
+    for (int i = 0; ANALYZE_CREATE_BASE_TABLES[i]; i++) {
+      CHECK(run_analysis_stmt(ANALYZE_CREATE_BASE_TABLES[i], latest_recordid));
+    }
+    gpucpu_usage_t gpucpu_usage;
+    CHECK(gpucpu_usage.fill());
+    gpucpu_usage.finalize();
+    for (int i = 0; ANALYZE_CREATE_USAGE_TABLES[i]; i++) {
+      CHECK(run_analysis_stmt(ANALYZE_CREATE_USAGE_TABLES[i], latest_recordid));
+    }
+    for (const char *sql : {ANALYZE_LATEST_GPU_USAGE_SQL,
+                            ANALYZE_GPU_USAGE_HISTORY_SQL,
+                            ANALYSIS_LIST_PROBLEMATIC_LATEST_SYS_RATIO_SQL,
+                            ANALYSIS_LIST_LATEST_SYS_RATIO_SQL,
+                            ANALYZE_SYS_RATIO_HISTORY_SQL,
+                            ANALYZE_RESOURCE_USAGE_SQL,
+                            ANALYZE_DUMP_DATA_TO_JSON_SQL,
+                            ANALYZE_LIST_ACTIVE_USERS}) {
+      CHECK(run_analysis_stmt(sql, latest_recordid));
+    }
+    const double analysis_secs = bench_now() - analysis_start;
+    CHECK(query_int(
+      "SELECT tot_in_batch || sys_ratio_1_10 || sys_ratio_1_3"
+      "       || sys_ratio_2_3 || CAST(sys_ratio_gt_1 AS INT)"
+      "  FROM inmem.sys_ratio WHERE stepid == 0") == 51113);
+    CHECK(query_int(
+      "SELECT measurement_cnt || zero_util_cnt || low_util_cnt"
+      "       || longest_continuous_zero_util"
+      "  FROM inmem.gpu_usage_base WHERE stepid == 0 AND gpuid_raw == 0")
+      == 6412);
+    // The first sample, with no CPU in use, is left out
+    CHECK(query_int(
+      "SELECT sum(cnt_cpu) || max(node_tot) FROM inmem.gpucpu_usage"
+      "  WHERE stepid == 0 AND ncpu_in_use IS NOT NULL") == 66);
+    CHECK(query_int(
+      "SELECT sample_cnt FROM inmem.resource_usage WHERE stepid == 0")
+      == ROLLUP_TEST_SAMPLES);
+    // Sampled above what accounting has
+    CHECK(query_int(
+      "SELECT peak_res_size FROM inmem.resource_usage WHERE stepid == 0")
+      == 300);
+    CHECK(sqlite3_exec_wrap(POST_ANALYZE_SQL, "(post_analyze)"));
+    CHECK(sqlite3_exec_wrap(ANALYZE_DETACH_CACHE_SQL, "(detach_cache)"));
+    printf("%d samples rolled up in %.2f us each, analysis of %d steps"
+           " in %.1f ms\n", ROLLUP_TEST_STEPS,
+           secs * 1e6 / ROLLUP_TEST_STEPS, ROLLUP_TEST_STEPS / 8 + 1,
+           analysis_secs * 1e3);
+  }
+  release_sqlite_reader(reader);
+
+  measurements.finalize();
+  gpu.finalize();
+  rollup_finalize();
+  db_common_finalize();
+  close_sqlite_readers();
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
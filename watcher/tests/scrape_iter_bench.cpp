@@ -0,0 +1,75 @@
+// Cost of one scrape of the process tree in steady state, where the cache
+// built by earlier scrapes is reused, against starting from an empty cache
+// every time as scraping did before processes were kept across scrapes
+//
+// Usage: scrape_iter_bench [processes] [iterations] [proc root]
+// Without a root a synthetic tree of the given size is created in /tmp
+#include "proc_tree.h"
+#include "bench_util.h"
+
+// Every STEPD_EVERY-th synthetic process is a slurmstepd
+#define STEPD_EVERY 50
+
+template <typename F>
+static void run(const char *name, int iterations, F iterate) {
+  syscall_counter_t counter;
+  counter.start();
+  const double start = bench_now();
+  size_t processes = 0;
+  size_t stepds = 0;
+  for (int i = 0; i < iterations; i++) {
+    iterate(processes, stepds);
+  }
+  const double elapsed = bench_now() - start;
+  const long long syscalls = counter.stop();
+  processes /= iterations;
+  printf("%-12s %9.3f ms/scrape %8.2f us/process", name,
+    elapsed * 1e3 / iterations, elapsed * 1e6 / iterations / processes);
+  if (syscalls >= 0) {
+    printf(" %8.2f syscalls/process",
+      (double)syscalls / iterations / processes);
+  } else {
+    printf("   syscalls n/a (try strace -c)");
+  }
+  printf(" %zu stepds\n", stepds / iterations);
+}
+
+int main(int argc, char **argv) {
+  const int processes = argc > 1 ? atoi(argv[1]) : 2000;
+  const int iterations = argc > 2 ? atoi(argv[2]) : 20;
+  char tmp_root[] = "/tmp/scrape_iter_bench.XXXXXX";
+  const char *root = argc > 3 ? argv[3] : NULL;
+  if (!root) {
+    if (!mkdtemp(tmp_root)
+        || !make_synthetic_proc(tmp_root, processes, STEPD_EVERY)) {
+      return 1;
+    }
+    root = tmp_root;
+  }
+  // Keeps cpuset lookups of stepds out of the picture
+  unsetenv(SLURM_CGROUP_MOUNT_POINT_ENV);
+  if (!init_proc_scrape(root)) {
+    return 1;
+  }
+  printf("%s, %d scrapes\n", root, iterations);
+  cgroup_cpu_available_map_t cpu_available;
+  run("empty cache", iterations, [&](size_t &processes, size_t &stepds) {
+    process_cache_t cache = {};
+    fetch_proc_stats(cache, cpu_available);
+    processes += cache.processes.size();
+    stepds += cache.stepd_pids.size();
+  });
+  process_cache_t cache = {};
+  fetch_proc_stats(cache, cpu_available);
+  run("steady state", iterations, [&](size_t &processes, size_t &stepds) {
+    fetch_proc_stats(cache, cpu_available);
+    processes += cache.processes.size();
+    stepds += cache.stepd_pids.size();
+  });
+  finalize_proc_scrape();
+  if (root == tmp_root) {
+    const std::string cmd = std::string("rm -rf ") + tmp_root;
+    return system(cmd.c_str()) != 0;
+  }
+  return 0;
+}
@@ -0,0 +1,216 @@
+// Ingest benchmark of the storage layer: commits synthetic measurements in
+// batches while a reader keeps scanning them, like the analyzer does.
+// rollback commits every batch on its own in rollback journal mode, as the
+// watcher did before; wal group-commits INGEST_GROUP_COMMIT_BATCHES batches
+// at a time in WAL mode, with the reader on a connection of the pool.
+// Inserted rows are filtered by the accuracy index, or by the per-row
+// trigger it replaced, on top of a table prefilled with existing rows. Rows
+// go to the partition of the current period where wal and index are taken
+// together, as in the watcher, to the main database otherwise, the existing
+// ones always
+//
+// Usage: sqlite_ingest [rows] [rows per batch] [rollback|wal]
+//                      [existing rows] [index|trigger]
+#include "db_common.h"
+#include "worker.h"
+#include "bench_util.h"
+#include "sql_helper.h"
+
+#include <atomic>
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+// As it was in the schema up to version 7, without the index on steps
+static const char *MEASUREMENT_QUALITY_ENSURANCE_SQL = SQLITE_CODEBLOCK(
+DROP INDEX measurements_jobstep_index;
+CREATE TRIGGER measurement_quality_ensurance
+  BEFORE INSERT ON measurements
+  FOR EACH ROW
+  WHEN NEW.tot_time == 0
+    OR EXISTS (
+      WITH newentry_watcher AS MATERIALIZED (
+        SELECT accuracy, target_node FROM watcher
+          WHERE NEW.watcherid == watcher.id
+      )
+      SELECT measurements.jobid FROM measurements, watcher, newentry_watcher
+        WHERE measurements.jobid == NEW.jobid
+              AND measurements.stepid IS NEW.stepid
+              AND measurements.watcherid == watcher.id
+              AND (watcher.accuracy > newentry_watcher.accuracy
+                 OR (watcher.accuracy == newentry_watcher.accuracy
+                     AND tot_time == NEW.tot_time
+                     AND watcher.target_node IS newentry_watcher.target_node
+                 )
+              )
+    )
+BEGIN SELECT RAISE (IGNORE); END;
+);
+
+#define SQLITE_INGEST_PARTITION_LENGTH (24 * 60 * 60)
+
+static const char *PREFILL_SQL = SQLITE_CODEBLOCK(
+  WITH RECURSIVE row(x) AS (
+    SELECT 0 UNION ALL SELECT x + 1 FROM row WHERE x + 1 < :existing
+  )
+  INSERT INTO measurements(watcherid, jobid, stepid,
+                           user_sec, user_usec, sys_sec, sys_usec, res_size)
+    SELECT 1, x / 64 + 1, x % 4, x, 1, x / 10, 2, x * 4096 FROM row
+);
+
+static std::atomic<bool> done;
+static bool use_index;
+static std::atomic<long> scans;
+
+static void *reader(void *arg) {
+  (void)arg;
+  sqlite3 *conn = acquire_sqlite_reader();
+  if (!conn) {
+    exit(1);
+  }
+  sqlite3_stmt *stmt;
+  if (!IS_SQLITE_OK(sqlite3_prepare_v2(
+        conn, "SELECT count(*), sum(tot_time) FROM measurements",
+        -1, &stmt, NULL))) {
+    exit(1);
+  }
+  while (!done) {
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      ;
+    sqlite3_reset(stmt);
+    scans++;
+  }
+  sqlite3_finalize(stmt);
+  release_sqlite_reader(conn);
+  return NULL;
+}
+
+// Stages row as the worker does, to be inserted with the rest of its batch
+static void stage_row(bulk_columns_t &rows, int row) {
+  // Same as inserted, user_sec * 1e6 + user_usec + sys_sec * 1e6 + sys_usec
+  const int64_t tot_time = (row + row / 10) * 1'000'000ll + 3;
+  if (use_index
+      && !accuracy_index_admit(1, row / 64 + 1, row % 4, tot_time)) {
+    return;
+  }
+  // In the column order of MEASUREMENTS_INSERT_SQL
+  rows.add_null();
+  rows.add((int64_t)1);
+  rows.add((int64_t)row / 64 + 1);
+  rows.add((int64_t)row % 4);
+  rows.add_null();
+  rows.add_null();
+  rows.add((int64_t)row);
+  rows.add((int64_t)1);
+  rows.add((int64_t)row / 10);
+  rows.add((int64_t)2);
+  rows.add((int64_t)row * 4096);
+  rows.add_null();
+  rows.add_null();
+  rows.add_null();
+}
+
+int main(int argc, char **argv) {
+  const int rows = argc > 1 ? atoi(argv[1]) : 1000000;
+  const int rows_per_batch = argc > 2 ? atoi(argv[2]) : 64;
+  const bool wal = argc <= 3 || !strcmp(argv[3], "wal");
+  const int group = wal ? INGEST_GROUP_COMMIT_BATCHES : 1;
+  const int existing = argc > 4 ? atoi(argv[4]) : 0;
+  use_index = argc <= 5 || !strcmp(argv[5], "index");
+  test_db_t db("sqlite_ingest");
+  if (!db.open()
+      || !(wal || sqlite3_exec_wrap("PRAGMA journal_mode = DELETE;",
+                                    "(journal_mode)"))
+      || !sqlite3_exec_wrap(
+           "INSERT INTO watcher(pid, jobid, privileged) VALUES (1, 0, 1);",
+           "(setup)")) {
+    return 1;
+  }
+  if (existing) {
+    const double prefill_start = bench_now();
+    sqlite3_stmt *prefill = NULL;
+    SQLITE3_BIND_START
+    if (!setup_stmt(prefill, PREFILL_SQL, "(prefill)")) {
+      return 1;
+    }
+    NAMED_BIND_INT(prefill, ":existing", existing);
+    if (BIND_FAILED || !step_and_verify(prefill, false, "(prefill)")) {
+      return 1;
+    }
+    SQLITE3_BIND_END
+    sqlite3_finalize(prefill);
+    printf("prefilled %d rows in %.2f s\n", existing,
+      bench_now() - prefill_start);
+  }
+  if (!use_index && !sqlite3_exec_wrap(MEASUREMENT_QUALITY_ENSURANCE_SQL,
+                                       "(create_trigger)")) {
+    return 1;
+  }
+  const bool partitioned = wal && use_index;
+  if (partitioned && !partitions_attach(SQLITE_INGEST_PARTITION_LENGTH)) {
+    return 1;
+  }
+  pthread_t reader_thread;
+  pthread_create(&reader_thread, NULL, reader, NULL);
+
+  const std::string head = partitioned
+    ? MEASUREMENTS_INSERT_SQL : unpartitioned(MEASUREMENTS_INSERT_SQL);
+  bulk_insert_t insert(head.c_str());
+  bulk_columns_t staged(insert.ncol);
+  bool failed = false;
+  // Of the commits, what a batch waits for on top of its inserts
+  std::vector<double> latencies;
+  const int batches = (rows + rows_per_batch - 1) / rows_per_batch;
+  const double start = bench_now();
+  for (int b = 0; b < batches; b++) {
+    if (b % group == 0 && !sqlite3_begin_immediate_transaction()) {
+      return 1;
+    }
+    for (int r = b * rows_per_batch;
+         r < std::min(rows, (b + 1) * rows_per_batch); r++) {
+      stage_row(staged, existing + r);
+    }
+    insert.insert(staged, [&](size_t) { failed = true; },
+                  "(measurement_insert)");
+    staged.clear();
+    if (failed) {
+      return 1;
+    }
+    if ((b + 1) % group == 0 || b + 1 == batches) {
+      const double commit_start = bench_now();
+      if (!sqlite3_end_transaction()) {
+        return 1;
+      }
+      accuracy_index_commit();
+      latencies.push_back(bench_now() - commit_start);
+    }
+  }
+  const double secs = bench_now() - start;
+  done = true;
+  pthread_join(reader_thread, NULL);
+
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (const double t : latencies) {
+    sum += t;
+  }
+  printf("%s, %s: %d rows in %d batches of %d, %.2f s, %.0f rows/s\n",
+    wal ? "wal" : "rollback", use_index ? "index" : "trigger",
+    rows, batches, rows_per_batch, secs,
+    rows / secs);
+  printf("%zu commits avg %.2f ms p99 %.2f ms max %.2f ms,"
+    " %ld reader scans meanwhile\n",
+    latencies.size(), sum / latencies.size() * 1e3,
+    latencies[latencies.size() * 99 / 100] * 1e3,
+    latencies.back() * 1e3, scans.load());
+
+  insert.finalize();
+  db_common_finalize();
+  close_sqlite_readers();
+  sqlite3_close(SQL_CONN_NAME);
+  return 0;
+}
@@ -0,0 +1,67 @@
+// Checks every statement of the registry against a fresh schema, then binds
+// and fetches through the typed statements, positionally and with NULLs
+#include "db_common.h"
+#include "stmts.h"
+#include "bench_util.h"
+
+#define STMT_REGISTRY_TEST_ROUNDS 100000
+#define STMT_REGISTRY_PARTITION_LENGTH (24 * 60 * 60)
+
+thread_local sqlite3 *SQL_CONN_NAME;
+thread_local int watcher_id;
+thread_local time_t time_range_start;
+thread_local time_t time_range_end;
+worker_info_t worker;
+char *db_path;
+
+int main() {
+  test_db_t db("stmt_registry");
+  CHECK(db.open(STMT_REGISTRY_PARTITION_LENGTH));
+  CHECK(stmt_registry_check());
+
+  worker.pid = 1;
+  worker.hostname = (char *)"n1";
+  worker.jobstep_info.job_id = 5;
+  worker.jobstep_info.step_id = 0;
+  worker.is_privileged = false;
+  CHECK(renew_watcher());
+  CHECK(watcher_id == 1);
+  decltype(WATCHER_RANK_STMT)::row_t rank;
+  CHECK(WATCHER_RANK_STMT.fetch_one(rank, watcher_id));
+  CHECK(std::get<1>(rank) == "n1");
+  // The parent watcher has no target node
+  worker.hostname = NULL;
+  worker.pid = 2;
+  CHECK(renew_watcher());
+  CHECK(WATCHER_RANK_STMT.fetch_one(rank, watcher_id));
+  CHECK(!std::get<1>(rank));
+
+  CHECK(JOBINFO_INSERT_STMT.exec(7, std::nullopt, "u", "job", "sbatch",
+                                 60, 1, 2, 1 << 30, std::nullopt, 1, 4, 0));
+  // Its steps take the user and what was allocated from it
+  CHECK(JOBINFO_INSERT_STMT.exec(7, 0, NULL, "step", "srun", std::nullopt,
+                                 1, 2, std::nullopt, 1 << 20, std::nullopt,
+                                 std::nullopt, std::nullopt));
+  decltype(JOBINFO_EXISTS_STMT)::row_t found;
+  CHECK(JOBINFO_EXISTS_STMT.fetch_one(found, 7));
+  CHECK(sqlite3_step(JOBINFO_EXISTS_STMT.bind(8)) == SQLITE_DONE);
+
+  // The hot path, binding and stepping a prepared statement within the
+  // transaction of the ingest
+  decltype(UPDATE_GPU_BATCHES_STMT)::row_t batches;
+  CHECK(sqlite3_begin_immediate_transaction());
+  const double start = bench_now();
+  for (int i = 0; i < STMT_REGISTRY_TEST_ROUNDS; i++) {
+    CHECK(UPDATE_GPU_BATCHES_STMT.fetch_one(batches, 2));
+  }
+  const double secs = bench_now() - start;
+  CHECK(sqlite3_end_transaction());
+  CHECK(std::get<1>(batches) == STMT_REGISTRY_TEST_ROUNDS * 2);
+  CHECK(std::get<0>(batches) + 2 == std::get<1>(batches));
+  printf("%zu statements checked, %.2f us per gpu batch renewal\n",
+    stmt_registry().size(), secs * 1e6 / STMT_REGISTRY_TEST_ROUNDS);
+
+  db_common_finalize();
+  CHECK(IS_SQLITE_OK(sqlite3_close(SQL_CONN_NAME)));
+  return 0;
+}
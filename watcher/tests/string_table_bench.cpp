@@ -0,0 +1,101 @@
+// Staging cost of hostnames and application names on the server over a few
+// hourly epochs, interned into the table of each batch against the memmem
+// deduplication over one buffer that lived as long as the watcher
+//
+// Usage: string_table_bench [nodes] [batches per node] [epochs]
+// Every batch carries its hostname and BENCH_APPS_PER_BATCH application
+// names, drawn from a set that grows by BENCH_NEW_APPS every epoch
+#include "string_table.h"
+#include "bench_util.h"
+
+#define BENCH_APPS_PER_BATCH 8
+#define BENCH_BASE_APPS 3000
+#define BENCH_NEW_APPS 200
+
+// Keeps the staging from being optimized out
+static volatile size_t sink;
+
+// The staging done before, deduplicating against everything ever staged
+struct memmem_buf_t {
+  char *buf = NULL;
+  size_t buf_size = 0;
+  size_t buf_used = 0;
+
+  size_t stage(const char *str) {
+    if (!buf) {
+      buf_size = 4096;
+      buf = (char *)calloc(buf_size, 1);
+    }
+    const size_t len = strlen(str) + 1;
+    if (auto dest = (char *)memmem(buf, buf_used, str, len)) {
+      return dest - buf;
+    }
+    while (buf_used + len > buf_size) {
+      buf_size *= 2;
+      buf = (char *)realloc(buf, buf_size);
+    }
+    memcpy(buf + buf_used, str, len);
+    buf_used += len;
+    return buf_used - len;
+  }
+};
+
+int main(int argc, char **argv) {
+  const int nodes = argc > 1 ? atoi(argv[1]) : 1500;
+  const int batches = argc > 2 ? atoi(argv[2]) : 10;
+  const int epochs = argc > 3 ? atoi(argv[3]) : 4;
+  std::vector<std::string> hostnames, apps;
+  char name[128];
+  for (int i = 0; i < nodes; i++) {
+    snprintf(name, sizeof(name), "%s-%04d", i % 3 ? "cpu" : "gpu-a100", i);
+    hostnames.push_back(name);
+  }
+  const char *prefixes[] = {"/opt/apps/", "/home/user", "/usr/bin/", ""};
+  for (int i = 0; i < BENCH_BASE_APPS + BENCH_NEW_APPS * epochs; i++) {
+    snprintf(name, sizeof(name), "%s%d/bin/app_%d_%x", prefixes[i % 4],
+      i % 97, i, i * 2654435761u);
+    apps.push_back(name);
+  }
+  memmem_buf_t old;
+  string_table_t table;
+  uint32_t seed = 1;
+  printf("%d nodes x %d batches x %d names per epoch\n",
+    nodes, batches, 1 + BENCH_APPS_PER_BATCH);
+  for (int epoch = 0; epoch < epochs; epoch++) {
+    // Same sequence of names for both
+    std::vector<const char *> names;
+    const size_t app_cnt = BENCH_BASE_APPS + BENCH_NEW_APPS * (epoch + 1);
+    for (int b = 0; b < batches; b++) {
+      for (int n = 0; n < nodes; n++) {
+        names.push_back(hostnames[n].c_str());
+        for (int a = 0; a < BENCH_APPS_PER_BATCH; a++) {
+          seed = seed * 1103515245 + 12345;
+          // Skewed towards the common applications
+          const size_t idx = (seed >> 8) % app_cnt;
+          names.push_back(apps[idx % (idx & 1 ? app_cnt : 64)].c_str());
+        }
+      }
+    }
+    double start = bench_now();
+    for (const char *str : names) {
+      sink += old.stage(str);
+    }
+    const double old_secs = bench_now() - start;
+    size_t table_bytes = 0;
+    start = bench_now();
+    for (size_t i = 0; i < names.size(); i++) {
+      sink += table.intern(names[i]);
+      // The batch got ingested
+      if ((i + 1) % (1 + BENCH_APPS_PER_BATCH) == 0) {
+        table_bytes += table.bytes();
+        table.clear();
+      }
+    }
+    const double table_secs = bench_now() - start;
+    printf("epoch %d: memmem %8.1f ns/name %8zu bytes | "
+           "interned %6.1f ns/name %8zu bytes\n",
+      epoch, old_secs * 1e9 / names.size(), old.buf_size,
+      table_secs * 1e9 / names.size(), table_bytes);
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+// Round trip and speed of the protocol version 3 codec. A synthetic scraper
+// reports every step each round with growing counters, like a real one
+// streaming over a kept-open connection, and the server side state decodes
+// it back. Exits non-zero on any mismatch
+//
+// Usage: v3_codec [steps] [rounds]
+#include "protocol_v3.h"
+#include "bench_util.h"
+
+const gpu_measurement_source_t gpu_measurement_source = GPU_SOURCE_NONE;
+
+static const char *apps[] = {"python3", "gmx_mpi", "lmp", "a.out"};
+
+static void make_round(batch_t &batch, int steps, int round, char *hostname) {
+  batch.header.worker.hostname = hostname;
+  for (int i = 0; i < steps; i++) {
+    scrape_result_t result;
+    memset(&result, 0, sizeof(result));
+    result.step.job_id = 4000000 + i / 4;
+    result.step.step_id = i % 4 == 3 ? SLURM_BATCH_SCRIPT : i % 4;
+    result.step.step_het_comp = NO_VAL;
+    result.res = (1ul << 30) + (size_t)round * 4096 * (i % 7);
+    result.minor_pagefault = (size_t)round * 1000 + i;
+    result.utime = (time_t)round * 2000 * (i % 3);
+    result.stime = (time_t)round * 13;
+    result.rchar = i % 5 ? (size_t)round << 20 : PRIVILEGED_STAT_NULL;
+    result.wchar = i % 5 ? (size_t)round << 18 : PRIVILEGED_STAT_NULL;
+    result.peak_mem_usage = result.res + 12345;
+    result.gpu_measurement_cnt = i % 8 == 0 ? 2 : 0;
+    batch.results.push_back(result);
+    for (int g = 0; g < result.gpu_measurement_cnt; g++) {
+      gpu_measurement_t gpu_result;
+      memset((void *)&gpu_result, 0, sizeof(gpu_result));
+      gpu_result.gpu_id = g;
+      gpu_result.pid = 10000 + i;
+      gpu_result.temp = 60 + round % 10;
+      gpu_result.sm_clock = 1410;
+      gpu_result.util = (round * 7 + i) % 101;
+      gpu_result.power_usage = 25000 + round;
+      gpu_result.step = result.step;
+      gpu_result.source = GPU_SOURCE_NONE;
+      batch.gpu_results.push_back(gpu_result);
+    }
+    if (round == 0 || i % 16 == 0) {
+      application_usage_t usage;
+      usage.step = result.step;
+      usage.app = batch.strings.intern(apps[(i + round) % 4]);
+      batch.usages.push_back(usage);
+    }
+    if (round == 0) {
+      cpu_available_info_t info;
+      info.step = result.step;
+      info.cpu_available = 1 + i % 128;
+      batch.cpu_available_infos.push_back(info);
+    }
+  }
+}
+
+#define SAME(COND) CHECK_RETURN(COND, false)
+
+// Mismatches are reported with the round by the caller
+static bool same_batch(const batch_t &sent, const batch_t &got) {
+  SAME(got.results.size() == sent.results.size());
+  SAME(got.gpu_results.size() == sent.gpu_results.size());
+  SAME(got.usages.size() == sent.usages.size());
+  SAME(got.cpu_available_infos.size() == sent.cpu_available_infos.size());
+  for (size_t i = 0; i < sent.results.size(); i++) {
+    const auto &a = sent.results[i];
+    const auto &b = got.results[i];
+    SAME(a.step.job_id == b.step.job_id && a.step.step_id == b.step.step_id);
+    SAME(a.res == b.res && a.minor_pagefault == b.minor_pagefault);
+    SAME(a.utime == b.utime && a.stime == b.stime);
+    SAME(a.rchar == b.rchar && a.wchar == b.wchar);
+    SAME(a.peak_mem_usage == b.peak_mem_usage);
+    SAME(a.gpu_measurement_cnt == b.gpu_measurement_cnt);
+  }
+  for (size_t i = 0; i < sent.gpu_results.size(); i++) {
+    const auto &a = sent.gpu_results[i];
+    const auto &b = got.gpu_results[i];
+    SAME(a.gpu_id == b.gpu_id && a.pid == b.pid && a.util == b.util);
+    SAME(a.temp == b.temp && a.power_usage == b.power_usage);
+    SAME(a.step.job_id == b.step.job_id && a.source == b.source);
+  }
+  for (size_t i = 0; i < sent.usages.size(); i++) {
+    SAME(sent.usages[i].step.job_id == got.usages[i].step.job_id);
+    SAME(sent.usages[i].step.step_id == got.usages[i].step.step_id);
+    SAME(!strcmp(sent.strings.str(sent.usages[i].app),
+                 got.strings.str(got.usages[i].app)));
+  }
+  for (size_t i = 0; i < sent.cpu_available_infos.size(); i++) {
+    const auto &a = sent.cpu_available_infos[i];
+    const auto &b = got.cpu_available_infos[i];
+    SAME(a.step.step_id == b.step.step_id);
+    SAME(a.cpu_available == b.cpu_available);
+  }
+  return true;
+}
+#undef SAME
+
+int main(int argc, char **argv) {
+  const int steps = argc > 1 ? atoi(argv[1]) : 4096;
+  const int rounds = argc > 2 ? atoi(argv[2]) : 45;
+  char hostname[] = "node0042";
+  v3_state_t client = {}, server = {};
+  double encode_secs = 0, decode_secs = 0;
+  size_t bytes = 0, v2_bytes = 0, results = 0;
+  for (int round = 0; round < rounds; round++) {
+    batch_t sent;
+    make_round(sent, steps, round, hostname);
+    std::string payload;
+    double start = bench_now();
+    v3_encode_batch(client, sent, payload);
+    encode_secs += bench_now() - start;
+    batch_t got;
+    start = bench_now();
+    const bool ok = v3_decode_batch(server, payload, got);
+    decode_secs += bench_now() - start;
+    if (!ok || !same_batch(sent, got)
+        || server.hostname != hostname) {
+      fprintf(stderr, "round %d: round trip failed\n", round);
+      return 1;
+    }
+    // A batch cut short must be refused, not half decoded
+    batch_t partial;
+    v3_state_t probe = server;
+    if (payload.size() > 1
+        && v3_decode_batch(probe, payload.substr(0, payload.size() / 2),
+                           partial)) {
+      fprintf(stderr, "round %d: truncated payload accepted\n", round);
+      return 1;
+    }
+    bytes += payload.size();
+    results += sent.results.size();
+    v2_bytes += sent.results.size() * sizeof(scrape_result_t)
+                + sent.gpu_results.size() * sizeof(gpu_measurement_t)
+                + sent.usages.size()
+                  * (sizeof(application_usage_t) + sizeof(uint32_t))
+                + sent.cpu_available_infos.size()
+                  * sizeof(cpu_available_info_t);
+    for (const auto &usage : sent.usages) {
+      v2_bytes += strlen(sent.strings.str(usage.app)) + 1;
+    }
+  }
+  printf("%d steps x %d rounds, %zu results\n", steps, rounds, results);
+  printf("encode %8.1f ns/result  decode %8.1f ns/result\n",
+    encode_secs * 1e9 / results, decode_secs * 1e9 / results);
+  printf("%.1f bytes/result, version 2 would send %.1f (%.1fx)\n",
+    (double)bytes / results, (double)v2_bytes / results,
+    (double)v2_bytes / bytes);
+  return 0;
+}
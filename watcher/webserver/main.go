@@ -40,6 +40,22 @@ type CommonContentDedup struct {
 	Size        int            `json:"-"`
 }
 
+// index.json of a result tarball with sections emitted by the analyzer
+type ReportIndex struct {
+	Started int64             `json:"started"`
+	Updated int64             `json:"updated"`
+	Names   map[string]string `json:"names"`
+	// map[user][][machine_name, shared section id or empty]
+	Users map[string][][2]string `json:"users"`
+}
+
+// users/<user>.json of a result tarball with sections emitted by the analyzer
+type ReportShard struct {
+	Data map[string]interface{} `json:"data"`
+	// map[machine_name]HTML
+	Sections map[string]string `json:"sections"`
+}
+
 type ResultSet struct {
 	Dedup       CommonContentDedup `json:"dedup"`
 	Results     map[int]Result     `json:"results"`
@@ -64,6 +80,17 @@ func genMismatchError(msg string) error {
 	return errors.New(msg + ": input mismatch from expectation")
 }
 
+func dedupContent(html string) int {
+	contentid, ok := resultSet.Dedup.ContentID[html]
+	if !ok {
+		resultSet.Dedup.Size += 1
+		contentid = resultSet.Dedup.Size
+		resultSet.Dedup.ContentData[contentid] = html
+		resultSet.Dedup.ContentID[html] = contentid
+	}
+	return contentid
+}
+
 func loadResult(headerText string, bodyText string, id int, name string) error {
 	ind := strings.Index(headerText, "<head>")
 	if ind == -1 {
@@ -138,13 +165,7 @@ func loadResult(headerText string, bodyText string, id int, name string) error {
 			}
 		}
 		if ok {
-			contentid, ok := resultSet.Dedup.ContentID[html]
-			if !ok {
-				resultSet.Dedup.Size += 1
-				contentid = resultSet.Dedup.Size
-				resultSet.Dedup.ContentData[contentid] = html
-				resultSet.Dedup.ContentID[html] = contentid
-			}
+			contentid := dedupContent(html)
 			resultSet.Results[id].CommonContent[machineName] = contentid
 		} else {
 			if resultSet.Results[id].UserContent[machineName] == nil {
@@ -167,18 +188,102 @@ func loadResult(headerText string, bodyText string, id int, name string) error {
 	return nil
 }
 
+// Sections and raw data come ahead of the letters, which are left unread
+func loadReportTar(tarReader *tar.Reader, id int, indexData []byte) error {
+	var index ReportIndex
+	err := json.Unmarshal(indexData, &index)
+	if err != nil {
+		return err
+	}
+	result := Result{
+		CommonContent: make(map[string]int),
+		UserContent:   make(map[string](map[string]string)),
+		RawData: ResultRaw{
+			Started: index.Started,
+			Updated: index.Updated,
+			Data:    make(map[string]interface{}),
+		},
+		seenUser: make(map[string]bool),
+	}
+	resultSet.Results[id] = result
+	for machineName, secName := range index.Names {
+		resultSet.NameMapping[machineName] = secName
+	}
+	contentids := make(map[string]int)
+	for {
+		info, err := tarReader.Next()
+		if err != nil {
+			if err == io.EOF {
+				break
+			} else {
+				return err
+			}
+		}
+		name := info.Name
+		sectionid := strings.TrimPrefix(name, "sections/")
+		user := strings.TrimPrefix(name, "users/")
+		if len(sectionid) != len(name) {
+			data, err := io.ReadAll(tarReader)
+			if err != nil {
+				return err
+			}
+			sectionid = strings.TrimSuffix(sectionid, ".html")
+			contentids[sectionid] = dedupContent(string(data))
+		} else if len(user) != len(name) {
+			data, err := io.ReadAll(tarReader)
+			if err != nil {
+				return err
+			}
+			user = strings.TrimSuffix(user, ".json")
+			var shard ReportShard
+			err = json.Unmarshal(data, &shard)
+			if err != nil {
+				return err
+			}
+			for key, val := range shard.Data {
+				result.RawData.Data[key] = val
+			}
+			for machineName, html := range shard.Sections {
+				if result.UserContent[machineName] == nil {
+					result.UserContent[machineName] = make(map[string]string)
+				}
+				result.UserContent[machineName][user] = html
+			}
+			result.seenUser[user] = true
+		} else {
+			break
+		}
+	}
+	for _, sections := range index.Users {
+		for _, section := range sections {
+			if section[1] == "" {
+				continue
+			}
+			contentid, ok := contentids[section[1]]
+			if !ok {
+				return genMismatchError("find_section")
+			}
+			result.CommonContent[section[0]] = contentid
+		}
+	}
+	return nil
+}
+
 func loadResultTar(tarReader *tar.Reader, id int) error {
 	info, err := tarReader.Next()
 	if err != nil {
 		return err
 	}
-	if info.Name != "raw.json" {
-		return genMismatchError("find_raw_json")
-	}
 	data, err := io.ReadAll(tarReader)
 	if err != nil {
 		return err
 	}
+	if info.Name == "index.json" {
+		return loadReportTar(tarReader, id, data)
+	}
+	if info.Name != "raw.json" {
+		return genMismatchError("find_raw_json")
+	}
 	result := Result{
 		CommonContent: make(map[string]int),
 		UserContent:   make(map[string](map[string]string)),